@@ -0,0 +1,260 @@
+/* vim: set et ts=4 sts=4 sw=4 : */
+/********************************************************************\
+ * This program is free software; you can redistribute it and/or    *
+ * modify it under the terms of the GNU General Public License as   *
+ * published by the Free Software Foundation; either version 2 of   *
+ * the License, or (at your option) any later version.              *
+ *                                                                  *
+ * This program is distributed in the hope that it will be useful,  *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of   *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the    *
+ * GNU General Public License for more details.                     *
+ *                                                                  *
+ * You should have received a copy of the GNU General Public License*
+ * along with this program; if not, contact:                        *
+ *                                                                  *
+ * Free Software Foundation           Voice:  +1-617-542-5942       *
+ * 59 Temple Place - Suite 330        Fax:    +1-617-542-2652       *
+ * Boston, MA  02111-1307,  USA       gnu@gnu.org                   *
+ *                                                                  *
+\********************************************************************/
+
+/** @file addr_cache.c
+    @brief resolved address cache for frps and local services
+
+    Work connections and local dials used to run a DNS query each time.
+    Answers are kept here with the ttl from the DNS server, refreshed in
+    background when 3/4 of the ttl passed, so connect_server can dial the
+    cached sockaddr directly.
+*/
+
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <assert.h>
+#include <syslog.h>
+#include <arpa/inet.h>
+
+#include <event2/util.h>
+#include <event2/event.h>
+#include <event2/dns.h>
+
+#include "addr_cache.h"
+#include "debug.h"
+#include "common.h"
+#include "utils.h"
+
+static struct event_base *cache_base;
+static struct evdns_base *cache_dnsbase;
+static struct addr_cache_entry *addr_cache;
+
+static void retry_cb(evutil_socket_t fd, short event, void *arg)
+{
+    struct addr_cache_entry *e = arg;
+    addr_cache_resolve(e->host, NULL, NULL);
+}
+
+static struct addr_cache_entry *get_cache_entry(const char *host)
+{
+    struct addr_cache_entry *e = NULL;
+    HASH_FIND_STR(addr_cache, host, e);
+    if (e)
+        return e;
+
+    e = calloc(1, sizeof(struct addr_cache_entry));
+    assert(e);
+    e->host = strdup(host);
+    assert(e->host);
+    e->ev_retry = evtimer_new(cache_base, retry_cb, e);
+    assert(e->ev_retry);
+    HASH_ADD_KEYPTR(hh, addr_cache, e->host, strlen(e->host), e);
+
+    return e;
+}
+
+// once waiters hear of the failure, the others wait for the retry
+static void lookup_failed(struct addr_cache_entry *e)
+{
+    struct addr_cache_waiter *failed = NULL, **pw = &e->waiters;
+    while (*pw) {
+        struct addr_cache_waiter *w = *pw;
+        if (!w->once) {
+            pw = &w->next;
+            continue;
+        }
+        *pw     = w->next;
+        w->next = failed;
+        failed  = w;
+    }
+
+    // a waiter may ask again from its callback, it goes to e->waiters
+    struct addr_cache_waiter *next = NULL;
+    for (; failed; failed = next) {
+        next = failed->next;
+        failed->cb(e->host, NULL, failed->arg);
+        SAFE_FREE(failed);
+    }
+
+    if (e->waiters && !e->resolving) {
+        struct timeval tv = {ADDR_CACHE_TTL_MIN, 0};
+        evtimer_add(e->ev_retry, &tv);
+    }
+}
+
+// the query could not even be sent, callers of addr_cache_wait are told
+// from the loop and not before addr_cache_wait returned
+static void lookup_failed_cb(evutil_socket_t fd, short event, void *arg)
+{
+    lookup_failed(arg);
+}
+
+static void addr_cache_dns_cb(int result, char type, int count, int ttl, void *addresses,
+                              void *arg)
+{
+    struct addr_cache_entry *e = arg;
+    uint64_t now               = get_monotonic_msec();
+
+    e->resolving = 0;
+
+    if (result != DNS_ERR_NONE || type != DNS_IPv4_A || count <= 0) {
+        // keep a stale address alive for a while, frps is not going anywhere
+        // only because our DNS server is unreachable
+        debug(LOG_WARNING, "resolve [%s] failed: %s", e->host, evdns_err_to_string(result));
+        e->refresh_at = now + ADDR_CACHE_TTL_MIN * 1000;
+        e->expire_at  = e->refresh_at;
+        lookup_failed(e);
+        return;
+    }
+
+    if (ttl < ADDR_CACHE_TTL_MIN)
+        ttl = ADDR_CACHE_TTL_MIN;
+    else if (ttl > ADDR_CACHE_TTL_MAX)
+        ttl = ADDR_CACHE_TTL_MAX;
+
+    memset(&e->sin, 0, sizeof(e->sin));
+    e->sin.sin_family = AF_INET;
+    memcpy(&e->sin.sin_addr, addresses, sizeof(e->sin.sin_addr));
+    e->has_addr   = 1;
+    e->expire_at  = now + (uint64_t) ttl * 1000;
+    e->refresh_at = now + (uint64_t) ttl * 750;
+
+    char buf[INET_ADDRSTRLEN] = {0};
+    debug(LOG_DEBUG, "resolve [%s] -> [%s] ttl %d", e->host,
+          evutil_inet_ntop(AF_INET, &e->sin.sin_addr, buf, sizeof(buf)), ttl);
+
+    // a waiter may ask again from its callback, it goes to a new list
+    struct addr_cache_waiter *w = e->waiters, *next = NULL;
+    e->waiters                  = NULL;
+    for (; w; w = next) {
+        next = w->next;
+        w->cb(e->host, &e->sin, w->arg);
+        SAFE_FREE(w);
+    }
+}
+
+static void add_waiter(struct addr_cache_entry *e, addr_resolved_cb cb, void *arg, int once)
+{
+    struct addr_cache_waiter **pw = &e->waiters;
+    for (; *pw; pw = &(*pw)->next)
+        if ((*pw)->cb == cb && (*pw)->arg == arg)
+            return;
+
+    struct addr_cache_waiter *w = calloc(1, sizeof(struct addr_cache_waiter));
+    assert(w);
+    w->cb   = cb;
+    w->arg  = arg;
+    w->once = once;
+    *pw     = w;
+}
+
+static void resolve(const char *host, addr_resolved_cb cb, void *arg, int once)
+{
+    struct addr_cache_entry *e = get_cache_entry(host);
+    if (cb)
+        add_waiter(e, cb, arg, once);
+
+    if (e->resolving)
+        return;
+
+    evtimer_del(e->ev_retry);
+    e->resolving = 1;
+    if (!evdns_base_resolve_ipv4(cache_dnsbase, host, 0, addr_cache_dns_cb, e)) {
+        debug(LOG_ERR, "error: can not analyse the dns of [%s]", host);
+        e->resolving  = 0;
+        struct timeval now = {0, 0};
+        event_base_once(cache_base, -1, EV_TIMEOUT, lookup_failed_cb, e, &now);
+    }
+}
+
+void addr_cache_resolve(const char *host, addr_resolved_cb cb, void *arg)
+{
+    if (!host || !cache_dnsbase)
+        return;
+
+    resolve(host, cb, arg, 0);
+}
+
+int addr_cache_wait(const char *host, addr_resolved_cb cb, void *arg)
+{
+    if (!host || !cache_dnsbase)
+        return -1;
+
+    resolve(host, cb, arg, 1);
+    return 0;
+}
+
+int addr_cache_lookup(const char *host, int port, struct sockaddr_in *sin)
+{
+    if (!host)
+        return 0;
+
+    memset(sin, 0, sizeof(*sin));
+    sin->sin_family = AF_INET;
+    sin->sin_port   = htons(port);
+
+    // ip address given, nothing to resolve
+    if (evutil_inet_pton(AF_INET, host, &sin->sin_addr) == 1)
+        return 1;
+
+    struct addr_cache_entry *e = NULL;
+    HASH_FIND_STR(addr_cache, host, e);
+    if (!e) {
+        addr_cache_resolve(host, NULL, NULL);
+        return 0;
+    }
+
+    uint64_t now = get_monotonic_msec();
+    if (now >= e->refresh_at)
+        addr_cache_resolve(host, NULL, NULL);
+
+    if (!e->has_addr || now >= e->expire_at)
+        return 0;
+
+    sin->sin_addr = e->sin.sin_addr;
+    return 1;
+}
+
+void init_addr_cache(struct event_base *base, struct evdns_base *dnsbase)
+{
+    cache_base    = base;
+    cache_dnsbase = dnsbase;
+}
+
+void free_addr_cache()
+{
+    struct addr_cache_entry *e = NULL, *tmp = NULL;
+    HASH_ITER(hh, addr_cache, e, tmp)
+    {
+        HASH_DEL(addr_cache, e);
+        struct addr_cache_waiter *w = e->waiters, *next = NULL;
+        for (; w; w = next) {
+            next = w->next;
+            SAFE_FREE(w);
+        }
+        event_free(e->ev_retry);
+        SAFE_FREE(e->host);
+        SAFE_FREE(e);
+    }
+    cache_base    = NULL;
+    cache_dnsbase = NULL;
+}
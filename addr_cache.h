@@ -0,0 +1,80 @@
+/* vim: set et ts=4 sts=4 sw=4 : */
+/********************************************************************\
+ * This program is free software; you can redistribute it and/or    *
+ * modify it under the terms of the GNU General Public License as   *
+ * published by the Free Software Foundation; either version 2 of   *
+ * the License, or (at your option) any later version.              *
+ *                                                                  *
+ * This program is distributed in the hope that it will be useful,  *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of   *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the    *
+ * GNU General Public License for more details.                     *
+ *                                                                  *
+ * You should have received a copy of the GNU General Public License*
+ * along with this program; if not, contact:                        *
+ *                                                                  *
+ * Free Software Foundation           Voice:  +1-617-542-5942       *
+ * 59 Temple Place - Suite 330        Fax:    +1-617-542-2652       *
+ * Boston, MA  02111-1307,  USA       gnu@gnu.org                   *
+ *                                                                  *
+\********************************************************************/
+
+/** @file addr_cache.h
+    @brief resolved address cache for frps and local services
+*/
+
+#ifndef _ADDR_CACHE_H_
+#define _ADDR_CACHE_H_
+
+#include <stdint.h>
+#include <netinet/in.h>
+
+#include "uthash.h"
+
+#define ADDR_CACHE_TTL_MIN 10     // seconds, also used as negative ttl
+#define ADDR_CACHE_TTL_MAX 3600   // seconds
+
+struct event_base;
+struct evdns_base;
+struct event;
+
+typedef void (*addr_resolved_cb)(const char *host, const struct sockaddr_in *sin, void *arg);
+
+struct addr_cache_waiter {
+    addr_resolved_cb cb;
+    void *arg;
+    int once;   // addr_cache_wait, told of a failed lookup too
+    struct addr_cache_waiter *next;
+};
+
+struct addr_cache_entry {
+    char *host;
+    struct sockaddr_in sin;   // port is not cached
+    int has_addr;
+    uint64_t refresh_at;   // monotonic msec, start background refresh after it
+    uint64_t expire_at;    // monotonic msec, entry is cold after it
+    int resolving;
+
+    struct addr_cache_waiter *waiters;   // called once by the first lookup that succeeds
+    struct event *ev_retry;              // failed lookup with waiters left, try again
+
+    UT_hash_handle hh;
+};
+
+void init_addr_cache(struct event_base *base, struct evdns_base *dnsbase);
+void free_addr_cache();
+
+// return 1 and fill sin (with port) when host has a fresh address,
+// ip literal never hit DNS; 0 means caller should resolve by itself
+int addr_cache_lookup(const char *host, int port, struct sockaddr_in *sin);
+
+// resolve host in background and cache the answer with its ttl
+// cb can be NULL, otherwise it waits, with every other cb of host, until a
+// lookup succeeds; failed lookups are retried every ADDR_CACHE_TTL_MIN
+void addr_cache_resolve(const char *host, addr_resolved_cb cb, void *arg);
+// cb is called once, from the loop, with the outcome of the next lookup of
+// host; sin is NULL when it failed. -1 when there is no resolver, cb is
+// never called then
+int addr_cache_wait(const char *host, addr_resolved_cb cb, void *arg);
+
+#endif   //_ADDR_CACHE_H_
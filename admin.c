@@ -0,0 +1,879 @@
+/* vim: set et ts=4 sts=4 sw=4 : */
+/********************************************************************\
+ * This program is free software; you can redistribute it and/or    *
+ * modify it under the terms of the GNU General Public License as   *
+ * published by the Free Software Foundation; either version 2 of   *
+ * the License, or (at your option) any later version.              *
+ *                                                                  *
+ * This program is distributed in the hope that it will be useful,  *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of   *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the    *
+ * GNU General Public License for more details.                     *
+ *                                                                  *
+ * You should have received a copy of the GNU General Public License*
+ * along with this program; if not, contact:                        *
+ *                                                                  *
+ * Free Software Foundation           Voice:  +1-617-542-5942       *
+ * 59 Temple Place - Suite 330        Fax:    +1-617-542-2652       *
+ * Boston, MA  02111-1307,  USA       gnu@gnu.org                   *
+ *                                                                  *
+\********************************************************************/
+
+
+/** @file admin.c
+    @brief local stats endpoint
+
+    Counters are plain integers bumped in the event loop by relay and
+    control callbacks, this module only reads them when a request comes,
+    so there is no lock and no cost in the data path.
+*/
+
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <assert.h>
+#include <unistd.h>
+#include <errno.h>
+#include <syslog.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include <json-c/json.h>
+
+#include <event2/event.h>
+#include <event2/buffer.h>
+#include <event2/bufferevent.h>
+#include <event2/http.h>
+#include <event2/keyvalq_struct.h>
+#include <event2/util.h>
+
+#include "admin.h"
+#include "client.h"
+#include "config.h"
+#include "control.h"
+#include "debug.h"
+#include "common.h"
+#include "histogram.h"
+#include "capture.h"
+#include "pool.h"
+#include "evmem.h"
+#include "tls.h"
+#include "uplink.h"
+#include "kcp_conn.h"
+#include "xtcp.h"
+#include "server_list.h"
+#include "utils.h"
+
+struct process_stats {
+    uint64_t rss_bytes;
+    uint64_t buffered_bytes;   // pending in work connection evbuffers
+    uint32_t work_conns;       // opened work connections not closed yet
+};
+
+static struct evhttp *admin_http;
+static char *admin_unix_path;
+
+static const char *reg_state_str(enum proxy_reg_state state)
+{
+    switch (state) {
+        case PS_REG_SENT:
+            return "sent";
+        case PS_REG_OK:
+            return "ok";
+        case PS_REG_FAILED:
+            return "failed";
+        default:
+            return "none";
+    }
+}
+
+static const char *control_state_str(enum control_state state)
+{
+    switch (state) {
+        case CTL_CONNECTING:
+            return "connecting";
+        case CTL_LOGGED:
+            return "logged";
+        default:
+            return "disconnected";
+    }
+}
+
+static uint64_t bev_buffered(struct bufferevent *bev)
+{
+    if (!bev)
+        return 0;
+
+    return evbuffer_get_length(bufferevent_get_input(bev)) +
+           evbuffer_get_length(bufferevent_get_output(bev));
+}
+
+static void collect_process_stats(struct process_stats *st)
+{
+    memset(st, 0, sizeof(*st));
+
+    // second field of statm is resident pages
+    FILE *fp = fopen("/proc/self/statm", "r");
+    if (fp) {
+        unsigned long size = 0, resident = 0;
+        if (fscanf(fp, "%lu %lu", &size, &resident) == 2)
+            st->rss_bytes = (uint64_t) resident * sysconf(_SC_PAGESIZE);
+        fclose(fp);
+    }
+
+    struct proxy_client *client = NULL;
+    for (client = get_all_pc(); client; client = client->hh.next) {
+        st->work_conns++;
+        st->buffered_bytes += bev_buffered(client->ctl_bev);
+        st->buffered_bytes += bev_buffered(client->local_proxy_bev);
+    }
+}
+
+// closed connection totals plus what live frps connections carried so far
+static void collect_uplink_stats(struct uplink_stats *st)
+{
+    get_uplink_stats(st);
+
+    struct control *ctl = get_main_control();
+    int i;
+    for (i = 0; i < ctl->session_num; i++)
+        if (ctl->sessions[i].connect_bev)
+            uplink_sample(bufferevent_getfd(ctl->sessions[i].connect_bev), st);
+
+    struct proxy_client *client = NULL;
+    for (client = get_all_pc(); client; client = client->hh.next)
+        if (client->ctl_bev)
+            uplink_sample(bufferevent_getfd(client->ctl_bev), st);
+}
+
+static void send_admin_reply(struct evhttp_request *req, const char *content_type,
+                             struct evbuffer *body)
+{
+    evhttp_add_header(evhttp_request_get_output_headers(req), "Content-Type", content_type);
+    evhttp_send_reply(req, HTTP_OK, "OK", body);
+}
+
+static json_object *session_json(const struct ctl_session *sess)
+{
+    json_object *j_ctl = json_object_new_object();
+    if (sess->server >= 0) {
+        const struct frps_server *srv = get_server(sess->server);
+        char addr[300];
+        snprintf(addr, sizeof(addr), "%s:%d", srv->addr, srv->port);
+        json_object_object_add(j_ctl, "server", json_object_new_string(addr));
+    }
+    json_object_object_add(j_ctl, "shard", json_object_new_int(sess->shard));
+    json_object_object_add(j_ctl, "state", json_object_new_string(control_state_str(sess->state)));
+    json_object_object_add(j_ctl, "run_id", json_object_new_string(sess->run_id));
+    json_object_object_add(j_ctl, "retry_times", json_object_new_int(sess->retry_times));
+    json_object_object_add(j_ctl, "switches", json_object_new_int64(sess->switches));
+    json_object_object_add(j_ctl, "last_recovery_ms",
+                           json_object_new_int64(sess->last_recovery_ms));
+
+    const struct heartbeat *hb = &sess->hb;
+    json_object *j_hb          = json_object_new_object();
+    json_object_object_add(j_hb, "pings", json_object_new_int64(hb->pings));
+    json_object_object_add(j_hb, "pongs", json_object_new_int64(hb->pongs));
+    json_object_object_add(j_hb, "timeouts", json_object_new_int64(hb->timeouts));
+    json_object_object_add(j_hb, "last_rtt_us", json_object_new_int64(hb->last_rtt_us));
+    json_object_object_add(j_hb, "srtt_us", json_object_new_int64(hb->srtt_us));
+    json_object_object_add(j_hb, "jitter_us", json_object_new_int64(hb->rttvar_us));
+
+    // oldest sample first
+    json_object *j_hist = json_object_new_array();
+    int i;
+    for (i = 0; i < hb->history_num; i++) {
+        int idx = (hb->history_idx - hb->history_num + i + HB_RTT_HISTORY) % HB_RTT_HISTORY;
+        json_object_array_add(j_hist, json_object_new_int64(hb->history[idx]));
+    }
+    json_object_object_add(j_hb, "rtt_history_us", j_hist);
+    json_object_object_add(j_ctl, "heartbeat", j_hb);
+    return j_ctl;
+}
+
+static void stats_json_cb(struct evhttp_request *req, void *arg)
+{
+    struct control *ctl = get_main_control();
+    struct process_stats st;
+    collect_process_stats(&st);
+
+    json_object *j_root = json_object_new_object();
+
+    json_object *j_proc = json_object_new_object();
+    json_object_object_add(j_proc, "rss_bytes", json_object_new_int64(st.rss_bytes));
+    json_object_object_add(j_proc, "buffered_bytes", json_object_new_int64(st.buffered_bytes));
+    json_object_object_add(j_proc, "work_conns", json_object_new_int64(st.work_conns));
+    json_object_object_add(j_proc, "work_conn_failures",
+                           json_object_new_int64(ctl->work_conn_failures));
+    json_object_object_add(j_root, "process", j_proc);
+
+    // first session keeps the layout of the single control connection
+    json_object_object_add(j_root, "control", session_json(&ctl->sessions[0]));
+
+    json_object *j_sessions = json_object_new_array();
+    int i;
+    for (i = 0; i < ctl->session_num; i++)
+        json_object_array_add(j_sessions, session_json(&ctl->sessions[i]));
+    json_object_object_add(j_root, "sessions", j_sessions);
+
+    const struct frps_server *servers = NULL;
+    int n                       = get_servers(&servers);
+    json_object *j_servers      = json_object_new_array();
+    for (i = 0; i < n; i++) {
+        const struct frps_server *srv = &servers[i];
+        json_object *j_srv            = json_object_new_object();
+        json_object_object_add(j_srv, "addr", json_object_new_string(srv->addr));
+        json_object_object_add(j_srv, "port", json_object_new_int(srv->port));
+        json_object_object_add(j_srv, "up", json_object_new_boolean(server_is_up(i)));
+        json_object_object_add(j_srv, "srtt_us", json_object_new_int64(srv->srtt_us));
+        json_object_object_add(j_srv, "probe_srtt_us", json_object_new_int64(srv->probe_srtt_us));
+        json_object_object_add(j_srv, "slow_us", json_object_new_int64(srv->slow_us));
+        json_object_object_add(j_srv, "sessions", json_object_new_int64(srv->sessions));
+        json_object_object_add(j_srv, "logins", json_object_new_int64(srv->logins));
+        json_object_object_add(j_srv, "failures", json_object_new_int64(srv->failures));
+        json_object_array_add(j_servers, j_srv);
+    }
+    json_object *j_list = json_object_new_object();
+    json_object_object_add(j_list, "policy", json_object_new_string(server_policy_str()));
+    json_object_object_add(j_list, "list", j_servers);
+    json_object_object_add(j_root, "servers", j_list);
+
+    json_object *j_proxies = json_object_new_object();
+    struct proxy_service *ps = NULL;
+    for (ps = get_all_proxy_services(); ps; ps = ps->hh.next) {
+        const struct proxy_stats *s = &ps->stats;
+        json_object *j_ps           = json_object_new_object();
+        json_object_object_add(j_ps, "type", json_object_new_string(ps->proxy_type));
+        json_object_object_add(j_ps, "registration",
+                               json_object_new_string(reg_state_str(s->reg_state)));
+        json_object_object_add(j_ps, "registered_sessions",
+                               json_object_new_int(__builtin_popcount(s->reg_sessions)));
+        json_object_object_add(j_ps, "bytes_in", json_object_new_int64(s->bytes_in));
+        json_object_object_add(j_ps, "bytes_out", json_object_new_int64(s->bytes_out));
+        json_object_object_add(j_ps, "active_tunnels", json_object_new_int64(s->active_tunnels));
+        json_object_object_add(j_ps, "total_tunnels", json_object_new_int64(s->total_tunnels));
+        json_object_object_add(j_ps, "connect_failures",
+                               json_object_new_int64(s->connect_failures));
+        json_object_object_add(j_ps, "local_connect_failures",
+                               json_object_new_int64(s->local_connect_failures));
+
+        json_object *j_lat = json_object_new_object();
+        int lat;
+        for (lat = 0; lat < LAT_MAX; lat++) {
+            const struct latency_hist *h = &s->latency[lat];
+            json_object *j_h             = json_object_new_object();
+            json_object_object_add(j_h, "count", json_object_new_int64(h->count));
+            json_object_object_add(j_h, "p50", json_object_new_int64(hist_percentile(h, 50)));
+            json_object_object_add(j_h, "p90", json_object_new_int64(hist_percentile(h, 90)));
+            json_object_object_add(j_h, "p99", json_object_new_int64(hist_percentile(h, 99)));
+            json_object_object_add(j_h, "max", json_object_new_int64(h->max_us));
+            json_object_object_add(j_lat, tunnel_latency_name(lat), j_h);
+        }
+        json_object_object_add(j_ps, "latency_us", j_lat);
+        json_object_object_add(j_proxies, ps->proxy_name, j_ps);
+    }
+    json_object_object_add(j_root, "proxies", j_proxies);
+
+    json_object *j_pools = json_object_new_object();
+    int type;
+    for (type = 0; type < POOL_MAX; type++) {
+        const struct pool_stats *pst = get_pool_stats(type);
+        json_object *j_pool          = json_object_new_object();
+        json_object_object_add(j_pool, "live", json_object_new_int64(pst->live));
+        json_object_object_add(j_pool, "pooled", json_object_new_int64(pst->pooled));
+        json_object_object_add(j_pool, "allocs", json_object_new_int64(pst->allocs));
+        json_object_object_add(j_pool, "reuses", json_object_new_int64(pst->reuses));
+        json_object_object_add(j_pools, pst->name, j_pool);
+    }
+    json_object_object_add(j_root, "pools", j_pools);
+
+    if (evmem_enabled()) {
+        const struct evmem_stats *ems = get_evmem_stats();
+        json_object *j_evmem          = json_object_new_object();
+        json_object *j_classes        = json_object_new_object();
+        json_object_object_add(j_evmem, "slab_bytes", json_object_new_int64(ems->slab_bytes));
+        json_object_object_add(j_evmem, "large_bytes", json_object_new_int64(ems->large_bytes));
+        json_object_object_add(j_evmem, "unmapped_slabs", json_object_new_int64(ems->unmapped));
+        int cls;
+        for (cls = 0; cls < EVMEM_CLASSES; cls++) {
+            const struct evmem_class_stats *cs = get_evmem_class_stats(cls);
+            json_object *j_cls                 = json_object_new_object();
+            char size[16];
+            snprintf(size, sizeof(size), "%zu", cs->size);
+            json_object_object_add(j_cls, "slab_size", json_object_new_int64(cs->slab_size));
+            json_object_object_add(j_cls, "slabs", json_object_new_int64(cs->slabs));
+            json_object_object_add(j_cls, "used", json_object_new_int64(cs->used));
+            json_object_object_add(j_cls, "capacity", json_object_new_int64(cs->capacity));
+            json_object_object_add(j_cls, "fallbacks", json_object_new_int64(cs->fallbacks));
+            json_object_object_add(j_classes, size, j_cls);
+        }
+        json_object_object_add(j_evmem, "classes", j_classes);
+        json_object_object_add(j_root, "evmem", j_evmem);
+    }
+
+    if (uplink_mptcp_enabled()) {
+        struct uplink_stats us;
+        collect_uplink_stats(&us);
+        json_object *j_uplink = json_object_new_object();
+        json_object *j_paths  = json_object_new_array();
+        json_object_object_add(j_uplink, "mptcp_conns", json_object_new_int64(us.mptcp_conns));
+        json_object_object_add(j_uplink, "fallback_conns",
+                               json_object_new_int64(us.fallback_conns));
+        int i;
+        for (i = 0; i < us.npaths; i++) {
+            const struct uplink_path *up = &us.paths[i];
+            json_object *j_path          = json_object_new_object();
+            json_object_object_add(j_path, "local", json_object_new_string(up->local));
+            json_object_object_add(j_path, "remote", json_object_new_string(up->remote));
+            json_object_object_add(j_path, "subflows", json_object_new_int64(up->subflows));
+            json_object_object_add(j_path, "bytes_sent", json_object_new_int64(up->bytes_sent));
+            json_object_object_add(j_path, "bytes_received",
+                                   json_object_new_int64(up->bytes_received));
+            json_object_array_add(j_paths, j_path);
+        }
+        json_object_object_add(j_uplink, "paths", j_paths);
+        json_object_object_add(j_root, "uplink", j_uplink);
+    }
+
+    if (uplink_fast_open_enabled()) {
+        struct uplink_stats us;
+        get_uplink_stats(&us);
+        json_object *j_tfo = json_object_new_object();
+        json_object_object_add(j_tfo, "conns", json_object_new_int64(us.fast_open_conns));
+        json_object_object_add(j_tfo, "syn_data", json_object_new_int64(us.fast_open_syn_data));
+        json_object_object_add(j_root, "fast_open", j_tfo);
+    }
+
+    const struct uplink *ups = NULL;
+    int n_ups                = get_uplinks(&ups);
+    if (n_ups) {
+        json_object *j_ups = json_object_new_object();
+        json_object *j_list = json_object_new_array();
+        json_object_object_add(j_ups, "policy", json_object_new_string(uplink_policy_str()));
+        int i;
+        for (i = 0; i < n_ups; i++) {
+            const struct uplink *u = &ups[i];
+            json_object *j_up      = json_object_new_object();
+            json_object_object_add(j_up, "name", json_object_new_string(u->name));
+            json_object_object_add(j_up, "weight", json_object_new_int(u->weight));
+            json_object_object_add(j_up, "conns", json_object_new_int64(u->conns));
+            json_object_object_add(j_up, "total_conns", json_object_new_int64(u->total_conns));
+            json_object_object_add(j_up, "failures", json_object_new_int64(u->failures));
+            json_object_object_add(j_up, "down",
+                                   json_object_new_boolean(u->down_until > get_monotonic_msec()));
+            json_object_object_add(j_up, "bytes_sent", json_object_new_int64(u->bytes_sent));
+            json_object_object_add(j_up, "bytes_received",
+                                   json_object_new_int64(u->bytes_received));
+            json_object_object_add(j_up, "rate", json_object_new_int64(u->rate));
+            json_object_array_add(j_list, j_up);
+        }
+        json_object_object_add(j_ups, "uplinks", j_list);
+        json_object_object_add(j_root, "bind", j_ups);
+    }
+
+    if (tls_enabled()) {
+        const struct tls_stats *ts = get_tls_stats();
+        json_object *j_tls         = json_object_new_object();
+        json_object_object_add(j_tls, "full_handshakes", json_object_new_int64(ts->full));
+        json_object_object_add(j_tls, "resumed_handshakes", json_object_new_int64(ts->resumed));
+        json_object_object_add(j_tls, "failed", json_object_new_int64(ts->failed));
+        json_object_object_add(j_tls, "ktls_tunnels", json_object_new_int64(ts->ktls));
+        json_object_object_add(j_root, "tls", j_tls);
+    }
+
+    struct kcp_conn_stats ks;
+    get_kcp_conn_stats(&ks);
+    if (ks.total_conns) {
+        json_object *j_kcp = json_object_new_object();
+        json_object_object_add(j_kcp, "live_conns", json_object_new_int64(ks.live_conns));
+        json_object_object_add(j_kcp, "total_conns", json_object_new_int64(ks.total_conns));
+        json_object_object_add(j_kcp, "timeouts", json_object_new_int64(ks.timeouts));
+        json_object_object_add(j_kcp, "segs_sent", json_object_new_int64(ks.seg.segs_sent));
+        json_object_object_add(j_kcp, "retrans", json_object_new_int64(ks.seg.retrans));
+        json_object_object_add(j_kcp, "fast_retrans", json_object_new_int64(ks.seg.fast_retrans));
+        json_object_object_add(j_kcp, "segs_recv", json_object_new_int64(ks.seg.segs_recv));
+        json_object_object_add(j_kcp, "dup_recv", json_object_new_int64(ks.seg.dup_recv));
+        json_object_object_add(j_root, "kcp", j_kcp);
+    }
+
+    const struct xtcp_stats *xs = get_xtcp_stats();
+    if (xs->punches || xs->fallbacks) {
+        json_object *j_xtcp = json_object_new_object();
+        json_object_object_add(j_xtcp, "punches", json_object_new_int64(xs->punches));
+        json_object_object_add(j_xtcp, "punched", json_object_new_int64(xs->punched));
+        json_object_object_add(j_xtcp, "failures", json_object_new_int64(xs->failures));
+        json_object_object_add(j_xtcp, "fallbacks", json_object_new_int64(xs->fallbacks));
+        json_object_object_add(j_root, "xtcp", j_xtcp);
+    }
+
+    struct evbuffer *body = evbuffer_new();
+    assert(body);
+    evbuffer_add_printf(body, "%s\n", json_object_to_json_string(j_root));
+    send_admin_reply(req, "application/json", body);
+
+    evbuffer_free(body);
+    json_object_put(j_root);
+}
+
+// label values are user strings (proxy names, hosts), escape them the way
+// the text exposition format wants; a value too long for out is cut short
+#define PROM_LABEL_LEN 256
+
+static const char *prom_label(const char *v, char *out, size_t len)
+{
+    size_t n = 0;
+    for (; v && *v && n + 3 <= len; v++) {
+        if (*v == '\\' || *v == '"') {
+            out[n++] = '\\';
+            out[n++] = *v;
+        } else if (*v == '\n') {
+            out[n++] = '\\';
+            out[n++] = 'n';
+        } else {
+            out[n++] = *v;
+        }
+    }
+    out[n] = '\0';
+    return out;
+}
+
+#define PROM_HEAD(buf, name, type, help) \
+    evbuffer_add_printf(buf, "# HELP " name " " help "\n# TYPE " name " " type "\n")
+
+#define PROM_PROXY_METRIC(buf, name, type, help, field)                              \
+    do {                                                                             \
+        struct proxy_service *ps = NULL;                                             \
+        char label[PROM_LABEL_LEN];                                                  \
+        PROM_HEAD(buf, name, type, help);                                            \
+        for (ps = get_all_proxy_services(); ps; ps = ps->hh.next)                    \
+            evbuffer_add_printf(buf, name "{proxy=\"%s\"} %llu\n",                     \
+                                prom_label(ps->proxy_name, label, sizeof(label)),    \
+                                (unsigned long long) ps->stats.field);               \
+    } while (0)
+
+#define PROM_VALUE(buf, name, type, help, fmt, val)       \
+    do {                                                  \
+        PROM_HEAD(buf, name, type, help);                 \
+        evbuffer_add_printf(buf, name " " fmt "\n", val); \
+    } while (0)
+
+// one sample per control session, expr reads struct ctl_session *sess
+#define PROM_SESSION_METRIC(buf, name, type, help, fmt, expr)                        \
+    do {                                                                             \
+        int i;                                                                       \
+        PROM_HEAD(buf, name, type, help);                                            \
+        for (i = 0; i < ctl->session_num; i++) {                                     \
+            const struct ctl_session *sess = &ctl->sessions[i];                      \
+            evbuffer_add_printf(buf, name "{session=\"%d\"} " fmt "\n", sess->index, \
+                                expr);                                               \
+        }                                                                            \
+    } while (0)
+
+// one sample per frps in the server list, expr reads struct frps_server *srv
+#define PROM_SERVER_METRIC(buf, name, type, help, fmt, expr)                         \
+    do {                                                                             \
+        const struct frps_server *servers = NULL;                                    \
+        int i, n = get_servers(&servers);                                            \
+        char label[PROM_LABEL_LEN];                                                  \
+        PROM_HEAD(buf, name, type, help);                                            \
+        for (i = 0; i < n; i++) {                                                    \
+            const struct frps_server *srv = &servers[i];                             \
+            evbuffer_add_printf(buf, name "{server=\"%s:%d\"} " fmt "\n",              \
+                                prom_label(srv->addr, label, sizeof(label)),         \
+                                srv->port, expr);                                    \
+        }                                                                            \
+    } while (0)
+
+static void prom_latency_summary(struct evbuffer *buf, const char *proxy, const char *stage,
+                                 const struct latency_hist *h)
+{
+    static const int quantiles[] = {50, 90, 99};
+    const char *name             = "xfrpc_proxy_tunnel_latency_seconds";
+    char label[PROM_LABEL_LEN];
+    int i;
+
+    proxy = prom_label(proxy, label, sizeof(label));
+
+    for (i = 0; i < (int) (sizeof(quantiles) / sizeof(quantiles[0])); i++)
+        evbuffer_add_printf(buf, "%s{proxy=\"%s\",stage=\"%s\",quantile=\"0.%d\"} %.6f\n", name,
+                            proxy, stage, quantiles[i],
+                            hist_percentile(h, quantiles[i]) / 1000000.0);
+    evbuffer_add_printf(buf, "%s_sum{proxy=\"%s\",stage=\"%s\"} %.6f\n", name, proxy, stage,
+                        h->sum_us / 1000000.0);
+    evbuffer_add_printf(buf, "%s_count{proxy=\"%s\",stage=\"%s\"} %llu\n", name, proxy, stage,
+                        (unsigned long long) h->count);
+}
+
+static void metrics_cb(struct evhttp_request *req, void *arg)
+{
+    struct control *ctl = get_main_control();
+    struct process_stats st;
+    collect_process_stats(&st);
+
+    struct evbuffer *buf = evbuffer_new();
+    assert(buf);
+
+    PROM_PROXY_METRIC(buf, "xfrpc_proxy_bytes_in_total", "counter",
+                      "Bytes relayed from frps to the local service.", bytes_in);
+    PROM_PROXY_METRIC(buf, "xfrpc_proxy_bytes_out_total", "counter",
+                      "Bytes relayed from the local service to frps.", bytes_out);
+    PROM_PROXY_METRIC(buf, "xfrpc_proxy_active_tunnels", "gauge",
+                      "Tunnels currently relaying.", active_tunnels);
+    PROM_PROXY_METRIC(buf, "xfrpc_proxy_tunnels_total", "counter",
+                      "Tunnels started by StartWorkConn.", total_tunnels);
+    PROM_PROXY_METRIC(buf, "xfrpc_proxy_connect_failures_total", "counter",
+                      "Tunnels closed by a socket error.", connect_failures);
+    PROM_PROXY_METRIC(buf, "xfrpc_proxy_local_connect_failures_total", "counter",
+                      "Tunnels whose local service could not be connected.",
+                      local_connect_failures);
+
+    struct proxy_service *ps = NULL;
+    char label[PROM_LABEL_LEN];
+    PROM_HEAD(buf, "xfrpc_proxy_registration", "gauge",
+              "Registration state of the proxy on frps.");
+    for (ps = get_all_proxy_services(); ps; ps = ps->hh.next)
+        evbuffer_add_printf(buf, "xfrpc_proxy_registration{proxy=\"%s\",state=\"%s\"} 1\n",
+                            prom_label(ps->proxy_name, label, sizeof(label)),
+                            reg_state_str(ps->stats.reg_state));
+
+    PROM_HEAD(buf, "xfrpc_proxy_tunnel_latency_seconds", "summary",
+              "Tunnel setup latency by stage, estimated from log2 buckets.");
+    for (ps = get_all_proxy_services(); ps; ps = ps->hh.next) {
+        int lat;
+        for (lat = 0; lat < LAT_MAX; lat++)
+            prom_latency_summary(buf, ps->proxy_name, tunnel_latency_name(lat),
+                                 &ps->stats.latency[lat]);
+    }
+
+    PROM_VALUE(buf, "process_resident_memory_bytes", "gauge", "Resident memory size in bytes.",
+               "%llu", (unsigned long long) st.rss_bytes);
+    PROM_VALUE(buf, "xfrpc_buffered_bytes", "gauge",
+               "Bytes pending in work connection buffers.", "%llu",
+               (unsigned long long) st.buffered_bytes);
+    PROM_VALUE(buf, "xfrpc_work_connections", "gauge", "Work connections not closed yet.", "%u",
+               st.work_conns);
+    PROM_VALUE(buf, "xfrpc_work_connection_failures_total", "counter",
+               "Work connections failed before StartWorkConn.", "%llu",
+               (unsigned long long) ctl->work_conn_failures);
+
+    int type;
+    PROM_HEAD(buf, "xfrpc_pool_live_objects", "gauge", "Pooled structs handed out.");
+    for (type = 0; type < POOL_MAX; type++)
+        evbuffer_add_printf(buf, "xfrpc_pool_live_objects{pool=\"%s\"} %u\n",
+                            get_pool_stats(type)->name, get_pool_stats(type)->live);
+    PROM_HEAD(buf, "xfrpc_pool_pooled_objects", "gauge", "Freed structs kept for reuse.");
+    for (type = 0; type < POOL_MAX; type++)
+        evbuffer_add_printf(buf, "xfrpc_pool_pooled_objects{pool=\"%s\"} %u\n",
+                            get_pool_stats(type)->name, get_pool_stats(type)->pooled);
+
+    if (evmem_enabled()) {
+        const struct evmem_stats *ems = get_evmem_stats();
+        PROM_VALUE(buf, "xfrpc_evmem_slab_bytes", "gauge", "Bytes mapped for libevent slabs.",
+                   "%llu", (unsigned long long) ems->slab_bytes);
+        PROM_VALUE(buf, "xfrpc_evmem_large_bytes", "gauge",
+                   "Libevent bytes served by malloc, over size classes or caps.", "%llu",
+                   (unsigned long long) ems->large_bytes);
+        PROM_HEAD(buf, "xfrpc_evmem_used_objects", "gauge", "Slab objects handed out.");
+        int cls;
+        for (cls = 0; cls < EVMEM_CLASSES; cls++)
+            evbuffer_add_printf(buf, "xfrpc_evmem_used_objects{size=\"%zu\"} %u\n",
+                                get_evmem_class_stats(cls)->size, get_evmem_class_stats(cls)->used);
+    }
+
+    if (uplink_mptcp_enabled()) {
+        struct uplink_stats us;
+        collect_uplink_stats(&us);
+        PROM_VALUE(buf, "xfrpc_uplink_mptcp_conns_total", "counter",
+                   "Connections to frps running multipath TCP.", "%llu",
+                   (unsigned long long) us.mptcp_conns);
+        PROM_VALUE(buf, "xfrpc_uplink_fallback_conns_total", "counter",
+                   "Connections to frps that fell back to TCP.", "%llu",
+                   (unsigned long long) us.fallback_conns);
+        int i;
+        PROM_HEAD(buf, "xfrpc_uplink_subflows", "gauge", "Live subflows per path to frps.");
+        for (i = 0; i < us.npaths; i++)
+            evbuffer_add_printf(buf, "xfrpc_uplink_subflows{local=\"%s\",remote=\"%s\"} %u\n",
+                                us.paths[i].local, us.paths[i].remote, us.paths[i].subflows);
+        PROM_HEAD(buf, "xfrpc_uplink_bytes_sent_total", "counter",
+                  "Bytes acked by frps per path.");
+        for (i = 0; i < us.npaths; i++)
+            evbuffer_add_printf(buf,
+                                "xfrpc_uplink_bytes_sent_total{local=\"%s\",remote=\"%s\"} %llu\n",
+                                us.paths[i].local, us.paths[i].remote,
+                                (unsigned long long) us.paths[i].bytes_sent);
+        PROM_HEAD(buf, "xfrpc_uplink_bytes_received_total", "counter",
+                  "Bytes received from frps per path.");
+        for (i = 0; i < us.npaths; i++)
+            evbuffer_add_printf(
+                buf, "xfrpc_uplink_bytes_received_total{local=\"%s\",remote=\"%s\"} %llu\n",
+                us.paths[i].local, us.paths[i].remote,
+                (unsigned long long) us.paths[i].bytes_received);
+    }
+
+    if (uplink_fast_open_enabled()) {
+        struct uplink_stats us;
+        get_uplink_stats(&us);
+        PROM_HEAD(buf, "xfrpc_fast_open_conns_total", "counter",
+                  "Closed frps connections opened with TCP fast open, by data in the SYN.");
+        evbuffer_add_printf(buf, "xfrpc_fast_open_conns_total{syn_data=\"yes\"} %llu\n",
+                            (unsigned long long) us.fast_open_syn_data);
+        evbuffer_add_printf(buf, "xfrpc_fast_open_conns_total{syn_data=\"no\"} %llu\n",
+                            (unsigned long long) (us.fast_open_conns - us.fast_open_syn_data));
+    }
+
+    const struct uplink *ups = NULL;
+    int n_ups                = get_uplinks(&ups);
+    if (n_ups) {
+        int i;
+        PROM_HEAD(buf, "xfrpc_bind_uplink_conns", "gauge", "Live work connections per uplink.");
+        for (i = 0; i < n_ups; i++)
+            evbuffer_add_printf(buf, "xfrpc_bind_uplink_conns{uplink=\"%s\"} %u\n",
+                                prom_label(ups[i].name, label, sizeof(label)), ups[i].conns);
+        PROM_HEAD(buf, "xfrpc_bind_uplink_failures_total", "counter",
+                  "Work connections that failed to bind or connect per uplink.");
+        for (i = 0; i < n_ups; i++)
+            evbuffer_add_printf(buf, "xfrpc_bind_uplink_failures_total{uplink=\"%s\"} %llu\n",
+                                prom_label(ups[i].name, label, sizeof(label)),
+                                (unsigned long long) ups[i].failures);
+        PROM_HEAD(buf, "xfrpc_bind_uplink_bytes_total", "counter",
+                  "Work connection bytes per uplink.");
+        for (i = 0; i < n_ups; i++) {
+            prom_label(ups[i].name, label, sizeof(label));
+            evbuffer_add_printf(buf, "xfrpc_bind_uplink_bytes_total{uplink=\"%s\",dir=\"sent\"} %llu\n",
+                                label, (unsigned long long) ups[i].bytes_sent);
+            evbuffer_add_printf(buf,
+                                "xfrpc_bind_uplink_bytes_total{uplink=\"%s\",dir=\"received\"} %llu\n",
+                                label, (unsigned long long) ups[i].bytes_received);
+        }
+    }
+
+    if (tls_enabled()) {
+        const struct tls_stats *ts = get_tls_stats();
+        PROM_HEAD(buf, "xfrpc_tls_handshakes_total", "counter", "TLS handshakes with frps.");
+        evbuffer_add_printf(buf, "xfrpc_tls_handshakes_total{type=\"full\"} %llu\n",
+                            (unsigned long long) ts->full);
+        evbuffer_add_printf(buf, "xfrpc_tls_handshakes_total{type=\"resumed\"} %llu\n",
+                            (unsigned long long) ts->resumed);
+        PROM_VALUE(buf, "xfrpc_tls_ktls_tunnels_total", "counter",
+                   "Tunnels relayed on a kernel TLS socket.", "%llu", (unsigned long long) ts->ktls);
+    }
+
+    struct kcp_conn_stats ks;
+    get_kcp_conn_stats(&ks);
+    if (ks.total_conns) {
+        PROM_VALUE(buf, "xfrpc_kcp_conns", "gauge",
+                   "Live KCP conversations, with frps or xtcp peers.", "%u", ks.live_conns);
+        PROM_VALUE(buf, "xfrpc_kcp_timeouts_total", "counter",
+                   "KCP conversations given up on a silent peer.", "%llu",
+                   (unsigned long long) ks.timeouts);
+        PROM_HEAD(buf, "xfrpc_kcp_segments_sent_total", "counter",
+                  "KCP data segments sent, by transmission kind.");
+        evbuffer_add_printf(buf, "xfrpc_kcp_segments_sent_total{kind=\"first\"} %llu\n",
+                            (unsigned long long) ks.seg.segs_sent);
+        evbuffer_add_printf(buf, "xfrpc_kcp_segments_sent_total{kind=\"timeout\"} %llu\n",
+                            (unsigned long long) ks.seg.retrans);
+        evbuffer_add_printf(buf, "xfrpc_kcp_segments_sent_total{kind=\"fast\"} %llu\n",
+                            (unsigned long long) ks.seg.fast_retrans);
+        PROM_HEAD(buf, "xfrpc_kcp_segments_received_total", "counter",
+                  "KCP data segments received.");
+        evbuffer_add_printf(buf, "xfrpc_kcp_segments_received_total{kind=\"new\"} %llu\n",
+                            (unsigned long long) ks.seg.segs_recv);
+        evbuffer_add_printf(buf, "xfrpc_kcp_segments_received_total{kind=\"dup\"} %llu\n",
+                            (unsigned long long) ks.seg.dup_recv);
+    }
+
+    const struct xtcp_stats *xs = get_xtcp_stats();
+    if (xs->punches || xs->fallbacks) {
+        PROM_HEAD(buf, "xfrpc_xtcp_punches_total", "counter", "xtcp hole punching, by result.");
+        evbuffer_add_printf(buf, "xfrpc_xtcp_punches_total{result=\"ok\"} %llu\n",
+                            (unsigned long long) xs->punched);
+        evbuffer_add_printf(buf, "xfrpc_xtcp_punches_total{result=\"failed\"} %llu\n",
+                            (unsigned long long) xs->failures);
+        PROM_VALUE(buf, "xfrpc_xtcp_fallbacks_total", "counter",
+                   "xtcp visitor tunnels relayed through frps.", "%llu",
+                   (unsigned long long) xs->fallbacks);
+    }
+
+    PROM_HEAD(buf, "xfrpc_control_state", "gauge", "State of each control session.");
+    int i;
+    for (i = 0; i < ctl->session_num; i++) {
+        const struct ctl_session *sess = &ctl->sessions[i];
+        const struct frps_server *srv  = get_server(sess->server);
+        evbuffer_add_printf(buf,
+                            "xfrpc_control_state{session=\"%d\",server=\"%s:%d\",state=\"%s\"} 1\n",
+                            sess->index, prom_label(srv ? srv->addr : "", label, sizeof(label)),
+                            srv ? srv->port : 0,
+                            control_state_str(sess->state));
+    }
+    PROM_SESSION_METRIC(buf, "xfrpc_control_last_recovery_seconds", "gauge",
+                        "Disconnect to login time of the latest reconnect.", "%.3f",
+                        sess->last_recovery_ms / 1000.0);
+    PROM_SESSION_METRIC(buf, "xfrpc_control_switches_total", "counter",
+                        "Logins to another frps than the one before.", "%llu",
+                        (unsigned long long) sess->switches);
+
+    PROM_SESSION_METRIC(buf, "xfrpc_heartbeat_pings_total", "counter", "Pings sent to frps.",
+                        "%llu", (unsigned long long) sess->hb.pings);
+    PROM_SESSION_METRIC(buf, "xfrpc_heartbeat_pongs_total", "counter",
+                        "Pongs received from frps.", "%llu", (unsigned long long) sess->hb.pongs);
+    PROM_SESSION_METRIC(buf, "xfrpc_heartbeat_timeouts_total", "counter",
+                        "Control connections dropped by heartbeat_timeout.", "%llu",
+                        (unsigned long long) sess->hb.timeouts);
+    PROM_SESSION_METRIC(buf, "xfrpc_heartbeat_rtt_seconds", "gauge",
+                        "Latest heartbeat round trip time.", "%.6f",
+                        sess->hb.last_rtt_us / 1000000.0);
+    PROM_SESSION_METRIC(buf, "xfrpc_heartbeat_srtt_seconds", "gauge",
+                        "Smoothed heartbeat round trip time.", "%.6f",
+                        sess->hb.srtt_us / 1000000.0);
+    PROM_SESSION_METRIC(buf, "xfrpc_heartbeat_jitter_seconds", "gauge",
+                        "Heartbeat round trip variation.", "%.6f", sess->hb.rttvar_us / 1000000.0);
+
+    PROM_SERVER_METRIC(buf, "xfrpc_server_up", "gauge",
+                       "Whether frps answered its latest login or probe.", "%d", server_is_up(i));
+    PROM_SERVER_METRIC(buf, "xfrpc_server_srtt_seconds", "gauge",
+                       "Smoothed heartbeat round trip time to frps, 0 when idle or unknown.",
+                       "%.6f", srv->srtt_us / 1000000.0);
+    PROM_SERVER_METRIC(buf, "xfrpc_server_probe_srtt_seconds", "gauge",
+                       "Smoothed connect time of probes to frps, 0 when unknown.", "%.6f",
+                       srv->probe_srtt_us / 1000000.0);
+    PROM_SERVER_METRIC(buf, "xfrpc_server_logins_total", "counter", "Logins to frps.", "%llu",
+                       (unsigned long long) srv->logins);
+    PROM_SERVER_METRIC(buf, "xfrpc_server_failures_total", "counter",
+                       "Connects, logins and heartbeats to frps that failed.", "%llu",
+                       (unsigned long long) srv->failures);
+
+    send_admin_reply(req, "text/plain; version=0.0.4", buf);
+    evbuffer_free(buf);
+}
+
+static void send_capture_status(struct evhttp_request *req)
+{
+    const struct capture_stats *cs = get_capture_stats();
+    json_object *j_root            = json_object_new_object();
+
+    json_object_object_add(j_root, "file",
+                           json_object_new_string(get_common_config()->capture_file));
+    json_object_object_add(j_root, "records", json_object_new_int64(cs->records));
+    json_object_object_add(j_root, "bytes", json_object_new_int64(cs->bytes));
+    json_object_object_add(j_root, "dropped", json_object_new_int64(cs->dropped));
+    json_object_object_add(j_root, "file_bytes", json_object_new_int64(cs->file_bytes));
+
+    json_object *j_on = json_object_new_object();
+    json_object_object_add(j_on, CAPTURE_CONTROL_NAME,
+                           json_object_new_boolean(capture_is_enabled(CAPTURE_CONTROL_NAME)));
+    struct proxy_service *ps = NULL;
+    for (ps = get_all_proxy_services(); ps; ps = ps->hh.next)
+        json_object_object_add(j_on, ps->proxy_name, json_object_new_boolean(ps->capture));
+    json_object_object_add(j_root, "proxies", j_on);
+
+    struct evbuffer *body = evbuffer_new();
+    assert(body);
+    evbuffer_add_printf(body, "%s\n", json_object_to_json_string(j_root));
+    send_admin_reply(req, "application/json", body);
+
+    evbuffer_free(body);
+    json_object_put(j_root);
+}
+
+// GET: capture status; POST ?proxy=<name>[&enable=0|1]: set or toggle capture
+static void capture_cb(struct evhttp_request *req, void *arg)
+{
+    if (evhttp_request_get_command(req) != EVHTTP_REQ_POST) {
+        send_capture_status(req);
+        return;
+    }
+
+    struct evkeyvalq params;
+    const char *query = evhttp_uri_get_query(evhttp_request_get_evhttp_uri(req));
+    if (!query || evhttp_parse_query_str(query, &params) != 0) {
+        evhttp_send_error(req, HTTP_BADREQUEST, "proxy is required");
+        return;
+    }
+
+    const char *proxy  = evhttp_find_header(&params, "proxy");
+    const char *enable = evhttp_find_header(&params, "enable");
+    int ret            = proxy ? capture_set_proxy(proxy, enable ? atoi(enable) : -1) : -1;
+    evhttp_clear_headers(&params);
+
+    if (!proxy)
+        evhttp_send_error(req, HTTP_BADREQUEST, "proxy is required");
+    else if (ret < 0)
+        evhttp_send_error(req, HTTP_NOTFOUND, "proxy not found");
+    else
+        send_capture_status(req);
+}
+
+static int bind_admin_unix(const char *path)
+{
+    struct sockaddr_un sun;
+    if (strlen(path) >= sizeof(sun.sun_path)) {
+        debug(LOG_ERR, "error: admin unix path [%s] is too long", path);
+        return -1;
+    }
+
+    memset(&sun, 0, sizeof(sun));
+    sun.sun_family = AF_UNIX;
+    strcpy(sun.sun_path, path);
+
+    evutil_socket_t fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0)
+        return -1;
+
+    // stale socket file of previous run
+    unlink(path);
+    if (bind(fd, (struct sockaddr *) &sun, sizeof(sun)) < 0 || listen(fd, 16) < 0 ||
+        evutil_make_socket_nonblocking(fd) < 0 || evhttp_accept_socket(admin_http, fd) < 0) {
+        debug(LOG_ERR, "error: admin listen on [%s] failed: %s", path, strerror(errno));
+        evutil_closesocket(fd);
+        return -1;
+    }
+
+    admin_unix_path = strdup(path);
+    assert(admin_unix_path);
+    return 0;
+}
+
+void start_admin_server(struct event_base *base)
+{
+    struct common_conf *c_conf = get_common_config();
+    const char *addr           = c_conf->admin_addr;
+    int is_unix = addr && strncmp(addr, ADMIN_UNIX_PREFIX, strlen(ADMIN_UNIX_PREFIX)) == 0;
+
+    if (admin_http || !addr || (!is_unix && c_conf->admin_port <= 0))
+        return;
+
+    admin_http = evhttp_new(base);
+    assert(admin_http);
+    evhttp_set_allowed_methods(admin_http, EVHTTP_REQ_GET | EVHTTP_REQ_POST);
+    evhttp_set_cb(admin_http, "/api/stats", stats_json_cb, NULL);
+    evhttp_set_cb(admin_http, "/metrics", metrics_cb, NULL);
+    evhttp_set_cb(admin_http, "/api/capture", capture_cb, NULL);
+
+    int ret = 0;
+    if (is_unix)
+        ret = bind_admin_unix(addr + strlen(ADMIN_UNIX_PREFIX));
+    else
+        ret = evhttp_bind_socket(admin_http, addr, c_conf->admin_port) ? -1 : 0;
+
+    if (ret) {
+        debug(LOG_ERR, "error: admin server start on [%s:%d] failed", addr, c_conf->admin_port);
+        evhttp_free(admin_http);
+        admin_http = NULL;
+        return;
+    }
+
+    debug(LOG_INFO, "admin server listen on [%s:%d]", addr, is_unix ? 0 : c_conf->admin_port);
+}
+
+void free_admin_server()
+{
+    if (admin_http) {
+        evhttp_free(admin_http);
+        admin_http = NULL;
+    }
+
+    if (admin_unix_path) {
+        unlink(admin_unix_path);
+        SAFE_FREE(admin_unix_path);
+    }
+}
@@ -0,0 +1,40 @@
+/* vim: set et ts=4 sts=4 sw=4 : */
+/********************************************************************\
+ * This program is free software; you can redistribute it and/or    *
+ * modify it under the terms of the GNU General Public License as   *
+ * published by the Free Software Foundation; either version 2 of   *
+ * the License, or (at your option) any later version.              *
+ *                                                                  *
+ * This program is distributed in the hope that it will be useful,  *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of   *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the    *
+ * GNU General Public License for more details.                     *
+ *                                                                  *
+ * You should have received a copy of the GNU General Public License*
+ * along with this program; if not, contact:                        *
+ *                                                                  *
+ * Free Software Foundation           Voice:  +1-617-542-5942       *
+ * 59 Temple Place - Suite 330        Fax:    +1-617-542-2652       *
+ * Boston, MA  02111-1307,  USA       gnu@gnu.org                   *
+ *                                                                  *
+\********************************************************************/
+
+
+/** @file admin.h
+    @brief local stats endpoint
+*/
+
+#ifndef _ADMIN_H_
+#define _ADMIN_H_
+
+#define ADMIN_UNIX_PREFIX "unix:"
+
+struct event_base;
+
+// listen on admin_addr:admin_port (or unix:/path) when configured
+// GET /api/stats answers json, GET /metrics answers prometheus text,
+// GET /api/capture shows and POST /api/capture?proxy=<name>&enable=0|1 switches capture
+void start_admin_server(struct event_base *base);
+void free_admin_server();
+
+#endif   //_ADMIN_H_
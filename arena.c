@@ -0,0 +1,118 @@
+/* vim: set et ts=4 sts=4 sw=4 : */
+/********************************************************************\
+ * This program is free software; you can redistribute it and/or    *
+ * modify it under the terms of the GNU General Public License as   *
+ * published by the Free Software Foundation; either version 2 of   *
+ * the License, or (at your option) any later version.              *
+ *                                                                  *
+ * This program is distributed in the hope that it will be useful,  *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of   *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the    *
+ * GNU General Public License for more details.                     *
+ *                                                                  *
+ * You should have received a copy of the GNU General Public License*
+ * along with this program; if not, contact:                        *
+ *                                                                  *
+ * Free Software Foundation           Voice:  +1-617-542-5942       *
+ * 59 Temple Place - Suite 330        Fax:    +1-617-542-2652       *
+ * Boston, MA  02111-1307,  USA       gnu@gnu.org                   *
+ *                                                                  *
+\********************************************************************/
+
+/** @file arena.c
+    @brief bump pointer arena for per-message decode allocations
+
+    Decoding one control message used to strdup every json field into
+    its own heap block, and most callers forgot some of them. Decode
+    allocations now come from an arena which is reset once the message
+    is dispatched, nothing decoded may be kept after that.
+*/
+
+#include <string.h>
+#include <stdlib.h>
+#include <assert.h>
+
+#include "arena.h"
+
+#define ARENA_ALIGN sizeof(void *)
+
+struct arena_block {
+    struct arena_block *next;
+    size_t size;
+    size_t used;
+    char data[];
+};
+
+static struct arena_block *new_arena_block(size_t size, struct arena_block *next)
+{
+    struct arena_block *b = malloc(sizeof(struct arena_block) + size);
+    assert(b);
+    b->next = next;
+    b->size = size;
+    b->used = 0;
+    return b;
+}
+
+void *arena_alloc(struct arena *a, size_t size)
+{
+    size = (size + ARENA_ALIGN - 1) & ~(ARENA_ALIGN - 1);
+
+    struct arena_block *b = a->head;
+    if (!b || b->size - b->used < size) {
+        size_t bsize = ARENA_BLOCK_SIZE;
+        while (bsize < size)
+            bsize <<= 1;
+        b       = new_arena_block(bsize, a->head);
+        a->head = b;
+    }
+
+    void *p = b->data + b->used;
+    b->used += size;
+    a->used += size;
+    memset(p, 0, size);
+    return p;
+}
+
+char *arena_strdup(struct arena *a, const char *s)
+{
+    if (!s)
+        return NULL;
+
+    size_t len = strlen(s) + 1;
+    char *d    = arena_alloc(a, len);
+    memcpy(d, s, len);
+    return d;
+}
+
+void arena_reset(struct arena *a)
+{
+    struct arena_block *b = a->head;
+    if (!b)
+        return;
+
+    // a round spilled over several blocks, merge them into one for the
+    // next, but do not keep a huge message's memory for the rest of time
+    if (b->next || b->size > ARENA_KEEP_MAX) {
+        size_t bsize = ARENA_BLOCK_SIZE;
+        while (bsize < a->used && bsize < ARENA_KEEP_MAX)
+            bsize <<= 1;
+        arena_free(a);
+        b       = new_arena_block(bsize, NULL);
+        a->head = b;
+    }
+
+    b->used = 0;
+    a->used = 0;
+}
+
+void arena_free(struct arena *a)
+{
+    struct arena_block *b = a->head;
+    while (b) {
+        struct arena_block *next = b->next;
+        free(b);
+        b = next;
+    }
+    a->head = NULL;
+    a->used = 0;
+}
@@ -0,0 +1,49 @@
+/* vim: set et ts=4 sts=4 sw=4 : */
+/********************************************************************\
+ * This program is free software; you can redistribute it and/or    *
+ * modify it under the terms of the GNU General Public License as   *
+ * published by the Free Software Foundation; either version 2 of   *
+ * the License, or (at your option) any later version.              *
+ *                                                                  *
+ * This program is distributed in the hope that it will be useful,  *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of   *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the    *
+ * GNU General Public License for more details.                     *
+ *                                                                  *
+ * You should have received a copy of the GNU General Public License*
+ * along with this program; if not, contact:                        *
+ *                                                                  *
+ * Free Software Foundation           Voice:  +1-617-542-5942       *
+ * 59 Temple Place - Suite 330        Fax:    +1-617-542-2652       *
+ * Boston, MA  02111-1307,  USA       gnu@gnu.org                   *
+ *                                                                  *
+\********************************************************************/
+
+/** @file arena.h
+    @brief bump pointer arena for per-message decode allocations
+*/
+
+#ifndef _ARENA_H_
+#define _ARENA_H_
+
+#include <stddef.h>
+
+#define ARENA_BLOCK_SIZE 1024   // first block, kept across resets
+#define ARENA_KEEP_MAX 16384    // larger blocks are freed on reset
+
+struct arena_block;
+
+struct arena {
+    struct arena_block *head;   // current block, older ones chained behind it
+    size_t used;                // bytes handed out since last reset
+};
+
+// zeroed memory valid until arena_reset, never NULL
+void *arena_alloc(struct arena *a, size_t size);
+// NULL string gives NULL
+char *arena_strdup(struct arena *a, const char *s);
+// forget everything allocated, keep one block big enough for the last round
+void arena_reset(struct arena *a);
+void arena_free(struct arena *a);
+
+#endif   //_ARENA_H_
@@ -0,0 +1,390 @@
+/* vim: set et ts=4 sts=4 sw=4 : */
+/********************************************************************\
+ * This program is free software; you can redistribute it and/or    *
+ * modify it under the terms of the GNU General Public License as   *
+ * published by the Free Software Foundation; either version 2 of   *
+ * the License, or (at your option) any later version.              *
+ *                                                                  *
+ * This program is distributed in the hope that it will be useful,  *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of   *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the    *
+ * GNU General Public License for more details.                     *
+ *                                                                  *
+ * You should have received a copy of the GNU General Public License*
+ * along with this program; if not, contact:                        *
+ *                                                                  *
+ * Free Software Foundation           Voice:  +1-617-542-5942       *
+ * 59 Temple Place - Suite 330        Fax:    +1-617-542-2652       *
+ * Boston, MA  02111-1307,  USA       gnu@gnu.org                   *
+ *                                                                  *
+\********************************************************************/
+
+
+/** @file bench_failover.c
+    @brief gap seen by users while xfrpc moves between frps servers
+
+    Two mock frps listen on the same ports of 127.0.0.1 (primary) and
+    127.0.0.2 (backup), one xfrpc has both in its server list and one tcp
+    proxy to a local greeting echo service. A user is one connection to the
+    proxy remote port of one frps that gets the greeting byte back.
+
+      failover       the primary is shut down, users poll the backup until
+                     one gets through: the gap is what a user failing over
+                     to the backup address waits. The primary is started
+                     again and the time until xfrpc is back on it (priority
+                     policy, server_probe_interval 1) is reported too.
+      active-active  active_servers = 2, users keep coming to the backup
+                     every few ms while the primary is shut down; none of
+                     them should fail.
+      rtt            the primary answers heartbeats 20 ms late, time until
+                     the rtt policy moved the session to the backup.
+
+    usage: xfrpc_bench_failover -x path/to/xfrpc [-n rounds] [-p base_port]
+*/
+
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <assert.h>
+#include <signal.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+
+#include <event2/event.h>
+#include <event2/buffer.h>
+#include <event2/bufferevent.h>
+#include <event2/listener.h>
+
+#include "mock_frps.h"
+#include "bench_util.h"
+#include "../histogram.h"
+
+#define READY_SEC 30
+#define USER_TIMEOUT_MS 1000
+#define POLL_MS 2
+#define STEADY_USER_MS 5      // active-active user interval
+#define STEADY_SEC 2          // active-active users around each shutdown
+#define RTT_DELAY_US 20000
+
+static const char *frps_ip[2] = {"127.0.0.1", "127.0.0.2"};
+
+struct bench_failover {
+    struct event_base *base;
+    struct mock_frps *frps[2];
+    int base_port;
+    int done;
+    int failed;
+};
+
+struct user_conn {
+    struct bench_failover *bf;
+    struct bufferevent *bev;
+};
+
+static void finish(struct bench_failover *bf, int failed)
+{
+    bf->failed = failed;
+    bf->done   = 1;
+}
+
+static void user_read_cb(struct bufferevent *bev, void *ctx)
+{
+    finish(ctx, 0);
+}
+
+static void user_event_cb(struct bufferevent *bev, short what, void *ctx)
+{
+    if (what & (BEV_EVENT_EOF | BEV_EVENT_ERROR))
+        finish(ctx, 1);
+}
+
+static void timeout_cb(evutil_socket_t fd, short what, void *arg)
+{
+    finish(arg, 1);
+}
+
+static void run_until_done(struct bench_failover *bf, int timeout_ms)
+{
+    struct timeval limit = {timeout_ms / 1000, (timeout_ms % 1000) * 1000};
+    struct event *ev     = evtimer_new(bf->base, timeout_cb, bf);
+    assert(ev);
+    bf->done = 0;
+    event_add(ev, &limit);
+    while (!bf->done)
+        event_base_loop(bf->base, EVLOOP_ONCE);
+    event_free(ev);
+}
+
+// keep the mock frps serving for ms
+static void pump(struct bench_failover *bf, int ms)
+{
+    run_until_done(bf, ms);
+}
+
+// one user through frps i, 0 when the greeting came back
+static int run_user(struct bench_failover *bf, int i)
+{
+    struct sockaddr_in sin;
+    memset(&sin, 0, sizeof(sin));
+    sin.sin_family = AF_INET;
+    sin.sin_port   = htons(bf->base_port + 2);
+    inet_pton(AF_INET, frps_ip[i], &sin.sin_addr);
+
+    struct bufferevent *bev = bufferevent_socket_new(bf->base, -1, BEV_OPT_CLOSE_ON_FREE);
+    assert(bev);
+    bufferevent_setcb(bev, user_read_cb, NULL, user_event_cb, bf);
+    bufferevent_enable(bev, EV_READ | EV_WRITE);
+    bf->failed = 1;
+    if (bufferevent_socket_connect(bev, (struct sockaddr *) &sin, sizeof(sin)) == 0)
+        run_until_done(bf, USER_TIMEOUT_MS);
+    bufferevent_free(bev);
+    return bf->failed ? -1 : 0;
+}
+
+// usec until a user got through frps i, -1 after limit_sec
+static int64_t wait_user(struct bench_failover *bf, int i, int limit_sec)
+{
+    uint64_t from = bench_now_usec();
+    while (bench_now_usec() - from < (uint64_t) limit_sec * 1000000) {
+        if (run_user(bf, i) == 0)
+            return bench_now_usec() - from;
+        pump(bf, POLL_MS);
+    }
+    return -1;
+}
+
+static int start_frps(struct bench_failover *bf, int i)
+{
+    if (mock_frps_bind_addr(frps_ip[i]))
+        return -1;
+    bf->frps[i] = mock_frps_new(bf->base, bf->base_port, NULL, NULL);
+    if (!bf->frps[i]) {
+        fprintf(stderr, "listen on %s:%d failed\n", frps_ip[i], bf->base_port);
+        return -1;
+    }
+    return 0;
+}
+
+static void stop_frps(struct bench_failover *bf, int i)
+{
+    mock_frps_free(bf->frps[i]);
+    bf->frps[i] = NULL;
+}
+
+// fresh mocks, no proxy listener or run_id left from the scenario before
+static int restart_frps(struct bench_failover *bf)
+{
+    int i;
+    for (i = 0; i < 2; i++) {
+        if (bf->frps[i])
+            stop_frps(bf, i);
+        if (start_frps(bf, i))
+            return -1;
+    }
+    return 0;
+}
+
+static pid_t start_xfrpc(struct bench_failover *bf, const char *xfrpc, const char *ini,
+                         const char *policy, int active)
+{
+    char extra[512];
+    snprintf(extra, sizeof(extra),
+             "servers = %s:%d, %s:%d\n"
+             "server_policy = %s\n"
+             "active_servers = %d\n"
+             "server_probe_interval = 1\n"
+             "heartbeat_interval = 1\n"
+             "heartbeat_timeout = 3\n",
+             frps_ip[0], bf->base_port, frps_ip[1], bf->base_port, policy, active);
+    if (write_xfrpc_ini(ini, bf->base_port, bf->base_port + 1, bf->base_port + 2, extra))
+        return -1;
+    return spawn_xfrpc(xfrpc, ini, NULL);
+}
+
+static void print_row(const char *name, int rounds, const struct latency_hist *gap,
+                      const struct latency_hist *back, uint64_t failed, uint64_t users)
+{
+    printf("%-14s %6d %9.1f/%8.1f", name, rounds, hist_percentile(gap, 50) / 1000.0,
+           gap->max_us / 1000.0);
+    if (back->count)
+        printf(" %9.1f/%8.1f", hist_percentile(back, 50) / 1000.0, back->max_us / 1000.0);
+    else
+        printf(" %18s", "-");
+    if (users)
+        printf(" %8llu/%llu\n", (unsigned long long) failed, (unsigned long long) users);
+    else
+        printf(" %10s\n", "-");
+}
+
+static int run_failover(struct bench_failover *bf, const char *xfrpc, const char *ini,
+                        int rounds)
+{
+    struct latency_hist gap, back;
+    memset(&gap, 0, sizeof(gap));
+    memset(&back, 0, sizeof(back));
+
+    if (restart_frps(bf))
+        return -1;
+    pid_t pid = start_xfrpc(bf, xfrpc, ini, "priority", 1);
+    int rc    = wait_user(bf, 0, READY_SEC) < 0 ? -1 : 0;
+    int r;
+    for (r = 0; r < rounds && !rc; r++) {
+        stop_frps(bf, 0);
+        int64_t us = wait_user(bf, 1, READY_SEC);
+        if (us < 0 || start_frps(bf, 0)) {
+            rc = -1;
+            break;
+        }
+        hist_add(&gap, us);
+
+        us = wait_user(bf, 0, READY_SEC);
+        if (us < 0) {
+            rc = -1;
+            break;
+        }
+        hist_add(&back, us);
+    }
+    stop_xfrpc(pid);
+    if (rc) {
+        fprintf(stderr, "failover: no user got through in %d seconds\n", READY_SEC);
+        return -1;
+    }
+    print_row("failover", rounds, &gap, &back, 0, 0);
+    return 0;
+}
+
+static int run_active(struct bench_failover *bf, const char *xfrpc, const char *ini,
+                      int rounds)
+{
+    struct latency_hist gap, back;
+    memset(&gap, 0, sizeof(gap));
+    memset(&back, 0, sizeof(back));
+    uint64_t users = 0, failed = 0;
+
+    if (restart_frps(bf))
+        return -1;
+    pid_t pid = start_xfrpc(bf, xfrpc, ini, "priority", 2);
+    int rc = wait_user(bf, 0, READY_SEC) < 0 || wait_user(bf, 1, READY_SEC) < 0 ? -1 : 0;
+    int r;
+    for (r = 0; r < rounds && !rc; r++) {
+        // the slowest user around the shutdown is the gap on the backup
+        uint64_t from = bench_now_usec(), slowest = 0;
+        int stopped   = 0;
+        while (bench_now_usec() - from < STEADY_SEC * 1000000ULL) {
+            if (!stopped && bench_now_usec() - from >= STEADY_SEC * 500000ULL) {
+                stop_frps(bf, 0);
+                stopped = 1;
+            }
+            uint64_t start = bench_now_usec();
+            users++;
+            if (run_user(bf, 1))
+                failed++;
+            else if (bench_now_usec() - start > slowest)
+                slowest = bench_now_usec() - start;
+            pump(bf, STEADY_USER_MS);
+        }
+        hist_add(&gap, slowest);
+
+        int64_t us = -1;
+        if (start_frps(bf, 0) == 0)
+            us = wait_user(bf, 0, READY_SEC);
+        if (us < 0) {
+            rc = -1;
+            break;
+        }
+        hist_add(&back, us);
+    }
+    stop_xfrpc(pid);
+    if (rc) {
+        fprintf(stderr, "active-active: no user got through in %d seconds\n", READY_SEC);
+        return -1;
+    }
+    print_row("active-active", rounds, &gap, &back, failed, users);
+    return 0;
+}
+
+static int run_rtt(struct bench_failover *bf, const char *xfrpc, const char *ini)
+{
+    struct latency_hist gap, back;
+    memset(&gap, 0, sizeof(gap));
+    memset(&back, 0, sizeof(back));
+
+    if (restart_frps(bf))
+        return -1;
+    mock_frps_set_pong_delay(bf->frps[0], RTT_DELAY_US);
+    pid_t pid  = start_xfrpc(bf, xfrpc, ini, "rtt", 1);
+    int64_t us = wait_user(bf, 0, READY_SEC);
+    if (us >= 0)
+        us = wait_user(bf, 1, READY_SEC);
+    stop_xfrpc(pid);
+    if (us < 0) {
+        fprintf(stderr, "rtt: session did not move in %d seconds\n", READY_SEC);
+        return -1;
+    }
+    hist_add(&gap, us);
+    print_row("rtt", 1, &gap, &back, 0, 0);
+    return 0;
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr, "usage: %s -x path/to/xfrpc [-n rounds] [-p base_port]\n", prog);
+    exit(2);
+}
+
+int main(int argc, char **argv)
+{
+    const char *xfrpc = NULL;
+    int rounds = 5, opt;
+    struct bench_failover bf;
+    memset(&bf, 0, sizeof(bf));
+    bf.base_port = 29200;
+    while ((opt = getopt(argc, argv, "x:n:p:")) != -1) {
+        switch (opt) {
+            case 'x':
+                xfrpc = optarg;
+                break;
+            case 'n':
+                rounds = atoi(optarg);
+                break;
+            case 'p':
+                bf.base_port = atoi(optarg);
+                break;
+            default:
+                usage(argv[0]);
+        }
+    }
+    if (!xfrpc || rounds <= 0)
+        usage(argv[0]);
+    signal(SIGPIPE, SIG_IGN);
+
+    bf.base = event_base_new();
+    assert(bf.base);
+    struct local_service_stats local;
+    memset(&local, 0, sizeof(local));
+    if (!start_local_service(bf.base, bf.base_port + 1, LOCAL_GREET_ECHO, &local)) {
+        fprintf(stderr, "listen on port %d failed\n", bf.base_port + 1);
+        return 1;
+    }
+
+    char ini[64];
+    snprintf(ini, sizeof(ini), "/tmp/xfrpc_bench_failover_%d.ini", (int) getpid());
+
+    printf("loopback, primary %s, backup %s, heartbeat_interval 1\n", frps_ip[0], frps_ip[1]);
+    printf("%-14s %6s %18s %18s %10s\n", "scenario", "rounds", "gap p50/max ms",
+           "back p50/max ms", "failed");
+    int rc = run_failover(&bf, xfrpc, ini, rounds);
+    if (!rc)
+        rc = run_active(&bf, xfrpc, ini, rounds);
+    if (!rc)
+        rc = run_rtt(&bf, xfrpc, ini);
+
+    int i;
+    for (i = 0; i < 2; i++)
+        if (bf.frps[i])
+            stop_frps(&bf, i);
+    unlink(ini);
+    return rc ? 1 : 0;
+}
@@ -0,0 +1,884 @@
+/* vim: set et ts=4 sts=4 sw=4 : */
+/********************************************************************\
+ * This program is free software; you can redistribute it and/or    *
+ * modify it under the terms of the GNU General Public License as   *
+ * published by the Free Software Foundation; either version 2 of   *
+ * the License, or (at your option) any later version.              *
+ *                                                                  *
+ * This program is distributed in the hope that it will be useful,  *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of   *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the    *
+ * GNU General Public License for more details.                     *
+ *                                                                  *
+ * You should have received a copy of the GNU General Public License*
+ * along with this program; if not, contact:                        *
+ *                                                                  *
+ * Free Software Foundation           Voice:  +1-617-542-5942       *
+ * 59 Temple Place - Suite 330        Fax:    +1-617-542-2652       *
+ * Boston, MA  02111-1307,  USA       gnu@gnu.org                   *
+ *                                                                  *
+\********************************************************************/
+
+
+/** @file bench_kcp.c
+    @brief TCP, TCP fast open and KCP to frps over an impaired link
+
+    xfrpc and the local echo service run in a network namespace whose
+    only way out is a pair of tap devices, this process moves frames
+    between them with the given loss, one way delay and rate, like netem
+    would on a cellular uplink (the sandboxes this runs in rarely have
+    sch_netem). The mock frps runs on loopback behind two relays on the
+    host end of the link, a TCP one and a KCP to TCP one, so both
+    transports cross the same impairment and the same number of hops.
+
+    For each transport and loss rate, a burst of users times tunnel setup
+    up to the greeting of the echo service, most of them wait for a new
+    work connection. Then one user does request/response round trips
+    through the tunnel and pushes bulk bytes through the echo service
+    and reads them back. tfo is tcp with tcp_fast_open, the TCP relay
+    then takes the first message in the SYN.
+
+    Needs root for the namespace and the tap devices (tap rather than tun,
+    xfrpc takes its run_id from the MAC of an interface), skips without it.
+
+    usage: xfrpc_bench_kcp -x path/to/xfrpc [-l 0,2,5] [-D delay_ms]
+                           [-R rate_mbit] [-n requests] [-b bulk_mb]
+                           [-s setups] [-t tcp,tfo,kcp] [-p base_port]
+                           [-o "option = value"]...
+*/
+
+#define _GNU_SOURCE
+
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <signal.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <sys/ioctl.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <net/if.h>
+#include <linux/if_tun.h>
+
+#include <event2/event.h>
+#include <event2/buffer.h>
+#include <event2/bufferevent.h>
+#include <event2/listener.h>
+
+#include "mock_frps.h"
+#include "bench_util.h"
+#include "../histogram.h"
+#include "../kcp_conn.h"
+
+#define NETNS "xfrpc_bench_kcp"
+#define TAP_HOST "xkcp0"
+#define TAP_NS "xkcp1"
+#define HOST_IP "10.77.0.1"
+#define TFO_SYSCTL "/proc/sys/net/ipv4/tcp_fastopen"
+#define NS_IP "10.77.0.2"
+
+#define MAX_LOSSES 8
+#define SHIM_QUEUE (256 * 1024)   // bytes waiting on the link per direction, then tail drop
+#define RELAY_HIGH (256 * 1024)
+#define REQ_SIZE 64
+#define BULK_CHUNK 65536
+#define READY_SEC 30
+#define PHASE_TIMEOUT_SEC 180
+
+struct shim_pkt {
+    struct shim_pkt *next;
+    uint64_t due;   // usec
+    int len;
+    char data[];
+};
+
+struct shim_dir {
+    int from, to;
+    struct shim_pkt *head, *tail;
+    size_t queued;
+    uint64_t busy_until;   // usec, link serializing earlier packets
+    struct event *ev_read;
+    struct event *timer;
+    struct shim *shim;
+    uint64_t passed, dropped;
+};
+
+struct shim {
+    double loss;   // 0..1
+    int delay_ms;
+    double rate_mbit;
+    uint64_t rng;
+    struct shim_dir dir[2];
+};
+
+enum kcp_phase {
+    PH_READY = 0,
+    PH_SETUP,
+    PH_RR,
+    PH_BULK,
+};
+
+struct bench_kcp {
+    struct event_base *base;
+    struct sockaddr_in remote;
+    enum kcp_phase phase;
+    int done;
+    int failed;
+
+    int requests;
+    size_t bulk;
+    int pending;   // users of a setup burst not greeted yet
+    char payload[BULK_CHUNK];
+
+    struct latency_hist setup_hist;
+    struct latency_hist rr_hist;
+    double bulk_sec;
+};
+
+struct user_conn {
+    struct bench_kcp *bk;
+    struct bufferevent *bev;
+    int greeted;
+    int left;   // requests to go
+    uint64_t started;
+    uint64_t sent_at;
+    size_t to_send;
+    size_t to_recv;
+};
+
+struct result {
+    const char *transport;
+    int loss;
+    struct latency_hist setup;
+    struct latency_hist rr;
+    double bulk_mbs;
+    uint64_t dropped;
+};
+
+static double shim_random(struct shim *sh)
+{
+    // xorshift64, the same loss pattern on every run
+    sh->rng ^= sh->rng << 13;
+    sh->rng ^= sh->rng >> 7;
+    sh->rng ^= sh->rng << 17;
+    return (sh->rng >> 11) * (1.0 / 9007199254740992.0);
+}
+
+static void shim_timer_cb(evutil_socket_t fd, short what, void *arg)
+{
+    struct shim_dir *d = arg;
+    uint64_t now       = bench_now_usec();
+
+    while (d->head && d->head->due <= now) {
+        struct shim_pkt *p = d->head;
+        d->head            = p->next;
+        if (!d->head)
+            d->tail = NULL;
+        d->queued -= p->len;
+        if (write(d->to, p->data, p->len) < 0 && errno != EAGAIN)
+            d->dropped++;
+        free(p);
+    }
+    if (d->head) {
+        struct timeval tv = {0, d->head->due - now};
+        evtimer_add(d->timer, &tv);
+    }
+}
+
+static void shim_read_cb(evutil_socket_t fd, short what, void *arg)
+{
+    struct shim_dir *d = arg;
+    struct shim *sh    = d->shim;
+    char buf[65536];
+    ssize_t n;
+
+    while ((n = read(fd, buf, sizeof(buf))) > 0) {
+        if (shim_random(sh) < sh->loss || d->queued + n > SHIM_QUEUE) {
+            d->dropped++;
+            continue;
+        }
+        d->passed++;
+
+        uint64_t now = bench_now_usec(), start = now > d->busy_until ? now : d->busy_until;
+        d->busy_until = start + (uint64_t) (n * 8 / sh->rate_mbit);
+        struct shim_pkt *p = malloc(sizeof(struct shim_pkt) + n);
+        assert(p);
+        p->next = NULL;
+        p->len  = n;
+        p->due  = d->busy_until + sh->delay_ms * 1000ULL;
+        memcpy(p->data, buf, n);
+        if (d->tail)
+            d->tail->next = p;
+        else
+            d->head = p;
+        d->tail = p;
+        d->queued += n;
+
+        if (!evtimer_pending(d->timer, NULL)) {
+            struct timeval tv = {0, p->due - now};
+            evtimer_add(d->timer, &tv);
+        }
+    }
+}
+
+static void shim_start(struct shim *sh, struct event_base *base, int host_fd, int ns_fd)
+{
+    int i;
+    sh->dir[0].from = ns_fd;
+    sh->dir[0].to   = host_fd;
+    sh->dir[1].from = host_fd;
+    sh->dir[1].to   = ns_fd;
+    for (i = 0; i < 2; i++) {
+        struct shim_dir *d = &sh->dir[i];
+        d->shim            = sh;
+        d->ev_read         = event_new(base, d->from, EV_READ | EV_PERSIST, shim_read_cb, d);
+        d->timer           = evtimer_new(base, shim_timer_cb, d);
+        assert(d->ev_read && d->timer);
+        event_add(d->ev_read, NULL);
+    }
+}
+
+static int open_tap(const char *name)
+{
+    int fd = open("/dev/net/tun", O_RDWR | O_NONBLOCK | O_CLOEXEC);
+    if (fd < 0)
+        return -1;
+
+    struct ifreq ifr;
+    memset(&ifr, 0, sizeof(ifr));
+    ifr.ifr_flags = IFF_TAP | IFF_NO_PI;
+    strncpy(ifr.ifr_name, name, IFNAMSIZ - 1);
+    if (ioctl(fd, TUNSETIFF, &ifr) < 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static int run(const char *cmd)
+{
+    int rc = system(cmd);
+    if (rc)
+        fprintf(stderr, "failed: %s\n", cmd);
+    return rc;
+}
+
+static void teardown_link()
+{
+    if (system("ip netns del " NETNS " 2>/dev/null")) {
+        // not there
+    }
+}
+
+static int setup_link(int *host_fd, int *ns_fd)
+{
+    teardown_link();
+    *host_fd = open_tap(TAP_HOST);
+    *ns_fd   = open_tap(TAP_NS);
+    if (*host_fd < 0 || *ns_fd < 0) {
+        perror("tap");
+        return -1;
+    }
+
+    if (run("ip netns add " NETNS) || run("ip link set " TAP_NS " netns " NETNS) ||
+        run("ip addr add " HOST_IP "/24 dev " TAP_HOST) || run("ip link set " TAP_HOST " up") ||
+        run("ip -n " NETNS " addr add " NS_IP "/24 dev " TAP_NS) ||
+        run("ip -n " NETNS " link set " TAP_NS " up") || run("ip -n " NETNS " link set lo up"))
+        return -1;
+    return 0;
+}
+
+static int read_tfo_sysctl()
+{
+    int v    = -1;
+    FILE *fp = fopen(TFO_SYSCTL, "r");
+    if (fp) {
+        if (fscanf(fp, "%d", &v) != 1)
+            v = -1;
+        fclose(fp);
+    }
+    return v;
+}
+
+static void write_tfo_sysctl(int v)
+{
+    FILE *fp = fopen(TFO_SYSCTL, "w");
+    if (fp) {
+        fprintf(fp, "%d\n", v);
+        fclose(fp);
+    }
+}
+
+static int enter_netns(const char *name)
+{
+    char path[128];
+    snprintf(path, sizeof(path), "/var/run/netns/%s", name);
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return -1;
+    int rc = setns(fd, CLONE_NEWNET);
+    close(fd);
+    return rc;
+}
+
+struct relay {
+    struct bufferevent *side[2];
+    int alive;
+};
+
+static void relay_event_cb(struct bufferevent *bev, short what, void *ctx);
+
+static struct bufferevent *relay_other(struct relay *r, struct bufferevent *bev)
+{
+    return r->side[0] == bev ? r->side[1] : r->side[0];
+}
+
+static void relay_drained_cb(struct bufferevent *bev, void *ctx)
+{
+    struct relay *r             = ctx;
+    struct bufferevent *partner = relay_other(r, bev);
+    bufferevent_setwatermark(bev, EV_WRITE, 0, 0);
+    if (partner)
+        bufferevent_enable(partner, EV_READ);
+}
+
+static void relay_read_cb(struct bufferevent *bev, void *ctx)
+{
+    struct relay *r             = ctx;
+    struct bufferevent *partner = relay_other(r, bev);
+    if (!partner) {
+        evbuffer_drain(bufferevent_get_input(bev), -1);
+        return;
+    }
+
+    struct evbuffer *dst = bufferevent_get_output(partner);
+    evbuffer_add_buffer(dst, bufferevent_get_input(bev));
+    if (evbuffer_get_length(dst) >= RELAY_HIGH) {
+        bufferevent_setwatermark(partner, EV_WRITE, RELAY_HIGH / 2, 0);
+        bufferevent_disable(bev, EV_READ);
+    }
+}
+
+static void relay_side_free(struct relay *r, struct bufferevent *bev)
+{
+    if (r->side[0] == bev)
+        r->side[0] = NULL;
+    else
+        r->side[1] = NULL;
+    bufferevent_free(bev);
+    if (--r->alive == 0)
+        free(r);
+}
+
+static void relay_flushed_cb(struct bufferevent *bev, void *ctx)
+{
+    if (!evbuffer_get_length(bufferevent_get_output(bev)))
+        relay_side_free(ctx, bev);
+}
+
+static void relay_event_cb(struct bufferevent *bev, short what, void *ctx)
+{
+    struct relay *r = ctx;
+    if (!(what & (BEV_EVENT_EOF | BEV_EVENT_ERROR)))
+        return;
+
+    struct bufferevent *partner = relay_other(r, bev);
+    if (partner) {
+        relay_read_cb(bev, r);
+        if (evbuffer_get_length(bufferevent_get_output(partner))) {
+            bufferevent_setcb(partner, NULL, relay_flushed_cb, relay_event_cb, r);
+            bufferevent_setwatermark(partner, EV_WRITE, 0, 0);
+            bufferevent_disable(partner, EV_READ);
+        } else {
+            relay_side_free(r, partner);
+        }
+    }
+    relay_side_free(r, bev);
+}
+
+// front is the xfrpc side, the back connection goes to the mock frps on loopback
+static void relay_start(struct event_base *base, struct bufferevent *front, int frps_port)
+{
+    struct relay *r = calloc(1, sizeof(struct relay));
+    assert(r);
+    r->side[0] = front;
+    r->side[1] = bufferevent_socket_new(base, -1, BEV_OPT_CLOSE_ON_FREE);
+    assert(r->side[1]);
+    r->alive = 2;
+
+    struct sockaddr_in sin;
+    memset(&sin, 0, sizeof(sin));
+    sin.sin_family      = AF_INET;
+    sin.sin_port        = htons(frps_port);
+    sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    int i;
+    for (i = 0; i < 2; i++) {
+        bufferevent_setcb(r->side[i], relay_read_cb, relay_drained_cb, relay_event_cb, r);
+        bufferevent_enable(r->side[i], EV_READ | EV_WRITE);
+    }
+    if (bufferevent_socket_connect(r->side[1], (struct sockaddr *) &sin, sizeof(sin)))
+        relay_event_cb(r->side[1], BEV_EVENT_ERROR, r);
+}
+
+static void tcp_accept_cb(struct evconnlistener *l, evutil_socket_t fd, struct sockaddr *sa,
+                          int socklen, void *arg)
+{
+    struct event_base *base = evconnlistener_get_base(l);
+    struct bufferevent *bev = bufferevent_socket_new(base, fd, BEV_OPT_CLOSE_ON_FREE);
+    assert(bev);
+    relay_start(base, bev, *(int *) arg);
+}
+
+static void kcp_accept(struct bufferevent *bev, const struct sockaddr_in *peer, void *arg)
+{
+    relay_start(bufferevent_get_base(bev), bev, *(int *) arg);
+}
+
+// mock frps on loopback and both relays on the host end of the link, until killed
+static void run_services(int base_port)
+{
+    static int frps_port;
+    frps_port               = base_port;
+    struct event_base *base = event_base_new();
+    assert(base);
+
+    struct sockaddr_in sin;
+    memset(&sin, 0, sizeof(sin));
+    sin.sin_family = AF_INET;
+    sin.sin_port   = htons(base_port);
+    evutil_inet_pton(AF_INET, HOST_IP, &sin.sin_addr);
+
+    // same tuning as the xfrpc defaults
+    struct kcp_conn_conf kc = {1, 20, 128, 512, 1350};
+    struct evconnlistener *tcp =
+        evconnlistener_new_bind(base, tcp_accept_cb, &frps_port,
+                                LEV_OPT_CLOSE_ON_FREE | LEV_OPT_REUSEABLE, 128,
+                                (struct sockaddr *) &sin, sizeof(sin));
+    if (!mock_frps_new(base, base_port, NULL, NULL) || !tcp ||
+        !kcp_listen(base, &kc, &sin, kcp_accept, &frps_port)) {
+        fprintf(stderr, "listen on port %d failed\n", base_port);
+        exit(1);
+    }
+
+    // take data in the SYN of clients with a cookie, plain TCP clients don't care
+    int qlen = 128;
+    setsockopt(evconnlistener_get_fd(tcp), IPPROTO_TCP, TCP_FASTOPEN, &qlen, sizeof(qlen));
+    event_base_dispatch(base);
+    exit(0);
+}
+
+// local echo service inside the namespace, until killed
+static void run_local_service(int port)
+{
+    struct local_service_stats local;
+    memset(&local, 0, sizeof(local));
+    if (enter_netns(NETNS)) {
+        perror("setns");
+        exit(1);
+    }
+    struct event_base *base = event_base_new();
+    assert(base);
+    if (!start_local_service(base, port, LOCAL_GREET_ECHO, &local)) {
+        fprintf(stderr, "listen on port %d failed\n", port);
+        exit(1);
+    }
+    event_base_dispatch(base);
+    exit(0);
+}
+
+static pid_t spawn_xfrpc_in_netns(const char *xfrpc, const char *ini)
+{
+    int self = open("/proc/self/ns/net", O_RDONLY | O_CLOEXEC);
+    if (self < 0 || enter_netns(NETNS)) {
+        perror("setns");
+        if (self >= 0)
+            close(self);
+        return -1;
+    }
+    pid_t pid = spawn_xfrpc(xfrpc, ini, NULL);
+    if (setns(self, CLONE_NEWNET)) {
+        perror("setns back");
+        exit(1);
+    }
+    close(self);
+    return pid;
+}
+
+static void finish(struct bench_kcp *bk, int failed, const char *why)
+{
+    if (failed && !bk->failed && why)
+        fprintf(stderr, "%s\n", why);
+    bk->failed |= failed;
+    bk->done = 1;
+    event_base_loopbreak(bk->base);
+}
+
+static void user_close(struct user_conn *uc)
+{
+    bufferevent_free(uc->bev);
+    free(uc);
+}
+
+static void user_fill(struct user_conn *uc)
+{
+    struct evbuffer *out = bufferevent_get_output(uc->bev);
+    while (uc->to_send > 0 && evbuffer_get_length(out) < 4 * BULK_CHUNK) {
+        size_t n = uc->to_send < BULK_CHUNK ? uc->to_send : BULK_CHUNK;
+        bufferevent_write(uc->bev, uc->bk->payload, n);
+        uc->to_send -= n;
+    }
+}
+
+static void user_request(struct user_conn *uc)
+{
+    uc->sent_at = bench_now_usec();
+    uc->to_recv = REQ_SIZE;
+    bufferevent_write(uc->bev, uc->bk->payload, REQ_SIZE);
+}
+
+static void user_write_cb(struct bufferevent *bev, void *ctx)
+{
+    struct user_conn *uc = ctx;
+    if (uc->greeted && uc->bk->phase == PH_BULK)
+        user_fill(uc);
+}
+
+static void user_read_cb(struct bufferevent *bev, void *ctx)
+{
+    struct user_conn *uc = ctx;
+    struct bench_kcp *bk = uc->bk;
+    struct evbuffer *in  = bufferevent_get_input(bev);
+    size_t len           = evbuffer_get_length(in);
+
+    if (!uc->greeted) {
+        uc->greeted = 1;
+        evbuffer_drain(in, 1);
+        len--;
+        if (bk->phase == PH_SETUP) {
+            hist_add(&bk->setup_hist, bench_now_usec() - uc->started);
+            user_close(uc);
+            if (--bk->pending == 0)
+                finish(bk, 0, NULL);
+            return;
+        }
+        if (bk->phase == PH_READY) {
+            user_close(uc);
+            finish(bk, 0, NULL);
+            return;
+        }
+        if (bk->phase == PH_RR)
+            user_request(uc);
+        else
+            user_fill(uc);
+    }
+
+    evbuffer_drain(in, len);
+    uc->to_recv = len < uc->to_recv ? uc->to_recv - len : 0;
+    if (uc->to_recv > 0 || len == 0)
+        return;
+
+    if (bk->phase == PH_RR) {
+        hist_add(&bk->rr_hist, bench_now_usec() - uc->sent_at);
+        if (--uc->left > 0) {
+            user_request(uc);
+            return;
+        }
+    }
+    user_close(uc);
+    finish(bk, 0, NULL);
+}
+
+static void user_event_cb(struct bufferevent *bev, short what, void *ctx)
+{
+    struct user_conn *uc = ctx;
+    if (!(what & (BEV_EVENT_EOF | BEV_EVENT_ERROR)))
+        return;
+
+    struct bench_kcp *bk = uc->bk;
+    user_close(uc);
+    // probes fail until xfrpc registered the proxy, quietly
+    finish(bk, 1, bk->phase == PH_READY ? NULL : "tunnel closed before its echo came back");
+}
+
+static void timeout_cb(evutil_socket_t fd, short what, void *arg)
+{
+    finish(arg, 1, "phase timed out");
+}
+
+static int user_start(struct bench_kcp *bk)
+{
+    struct user_conn *uc = calloc(1, sizeof(struct user_conn));
+    assert(uc);
+    uc->bk      = bk;
+    uc->left    = bk->requests;
+    uc->started = bench_now_usec();
+    if (bk->phase == PH_BULK) {
+        uc->to_send = bk->bulk;
+        uc->to_recv = bk->bulk;
+    }
+
+    uc->bev = bufferevent_socket_new(bk->base, -1, BEV_OPT_CLOSE_ON_FREE);
+    assert(uc->bev);
+    bufferevent_setcb(uc->bev, user_read_cb, user_write_cb, user_event_cb, uc);
+    bufferevent_enable(uc->bev, EV_READ | EV_WRITE);
+    if (bufferevent_socket_connect(uc->bev, (struct sockaddr *) &bk->remote, sizeof(bk->remote))) {
+        user_close(uc);
+        return -1;
+    }
+    return 0;
+}
+
+// users at once through the tunnel, 0 when their phase completed
+static int run_users(struct bench_kcp *bk, enum kcp_phase phase, int users, int timeout_sec)
+{
+    bk->phase   = phase;
+    bk->done    = 0;
+    bk->pending = users;
+    int i;
+    for (i = 0; i < users; i++)
+        if (user_start(bk))
+            return -1;
+
+    struct timeval limit = {timeout_sec, 0};
+    struct event *ev     = evtimer_new(bk->base, timeout_cb, bk);
+    event_add(ev, &limit);
+    while (!bk->done)
+        event_base_loop(bk->base, EVLOOP_ONCE);
+    event_free(ev);
+    return bk->failed ? -1 : 0;
+}
+
+static int wait_ready(struct bench_kcp *bk)
+{
+    int i;
+    for (i = 0; i < READY_SEC * 5; i++) {
+        int rc     = run_users(bk, PH_READY, 1, 5);
+        bk->failed = 0;
+        if (!rc)
+            return 0;
+        usleep(200 * 1000);
+    }
+    return -1;
+}
+
+static int parse_losses(const char *arg, int *losses)
+{
+    int n = 0;
+    char *dup = strdup(arg), *save = NULL, *tok;
+    assert(dup);
+    for (tok = strtok_r(dup, ",", &save); tok && n < MAX_LOSSES;
+         tok = strtok_r(NULL, ",", &save)) {
+        losses[n] = atoi(tok);
+        if (losses[n] < 0 || losses[n] >= 100) {
+            n = 0;
+            break;
+        }
+        n++;
+    }
+    free(dup);
+    return n;
+}
+
+static double ms(uint64_t us)
+{
+    return us / 1000.0;
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr,
+            "usage: %s -x path/to/xfrpc [-l 0,2,5] [-D delay_ms] [-R rate_mbit]\n"
+            "       [-n requests] [-b bulk_mb] [-s setups] [-t tcp,tfo,kcp] [-p base_port]\n"
+            "       [-o \"option = value\"]...\n",
+            prog);
+    exit(2);
+}
+
+int main(int argc, char **argv)
+{
+    const char *xfrpc = NULL, *loss_arg = "0,2,5", *transports = "tcp,tfo,kcp";
+    int delay_ms = 40, requests = 200, bulk_mb = 4, setups = 16, base_port = 29000, opt;
+    double rate_mbit = 20;
+    char extra[1024]  = {0};
+    while ((opt = getopt(argc, argv, "x:l:D:R:n:b:s:t:p:o:")) != -1) {
+        switch (opt) {
+            case 'x':
+                xfrpc = optarg;
+                break;
+            case 'l':
+                loss_arg = optarg;
+                break;
+            case 'D':
+                delay_ms = atoi(optarg);
+                break;
+            case 'R':
+                rate_mbit = atof(optarg);
+                break;
+            case 'n':
+                requests = atoi(optarg);
+                break;
+            case 'b':
+                bulk_mb = atoi(optarg);
+                break;
+            case 's':
+                setups = atoi(optarg);
+                break;
+            case 't':
+                transports = optarg;
+                break;
+            case 'p':
+                base_port = atoi(optarg);
+                break;
+            case 'o':
+                strncat(extra, optarg, sizeof(extra) - strlen(extra) - 2);
+                strcat(extra, "\n");
+                break;
+            default:
+                usage(argv[0]);
+        }
+    }
+
+    int losses[MAX_LOSSES];
+    int nlosses = parse_losses(loss_arg, losses);
+    if (!xfrpc || !nlosses || delay_ms < 0 || rate_mbit <= 0 || requests <= 0 || bulk_mb <= 0 ||
+        setups <= 0)
+        usage(argv[0]);
+
+    if (geteuid() != 0) {
+        printf("skipped: network namespace and tap devices need root\n");
+        return 0;
+    }
+    signal(SIGPIPE, SIG_IGN);
+
+    // server side fast open for the TCP relay on the host, restored at exit
+    int tfo_sysctl = read_tfo_sysctl();
+    if (tfo_sysctl >= 0 && !(tfo_sysctl & 2))
+        write_tfo_sysctl(tfo_sysctl | 2);
+
+    int host_fd, ns_fd;
+    if (setup_link(&host_fd, &ns_fd)) {
+        teardown_link();
+        return 1;
+    }
+
+    struct shim shim;
+    memset(&shim, 0, sizeof(shim));
+    shim.delay_ms  = delay_ms;
+    shim.rate_mbit = rate_mbit;
+
+    struct bench_kcp *bk = calloc(1, sizeof(struct bench_kcp));
+    assert(bk);
+    bk->requests = requests;
+    bk->bulk     = (size_t) bulk_mb << 20;
+    bk->base     = event_base_new();
+    assert(bk->base);
+    bk->remote.sin_family      = AF_INET;
+    bk->remote.sin_port        = htons(base_port + 2);
+    bk->remote.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    shim_start(&shim, bk->base, host_fd, ns_fd);
+
+    pid_t local = fork();
+    if (local == 0)
+        run_local_service(base_port + 1);
+
+    struct result results[3 * MAX_LOSSES];
+    int nresults = 0, failed = 0, i;
+    char *tlist = strdup(transports), *save = NULL, *t;
+    assert(tlist);
+    for (t = strtok_r(tlist, ",", &save); t && !failed; t = strtok_r(NULL, ",", &save)) {
+        char ini[64], opts[1200];
+        snprintf(ini, sizeof(ini), "/tmp/xfrpc_bench_kcp_%d.ini", (int) getpid());
+        int tfo = strcmp(t, "tfo") == 0;
+        snprintf(opts, sizeof(opts), "server_addr = " HOST_IP "\nprotocol = %s\n%s%s",
+                 tfo ? "tcp" : t, tfo ? "tcp_fast_open = true\n" : "", extra);
+        if (write_xfrpc_ini(ini, base_port, base_port + 1, base_port + 2, opts)) {
+            perror(ini);
+            failed = 1;
+            break;
+        }
+
+        pid_t services = fork();
+        if (services == 0)
+            run_services(base_port);
+
+        shim.loss   = 0;
+        pid_t pid   = spawn_xfrpc_in_netns(xfrpc, ini);
+        if (pid < 0 || wait_ready(bk)) {
+            fprintf(stderr, "%s: no tunnel came up in %d seconds\n", t, READY_SEC);
+            failed = 1;
+        }
+
+        for (i = 0; i < nlosses && !failed; i++) {
+            struct result *r = &results[nresults++];
+            memset(r, 0, sizeof(*r));
+            r->transport = t;
+            r->loss      = losses[i];
+            shim.loss    = losses[i] / 100.0;
+            shim.rng     = 0x9e3779b97f4a7c15ULL;
+            uint64_t dropped = shim.dir[0].dropped + shim.dir[1].dropped;
+
+            memset(&bk->setup_hist, 0, sizeof(bk->setup_hist));
+            if (run_users(bk, PH_SETUP, setups, PHASE_TIMEOUT_SEC)) {
+                failed = 1;
+                break;
+            }
+            r->setup = bk->setup_hist;
+
+            memset(&bk->rr_hist, 0, sizeof(bk->rr_hist));
+            if (run_users(bk, PH_RR, 1, PHASE_TIMEOUT_SEC)) {
+                failed = 1;
+                break;
+            }
+            r->rr = bk->rr_hist;
+
+            uint64_t from = bench_now_usec();
+            if (run_users(bk, PH_BULK, 1, PHASE_TIMEOUT_SEC)) {
+                failed = 1;
+                break;
+            }
+            r->bulk_mbs = bulk_mb / ((bench_now_usec() - from) / 1e6);
+            r->dropped  = shim.dir[0].dropped + shim.dir[1].dropped - dropped;
+        }
+
+        if (pid > 0)
+            stop_xfrpc(pid);
+        kill(services, SIGTERM);
+        waitpid(services, NULL, 0);
+        unlink(ini);
+    }
+
+    kill(local, SIGTERM);
+    waitpid(local, NULL, 0);
+    close(host_fd);
+    close(ns_fd);
+    teardown_link();
+    if (tfo_sysctl >= 0 && !(tfo_sysctl & 2))
+        write_tfo_sysctl(tfo_sysctl);
+    if (failed) {
+        free(tlist);
+        return 1;
+    }
+
+    printf("link: %d ms one way, %.0f Mbit/s, bursts of %d setups, requests of %d bytes, "
+           "%d MB echoed\n",
+           delay_ms, rate_mbit, setups, REQ_SIZE, bulk_mb);
+    printf("%9s %5s %16s %24s %9s %9s\n", "transport", "loss%", "setup p50/p99 ms",
+           "rtt p50/p99/max ms", "bulk MB/s", "dropped");
+    for (i = 0; i < nresults; i++) {
+        struct result *r = &results[i];
+        printf("%9s %5d %7.1f/%8.1f %7.1f/%7.1f/%8.1f %9.2f %9llu\n", r->transport, r->loss,
+               ms(hist_percentile(&r->setup, 50)), ms(hist_percentile(&r->setup, 99)),
+               ms(hist_percentile(&r->rr, 50)), ms(hist_percentile(&r->rr, 99)),
+               ms(r->rr.max_us), r->bulk_mbs, (unsigned long long) r->dropped);
+    }
+    free(tlist);   // transport names point into it
+    return 0;
+}
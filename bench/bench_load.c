@@ -0,0 +1,454 @@
+/* vim: set et ts=4 sts=4 sw=4 : */
+/********************************************************************\
+ * This program is free software; you can redistribute it and/or    *
+ * modify it under the terms of the GNU General Public License as   *
+ * published by the Free Software Foundation; either version 2 of   *
+ * the License, or (at your option) any later version.              *
+ *                                                                  *
+ * This program is distributed in the hope that it will be useful,  *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of   *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the    *
+ * GNU General Public License for more details.                     *
+ *                                                                  *
+ * You should have received a copy of the GNU General Public License*
+ * along with this program; if not, contact:                        *
+ *                                                                  *
+ * Free Software Foundation           Voice:  +1-617-542-5942       *
+ * 59 Temple Place - Suite 330        Fax:    +1-617-542-2652       *
+ * Boston, MA  02111-1307,  USA       gnu@gnu.org                   *
+ *                                                                  *
+\********************************************************************/
+
+
+/** @file bench_load.c
+    @brief tunnel setup rate, latency and bulk throughput under load
+
+    The mock frps and an echo service run in a child process, the load
+    generator in this one, so xfrpc is measured rather than the harness.
+    For each concurrency level C:
+
+    - setup: C users keep connecting for the given duration, each waits
+      for the greeting byte of the local service (tunnel setup), sends a
+      request and waits for its echo (first byte), then closes
+    - bulk: C users push bulk/C bytes each through the echo service and
+      read them back, xfrpc cpu time is sampled around it
+
+    -m makes the mock frps listen with multipath TCP, to try the mptcp
+    option over loopback addresses set up as path manager endpoints
+
+    usage: xfrpc_bench_load -x path/to/xfrpc [-c 1,10,100] [-d seconds]
+                            [-b bulk_mb] [-r request_bytes] [-p base_port]
+                            [-o "option = value"]... [-m]
+*/
+
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <assert.h>
+#include <signal.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+
+#include <event2/event.h>
+#include <event2/buffer.h>
+#include <event2/bufferevent.h>
+#include <event2/listener.h>
+
+#include "mock_frps.h"
+#include "bench_util.h"
+#include "../histogram.h"
+
+#define MAX_LEVELS 16
+#define BULK_CHUNK 65536
+#define BULK_HIGH (4 * BULK_CHUNK)   // stop writing while this much is queued
+#define READY_SEC 30                 // wait for xfrpc to register the proxy
+#define PHASE_TIMEOUT_SEC 120
+
+enum load_phase {
+    PH_READY = 0,   // probing until a tunnel works
+    PH_SETUP,
+    PH_BULK,
+};
+
+struct load_level {
+    int conc;
+    uint64_t setups;
+    double setup_sec;
+    struct latency_hist setup_hist;   // connect -> greeting
+    struct latency_hist first_hist;   // connect -> first echoed byte
+    uint64_t bulk_bytes;   // sent by users, echoed back as much
+    double bulk_sec;
+    double bulk_cpu;                  // xfrpc user + system seconds
+};
+
+struct bench_load {
+    struct event_base *base;
+    struct sockaddr_in remote;
+    pid_t xfrpc;
+
+    enum load_phase phase;
+    struct load_level *level;
+    int active;
+    int stopping;   // setup duration is over, do not reconnect
+    int probe_ok;
+    int failed;
+
+    int duration;
+    size_t req_size;
+    size_t bulk_per_conn;
+    char *payload;   // max(req_size, BULK_CHUNK) bytes
+};
+
+struct load_conn {
+    struct bench_load *bl;
+    struct bufferevent *bev;
+    uint64_t start;   // usec
+    int greeted;
+    int first_seen;
+    size_t to_send;
+    size_t to_recv;
+};
+
+static void open_conn(struct bench_load *bl);
+
+static void fail(struct bench_load *bl, const char *why)
+{
+    if (!bl->failed)
+        fprintf(stderr, "%s\n", why);
+    bl->failed = 1;
+    event_base_loopbreak(bl->base);
+}
+
+static void close_conn(struct load_conn *lc)
+{
+    struct bench_load *bl = lc->bl;
+    bufferevent_free(lc->bev);
+    free(lc);
+    bl->active--;
+    if (bl->active == 0 && (bl->phase != PH_SETUP || bl->stopping))
+        event_base_loopbreak(bl->base);
+}
+
+static void fill_output(struct load_conn *lc)
+{
+    struct evbuffer *out = bufferevent_get_output(lc->bev);
+    while (lc->to_send > 0 && evbuffer_get_length(out) < BULK_HIGH) {
+        size_t n = lc->to_send < BULK_CHUNK ? lc->to_send : BULK_CHUNK;
+        bufferevent_write(lc->bev, lc->bl->payload, n);
+        lc->to_send -= n;
+    }
+}
+
+static void conn_write_cb(struct bufferevent *bev, void *ctx)
+{
+    struct load_conn *lc = ctx;
+    if (lc->greeted)
+        fill_output(lc);
+}
+
+static void conn_read_cb(struct bufferevent *bev, void *ctx)
+{
+    struct load_conn *lc  = ctx;
+    struct bench_load *bl = lc->bl;
+    struct evbuffer *in   = bufferevent_get_input(bev);
+    size_t len            = evbuffer_get_length(in);
+
+    if (!lc->greeted) {
+        lc->greeted = 1;
+        evbuffer_drain(in, 1);
+        len--;
+        if (bl->phase == PH_SETUP)
+            hist_add(&bl->level->setup_hist, bench_now_usec() - lc->start);
+        fill_output(lc);
+    }
+    if (len == 0)
+        return;
+
+    if (!lc->first_seen) {
+        lc->first_seen = 1;
+        if (bl->phase == PH_SETUP)
+            hist_add(&bl->level->first_hist, bench_now_usec() - lc->start);
+    }
+    evbuffer_drain(in, len);
+    lc->to_recv = len < lc->to_recv ? lc->to_recv - len : 0;
+    if (lc->to_recv > 0)
+        return;
+
+    int again = bl->phase == PH_SETUP && !bl->stopping;
+    if (again)
+        bl->level->setups++;
+    else if (bl->phase == PH_READY)
+        bl->probe_ok = 1;
+    // reset rather than leave TIME_WAIT behind, setups would run out of ports
+    struct linger lg = {1, 0};
+    setsockopt(bufferevent_getfd(bev), SOL_SOCKET, SO_LINGER, &lg, sizeof(lg));
+    close_conn(lc);
+    if (again)
+        open_conn(bl);
+}
+
+static void conn_event_cb(struct bufferevent *bev, short what, void *ctx)
+{
+    struct load_conn *lc = ctx;
+    if (!(what & (BEV_EVENT_EOF | BEV_EVENT_ERROR)))
+        return;
+
+    // probes fail until xfrpc registered the proxy
+    if (lc->bl->phase == PH_READY) {
+        close_conn(lc);
+        return;
+    }
+    fail(lc->bl, "tunnel closed before its echo came back");
+}
+
+static void open_conn(struct bench_load *bl)
+{
+    struct load_conn *lc = calloc(1, sizeof(struct load_conn));
+    assert(lc);
+    lc->bl    = bl;
+    lc->start = bench_now_usec();
+    if (bl->phase == PH_BULK) {
+        lc->to_send = bl->bulk_per_conn;
+        lc->to_recv = bl->bulk_per_conn;
+    } else {
+        lc->to_send = bl->req_size;
+        lc->to_recv = bl->req_size;
+    }
+
+    lc->bev = bufferevent_socket_new(bl->base, -1, BEV_OPT_CLOSE_ON_FREE);
+    assert(lc->bev);
+    bufferevent_setcb(lc->bev, conn_read_cb, conn_write_cb, conn_event_cb, lc);
+    bufferevent_enable(lc->bev, EV_READ | EV_WRITE);
+    bl->active++;
+    if (bufferevent_socket_connect(lc->bev, (struct sockaddr *) &bl->remote,
+                                   sizeof(bl->remote))) {
+        close_conn(lc);
+        fail(bl, "connect remote port failed");
+    }
+}
+
+static void stop_cb(evutil_socket_t fd, short what, void *arg)
+{
+    struct bench_load *bl = arg;
+    bl->stopping          = 1;
+    if (bl->active == 0)
+        event_base_loopbreak(bl->base);
+}
+
+// run the loop until all connections are gone, stop_after 0 means no deadline
+static void run_phase(struct bench_load *bl, int stop_after)
+{
+    struct timeval limit = {PHASE_TIMEOUT_SEC, 0}, stop = {stop_after, 0};
+    struct event *ev_stop    = evtimer_new(bl->base, stop_cb, bl);
+    struct event *ev_timeout = evtimer_new(bl->base, stop_cb, bl);
+    bl->stopping = 0;
+    if (stop_after)
+        event_add(ev_stop, &stop);
+    event_add(ev_timeout, &limit);
+    event_base_dispatch(bl->base);
+    if (bl->active > 0 && !bl->failed)
+        fail(bl, "phase timed out");
+    event_free(ev_stop);
+    event_free(ev_timeout);
+}
+
+static int wait_ready(struct bench_load *bl)
+{
+    int i;
+    bl->phase = PH_READY;
+    for (i = 0; i < READY_SEC * 10 && !bl->failed; i++) {
+        open_conn(bl);
+        run_phase(bl, 0);
+        if (bl->probe_ok)
+            return 0;
+        usleep(100 * 1000);
+    }
+    return -1;
+}
+
+static void run_level(struct bench_load *bl, struct load_level *lv, size_t bulk)
+{
+    int i;
+    bl->level = lv;
+
+    bl->phase     = PH_SETUP;
+    uint64_t from = bench_now_usec();
+    for (i = 0; i < lv->conc; i++)
+        open_conn(bl);
+    run_phase(bl, bl->duration);
+    lv->setup_sec = (bench_now_usec() - from) / 1e6;
+    if (bl->failed || bulk == 0)
+        return;
+
+    bl->phase         = PH_BULK;
+    bl->bulk_per_conn = bulk / lv->conc;
+    double cpu        = proc_cpu_sec(bl->xfrpc);
+    from              = bench_now_usec();
+    for (i = 0; i < lv->conc; i++)
+        open_conn(bl);
+    run_phase(bl, 0);
+    lv->bulk_sec   = (bench_now_usec() - from) / 1e6;
+    lv->bulk_bytes = (uint64_t) bl->bulk_per_conn * lv->conc;
+    lv->bulk_cpu = proc_cpu_sec(bl->xfrpc) - cpu;
+}
+
+// mock frps and the local echo service, until killed
+static void run_services(int base_port)
+{
+    struct local_service_stats local;
+    memset(&local, 0, sizeof(local));
+    struct event_base *base = event_base_new();
+    assert(base);
+    if (!mock_frps_new(base, base_port, NULL, NULL) ||
+        !start_local_service(base, base_port + 1, LOCAL_GREET_ECHO, &local)) {
+        fprintf(stderr, "listen on ports %d-%d failed\n", base_port, base_port + 1);
+        exit(1);
+    }
+    event_base_dispatch(base);
+    exit(0);
+}
+
+static int parse_levels(const char *arg, struct load_level *levels)
+{
+    int n = 0;
+    char *dup = strdup(arg), *save = NULL, *tok;
+    assert(dup);
+    for (tok = strtok_r(dup, ",", &save); tok && n < MAX_LEVELS;
+         tok = strtok_r(NULL, ",", &save)) {
+        memset(&levels[n], 0, sizeof(levels[n]));
+        levels[n].conc = atoi(tok);
+        if (levels[n].conc <= 0) {
+            n = 0;
+            break;
+        }
+        n++;
+    }
+    free(dup);
+    return n;
+}
+
+static double ms(uint64_t us)
+{
+    return us / 1000.0;
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr,
+            "usage: %s -x path/to/xfrpc [-c 1,10,100] [-d seconds] [-b bulk_mb]\n"
+            "       [-r request_bytes] [-p base_port] [-o \"option = value\"]... [-m]\n",
+            prog);
+    exit(2);
+}
+
+int main(int argc, char **argv)
+{
+    const char *xfrpc = NULL, *conc = "1,10,100";
+    int duration = 3, bulk_mb = 256, req_size = 64, base_port = 28000, opt;
+    char extra[1024] = {0};
+    while ((opt = getopt(argc, argv, "x:c:d:b:r:p:o:m")) != -1) {
+        switch (opt) {
+            case 'x':
+                xfrpc = optarg;
+                break;
+            case 'c':
+                conc = optarg;
+                break;
+            case 'd':
+                duration = atoi(optarg);
+                break;
+            case 'b':
+                bulk_mb = atoi(optarg);
+                break;
+            case 'r':
+                req_size = atoi(optarg);
+                break;
+            case 'p':
+                base_port = atoi(optarg);
+                break;
+            case 'o':
+                strncat(extra, optarg, sizeof(extra) - strlen(extra) - 2);
+                strcat(extra, "\n");
+                break;
+            case 'm':
+                mock_frps_use_mptcp(1);
+                break;
+            default:
+                usage(argv[0]);
+        }
+    }
+
+    struct load_level levels[MAX_LEVELS];
+    int nlevels = parse_levels(conc, levels);
+    if (!xfrpc || !nlevels || duration <= 0 || bulk_mb < 0 || req_size <= 0)
+        usage(argv[0]);
+
+    int i, max_conc = 0;
+    for (i = 0; i < nlevels; i++)
+        if (levels[i].conc > max_conc)
+            max_conc = levels[i].conc;
+    long nofile = raise_nofile();
+    if (nofile > 0 && nofile < max_conc * 2 + 64) {
+        fprintf(stderr, "open files limit %ld is too low for %d users\n", nofile, max_conc);
+        return 1;
+    }
+    signal(SIGPIPE, SIG_IGN);
+
+    pid_t services = fork();
+    if (services == 0)
+        run_services(base_port);
+
+    char ini[64];
+    snprintf(ini, sizeof(ini), "/tmp/xfrpc_bench_load_%d.ini", (int) getpid());
+    if (write_xfrpc_ini(ini, base_port, base_port + 1, base_port + 2, extra)) {
+        perror(ini);
+        kill(services, SIGTERM);
+        return 1;
+    }
+
+    struct bench_load bl;
+    memset(&bl, 0, sizeof(bl));
+    bl.duration = duration;
+    bl.req_size = req_size;
+    bl.payload  = calloc(1, req_size > BULK_CHUNK ? req_size : BULK_CHUNK);
+    assert(bl.payload);
+    bl.base = event_base_new();
+    assert(bl.base);
+    bl.remote.sin_family      = AF_INET;
+    bl.remote.sin_port        = htons(base_port + 2);
+    bl.remote.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    // services need a moment to listen, xfrpc retries its login anyway
+    bl.xfrpc = spawn_xfrpc(xfrpc, ini, NULL);
+    if (wait_ready(&bl)) {
+        fprintf(stderr, "no tunnel came up in %d seconds\n", READY_SEC);
+        bl.failed = 1;
+    }
+    for (i = 0; i < nlevels && !bl.failed; i++)
+        run_level(&bl, &levels[i], (size_t) bulk_mb << 20);
+
+    stop_xfrpc(bl.xfrpc);
+    kill(services, SIGTERM);
+    waitpid(services, NULL, 0);
+    unlink(ini);
+    if (bl.failed)
+        return 1;
+
+    printf("%5s %10s %21s %21s %9s %9s\n", "conc", "setups/s", "setup p50/p99/max ms",
+           "first p50/p99/max ms", "bulk MB/s", "cpu s/GB");
+    for (i = 0; i < nlevels; i++) {
+        struct load_level *lv = &levels[i];
+        // every bulk byte crosses xfrpc twice, once each way
+        double mb = lv->bulk_bytes / 1048576.0, gb = 2 * mb / 1024;
+        printf("%5d %10.0f %6.2f/%6.2f/%7.2f %6.2f/%6.2f/%7.2f %9.1f %9.2f\n", lv->conc,
+               lv->setups / lv->setup_sec, ms(hist_percentile(&lv->setup_hist, 50)),
+               ms(hist_percentile(&lv->setup_hist, 99)), ms(lv->setup_hist.max_us),
+               ms(hist_percentile(&lv->first_hist, 50)), ms(hist_percentile(&lv->first_hist, 99)),
+               ms(lv->first_hist.max_us), lv->bulk_sec > 0 ? mb / lv->bulk_sec : 0,
+               gb > 0 ? lv->bulk_cpu / gb : 0);
+    }
+    return 0;
+}
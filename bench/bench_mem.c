@@ -0,0 +1,265 @@
+/* vim: set et ts=4 sts=4 sw=4 : */
+/********************************************************************\
+ * This program is free software; you can redistribute it and/or    *
+ * modify it under the terms of the GNU General Public License as   *
+ * published by the Free Software Foundation; either version 2 of   *
+ * the License, or (at your option) any later version.              *
+ *                                                                  *
+ * This program is distributed in the hope that it will be useful,  *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of   *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the    *
+ * GNU General Public License for more details.                     *
+ *                                                                  *
+ * You should have received a copy of the GNU General Public License*
+ * along with this program; if not, contact:                        *
+ *                                                                  *
+ * Free Software Foundation           Voice:  +1-617-542-5942       *
+ * 59 Temple Place - Suite 330        Fax:    +1-617-542-2652       *
+ * Boston, MA  02111-1307,  USA       gnu@gnu.org                   *
+ *                                                                  *
+\********************************************************************/
+
+/** @file bench_mem.c
+    @brief memory cost of idle tunnels
+
+    Runs xfrpc against the mock frps, opens N user connections which
+    stay idle once their tunnel reaches the local service, and reports
+    how much xfrpc resident memory grew per tunnel.
+
+    usage: xfrpc_bench_mem -x path/to/xfrpc [-n tunnels] [-p base_port]
+                           [-o "option = value"]...
+    -o lines are added to [common] of the generated ini.
+*/
+
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <assert.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <arpa/inet.h>
+
+#include <event2/event.h>
+#include <event2/bufferevent.h>
+#include <event2/listener.h>
+
+#include "mock_frps.h"
+#include "bench_util.h"
+
+#define OPEN_BATCH 100       // user connections opened per tick
+#define TICK_MSEC 20
+#define SETTLE_MSEC 1000     // let xfrpc finish what it was doing before reading RSS
+#define TIMEOUT_SEC 120
+
+enum bench_phase {
+    PH_WAIT_PROXY = 0,   // xfrpc starting, NewProxy not seen
+    PH_IDLE,             // settle, then read idle RSS
+    PH_OPEN,             // opening user connections
+    PH_LOADED,           // all tunnels up, settle, then read RSS
+    PH_CLOSED,           // tunnels closed, settle, then read RSS
+};
+
+struct bench_mem {
+    struct event_base *base;
+    struct mock_frps *frps;
+    struct local_service_stats local;
+    pid_t xfrpc;
+    int tunnels;
+    int remote_port;
+
+    enum bench_phase phase;
+    uint64_t phase_at;   // usec
+    int opened;
+    struct bufferevent **users;
+
+    long rss_idle;
+    long rss_loaded;
+    long rss_closed;
+    int failed;
+};
+
+static void proxy_cb(const char *proxy_name, int remote_port, void *arg)
+{
+    struct bench_mem *bm = arg;
+    if (bm->phase != PH_WAIT_PROXY)
+        return;
+    bm->remote_port = remote_port;
+    bm->phase       = PH_IDLE;
+    bm->phase_at    = bench_now_usec();
+}
+
+static void user_event_cb(struct bufferevent *bev, short what, void *ctx)
+{
+    struct bench_mem *bm = ctx;
+    if (what & (BEV_EVENT_EOF | BEV_EVENT_ERROR)) {
+        fprintf(stderr, "user connection closed before the end\n");
+        bm->failed = 1;
+        event_base_loopexit(bm->base, NULL);
+    }
+}
+
+static void open_users(struct bench_mem *bm)
+{
+    struct sockaddr_in sin;
+    memset(&sin, 0, sizeof(sin));
+    sin.sin_family      = AF_INET;
+    sin.sin_port        = htons(bm->remote_port);
+    sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    int n;
+    for (n = 0; n < OPEN_BATCH && bm->opened < bm->tunnels; n++) {
+        struct bufferevent *bev = bufferevent_socket_new(bm->base, -1, BEV_OPT_CLOSE_ON_FREE);
+        assert(bev);
+        bufferevent_setcb(bev, NULL, NULL, user_event_cb, bm);
+        bufferevent_enable(bev, EV_READ);
+        if (bufferevent_socket_connect(bev, (struct sockaddr *) &sin, sizeof(sin))) {
+            fprintf(stderr, "connect remote port %d failed\n", bm->remote_port);
+            bm->failed = 1;
+            event_base_loopexit(bm->base, NULL);
+            return;
+        }
+        bm->users[bm->opened++] = bev;
+    }
+}
+
+static void close_users(struct bench_mem *bm)
+{
+    int i;
+    for (i = 0; i < bm->opened; i++)
+        bufferevent_free(bm->users[i]);
+    bm->opened = 0;
+}
+
+static void next_phase(struct bench_mem *bm, enum bench_phase phase)
+{
+    bm->phase    = phase;
+    bm->phase_at = bench_now_usec();
+}
+
+static void tick_cb(evutil_socket_t fd, short what, void *arg)
+{
+    struct bench_mem *bm = arg;
+    uint64_t settled     = bench_now_usec() - bm->phase_at >= SETTLE_MSEC * 1000;
+
+    switch (bm->phase) {
+        case PH_WAIT_PROXY:
+            break;
+        case PH_IDLE:
+            if (!settled)
+                break;
+            bm->rss_idle = proc_rss_kb(bm->xfrpc);
+            next_phase(bm, PH_OPEN);
+            break;
+        case PH_OPEN:
+            if (bm->opened < bm->tunnels) {
+                open_users(bm);
+                bm->phase_at = bench_now_usec();
+            } else if (bm->local.accepted >= (uint64_t) bm->tunnels && settled) {
+                bm->rss_loaded = proc_rss_kb(bm->xfrpc);
+                close_users(bm);
+                next_phase(bm, PH_CLOSED);
+            }
+            break;
+        case PH_CLOSED:
+            if (!settled)
+                break;
+            bm->rss_closed = proc_rss_kb(bm->xfrpc);
+            event_base_loopexit(bm->base, NULL);
+            break;
+        default:
+            break;
+    }
+}
+
+static void timeout_cb(evutil_socket_t fd, short what, void *arg)
+{
+    struct bench_mem *bm = arg;
+    fprintf(stderr, "timeout: %llu of %d tunnels reached the local service\n",
+            (unsigned long long) bm->local.accepted, bm->tunnels);
+    bm->failed = 1;
+    event_base_loopexit(bm->base, NULL);
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr,
+            "usage: %s -x path/to/xfrpc [-n tunnels] [-p base_port] [-o \"option = value\"]...\n",
+            prog);
+    exit(2);
+}
+
+int main(int argc, char **argv)
+{
+    const char *xfrpc = NULL;
+    int tunnels = 1000, base_port = 27000, opt;
+    char extra[1024] = {0};
+    while ((opt = getopt(argc, argv, "x:n:p:o:")) != -1) {
+        switch (opt) {
+            case 'x':
+                xfrpc = optarg;
+                break;
+            case 'n':
+                tunnels = atoi(optarg);
+                break;
+            case 'p':
+                base_port = atoi(optarg);
+                break;
+            case 'o':
+                strncat(extra, optarg, sizeof(extra) - strlen(extra) - 2);
+                strcat(extra, "\n");
+                break;
+            default:
+                usage(argv[0]);
+        }
+    }
+    if (!xfrpc || tunnels <= 0)
+        usage(argv[0]);
+
+    // each tunnel is two sockets here and two in xfrpc
+    long nofile = raise_nofile();
+    if (nofile > 0 && nofile < tunnels * 2 + 64) {
+        fprintf(stderr, "open files limit %ld is too low for %d tunnels\n", nofile, tunnels);
+        return 1;
+    }
+
+    struct bench_mem bm;
+    memset(&bm, 0, sizeof(bm));
+    bm.tunnels = tunnels;
+    bm.users   = calloc(tunnels, sizeof(struct bufferevent *));
+    assert(bm.users);
+    bm.base = event_base_new();
+    assert(bm.base);
+
+    bm.frps = mock_frps_new(bm.base, base_port, proxy_cb, &bm);
+    if (!bm.frps || !start_local_service(bm.base, base_port + 1, LOCAL_HOLD, &bm.local)) {
+        fprintf(stderr, "listen on ports %d-%d failed\n", base_port, base_port + 1);
+        return 1;
+    }
+
+    char ini[64];
+    snprintf(ini, sizeof(ini), "/tmp/xfrpc_bench_mem_%d.ini", (int) getpid());
+    if (write_xfrpc_ini(ini, base_port, base_port + 1, base_port + 2, extra)) {
+        perror(ini);
+        return 1;
+    }
+    bm.xfrpc = spawn_xfrpc(xfrpc, ini, NULL);
+
+    struct timeval tick = {0, TICK_MSEC * 1000}, limit = {TIMEOUT_SEC, 0};
+    struct event *ev_tick = event_new(bm.base, -1, EV_PERSIST, tick_cb, &bm);
+    struct event *ev_timeout = evtimer_new(bm.base, timeout_cb, &bm);
+    event_add(ev_tick, &tick);
+    event_add(ev_timeout, &limit);
+    event_base_dispatch(bm.base);
+
+    stop_xfrpc(bm.xfrpc);
+    unlink(ini);
+    if (bm.failed)
+        return 1;
+
+    printf("tunnels          %d\n", tunnels);
+    printf("rss idle         %ld KB\n", bm.rss_idle);
+    printf("rss loaded       %ld KB\n", bm.rss_loaded);
+    printf("rss closed       %ld KB\n", bm.rss_closed);
+    printf("bytes per tunnel %ld\n", (bm.rss_loaded - bm.rss_idle) * 1024 / tunnels);
+    return 0;
+}
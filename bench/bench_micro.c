@@ -0,0 +1,430 @@
+/* vim: set et ts=4 sts=4 sw=4 : */
+/********************************************************************\
+ * This program is free software; you can redistribute it and/or    *
+ * modify it under the terms of the GNU General Public License as   *
+ * published by the Free Software Foundation; either version 2 of   *
+ * the License, or (at your option) any later version.              *
+ *                                                                  *
+ * This program is distributed in the hope that it will be useful,  *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of   *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the    *
+ * GNU General Public License for more details.                     *
+ *                                                                  *
+ * You should have received a copy of the GNU General Public License*
+ * along with this program; if not, contact:                        *
+ *                                                                  *
+ * Free Software Foundation           Voice:  +1-617-542-5942       *
+ * 59 Temple Place - Suite 330        Fax:    +1-617-542-2652       *
+ * Boston, MA  02111-1307,  USA       gnu@gnu.org                   *
+ *                                                                  *
+\********************************************************************/
+
+
+/** @file bench_micro.c
+    @brief hot path micro benchmarks
+
+    Times the message codec, frame parsing, encryption, compression, key
+    derivation and ftp passive reply rewriting one function at a time and
+    prints ns per call and bytes per cpu cycle. With -t it compares each
+    result to the ceiling in a limits file and fails when one is over, so
+    ctest catches gross regressions.
+
+    usage: xfrpc_bench_micro [-f filter] [-m msec_per_case] [-t limits_file]
+*/
+
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <assert.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+#include "../msg.h"
+#include "../frame.h"
+#include "../crypto.h"
+#include "../zip.h"
+#include "../proxy.h"
+#include "../config.h"
+#include "../login.h"
+#include "../version.h"
+#include "../debug.h"
+#include "bench_util.h"
+
+#define MAX_CASES 32
+#define DATA_SIZE 4096   // frame payload, also what crypto cases process
+#define ZIP_SIZE 16384
+
+struct micro_case {
+    const char *name;
+    size_t bytes;   // processed per call, 0 when it does not make sense
+    void (*run)();
+
+    double ns_per_op;
+    double bytes_per_cycle;   // 0 when cycles are not available
+};
+
+static volatile size_t sink;   // keeps results alive
+
+static unsigned char *packed;
+static size_t packed_len;
+static struct message work_conn_msg;
+static struct proxy_service bench_ps;
+static struct work_conn bench_wc = {.run_id = "f2:3a:9c:11:8d:04"};
+static struct frp_coder *coder;
+static unsigned char data[DATAI + DATA_SIZE];
+static unsigned char *encrypted;
+static unsigned char zip_src[ZIP_SIZE];
+static unsigned char *zipped;
+static int zipped_len;
+static char pasv_reply[] = "227 Entering Passive Mode (192,168,1,20,117,48).\r\n";
+static struct ftp_pasv pasv_fp = {227, "10.0.0.1", 30000};
+
+static const char *login_resp_json =
+    "{\"version\":\"0.10.0\",\"run_id\":\"f2:3a:9c:11:8d:04\",\"error\":\"\"}";
+static const char *new_proxy_resp_json =
+    "{\"run_id\":\"f2:3a:9c:11:8d:04\",\"remote_port\":6022,\"proxy_name\":\"ssh\","
+    "\"error\":\"\"}";
+static const char *start_work_conn_json = "{\"proxy_name\":\"ssh\"}";
+static const char *control_resp_json    = "{\"type\":1,\"code\":0,\"msg\":\"ok\"}";
+
+static void run_pack()
+{
+    unsigned char *buf = NULL;
+    sink               = pack(&work_conn_msg, &buf);
+    free(buf);
+}
+
+static void run_unpack()
+{
+    sink = (size_t) unpack(packed, packed_len);
+    msg_decode_reset();
+}
+
+static void run_login_request_marshal()
+{
+    char *msg = NULL;
+    sink      = login_request_marshal(get_run_id(), &msg);
+    free(msg);
+}
+
+static void run_new_proxy_service_marshal()
+{
+    char *msg = NULL;
+    sink      = new_proxy_service_marshal(&bench_ps, &msg);
+    free(msg);
+}
+
+static void run_new_work_conn_marshal()
+{
+    char *msg = NULL;
+    sink      = new_work_conn_marshal(&bench_wc, &msg);
+    free(msg);
+}
+
+static void run_login_resp_unmarshal()
+{
+    sink = (size_t) login_resp_unmarshal(login_resp_json);
+    msg_decode_reset();
+}
+
+static void run_new_proxy_resp_unmarshal()
+{
+    sink = (size_t) new_proxy_resp_unmarshal(new_proxy_resp_json);
+    msg_decode_reset();
+}
+
+static void run_start_work_conn_resp_unmarshal()
+{
+    sink = (size_t) start_work_conn_resp_unmarshal(start_work_conn_json);
+    msg_decode_reset();
+}
+
+static void run_control_response_unmarshal()
+{
+    struct control_response *res = control_response_unmarshal(control_resp_json);
+    sink                         = res->code;
+    control_response_free(res);
+}
+
+static void run_new_frame()
+{
+    struct frame *f = new_frame(cmdPSH, 3);
+    sink            = f->sid;
+    free_frame(f);
+}
+
+static void run_raw_frame()
+{
+    struct frame *f = raw_frame(data, sizeof(data));
+    sink            = f->len;
+    free_frame(f);
+}
+
+static void run_encrypt_data()
+{
+    unsigned char *out = NULL;
+    sink               = encrypt_data(data, DATA_SIZE, coder, &out);
+    free(out);
+}
+
+static void run_decrypt_data()
+{
+    unsigned char *out = NULL;
+    sink               = decrypt_data(encrypted, DATA_SIZE, coder, &out);
+    free(out);
+}
+
+static void run_deflate_write()
+{
+    uint8 *out = NULL;
+    int len    = 0;
+    deflate_write(zip_src, ZIP_SIZE, &out, &len, 0);
+    sink = len;
+    free(out);
+}
+
+static void run_inflate_read()
+{
+    uint8 *out = NULL;
+    int len    = 0;
+    inflate_read(zipped, zipped_len, &out, &len, 0);
+    sink = len;
+    free(out);
+}
+
+static void run_encrypt_key()
+{
+    unsigned char *key = encrypt_key("bench_token", 11, "frp");
+    sink               = key[0];
+    free(key);
+}
+
+static void run_pasv_unpack()
+{
+    struct ftp_pasv *fp = pasv_unpack(pasv_reply);
+    sink                = fp->ftp_server_port;
+    free_ftp_pasv(fp);
+}
+
+static void run_pasv_pack()
+{
+    char *msg = NULL;
+    sink      = pasv_pack(&pasv_fp, &msg);
+    free(msg);
+}
+
+static struct micro_case cases[] = {
+    {"pack", 0, run_pack},
+    {"unpack", 0, run_unpack},
+    {"login_request_marshal", 0, run_login_request_marshal},
+    {"new_proxy_service_marshal", 0, run_new_proxy_service_marshal},
+    {"new_work_conn_marshal", 0, run_new_work_conn_marshal},
+    {"login_resp_unmarshal", 0, run_login_resp_unmarshal},
+    {"new_proxy_resp_unmarshal", 0, run_new_proxy_resp_unmarshal},
+    {"start_work_conn_resp_unmarshal", 0, run_start_work_conn_resp_unmarshal},
+    {"control_response_unmarshal", 0, run_control_response_unmarshal},
+    {"new_frame", 0, run_new_frame},
+    {"raw_frame", 0, run_raw_frame},
+    {"encrypt_data", DATA_SIZE, run_encrypt_data},
+    {"decrypt_data", DATA_SIZE, run_decrypt_data},
+    {"deflate_write", ZIP_SIZE, run_deflate_write},
+    {"inflate_read", ZIP_SIZE, run_inflate_read},
+    {"encrypt_key", 0, run_encrypt_key},
+    {"pasv_unpack", 0, run_pasv_unpack},
+    {"pasv_pack", 0, run_pasv_pack},
+};
+
+static void set_case_bytes(const char *name, size_t bytes)
+{
+    int i;
+    for (i = 0; i < sizeof(cases) / sizeof(cases[0]); i++)
+        if (!strcmp(cases[i].name, name))
+            cases[i].bytes = bytes;
+}
+
+// the codec needs a loaded config and login, as xfrpc has when it runs
+static void setup_cases()
+{
+    char ini[64];
+    snprintf(ini, sizeof(ini), "/tmp/xfrpc_bench_micro_%d.ini", (int) getpid());
+    if (write_xfrpc_ini(ini, 7000, 22, 6022, "privilege_token = bench_token\n")) {
+        perror(ini);
+        exit(1);
+    }
+    load_config(ini);
+    unlink(ini);
+    init_login();
+
+    bench_ps.proxy_name  = "ssh";
+    bench_ps.proxy_type  = "tcp";
+    bench_ps.local_ip    = "127.0.0.1";
+    bench_ps.local_port  = 22;
+    bench_ps.remote_port = 6022;
+
+    char *json             = NULL;
+    work_conn_msg.type     = TypeNewWorkConn;
+    work_conn_msg.data_len = new_work_conn_marshal(&bench_wc, &json);
+    work_conn_msg.data_p   = json;
+    packed_len             = pack(&work_conn_msg, &packed);
+    set_case_bytes("pack", packed_len);
+    set_case_bytes("unpack", packed_len);
+
+    // codec cases count the json they produce or parse
+    set_case_bytes("login_request_marshal", login_request_marshal(get_run_id(), &json));
+    free(json);
+    set_case_bytes("new_proxy_service_marshal", new_proxy_service_marshal(&bench_ps, &json));
+    free(json);
+    set_case_bytes("new_work_conn_marshal", work_conn_msg.data_len);
+    set_case_bytes("login_resp_unmarshal", strlen(login_resp_json));
+    set_case_bytes("new_proxy_resp_unmarshal", strlen(new_proxy_resp_json));
+    set_case_bytes("start_work_conn_resp_unmarshal", strlen(start_work_conn_json));
+    set_case_bytes("control_response_unmarshal", strlen(control_resp_json));
+
+    // frame header, then payload
+    data[VERI]                = CLIENT_V;
+    data[CMDI]                = cmdPSH;
+    *(ushort *) (data + LENI) = DATA_SIZE;
+    set_case_bytes("raw_frame", DATAI);   // only the header is parsed
+    coder = new_coder("bench_token", "frp");
+    encrypt_data(data, DATA_SIZE, coder, &encrypted);
+
+    set_case_bytes("pasv_unpack", strlen(pasv_reply));
+    set_case_bytes("pasv_pack", pasv_pack(&pasv_fp, &json));
+    free(json);
+
+    // log like text compresses about as well as real traffic does
+    size_t i;
+    for (i = 0; i < ZIP_SIZE; i++)
+        zip_src[i] = "GET /index.html HTTP/1.1\r\nHost: 192.168.1.1\r\n"[i % 46] + (i / 997) % 3;
+    deflate_write(zip_src, ZIP_SIZE, &zipped, &zipped_len, 0);
+}
+
+static int cycles_fd = -1;
+
+static void init_cycles()
+{
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.type           = PERF_TYPE_HARDWARE;
+    attr.size           = sizeof(attr);
+    attr.config         = PERF_COUNT_HW_CPU_CYCLES;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv     = 1;
+    cycles_fd           = syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+// cpu cycles from perf, the time stamp counter where perf is not allowed
+static uint64_t read_cycles()
+{
+    uint64_t n = 0;
+    if (cycles_fd >= 0 && read(cycles_fd, &n, sizeof(n)) == sizeof(n))
+        return n;
+#if defined(__x86_64__) || defined(__i386__)
+    uint32_t lo, hi;
+    __asm__ volatile("rdtsc" : "=a"(lo), "=d"(hi));
+    return ((uint64_t) hi << 32) | lo;
+#else
+    return 0;
+#endif
+}
+
+static void run_case(struct micro_case *mc, int msec)
+{
+    uint64_t iters = 1, i;
+    mc->run();   // warm up caches and pools
+
+    // double the batch until it runs long enough to time
+    for (;;) {
+        uint64_t from = bench_now_usec(), c0 = read_cycles();
+        for (i = 0; i < iters; i++)
+            mc->run();
+        uint64_t took = bench_now_usec() - from, cycles = read_cycles() - c0;
+        if (took >= (uint64_t) msec * 1000 || iters >= (1ULL << 32)) {
+            mc->ns_per_op       = took * 1000.0 / iters;
+            mc->bytes_per_cycle = mc->bytes && cycles ? (double) mc->bytes * iters / cycles : 0;
+            return;
+        }
+        iters *= 2;
+    }
+}
+
+// "name max_ns_per_op" per line, # starts a comment
+static int check_limits(const char *path, int ncases)
+{
+    FILE *fp = fopen(path, "r");
+    if (!fp) {
+        perror(path);
+        return -1;
+    }
+
+    char line[256], name[128];
+    double limit;
+    int failed = 0, i;
+    while (fgets(line, sizeof(line), fp)) {
+        if (line[0] == '#' || sscanf(line, "%127s %lf", name, &limit) != 2)
+            continue;
+        for (i = 0; i < ncases; i++) {
+            if (strcmp(cases[i].name, name) || cases[i].ns_per_op == 0)
+                continue;
+            if (cases[i].ns_per_op > limit) {
+                fprintf(stderr, "%s: %.0f ns/op is over the limit of %.0f\n", name,
+                        cases[i].ns_per_op, limit);
+                failed = 1;
+            }
+        }
+    }
+    fclose(fp);
+    return failed ? -1 : 0;
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr, "usage: %s [-f filter] [-m msec_per_case] [-t limits_file]\n", prog);
+    exit(2);
+}
+
+int main(int argc, char **argv)
+{
+    const char *filter = NULL, *limits = NULL;
+    int msec = 200, opt;
+    while ((opt = getopt(argc, argv, "f:m:t:")) != -1) {
+        switch (opt) {
+            case 'f':
+                filter = optarg;
+                break;
+            case 'm':
+                msec = atoi(optarg);
+                break;
+            case 't':
+                limits = optarg;
+                break;
+            default:
+                usage(argv[0]);
+        }
+    }
+    if (msec <= 0)
+        usage(argv[0]);
+
+    debugconf.debuglevel = LOG_ERR;
+    setup_cases();
+    init_cycles();
+
+    int ncases = sizeof(cases) / sizeof(cases[0]), i;
+    printf("%-32s %12s %12s\n", "case", "ns/op", "bytes/cycle");
+    for (i = 0; i < ncases; i++) {
+        if (filter && !strstr(cases[i].name, filter))
+            continue;
+        run_case(&cases[i], msec);
+        printf("%-32s %12.1f ", cases[i].name, cases[i].ns_per_op);
+        if (cases[i].bytes_per_cycle > 0)
+            printf("%12.3f\n", cases[i].bytes_per_cycle);
+        else
+            printf("%12s\n", "-");
+    }
+
+    if (limits && check_limits(limits, ncases))
+        return 1;
+    return 0;
+}
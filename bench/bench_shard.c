@@ -0,0 +1,213 @@
+/* vim: set et ts=4 sts=4 sw=4 : */
+/********************************************************************\
+ * This program is free software; you can redistribute it and/or    *
+ * modify it under the terms of the GNU General Public License as   *
+ * published by the Free Software Foundation; either version 2 of   *
+ * the License, or (at your option) any later version.              *
+ *                                                                  *
+ * This program is distributed in the hope that it will be useful,  *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of   *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the    *
+ * GNU General Public License for more details.                     *
+ *                                                                  *
+ * You should have received a copy of the GNU General Public License*
+ * along with this program; if not, contact:                        *
+ *                                                                  *
+ * Free Software Foundation           Voice:  +1-617-542-5942       *
+ * 59 Temple Place - Suite 330        Fax:    +1-617-542-2652       *
+ * Boston, MA  02111-1307,  USA       gnu@gnu.org                   *
+ *                                                                  *
+\********************************************************************/
+
+
+/** @file bench_shard.c
+    @brief proxy registration time against the number of control sessions
+
+    xfrpc starts with many tcp proxies against a mock frps that spends
+    -d usec on each NewProxy and serves the messages of one control
+    connection in order, like frps does with one goroutine per control.
+    For each control_sessions value the time from the start of xfrpc to
+    every proxy registered is reported, with the percentiles of the time
+    each single proxy took to get registered.
+
+    usage: xfrpc_bench_shard -x path/to/xfrpc [-n proxies] [-s 1,4,16]
+                             [-d usec] [-p base_port]
+*/
+
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <assert.h>
+#include <signal.h>
+#include <unistd.h>
+#include <getopt.h>
+
+#include <event2/event.h>
+
+#include "mock_frps.h"
+#include "bench_util.h"
+#include "../histogram.h"
+
+#define REGISTER_SEC 120
+#define MAX_SESSIONS 32
+
+struct bench_shard {
+    struct event_base *base;
+    int proxies;
+    int registered;
+    uint64_t started;   // usec, xfrpc spawned
+    struct latency_hist hist;
+};
+
+static void proxy_cb(const char *proxy_name, int remote_port, void *arg)
+{
+    struct bench_shard *bs = arg;
+    hist_add(&bs->hist, bench_now_usec() - bs->started);
+    if (++bs->registered == bs->proxies)
+        event_base_loopbreak(bs->base);
+}
+
+static void timeout_cb(evutil_socket_t fd, short what, void *arg)
+{
+    event_base_loopbreak(arg);
+}
+
+static int write_ini(const char *path, int base_port, int proxies, int sessions)
+{
+    FILE *fp = fopen(path, "w");
+    if (!fp)
+        return -1;
+
+    fprintf(fp,
+            "[common]\n"
+            "server_addr = 127.0.0.1\n"
+            "server_port = %d\n"
+            "control_sessions = %d\n"
+            "log_level = error\n",
+            base_port, sessions);
+    int i;
+    for (i = 0; i < proxies; i++)
+        fprintf(fp,
+                "\n[p%d]\n"
+                "type = tcp\n"
+                "local_ip = 127.0.0.1\n"
+                "local_port = %d\n"
+                "remote_port = %d\n",
+                i, base_port + 1, base_port + 2 + i);
+    fclose(fp);
+    return 0;
+}
+
+// 0 when every proxy got registered, the mock frps is fresh for each run
+static int run_sessions(struct bench_shard *bs, const char *xfrpc, const char *ini,
+                        int base_port, int sessions, uint32_t delay_us, uint64_t *logins)
+{
+    if (write_ini(ini, base_port, bs->proxies, sessions))
+        return -1;
+
+    struct mock_frps *frps = mock_frps_new(bs->base, base_port, proxy_cb, bs);
+    if (!frps) {
+        fprintf(stderr, "listen on port %d failed\n", base_port);
+        return -1;
+    }
+    mock_frps_set_proxy_delay(frps, delay_us);
+
+    bs->registered = 0;
+    memset(&bs->hist, 0, sizeof(bs->hist));
+    bs->started = bench_now_usec();
+    pid_t pid   = spawn_xfrpc(xfrpc, ini, NULL);
+
+    struct timeval limit = {REGISTER_SEC, 0};
+    struct event *ev     = evtimer_new(bs->base, timeout_cb, bs->base);
+    assert(ev);
+    event_add(ev, &limit);
+    event_base_dispatch(bs->base);
+    event_free(ev);
+
+    stop_xfrpc(pid);
+    *logins = mock_frps_get_stats(frps)->logins;
+    mock_frps_free(frps);
+    if (bs->registered < bs->proxies) {
+        fprintf(stderr, "control_sessions %d: %d of %d proxies registered in %d seconds\n",
+                sessions, bs->registered, bs->proxies, REGISTER_SEC);
+        return -1;
+    }
+    return 0;
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr,
+            "usage: %s -x path/to/xfrpc [-n proxies] [-s 1,4,16] [-d usec] [-p base_port]\n",
+            prog);
+    exit(2);
+}
+
+int main(int argc, char **argv)
+{
+    const char *xfrpc = NULL, *list = "1,4,16";
+    int proxies = 1000, base_port = 20000, opt;
+    long delay_us = 200;
+    while ((opt = getopt(argc, argv, "x:n:s:d:p:")) != -1) {
+        switch (opt) {
+            case 'x':
+                xfrpc = optarg;
+                break;
+            case 'n':
+                proxies = atoi(optarg);
+                break;
+            case 's':
+                list = optarg;
+                break;
+            case 'd':
+                delay_us = atol(optarg);
+                break;
+            case 'p':
+                base_port = atoi(optarg);
+                break;
+            default:
+                usage(argv[0]);
+        }
+    }
+    if (!xfrpc || proxies <= 0 || delay_us < 0 || base_port + 2 + proxies > 65535)
+        usage(argv[0]);
+    signal(SIGPIPE, SIG_IGN);
+    raise_nofile();
+
+    struct bench_shard bs;
+    memset(&bs, 0, sizeof(bs));
+    bs.proxies = proxies;
+    // the coarse clock libevent uses by default ticks in milliseconds
+    struct event_config *cfg = event_config_new();
+    assert(cfg);
+    event_config_set_flag(cfg, EVENT_BASE_FLAG_PRECISE_TIMER);
+    bs.base = event_base_new_with_config(cfg);
+    event_config_free(cfg);
+    assert(bs.base);
+
+    char ini[64];
+    snprintf(ini, sizeof(ini), "/tmp/xfrpc_bench_shard_%d.ini", (int) getpid());
+
+    printf("%d proxies, frps spends %ld us on each NewProxy\n", proxies, delay_us);
+    printf("%8s %7s %12s %26s\n", "sessions", "logins", "all ms", "proxy p50/p90/p99 ms");
+    char *sessions_list = strdup(list), *tok, *save = NULL;
+    assert(sessions_list);
+    int rc = 0;
+    for (tok = strtok_r(sessions_list, ",", &save); tok && !rc;
+         tok = strtok_r(NULL, ",", &save)) {
+        int sessions = atoi(tok);
+        if (sessions <= 0 || sessions > MAX_SESSIONS)
+            usage(argv[0]);
+
+        uint64_t logins = 0;
+        rc = run_sessions(&bs, xfrpc, ini, base_port, sessions, (uint32_t) delay_us, &logins);
+        if (rc)
+            break;
+        printf("%8d %7llu %12.1f %8.1f/%8.1f/%8.1f\n", sessions, (unsigned long long) logins,
+               bs.hist.max_us / 1000.0, hist_percentile(&bs.hist, 50) / 1000.0,
+               hist_percentile(&bs.hist, 90) / 1000.0, hist_percentile(&bs.hist, 99) / 1000.0);
+    }
+    free(sessions_list);
+    unlink(ini);
+    return rc ? 1 : 0;
+}
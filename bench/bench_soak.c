@@ -0,0 +1,707 @@
+/* vim: set et ts=4 sts=4 sw=4 : */
+/********************************************************************\
+ * This program is free software; you can redistribute it and/or    *
+ * modify it under the terms of the GNU General Public License as   *
+ * published by the Free Software Foundation; either version 2 of   *
+ * the License, or (at your option) any later version.              *
+ *                                                                  *
+ * This program is distributed in the hope that it will be useful,  *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of   *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the    *
+ * GNU General Public License for more details.                     *
+ *                                                                  *
+ * You should have received a copy of the GNU General Public License*
+ * along with this program; if not, contact:                        *
+ *                                                                  *
+ * Free Software Foundation           Voice:  +1-617-542-5942       *
+ * 59 Temple Place - Suite 330        Fax:    +1-617-542-2652       *
+ * Boston, MA  02111-1307,  USA       gnu@gnu.org                   *
+ *                                                                  *
+\********************************************************************/
+
+
+/** @file bench_soak.c
+    @brief long running churn test that fails on resource growth
+
+    Runs xfrpc against the mock frps for hours. Each cycle keeps tcp tunnels
+    and ftp sessions (control, PASV rewrite, data transfer) churning, and
+    every few cycles the control connection is dropped so xfrpc reconnects.
+    Then the load stops and, once xfrpc settled, its RSS, open fds and live
+    pooled objects (from the admin api) are sampled. The first sample is
+    the baseline, the run fails when fds or live objects end above it or
+    RSS grew more than allowed.
+
+    usage: xfrpc_bench_soak -x path/to/xfrpc [-t seconds] [-i cycle_seconds]
+                            [-c tcp_users] [-f ftp_sessions] [-r reconnect_every]
+                            [-g max_rss_growth_kb] [-l samples.csv] [-p base_port]
+                            [-o "option = value"]...
+*/
+
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <assert.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <arpa/inet.h>
+
+#include <json-c/json.h>
+
+#include <event2/event.h>
+#include <event2/buffer.h>
+#include <event2/bufferevent.h>
+#include <event2/listener.h>
+
+#include "mock_frps.h"
+#include "bench_util.h"
+
+// offsets from the base port
+#define PORT_FRPS 0
+#define PORT_LOCAL 1
+#define PORT_REMOTE 2
+#define PORT_ADMIN 3
+#define PORT_FTP_LOCAL 4
+#define PORT_FTP_REMOTE 5
+#define PORT_FTP_DATA_REMOTE 6
+#define PORT_FTP_DATA_LOCAL 7
+
+#define TICK_MSEC 100
+#define SETTLE_SEC 2
+#define DRAIN_SEC 30     // sessions still open after it are reported stuck
+#define REQ_SIZE 64
+#define FTP_FILE_SIZE 8192
+
+enum soak_phase {
+    PH_WAIT_PROXY = 0,
+    PH_ACTIVE,
+    PH_DRAIN,
+    PH_SETTLE,
+};
+
+struct soak_sample {
+    int cycle;
+    uint64_t sec;   // since start
+    long rss_kb;
+    int fds;
+    long live;   // pooled objects handed out
+    uint64_t tcp;
+    uint64_t ftp;
+    uint64_t logins;
+};
+
+struct soak {
+    struct event_base *base;
+    struct mock_frps *frps;
+    struct local_service_stats local;
+    pid_t xfrpc;
+    int base_port;
+
+    int tcp_conc;
+    int ftp_conc;
+    int cycle_sec;
+    int reconnect_every;
+    int cycles;
+    long max_growth_kb;
+    FILE *csv;
+
+    enum soak_phase phase;
+    uint64_t phase_at;
+    uint64_t start_at;
+    int cycle;
+    int dropped;   // control dropped in this cycle
+    int proxies;
+    int active;
+    uint64_t tcp_done;
+    uint64_t ftp_done;
+    int failed;
+
+    struct soak_sample *samples;
+    int nsamples;
+};
+
+struct tcp_sess {
+    struct soak *sk;
+    struct bufferevent *bev;
+    int greeted;
+    size_t to_recv;
+};
+
+enum ftp_state {
+    FTP_GREETING = 0,
+    FTP_PASV,
+    FTP_DATA,
+};
+
+struct ftp_sess {
+    struct soak *sk;
+    struct bufferevent *ctl;
+    struct bufferevent *data;
+    enum ftp_state state;
+    size_t received;
+};
+
+static char request[REQ_SIZE];
+static char ftp_file[FTP_FILE_SIZE];
+
+static void fail(struct soak *sk, const char *why)
+{
+    if (!sk->failed)
+        fprintf(stderr, "cycle %d: %s\n", sk->cycle, why);
+    sk->failed = 1;
+    event_base_loopexit(sk->base, NULL);
+}
+
+static struct sockaddr_in loopback(int port)
+{
+    struct sockaddr_in sin;
+    memset(&sin, 0, sizeof(sin));
+    sin.sin_family      = AF_INET;
+    sin.sin_port        = htons(port);
+    sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    return sin;
+}
+
+static struct bufferevent *dial(struct soak *sk, int port, bufferevent_data_cb readcb,
+                                bufferevent_event_cb eventcb, void *ctx)
+{
+    struct sockaddr_in sin  = loopback(port);
+    struct bufferevent *bev = bufferevent_socket_new(sk->base, -1, BEV_OPT_CLOSE_ON_FREE);
+    assert(bev);
+    bufferevent_setcb(bev, readcb, NULL, eventcb, ctx);
+    bufferevent_enable(bev, EV_READ | EV_WRITE);
+    if (bufferevent_socket_connect(bev, (struct sockaddr *) &sin, sizeof(sin))) {
+        bufferevent_free(bev);
+        return NULL;
+    }
+    return bev;
+}
+
+// reset rather than leave TIME_WAIT behind, hours of churn would run out of ports
+static void close_rst(struct bufferevent *bev)
+{
+    struct linger lg = {1, 0};
+    setsockopt(bufferevent_getfd(bev), SOL_SOCKET, SO_LINGER, &lg, sizeof(lg));
+    bufferevent_free(bev);
+}
+
+static void start_tcp(struct soak *sk);
+static void start_ftp(struct soak *sk);
+
+static void tcp_read_cb(struct bufferevent *bev, void *ctx)
+{
+    struct tcp_sess *ts = ctx;
+    struct soak *sk     = ts->sk;
+    struct evbuffer *in = bufferevent_get_input(bev);
+
+    if (!ts->greeted) {
+        ts->greeted = 1;
+        evbuffer_drain(in, 1);
+        bufferevent_write(bev, request, REQ_SIZE);
+    }
+    size_t len = evbuffer_get_length(in);
+    evbuffer_drain(in, len);
+    ts->to_recv = len < ts->to_recv ? ts->to_recv - len : 0;
+    if (ts->to_recv > 0)
+        return;
+
+    close_rst(bev);
+    free(ts);
+    sk->active--;
+    sk->tcp_done++;
+    if (sk->phase == PH_ACTIVE)
+        start_tcp(sk);
+}
+
+static void tcp_event_cb(struct bufferevent *bev, short what, void *ctx)
+{
+    struct tcp_sess *ts = ctx;
+    if (what & (BEV_EVENT_EOF | BEV_EVENT_ERROR))
+        fail(ts->sk, "tcp tunnel closed before its echo came back");
+}
+
+static void start_tcp(struct soak *sk)
+{
+    struct tcp_sess *ts = calloc(1, sizeof(struct tcp_sess));
+    assert(ts);
+    ts->sk      = sk;
+    ts->to_recv = REQ_SIZE;
+    ts->bev     = dial(sk, sk->base_port + PORT_REMOTE, tcp_read_cb, tcp_event_cb, ts);
+    if (!ts->bev) {
+        free(ts);
+        fail(sk, "connect tcp remote port failed");
+        return;
+    }
+    sk->active++;
+}
+
+static void ftp_done(struct ftp_sess *fs)
+{
+    struct soak *sk = fs->sk;
+    bufferevent_write(fs->ctl, "QUIT\r\n", 6);
+    close_rst(fs->ctl);
+    if (fs->data)
+        bufferevent_free(fs->data);
+    free(fs);
+    sk->active--;
+    sk->ftp_done++;
+    if (sk->phase == PH_ACTIVE)
+        start_ftp(sk);
+}
+
+static void ftp_data_read_cb(struct bufferevent *bev, void *ctx)
+{
+    struct ftp_sess *fs = ctx;
+    struct evbuffer *in = bufferevent_get_input(bev);
+    fs->received += evbuffer_get_length(in);
+    evbuffer_drain(in, evbuffer_get_length(in));
+}
+
+static void ftp_data_event_cb(struct bufferevent *bev, short what, void *ctx)
+{
+    struct ftp_sess *fs = ctx;
+    if (what & BEV_EVENT_ERROR) {
+        fail(fs->sk, "ftp data connection failed");
+        return;
+    }
+    if (!(what & BEV_EVENT_EOF))
+        return;
+
+    ftp_data_read_cb(bev, fs);
+    if (fs->received != FTP_FILE_SIZE) {
+        fail(fs->sk, "ftp data connection closed early");
+        return;
+    }
+    ftp_done(fs);
+}
+
+static void ftp_ctl_read_cb(struct bufferevent *bev, void *ctx)
+{
+    struct ftp_sess *fs = ctx;
+    struct soak *sk     = fs->sk;
+    char *line;
+    while ((line = evbuffer_readln(bufferevent_get_input(bev), NULL, EVBUFFER_EOL_CRLF))) {
+        int h1, h2, h3, h4, p1, p2;
+        if (fs->state == FTP_GREETING && !strncmp(line, "220", 3)) {
+            fs->state = FTP_PASV;
+            bufferevent_write(bev, "PASV\r\n", 6);
+        } else if (fs->state == FTP_PASV && !strncmp(line, "227", 3)) {
+            // xfrpc must have pointed the reply at the remote data port
+            char *p = strchr(line, '(');
+            if (!p || sscanf(p, "(%d,%d,%d,%d,%d,%d)", &h1, &h2, &h3, &h4, &p1, &p2) != 6 ||
+                p1 * 256 + p2 != sk->base_port + PORT_FTP_DATA_REMOTE) {
+                fprintf(stderr, "unexpected PASV reply: %s\n", line);
+                free(line);
+                fail(sk, "ftp PASV reply was not rewritten");
+                return;
+            }
+            fs->state = FTP_DATA;
+            fs->data  = dial(sk, p1 * 256 + p2, ftp_data_read_cb, ftp_data_event_cb, fs);
+            if (!fs->data) {
+                free(line);
+                fail(sk, "connect ftp data port failed");
+                return;
+            }
+        }
+        free(line);
+    }
+}
+
+static void ftp_ctl_event_cb(struct bufferevent *bev, short what, void *ctx)
+{
+    struct ftp_sess *fs = ctx;
+    if (what & (BEV_EVENT_EOF | BEV_EVENT_ERROR))
+        fail(fs->sk, "ftp control tunnel closed during the session");
+}
+
+static void start_ftp(struct soak *sk)
+{
+    struct ftp_sess *fs = calloc(1, sizeof(struct ftp_sess));
+    assert(fs);
+    fs->sk  = sk;
+    fs->ctl = dial(sk, sk->base_port + PORT_FTP_REMOTE, ftp_ctl_read_cb, ftp_ctl_event_cb, fs);
+    if (!fs->ctl) {
+        free(fs);
+        fail(sk, "connect ftp remote port failed");
+        return;
+    }
+    sk->active++;
+}
+
+// local ftp server stand-in: greeting, PASV reply, one file per data connection
+static void ftpd_event_cb(struct bufferevent *bev, short what, void *ctx)
+{
+    if (what & (BEV_EVENT_EOF | BEV_EVENT_ERROR))
+        bufferevent_free(bev);
+}
+
+static void ftpd_ctl_read_cb(struct bufferevent *bev, void *ctx)
+{
+    struct soak *sk = ctx;
+    char *line;
+    while ((line = evbuffer_readln(bufferevent_get_input(bev), NULL, EVBUFFER_EOL_CRLF))) {
+        if (!strcmp(line, "PASV")) {
+            int port = sk->base_port + PORT_FTP_DATA_LOCAL;
+            evbuffer_add_printf(bufferevent_get_output(bev),
+                                "227 Entering Passive Mode (127,0,0,1,%d,%d).\r\n", port / 256,
+                                port % 256);
+        }
+        free(line);
+    }
+}
+
+static void ftpd_ctl_accept_cb(struct evconnlistener *listener, evutil_socket_t fd,
+                               struct sockaddr *addr, int socklen, void *ctx)
+{
+    struct soak *sk         = ctx;
+    struct bufferevent *bev = bufferevent_socket_new(sk->base, fd, BEV_OPT_CLOSE_ON_FREE);
+    assert(bev);
+    bufferevent_setcb(bev, ftpd_ctl_read_cb, NULL, ftpd_event_cb, sk);
+    bufferevent_enable(bev, EV_READ | EV_WRITE);
+    bufferevent_write(bev, "220 soak\r\n", 10);
+}
+
+static void ftpd_data_sent_cb(struct bufferevent *bev, void *ctx)
+{
+    bufferevent_free(bev);
+}
+
+static void ftpd_data_accept_cb(struct evconnlistener *listener, evutil_socket_t fd,
+                                struct sockaddr *addr, int socklen, void *ctx)
+{
+    struct soak *sk         = ctx;
+    struct bufferevent *bev = bufferevent_socket_new(sk->base, fd, BEV_OPT_CLOSE_ON_FREE);
+    assert(bev);
+    bufferevent_setcb(bev, NULL, ftpd_data_sent_cb, ftpd_event_cb, sk);
+    bufferevent_enable(bev, EV_WRITE);
+    bufferevent_write(bev, ftp_file, FTP_FILE_SIZE);
+}
+
+static int start_ftpd(struct soak *sk)
+{
+    struct sockaddr_in ctl = loopback(sk->base_port + PORT_FTP_LOCAL);
+    struct sockaddr_in data = loopback(sk->base_port + PORT_FTP_DATA_LOCAL);
+    unsigned flags          = LEV_OPT_CLOSE_ON_FREE | LEV_OPT_REUSEABLE;
+    if (!evconnlistener_new_bind(sk->base, ftpd_ctl_accept_cb, sk, flags, 128,
+                                 (struct sockaddr *) &ctl, sizeof(ctl)) ||
+        !evconnlistener_new_bind(sk->base, ftpd_data_accept_cb, sk, flags, 128,
+                                 (struct sockaddr *) &data, sizeof(data)))
+        return -1;
+    return 0;
+}
+
+// sum of "live" over the pools in /api/stats, -1 when the admin api did not answer
+static long admin_live_objects(int port)
+{
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0)
+        return -1;
+
+    struct timeval tv     = {2, 0};
+    struct sockaddr_in sin = loopback(port);
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    const char *req = "GET /api/stats HTTP/1.0\r\n\r\n";
+    if (connect(fd, (struct sockaddr *) &sin, sizeof(sin)) ||
+        write(fd, req, strlen(req)) != (ssize_t) strlen(req)) {
+        close(fd);
+        return -1;
+    }
+
+    struct evbuffer *resp = evbuffer_new();
+    assert(resp);
+    while (evbuffer_read(resp, fd, 4096) > 0)
+        ;
+    close(fd);
+    evbuffer_add(resp, "", 1);
+
+    long live  = -1;
+    char *body = strstr((char *) evbuffer_pullup(resp, -1), "\r\n\r\n");
+    struct json_object *j = body ? json_tokener_parse(body + 4) : NULL, *j_pools = NULL;
+    if (j && json_object_object_get_ex(j, "pools", &j_pools)) {
+        live = 0;
+        json_object_object_foreach(j_pools, name, j_pool)
+        {
+            struct json_object *j_live = NULL;
+            (void) name;
+            if (json_object_object_get_ex(j_pool, "live", &j_live))
+                live += json_object_get_int64(j_live);
+        }
+    }
+    if (j)
+        json_object_put(j);
+    evbuffer_free(resp);
+    return live;
+}
+
+static void take_sample(struct soak *sk)
+{
+    struct soak_sample *s = &sk->samples[sk->nsamples++];
+    s->cycle              = sk->cycle;
+    s->sec                = (bench_now_usec() - sk->start_at) / 1000000;
+    s->rss_kb             = proc_rss_kb(sk->xfrpc);
+    s->fds                = proc_fd_count(sk->xfrpc);
+    s->live               = admin_live_objects(sk->base_port + PORT_ADMIN);
+    s->tcp                = sk->tcp_done;
+    s->ftp                = sk->ftp_done;
+    s->logins             = mock_frps_get_stats(sk->frps)->logins;
+
+    printf("%6d %8llu %8ld %6d %6ld %10llu %8llu %7llu\n", s->cycle, (unsigned long long) s->sec,
+           s->rss_kb, s->fds, s->live, (unsigned long long) s->tcp, (unsigned long long) s->ftp,
+           (unsigned long long) s->logins);
+    fflush(stdout);
+    if (sk->csv) {
+        fprintf(sk->csv, "%d,%llu,%ld,%d,%ld,%llu,%llu,%llu\n", s->cycle,
+                (unsigned long long) s->sec, s->rss_kb, s->fds, s->live,
+                (unsigned long long) s->tcp, (unsigned long long) s->ftp,
+                (unsigned long long) s->logins);
+        fflush(sk->csv);
+    }
+    if (s->rss_kb < 0 || s->fds < 0 || s->live < 0)
+        fail(sk, "xfrpc can not be sampled, did it exit?");
+}
+
+static void next_phase(struct soak *sk, enum soak_phase phase)
+{
+    sk->phase    = phase;
+    sk->phase_at = bench_now_usec();
+}
+
+static void start_cycle(struct soak *sk)
+{
+    int i;
+    sk->cycle++;
+    sk->dropped = 0;
+    next_phase(sk, PH_ACTIVE);
+    for (i = 0; i < sk->tcp_conc; i++)
+        start_tcp(sk);
+    for (i = 0; i < sk->ftp_conc; i++)
+        start_ftp(sk);
+}
+
+static void proxy_cb(const char *proxy_name, int remote_port, void *arg)
+{
+    struct soak *sk = arg;
+    // bench, ftp and ftp data proxies
+    if (sk->phase == PH_WAIT_PROXY && ++sk->proxies == 3)
+        start_cycle(sk);
+}
+
+static void tick_cb(evutil_socket_t fd, short what, void *arg)
+{
+    struct soak *sk  = arg;
+    uint64_t elapsed = (bench_now_usec() - sk->phase_at) / 1000;
+
+    switch (sk->phase) {
+        case PH_ACTIVE:
+            // drop in the middle of the load, tunnels are being set up
+            if (sk->reconnect_every && sk->cycle % sk->reconnect_every == 0 && !sk->dropped &&
+                elapsed >= sk->cycle_sec * 500) {
+                sk->dropped = 1;
+                mock_frps_drop_control(sk->frps);
+            }
+            if (elapsed >= sk->cycle_sec * 1000)
+                next_phase(sk, PH_DRAIN);
+            break;
+        case PH_DRAIN:
+            if (sk->active == 0)
+                next_phase(sk, PH_SETTLE);
+            else if (elapsed >= DRAIN_SEC * 1000)
+                fail(sk, "sessions did not finish");
+            break;
+        case PH_SETTLE:
+            if (elapsed < SETTLE_SEC * 1000)
+                break;
+            take_sample(sk);
+            if (sk->cycle >= sk->cycles)
+                event_base_loopexit(sk->base, NULL);
+            else
+                start_cycle(sk);
+            break;
+        default:
+            if (elapsed >= DRAIN_SEC * 1000)
+                fail(sk, "xfrpc did not register its proxies");
+            break;
+    }
+}
+
+// the first sample is taken warm, pools and allocator caches are filled by then
+static int check_growth(struct soak *sk)
+{
+    if (sk->nsamples < 2)
+        return 0;
+
+    const struct soak_sample *first = &sk->samples[0], *last = &sk->samples[sk->nsamples - 1];
+    int i, failed = 0;
+
+    // least squares slope of rss over time
+    double n = sk->nsamples, sx = 0, sy = 0, sxx = 0, sxy = 0;
+    for (i = 0; i < sk->nsamples; i++) {
+        double x = sk->samples[i].sec / 3600.0, y = sk->samples[i].rss_kb;
+        sx += x;
+        sy += y;
+        sxx += x * x;
+        sxy += x * y;
+    }
+    double den = n * sxx - sx * sx;
+    printf("rss %ld -> %ld KB, slope %.0f KB/hour\n", first->rss_kb, last->rss_kb,
+           den > 0 ? (n * sxy - sx * sy) / den : 0);
+    fflush(stdout);
+
+    if (last->fds > first->fds) {
+        fprintf(stderr, "open fds grew from %d to %d\n", first->fds, last->fds);
+        failed = 1;
+    }
+    if (last->live > first->live) {
+        fprintf(stderr, "live objects grew from %ld to %ld\n", first->live, last->live);
+        failed = 1;
+    }
+    if (last->rss_kb - first->rss_kb > sk->max_growth_kb) {
+        fprintf(stderr, "rss grew %ld KB, more than %ld KB allowed\n",
+                last->rss_kb - first->rss_kb, sk->max_growth_kb);
+        failed = 1;
+    }
+    return failed ? -1 : 0;
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr,
+            "usage: %s -x path/to/xfrpc [-t seconds] [-i cycle_seconds] [-c tcp_users]\n"
+            "       [-f ftp_sessions] [-r reconnect_every] [-g max_rss_growth_kb]\n"
+            "       [-l samples.csv] [-p base_port] [-o \"option = value\"]...\n",
+            prog);
+    exit(2);
+}
+
+int main(int argc, char **argv)
+{
+    const char *xfrpc = NULL, *csv = NULL;
+    int duration = 3600, opt;
+    char extra[1024] = {0};
+
+    struct soak sk;
+    memset(&sk, 0, sizeof(sk));
+    sk.base_port       = 29000;
+    sk.tcp_conc        = 20;
+    sk.ftp_conc        = 2;
+    sk.cycle_sec       = 10;
+    sk.reconnect_every = 6;
+    sk.max_growth_kb   = 1024;
+    while ((opt = getopt(argc, argv, "x:t:i:c:f:r:g:l:p:o:")) != -1) {
+        switch (opt) {
+            case 'x':
+                xfrpc = optarg;
+                break;
+            case 't':
+                duration = atoi(optarg);
+                break;
+            case 'i':
+                sk.cycle_sec = atoi(optarg);
+                break;
+            case 'c':
+                sk.tcp_conc = atoi(optarg);
+                break;
+            case 'f':
+                sk.ftp_conc = atoi(optarg);
+                break;
+            case 'r':
+                sk.reconnect_every = atoi(optarg);
+                break;
+            case 'g':
+                sk.max_growth_kb = atol(optarg);
+                break;
+            case 'l':
+                csv = optarg;
+                break;
+            case 'p':
+                sk.base_port = atoi(optarg);
+                break;
+            case 'o':
+                strncat(extra, optarg, sizeof(extra) - strlen(extra) - 2);
+                strcat(extra, "\n");
+                break;
+            default:
+                usage(argv[0]);
+        }
+    }
+    if (!xfrpc || sk.cycle_sec <= 0 || sk.tcp_conc < 0 || sk.ftp_conc < 0 ||
+        sk.reconnect_every < 0)
+        usage(argv[0]);
+
+    // settle and drain add to each cycle, count them in
+    sk.cycles = duration / (sk.cycle_sec + SETTLE_SEC);
+    if (sk.cycles < 2)
+        sk.cycles = 2;
+    sk.samples = calloc(sk.cycles, sizeof(struct soak_sample));
+    assert(sk.samples);
+    if (csv) {
+        sk.csv = fopen(csv, "w");
+        if (!sk.csv) {
+            perror(csv);
+            return 1;
+        }
+        fprintf(sk.csv, "cycle,sec,rss_kb,fds,live,tcp,ftp,logins\n");
+    }
+    memset(request, 'q', sizeof(request));
+    memset(ftp_file, 'f', sizeof(ftp_file));
+    raise_nofile();
+
+    sk.base = event_base_new();
+    assert(sk.base);
+    sk.frps = mock_frps_new(sk.base, sk.base_port + PORT_FRPS, proxy_cb, &sk);
+    if (!sk.frps ||
+        !start_local_service(sk.base, sk.base_port + PORT_LOCAL, LOCAL_GREET_ECHO, &sk.local) ||
+        start_ftpd(&sk)) {
+        fprintf(stderr, "listen on ports %d-%d failed\n", sk.base_port,
+                sk.base_port + PORT_FTP_DATA_LOCAL);
+        return 1;
+    }
+
+    char ini[64], log[64];
+    snprintf(ini, sizeof(ini), "/tmp/xfrpc_bench_soak_%d.ini", (int) getpid());
+    snprintf(log, sizeof(log), "/tmp/xfrpc_bench_soak_%d.log", (int) getpid());
+    snprintf(extra + strlen(extra), sizeof(extra) - strlen(extra), "admin_port = %d\n",
+             sk.base_port + PORT_ADMIN);
+    FILE *fp = NULL;
+    if (write_xfrpc_ini(ini, sk.base_port + PORT_FRPS, sk.base_port + PORT_LOCAL,
+                        sk.base_port + PORT_REMOTE, extra) ||
+        !(fp = fopen(ini, "a"))) {
+        perror(ini);
+        return 1;
+    }
+    fprintf(fp,
+            "\n[ftp]\n"
+            "type = ftp\n"
+            "local_ip = 127.0.0.1\n"
+            "local_port = %d\n"
+            "remote_port = %d\n"
+            "remote_data_port = %d\n",
+            sk.base_port + PORT_FTP_LOCAL, sk.base_port + PORT_FTP_REMOTE,
+            sk.base_port + PORT_FTP_DATA_REMOTE);
+    fclose(fp);
+
+    sk.xfrpc    = spawn_xfrpc(xfrpc, ini, log);
+    sk.start_at = bench_now_usec();
+    sk.phase_at = sk.start_at;
+    printf("%6s %8s %8s %6s %6s %10s %8s %7s\n", "cycle", "sec", "rss_kb", "fds", "live",
+           "tcp", "ftp", "logins");
+
+    struct timeval tick = {0, TICK_MSEC * 1000};
+    struct event *ev_tick = event_new(sk.base, -1, EV_PERSIST, tick_cb, &sk);
+    event_add(ev_tick, &tick);
+    event_base_dispatch(sk.base);
+
+    stop_xfrpc(sk.xfrpc);
+    unlink(ini);
+    if (sk.csv)
+        fclose(sk.csv);
+    if (!sk.failed && check_growth(&sk))
+        sk.failed = 1;
+    if (sk.failed) {
+        fprintf(stderr, "xfrpc output kept in %s\n", log);
+        return 1;
+    }
+    unlink(log);
+    return 0;
+}
@@ -0,0 +1,318 @@
+/* vim: set et ts=4 sts=4 sw=4 : */
+/********************************************************************\
+ * This program is free software; you can redistribute it and/or    *
+ * modify it under the terms of the GNU General Public License as   *
+ * published by the Free Software Foundation; either version 2 of   *
+ * the License, or (at your option) any later version.              *
+ *                                                                  *
+ * This program is distributed in the hope that it will be useful,  *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of   *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the    *
+ * GNU General Public License for more details.                     *
+ *                                                                  *
+ * You should have received a copy of the GNU General Public License*
+ * along with this program; if not, contact:                        *
+ *                                                                  *
+ * Free Software Foundation           Voice:  +1-617-542-5942       *
+ * 59 Temple Place - Suite 330        Fax:    +1-617-542-2652       *
+ * Boston, MA  02111-1307,  USA       gnu@gnu.org                   *
+ *                                                                  *
+\********************************************************************/
+
+
+/** @file bench_tls.c
+    @brief cost of full and resumed TLS handshakes with frps
+
+    A child process runs a plain OpenSSL server with a self-signed P-256
+    certificate made at start, standing in for the TLS terminator in
+    front of frps. This process dials it through tls.c, one connection at
+    a time, the way work connections do. Each connection waits for one
+    byte from the server, so session tickets sent after the handshake are
+    cached before it closes.
+
+    - full: the cached session is dropped before every connection
+    - resumed: every connection offers the session of the previous one
+
+    TLS 1.3 resumption still runs an ECDHE exchange, -2 caps the server at
+    TLS 1.2 where a resumed handshake skips key exchange altogether.
+
+    usage: xfrpc_bench_tls [-n handshakes] [-p port] [-2]
+*/
+
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <assert.h>
+#include <signal.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <sys/resource.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+#include <openssl/evp.h>
+#include <openssl/ec.h>
+#include <openssl/x509.h>
+
+#include <event2/event.h>
+#include <event2/bufferevent.h>
+
+#include "bench_util.h"
+#include "../tls.h"
+#include "../histogram.h"
+
+struct tls_run {
+    struct event_base *base;
+    struct sockaddr_in sin;
+    int resume;
+    int todo;
+    uint64_t start;
+    struct latency_hist hist;   // tcp connect -> handshake done
+    int failed;
+};
+
+static EVP_PKEY *make_key()
+{
+    EVP_PKEY *pkey     = NULL;
+    EVP_PKEY_CTX *kctx = EVP_PKEY_CTX_new_id(EVP_PKEY_EC, NULL);
+    if (!kctx || EVP_PKEY_keygen_init(kctx) <= 0 ||
+        EVP_PKEY_CTX_set_ec_paramgen_curve_nid(kctx, NID_X9_62_prime256v1) <= 0 ||
+        EVP_PKEY_keygen(kctx, &pkey) <= 0)
+        pkey = NULL;
+    EVP_PKEY_CTX_free(kctx);
+    return pkey;
+}
+
+static X509 *make_cert(EVP_PKEY *pkey)
+{
+    X509 *x = X509_new();
+    if (!x)
+        return NULL;
+
+    X509_set_version(x, 2);
+    ASN1_INTEGER_set(X509_get_serialNumber(x), 1);
+    X509_gmtime_adj(X509_get_notBefore(x), 0);
+    X509_gmtime_adj(X509_get_notAfter(x), 86400);
+    X509_set_pubkey(x, pkey);
+
+    X509_NAME *name = X509_get_subject_name(x);
+    X509_NAME_add_entry_by_txt(name, "CN", MBSTRING_ASC, (const unsigned char *) "localhost", -1,
+                               -1, 0);
+    X509_set_issuer_name(x, name);
+    if (!X509_sign(x, pkey, EVP_sha256())) {
+        X509_free(x);
+        return NULL;
+    }
+    return x;
+}
+
+// child: accept one connection at a time, handshake, send a byte, wait for close
+static void run_server(int lfd, int tls12)
+{
+    EVP_PKEY *pkey = make_key();
+    X509 *cert     = pkey ? make_cert(pkey) : NULL;
+    SSL_CTX *ctx   = SSL_CTX_new(SSLv23_server_method());
+    if (!cert || !ctx || !SSL_CTX_use_certificate(ctx, cert) || !SSL_CTX_use_PrivateKey(ctx, pkey)) {
+        fprintf(stderr, "server: certificate setup failed\n");
+        ERR_print_errors_fp(stderr);
+        _exit(1);
+    }
+    SSL_CTX_set_options(ctx, SSL_OP_NO_SSLv2 | SSL_OP_NO_SSLv3 | SSL_OP_NO_TLSv1 |
+                                 SSL_OP_NO_TLSv1_1 | SSL_OP_NO_COMPRESSION);
+    SSL_CTX_set_session_id_context(ctx, (const unsigned char *) "xfrpc", 5);
+#ifdef SSL_OP_NO_TLSv1_3
+    if (tls12)
+        SSL_CTX_set_options(ctx, SSL_OP_NO_TLSv1_3);
+#endif
+
+    for (;;) {
+        int fd = accept(lfd, NULL, NULL);
+        if (fd < 0)
+            continue;
+        // tickets and the byte after them must not wait for delayed acks
+        int on = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+
+        SSL *ssl = SSL_new(ctx);
+        SSL_set_fd(ssl, fd);
+        char c = 'G';
+        if (SSL_accept(ssl) == 1 && SSL_write(ssl, &c, 1) == 1)
+            SSL_read(ssl, &c, 1);   // returns once the client closed
+        SSL_free(ssl);
+        close(fd);
+    }
+}
+
+static void next_handshake(struct tls_run *run);
+
+static void read_cb(struct bufferevent *bev, void *ctx)
+{
+    struct tls_run *run = ctx;
+    bufferevent_free(bev);
+    next_handshake(run);
+}
+
+static void event_cb(struct bufferevent *bev, short what, void *ctx)
+{
+    struct tls_run *run = ctx;
+
+    if (what & BEV_EVENT_CONNECTED) {
+        if (tls_pending(bev)) {
+            if (!tls_wrap(bev, "localhost")) {
+                run->failed++;
+                next_handshake(run);
+            }
+            return;
+        }
+        hist_add(&run->hist, bench_now_usec() - run->start);
+        tls_handshake_done(bev);
+        return;
+    }
+
+    if (what & (BEV_EVENT_EOF | BEV_EVENT_ERROR)) {
+        run->failed++;
+        bufferevent_free(bev);
+        next_handshake(run);
+    }
+}
+
+static void next_handshake(struct tls_run *run)
+{
+    if (run->todo-- <= 0) {
+        event_base_loopexit(run->base, NULL);
+        return;
+    }
+
+    if (!run->resume)
+        tls_forget_session();
+
+    struct bufferevent *bev = bufferevent_socket_new(run->base, -1, BEV_OPT_CLOSE_ON_FREE);
+    assert(bev);
+    bufferevent_setcb(bev, read_cb, NULL, event_cb, run);
+    bufferevent_enable(bev, EV_READ | EV_WRITE);
+    run->start = bench_now_usec();
+    if (bufferevent_socket_connect(bev, (struct sockaddr *) &run->sin, sizeof(run->sin)) < 0) {
+        bufferevent_free(bev);
+        event_base_loopexit(run->base, NULL);
+    }
+}
+
+static double self_cpu_sec()
+{
+    struct rusage ru;
+    getrusage(RUSAGE_SELF, &ru);
+    return ru.ru_utime.tv_sec + ru.ru_stime.tv_sec +
+           (ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) / 1e6;
+}
+
+static double ms(uint64_t us)
+{
+    return us / 1000.0;
+}
+
+static int run_phase(struct event_base *base, const struct sockaddr_in *sin, pid_t server,
+                     int resume, int n)
+{
+    struct tls_run run;
+    memset(&run, 0, sizeof(run));
+    run.base   = base;
+    run.sin    = *sin;
+    run.resume = resume;
+
+    // one handshake to cache a session (resumed) or to warm up (full)
+    run.todo = 1;
+    next_handshake(&run);
+    event_base_dispatch(base);
+
+    struct tls_stats before = *get_tls_stats();
+    memset(&run.hist, 0, sizeof(run.hist));
+    run.failed     = 0;
+    run.todo       = n;
+    double cli_cpu = self_cpu_sec();
+    double srv_cpu = proc_cpu_sec(server);
+    uint64_t start = bench_now_usec();
+    next_handshake(&run);
+    event_base_dispatch(base);
+    double sec = (bench_now_usec() - start) / 1e6;
+    cli_cpu    = self_cpu_sec() - cli_cpu;
+    srv_cpu    = proc_cpu_sec(server) - srv_cpu;
+
+    const struct tls_stats *after = get_tls_stats();
+    uint64_t done = run.hist.count;
+    printf("%-8s %8llu %8llu %8.0f %7.2f %7.2f %7.2f %9.0f %9.0f\n", resume ? "resumed" : "full",
+           (unsigned long long) (after->full - before.full),
+           (unsigned long long) (after->resumed - before.resumed), done / sec,
+           ms(hist_percentile(&run.hist, 50)), ms(hist_percentile(&run.hist, 99)),
+           ms(run.hist.max_us), done ? cli_cpu * 1e6 / done : 0,
+           done ? srv_cpu * 1e6 / done : 0);
+    return run.failed || !done;
+}
+
+int main(int argc, char **argv)
+{
+    int n = 1000, port = 27400, tls12 = 0, opt;
+    while ((opt = getopt(argc, argv, "n:p:2")) != -1) {
+        switch (opt) {
+        case 'n':
+            n = atoi(optarg);
+            break;
+        case 'p':
+            port = atoi(optarg);
+            break;
+        case '2':
+            tls12 = 1;
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-n handshakes] [-p port] [-2]\n", argv[0]);
+            return 1;
+        }
+    }
+    signal(SIGPIPE, SIG_IGN);
+
+    struct sockaddr_in sin;
+    memset(&sin, 0, sizeof(sin));
+    sin.sin_family      = AF_INET;
+    sin.sin_port        = htons(port);
+    sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    int lfd = socket(AF_INET, SOCK_STREAM, 0), on = 1;
+    setsockopt(lfd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+    if (lfd < 0 || bind(lfd, (struct sockaddr *) &sin, sizeof(sin)) || listen(lfd, 128)) {
+        perror("listen");
+        return 1;
+    }
+
+    pid_t server = fork();
+    if (server < 0) {
+        perror("fork");
+        return 1;
+    }
+    if (server == 0)
+        run_server(lfd, tls12);
+    close(lfd);
+
+    // "localhost" is sent as SNI, the certificate is not verified
+    if (init_tls(NULL, 0)) {
+        fprintf(stderr, "init_tls failed\n");
+        kill(server, SIGKILL);
+        return 1;
+    }
+
+    struct event_base *base = event_base_new();
+    assert(base);
+
+    printf("%-8s %8s %8s %8s %7s %7s %7s %9s %9s\n", "mode", "full", "resumed", "hs/s",
+           "p50_ms", "p99_ms", "max_ms", "cli_us/hs", "srv_us/hs");
+    int rc = run_phase(base, &sin, server, 0, n);
+    rc |= run_phase(base, &sin, server, 1, n);
+
+    kill(server, SIGKILL);
+    waitpid(server, NULL, 0);
+    free_tls();
+    event_base_free(base);
+    return rc;
+}
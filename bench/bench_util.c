@@ -0,0 +1,242 @@
+/* vim: set et ts=4 sts=4 sw=4 : */
+/********************************************************************\
+ * This program is free software; you can redistribute it and/or    *
+ * modify it under the terms of the GNU General Public License as   *
+ * published by the Free Software Foundation; either version 2 of   *
+ * the License, or (at your option) any later version.              *
+ *                                                                  *
+ * This program is distributed in the hope that it will be useful,  *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of   *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the    *
+ * GNU General Public License for more details.                     *
+ *                                                                  *
+ * You should have received a copy of the GNU General Public License*
+ * along with this program; if not, contact:                        *
+ *                                                                  *
+ * Free Software Foundation           Voice:  +1-617-542-5942       *
+ * 59 Temple Place - Suite 330        Fax:    +1-617-542-2652       *
+ * Boston, MA  02111-1307,  USA       gnu@gnu.org                   *
+ *                                                                  *
+\********************************************************************/
+
+/** @file bench_util.c
+    @brief process and local service helpers shared by benchmarks
+*/
+
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <assert.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+#include <arpa/inet.h>
+
+#include <event2/event.h>
+#include <event2/buffer.h>
+#include <event2/bufferevent.h>
+#include <event2/listener.h>
+
+#include "bench_util.h"
+
+int write_xfrpc_ini(const char *path, int frps_port, int local_port, int remote_port,
+                    const char *extra)
+{
+    FILE *fp = fopen(path, "w");
+    if (!fp)
+        return -1;
+
+    fprintf(fp,
+            "[common]\n"
+            "server_addr = 127.0.0.1\n"
+            "server_port = %d\n"
+            "log_level = error\n"
+            "%s\n"
+            "[bench]\n"
+            "type = tcp\n"
+            "local_ip = 127.0.0.1\n"
+            "local_port = %d\n"
+            "remote_port = %d\n",
+            frps_port, extra ? extra : "", local_port, remote_port);
+    fclose(fp);
+    return 0;
+}
+
+pid_t spawn_xfrpc(const char *xfrpc, const char *ini, const char *log)
+{
+    pid_t pid = fork();
+    if (pid != 0)
+        return pid;
+
+    int fd = open(log ? log : "/dev/null", O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd >= 0) {
+        dup2(fd, STDOUT_FILENO);
+        dup2(fd, STDERR_FILENO);
+        close(fd);
+    }
+    // listeners of a mock frps in the caller must not outlive it in xfrpc
+    long max_fd = sysconf(_SC_OPEN_MAX);
+    for (fd = STDERR_FILENO + 1; fd < max_fd && fd < 4096; fd++)
+        close(fd);
+    execl(xfrpc, xfrpc, "-c", ini, "-f", (char *) NULL);
+    perror("exec xfrpc");
+    _exit(127);
+}
+
+void stop_xfrpc(pid_t pid)
+{
+    if (pid <= 0)
+        return;
+
+    kill(pid, SIGTERM);
+    int i;
+    for (i = 0; i < 20; i++) {
+        if (waitpid(pid, NULL, WNOHANG) == pid)
+            return;
+        usleep(50 * 1000);
+    }
+    kill(pid, SIGKILL);
+    waitpid(pid, NULL, 0);
+}
+
+long proc_rss_kb(pid_t pid)
+{
+    char path[64];
+    snprintf(path, sizeof(path), "/proc/%d/statm", (int) pid);
+    FILE *fp = fopen(path, "r");
+    if (!fp)
+        return -1;
+
+    unsigned long size = 0, resident = 0;
+    int n = fscanf(fp, "%lu %lu", &size, &resident);
+    fclose(fp);
+    if (n != 2)
+        return -1;
+    return (long) (resident * (sysconf(_SC_PAGESIZE) / 1024));
+}
+
+int proc_fd_count(pid_t pid)
+{
+    char path[64];
+    snprintf(path, sizeof(path), "/proc/%d/fd", (int) pid);
+    DIR *dir = opendir(path);
+    if (!dir)
+        return -1;
+
+    int n = 0;
+    struct dirent *de;
+    while ((de = readdir(dir)))
+        if (de->d_name[0] != '.')
+            n++;
+    closedir(dir);
+    return n;
+}
+
+double proc_cpu_sec(pid_t pid)
+{
+    char path[64], buf[1024];
+    snprintf(path, sizeof(path), "/proc/%d/stat", (int) pid);
+    FILE *fp = fopen(path, "r");
+    if (!fp)
+        return -1;
+
+    size_t n = fread(buf, 1, sizeof(buf) - 1, fp);
+    fclose(fp);
+    buf[n] = '\0';
+
+    // comm may hold spaces, fields are counted after its closing paren
+    char *p = strrchr(buf, ')');
+    unsigned long utime = 0, stime = 0;
+    if (!p || sscanf(p + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu", &utime,
+                     &stime) != 2)
+        return -1;
+    return (double) (utime + stime) / sysconf(_SC_CLK_TCK);
+}
+
+long raise_nofile()
+{
+    struct rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE, &rl))
+        return -1;
+    rl.rlim_cur = rl.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &rl);
+    getrlimit(RLIMIT_NOFILE, &rl);
+    return (long) rl.rlim_cur;
+}
+
+static void local_read_cb(struct bufferevent *bev, void *ctx)
+{
+    struct local_service_stats *stats = ctx;
+    struct evbuffer *in               = bufferevent_get_input(bev);
+    stats->bytes += evbuffer_get_length(in);
+    evbuffer_drain(in, evbuffer_get_length(in));
+}
+
+static void local_echo_cb(struct bufferevent *bev, void *ctx)
+{
+    struct local_service_stats *stats = ctx;
+    struct evbuffer *in               = bufferevent_get_input(bev);
+    stats->bytes += evbuffer_get_length(in);
+    bufferevent_write_buffer(bev, in);
+}
+
+static void local_event_cb(struct bufferevent *bev, short what, void *ctx)
+{
+    struct local_service_stats *stats = ctx;
+    if (what & (BEV_EVENT_EOF | BEV_EVENT_ERROR)) {
+        stats->closed++;
+        bufferevent_free(bev);
+    }
+}
+
+struct local_service {
+    enum local_service_mode mode;
+    struct local_service_stats *stats;
+};
+
+static void local_accept_cb(struct evconnlistener *listener, evutil_socket_t fd,
+                            struct sockaddr *addr, int socklen, void *ctx)
+{
+    struct local_service *ls = ctx;
+    struct bufferevent *bev =
+        bufferevent_socket_new(evconnlistener_get_base(listener), fd, BEV_OPT_CLOSE_ON_FREE);
+    assert(bev);
+
+    ls->stats->accepted++;
+    bufferevent_setcb(bev, ls->mode == LOCAL_HOLD ? local_read_cb : local_echo_cb, NULL,
+                      local_event_cb, ls->stats);
+    bufferevent_enable(bev, EV_READ | EV_WRITE);
+    if (ls->mode == LOCAL_GREET_ECHO)
+        bufferevent_write(bev, "G", 1);
+}
+
+// the listener lives as long as the benchmark, so does its ctx
+struct evconnlistener *start_local_service(struct event_base *base, int port,
+                                           enum local_service_mode mode,
+                                           struct local_service_stats *stats)
+{
+    struct local_service *ls = calloc(1, sizeof(struct local_service));
+    assert(ls);
+    ls->mode  = mode;
+    ls->stats = stats;
+
+    struct sockaddr_in sin;
+    memset(&sin, 0, sizeof(sin));
+    sin.sin_family      = AF_INET;
+    sin.sin_port        = htons(port);
+    sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    return evconnlistener_new_bind(base, local_accept_cb, ls,
+                                   LEV_OPT_CLOSE_ON_FREE | LEV_OPT_REUSEABLE, 1024,
+                                   (struct sockaddr *) &sin, sizeof(sin));
+}
+
+uint64_t bench_now_usec()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
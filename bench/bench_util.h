@@ -0,0 +1,69 @@
+/* vim: set et ts=4 sts=4 sw=4 : */
+/********************************************************************\
+ * This program is free software; you can redistribute it and/or    *
+ * modify it under the terms of the GNU General Public License as   *
+ * published by the Free Software Foundation; either version 2 of   *
+ * the License, or (at your option) any later version.              *
+ *                                                                  *
+ * This program is distributed in the hope that it will be useful,  *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of   *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the    *
+ * GNU General Public License for more details.                     *
+ *                                                                  *
+ * You should have received a copy of the GNU General Public License*
+ * along with this program; if not, contact:                        *
+ *                                                                  *
+ * Free Software Foundation           Voice:  +1-617-542-5942       *
+ * 59 Temple Place - Suite 330        Fax:    +1-617-542-2652       *
+ * Boston, MA  02111-1307,  USA       gnu@gnu.org                   *
+ *                                                                  *
+\********************************************************************/
+
+/** @file bench_util.h
+    @brief process and local service helpers shared by benchmarks
+*/
+
+#ifndef _BENCH_UTIL_H_
+#define _BENCH_UTIL_H_
+
+#include <stdint.h>
+#include <sys/types.h>
+
+struct event_base;
+struct evconnlistener;
+
+enum local_service_mode {
+    LOCAL_HOLD = 0,   // accept and keep the connection, drop what is read
+    LOCAL_ECHO,
+    LOCAL_GREET_ECHO,   // send one byte on accept, then echo
+};
+
+struct local_service_stats {
+    uint64_t accepted;
+    uint64_t closed;
+    uint64_t bytes;   // read from tunnels
+};
+
+// write an ini for one tcp proxy; extra is appended to [common], may be NULL
+int write_xfrpc_ini(const char *path, int frps_port, int local_port, int remote_port,
+                    const char *extra);
+// run xfrpc -c ini -f in foreground, its output goes to log (or /dev/null)
+pid_t spawn_xfrpc(const char *xfrpc, const char *ini, const char *log);
+void stop_xfrpc(pid_t pid);
+
+// resident set of pid in KB, -1 on failure
+long proc_rss_kb(pid_t pid);
+// open file descriptors of pid, -1 on failure
+int proc_fd_count(pid_t pid);
+// user + system cpu time of pid in seconds, -1 on failure
+double proc_cpu_sec(pid_t pid);
+// raise RLIMIT_NOFILE to its hard limit, return the new soft limit
+long raise_nofile();
+
+struct evconnlistener *start_local_service(struct event_base *base, int port,
+                                           enum local_service_mode mode,
+                                           struct local_service_stats *stats);
+
+uint64_t bench_now_usec();
+
+#endif   //_BENCH_UTIL_H_
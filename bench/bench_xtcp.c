@@ -0,0 +1,467 @@
+/* vim: set et ts=4 sts=4 sw=4 : */
+/********************************************************************\
+ * This program is free software; you can redistribute it and/or    *
+ * modify it under the terms of the GNU General Public License as   *
+ * published by the Free Software Foundation; either version 2 of   *
+ * the License, or (at your option) any later version.              *
+ *                                                                  *
+ * This program is distributed in the hope that it will be useful,  *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of   *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the    *
+ * GNU General Public License for more details.                     *
+ *                                                                  *
+ * You should have received a copy of the GNU General Public License*
+ * along with this program; if not, contact:                        *
+ *                                                                  *
+ * Free Software Foundation           Voice:  +1-617-542-5942       *
+ * 59 Temple Place - Suite 330        Fax:    +1-617-542-2652       *
+ * Boston, MA  02111-1307,  USA       gnu@gnu.org                   *
+ *                                                                  *
+\********************************************************************/
+
+
+/** @file bench_xtcp.c
+    @brief xtcp direct path against the frps relay
+
+    The mock frps doubles as the xtcp rendezvous. One xfrpc serves a local
+    echo service both as a tcp proxy on a frps remote port and as an xtcp
+    proxy, a second xfrpc runs the visitor with the tcp proxy as fallback.
+    Users then go three ways to the same echo service: through the frps
+    relay, through the visitor over the punched path, and through the
+    visitor while the rendezvous hands out unusable addresses, so the
+    visitor falls back to the relay.
+
+    For each way a few users measure the time to the greeting byte of the
+    echo service (punching included for xtcp), then one user does
+    request/response round trips and one pushes bulk bytes. -r caps each
+    relayed connection at frps like a small VPS would.
+
+    usage: xfrpc_bench_xtcp -x path/to/xfrpc [-n requests] [-b bulk_mb]
+                            [-c opens] [-r relay_mbs] [-p base_port]
+*/
+
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <assert.h>
+#include <signal.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+
+#include <event2/event.h>
+#include <event2/buffer.h>
+#include <event2/bufferevent.h>
+#include <event2/listener.h>
+
+#include "mock_frps.h"
+#include "bench_util.h"
+#include "../histogram.h"
+
+#define SK "bench"
+#define REQ_SIZE 64
+#define BULK_CHUNK 65536
+#define READY_SEC 30
+#define PHASE_TIMEOUT_SEC 120
+
+enum xtcp_phase {
+    PH_OPEN = 0,   // greeting byte only
+    PH_RR,
+    PH_BULK,
+};
+
+enum xtcp_way {
+    WAY_RELAY = 0,
+    WAY_XTCP,
+    WAY_FALLBACK,
+    WAYS,
+};
+
+static const char *way_names[WAYS] = {"relay", "xtcp", "fallback"};
+
+struct bench_xtcp {
+    struct event_base *base;
+    struct sockaddr_in remote;
+    enum xtcp_phase phase;
+    int done;
+    int failed;
+    int quiet;   // failures expected while waiting for tunnels
+
+    int requests;
+    size_t bulk;
+    char payload[BULK_CHUNK];
+
+    struct latency_hist hist;
+};
+
+struct user_conn {
+    struct bench_xtcp *bx;
+    struct bufferevent *bev;
+    int greeted;
+    int left;   // requests to go
+    uint64_t sent_at;
+    size_t to_send;
+    size_t to_recv;
+};
+
+struct result {
+    struct latency_hist open;
+    struct latency_hist rr;
+    double bulk_mbs;
+};
+
+static void block_cb(evutil_socket_t fd, short what, void *arg)
+{
+    mock_frps_set_nat_block(arg, 1);
+}
+
+// mock frps with its rendezvous and the local echo service, until killed
+static void run_services(int base_port, size_t relay_rate)
+{
+    struct local_service_stats local;
+    memset(&local, 0, sizeof(local));
+    struct event_base *base = event_base_new();
+    assert(base);
+
+    struct mock_frps *frps = mock_frps_new(base, base_port, NULL, NULL);
+    if (!frps || mock_frps_listen_udp(frps, base_port) ||
+        !start_local_service(base, base_port + 1, LOCAL_GREET_ECHO, &local)) {
+        fprintf(stderr, "listen on port %d or %d failed\n", base_port, base_port + 1);
+        exit(1);
+    }
+    mock_frps_set_relay_rate(frps, relay_rate);
+
+    // SIGUSR1 turns on the blocking NAT for the fallback phase
+    struct event *ev = evsignal_new(base, SIGUSR1, block_cb, frps);
+    assert(ev);
+    event_add(ev, NULL);
+    event_base_dispatch(base);
+    exit(0);
+}
+
+static int write_inis(const char *proxy_ini, const char *visitor_ini, int base_port)
+{
+    FILE *fp = fopen(proxy_ini, "w");
+    if (!fp)
+        return -1;
+    fprintf(fp,
+            "[common]\n"
+            "server_addr = 127.0.0.1\n"
+            "server_port = %d\n"
+            "log_level = error\n"
+            "\n"
+            "[echo_relay]\n"
+            "type = tcp\n"
+            "local_ip = 127.0.0.1\n"
+            "local_port = %d\n"
+            "remote_port = %d\n"
+            "\n"
+            "[echo_xtcp]\n"
+            "type = xtcp\n"
+            "sk = " SK "\n"
+            "local_ip = 127.0.0.1\n"
+            "local_port = %d\n",
+            base_port, base_port + 1, base_port + 2, base_port + 1);
+    fclose(fp);
+
+    fp = fopen(visitor_ini, "w");
+    if (!fp)
+        return -1;
+    fprintf(fp,
+            "[common]\n"
+            "server_addr = 127.0.0.1\n"
+            "server_port = %d\n"
+            "log_level = error\n"
+            "\n"
+            "[echo_visitor]\n"
+            "type = xtcp\n"
+            "role = visitor\n"
+            "server_name = echo_xtcp\n"
+            "sk = " SK "\n"
+            "bind_port = %d\n"
+            "fallback_port = %d\n",
+            base_port, base_port + 3, base_port + 2);
+    fclose(fp);
+    return 0;
+}
+
+static void finish(struct bench_xtcp *bx, int failed, const char *why)
+{
+    if (failed && !bx->failed && why && !bx->quiet)
+        fprintf(stderr, "%s\n", why);
+    bx->failed |= failed;
+    bx->done = 1;
+    event_base_loopbreak(bx->base);
+}
+
+static void user_close(struct user_conn *uc)
+{
+    bufferevent_free(uc->bev);
+    free(uc);
+}
+
+static void user_fill(struct user_conn *uc)
+{
+    struct evbuffer *out = bufferevent_get_output(uc->bev);
+    while (uc->to_send > 0 && evbuffer_get_length(out) < 4 * BULK_CHUNK) {
+        size_t n = uc->to_send < BULK_CHUNK ? uc->to_send : BULK_CHUNK;
+        bufferevent_write(uc->bev, uc->bx->payload, n);
+        uc->to_send -= n;
+    }
+}
+
+static void user_request(struct user_conn *uc)
+{
+    uc->sent_at = bench_now_usec();
+    uc->to_recv = REQ_SIZE;
+    bufferevent_write(uc->bev, uc->bx->payload, REQ_SIZE);
+}
+
+static void user_write_cb(struct bufferevent *bev, void *ctx)
+{
+    struct user_conn *uc = ctx;
+    if (uc->greeted && uc->bx->phase == PH_BULK)
+        user_fill(uc);
+}
+
+static void user_read_cb(struct bufferevent *bev, void *ctx)
+{
+    struct user_conn *uc  = ctx;
+    struct bench_xtcp *bx = uc->bx;
+    struct evbuffer *in   = bufferevent_get_input(bev);
+    size_t len            = evbuffer_get_length(in);
+
+    if (!uc->greeted) {
+        uc->greeted = 1;
+        evbuffer_drain(in, 1);
+        len--;
+        if (bx->phase == PH_OPEN) {
+            hist_add(&bx->hist, bench_now_usec() - uc->sent_at);
+            user_close(uc);
+            finish(bx, 0, NULL);
+            return;
+        }
+        if (bx->phase == PH_RR)
+            user_request(uc);
+        else
+            user_fill(uc);
+    }
+
+    evbuffer_drain(in, len);
+    uc->to_recv = len < uc->to_recv ? uc->to_recv - len : 0;
+    if (uc->to_recv > 0 || len == 0)
+        return;
+
+    if (bx->phase == PH_RR) {
+        hist_add(&bx->hist, bench_now_usec() - uc->sent_at);
+        if (--uc->left > 0) {
+            user_request(uc);
+            return;
+        }
+    }
+    user_close(uc);
+    finish(bx, 0, NULL);
+}
+
+static void user_event_cb(struct bufferevent *bev, short what, void *ctx)
+{
+    struct user_conn *uc = ctx;
+    if (!(what & (BEV_EVENT_EOF | BEV_EVENT_ERROR)))
+        return;
+
+    struct bench_xtcp *bx = uc->bx;
+    user_close(uc);
+    finish(bx, 1, "tunnel closed before its echo came back");
+}
+
+static void timeout_cb(evutil_socket_t fd, short what, void *arg)
+{
+    finish(arg, 1, "phase timed out");
+}
+
+// one user to port, 0 when its phase completed
+static int run_user(struct bench_xtcp *bx, int port, enum xtcp_phase phase, int timeout_sec)
+{
+    struct user_conn *uc = calloc(1, sizeof(struct user_conn));
+    assert(uc);
+    uc->bx      = bx;
+    uc->left    = bx->requests;
+    uc->sent_at = bench_now_usec();
+    if (phase == PH_BULK) {
+        uc->to_send = bx->bulk;
+        uc->to_recv = bx->bulk;
+    }
+    bx->phase                  = phase;
+    bx->done                   = 0;
+    bx->failed                 = 0;
+    bx->remote.sin_family      = AF_INET;
+    bx->remote.sin_port        = htons(port);
+    bx->remote.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    uc->bev = bufferevent_socket_new(bx->base, -1, BEV_OPT_CLOSE_ON_FREE);
+    assert(uc->bev);
+    bufferevent_setcb(uc->bev, user_read_cb, user_write_cb, user_event_cb, uc);
+    bufferevent_enable(uc->bev, EV_READ | EV_WRITE);
+    if (bufferevent_socket_connect(uc->bev, (struct sockaddr *) &bx->remote, sizeof(bx->remote))) {
+        user_close(uc);
+        return -1;
+    }
+
+    struct timeval limit = {timeout_sec, 0};
+    struct event *ev     = evtimer_new(bx->base, timeout_cb, bx);
+    event_add(ev, &limit);
+    while (!bx->done)
+        event_base_loop(bx->base, EVLOOP_ONCE);
+    event_free(ev);
+    return bx->failed ? -1 : 0;
+}
+
+static int wait_ready(struct bench_xtcp *bx, int port)
+{
+    int i, rc = -1;
+    bx->quiet = 1;
+    for (i = 0; i < READY_SEC * 5 && rc; i++) {
+        rc = run_user(bx, port, PH_OPEN, 5);
+        if (rc)
+            usleep(200 * 1000);
+    }
+    bx->quiet = 0;
+    return rc;
+}
+
+static int run_way(struct bench_xtcp *bx, int port, int opens, struct result *r)
+{
+    int i;
+    memset(&bx->hist, 0, sizeof(bx->hist));
+    for (i = 0; i < opens; i++)
+        if (run_user(bx, port, PH_OPEN, PHASE_TIMEOUT_SEC))
+            return -1;
+    r->open = bx->hist;
+
+    memset(&bx->hist, 0, sizeof(bx->hist));
+    if (run_user(bx, port, PH_RR, PHASE_TIMEOUT_SEC))
+        return -1;
+    r->rr = bx->hist;
+
+    uint64_t from = bench_now_usec();
+    if (run_user(bx, port, PH_BULK, PHASE_TIMEOUT_SEC))
+        return -1;
+    r->bulk_mbs = (bx->bulk >> 20) / ((bench_now_usec() - from) / 1e6);
+    return 0;
+}
+
+static double ms(uint64_t us)
+{
+    return us / 1000.0;
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr,
+            "usage: %s -x path/to/xfrpc [-n requests] [-b bulk_mb] [-c opens]\n"
+            "       [-r relay_mbs] [-p base_port]\n",
+            prog);
+    exit(2);
+}
+
+int main(int argc, char **argv)
+{
+    const char *xfrpc = NULL;
+    int requests = 1000, bulk_mb = 64, opens = 20, base_port = 29100, opt;
+    double relay_mbs = 0;
+    while ((opt = getopt(argc, argv, "x:n:b:c:r:p:")) != -1) {
+        switch (opt) {
+            case 'x':
+                xfrpc = optarg;
+                break;
+            case 'n':
+                requests = atoi(optarg);
+                break;
+            case 'b':
+                bulk_mb = atoi(optarg);
+                break;
+            case 'c':
+                opens = atoi(optarg);
+                break;
+            case 'r':
+                relay_mbs = atof(optarg);
+                break;
+            case 'p':
+                base_port = atoi(optarg);
+                break;
+            default:
+                usage(argv[0]);
+        }
+    }
+    if (!xfrpc || requests <= 0 || bulk_mb <= 0 || opens <= 0 || relay_mbs < 0)
+        usage(argv[0]);
+    signal(SIGPIPE, SIG_IGN);
+
+    char proxy_ini[64], visitor_ini[64];
+    snprintf(proxy_ini, sizeof(proxy_ini), "/tmp/xfrpc_bench_xtcp_%d.ini", (int) getpid());
+    snprintf(visitor_ini, sizeof(visitor_ini), "/tmp/xfrpc_bench_xtcp_v_%d.ini", (int) getpid());
+    if (write_inis(proxy_ini, visitor_ini, base_port)) {
+        perror("ini");
+        return 1;
+    }
+
+    pid_t services = fork();
+    if (services == 0)
+        run_services(base_port, (size_t) (relay_mbs * (1 << 20)));
+
+    struct bench_xtcp *bx = calloc(1, sizeof(struct bench_xtcp));
+    assert(bx);
+    bx->requests = requests;
+    bx->bulk     = (size_t) bulk_mb << 20;
+    bx->base     = event_base_new();
+    assert(bx->base);
+
+    struct result results[WAYS];
+    memset(results, 0, sizeof(results));
+    int failed = 0, way;
+    pid_t proxy   = spawn_xfrpc(xfrpc, proxy_ini, NULL);
+    pid_t visitor = spawn_xfrpc(xfrpc, visitor_ini, NULL);
+    if (wait_ready(bx, base_port + 2) || wait_ready(bx, base_port + 3)) {
+        fprintf(stderr, "no tunnel came up in %d seconds\n", READY_SEC);
+        failed = 1;
+    }
+
+    for (way = 0; way < WAYS && !failed; way++) {
+        int port = way == WAY_RELAY ? base_port + 2 : base_port + 3;
+        if (way == WAY_FALLBACK) {
+            kill(services, SIGUSR1);
+            usleep(100 * 1000);
+        }
+        if (run_way(bx, port, opens, &results[way])) {
+            fprintf(stderr, "%s: failed\n", way_names[way]);
+            failed = 1;
+        }
+    }
+
+    stop_xfrpc(visitor);
+    stop_xfrpc(proxy);
+    kill(services, SIGTERM);
+    waitpid(services, NULL, 0);
+    unlink(proxy_ini);
+    unlink(visitor_ini);
+    if (failed)
+        return 1;
+
+    printf("loopback, requests of %d bytes, %d MB echoed, relay cap ", REQ_SIZE, bulk_mb);
+    if (relay_mbs > 0)
+        printf("%.1f MB/s\n", relay_mbs);
+    else
+        printf("none\n");
+    printf("%9s %24s %24s %9s\n", "way", "open p50/p99/max ms", "rtt p50/p99/max ms",
+           "bulk MB/s");
+    for (way = 0; way < WAYS; way++) {
+        struct result *r = &results[way];
+        printf("%9s %7.1f/%7.1f/%8.1f %7.2f/%7.2f/%8.2f %9.2f\n", way_names[way],
+               ms(hist_percentile(&r->open, 50)), ms(hist_percentile(&r->open, 99)),
+               ms(r->open.max_us), ms(hist_percentile(&r->rr, 50)),
+               ms(hist_percentile(&r->rr, 99)), ms(r->rr.max_us), r->bulk_mbs);
+    }
+    return 0;
+}
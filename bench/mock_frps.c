@@ -0,0 +1,955 @@
+/* vim: set et ts=4 sts=4 sw=4 : */
+/********************************************************************\
+ * This program is free software; you can redistribute it and/or    *
+ * modify it under the terms of the GNU General Public License as   *
+ * published by the Free Software Foundation; either version 2 of   *
+ * the License, or (at your option) any later version.              *
+ *                                                                  *
+ * This program is distributed in the hope that it will be useful,  *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of   *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the    *
+ * GNU General Public License for more details.                     *
+ *                                                                  *
+ * You should have received a copy of the GNU General Public License*
+ * along with this program; if not, contact:                        *
+ *                                                                  *
+ * Free Software Foundation           Voice:  +1-617-542-5942       *
+ * 59 Temple Place - Suite 330        Fax:    +1-617-542-2652       *
+ * Boston, MA  02111-1307,  USA       gnu@gnu.org                   *
+ *                                                                  *
+\********************************************************************/
+
+/** @file mock_frps.c
+    @brief frps 0.10 stand-in for benchmarks
+*/
+
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <assert.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+
+#include <json-c/json.h>
+
+#include <event2/event.h>
+#include <event2/buffer.h>
+#include <event2/bufferevent.h>
+#include <event2/listener.h>
+#include <event2/util.h>
+
+#include "mock_frps.h"
+
+#define MSG_HEAD_LEN 5   // type char and 32 bits big endian length
+#define SPLICE_HIGH (256 * 1024)
+#define HOLE_TTL_USEC (30 * 1000000ULL)
+
+#ifndef IPPROTO_MPTCP
+#define IPPROTO_MPTCP 262
+#endif
+
+static int use_mptcp;
+static struct in_addr bind_addr;   // 0 for 127.0.0.1
+
+struct conn_node {
+    struct bufferevent *bev;   // NULL once closed while queued
+    const char *proxy_name;    // user connections and sids only
+    char *sid;                 // xtcp: NatHoleSid to send on a work connection
+    struct conn_node *next;
+};
+
+struct conn_queue {
+    struct conn_node *head;
+    struct conn_node *tail;
+};
+
+// one logged in xfrpc, found again by the run_id it was given
+struct mock_ctl {
+    struct mock_frps *frps;
+    struct bufferevent *bev;   // NULL while the client is away
+    char run_id[32];
+    struct event *ev_pong;         // delayed pong, created on first use
+    struct event *ev_resume;       // reading paused by proxy_delay_usec
+    struct conn_queue users;       // waiting for a work connection
+    struct conn_queue work_pool;   // NewWorkConn received, not used yet
+    struct mock_ctl *next;
+};
+
+struct mock_proxy {
+    char *name;
+    int remote_port;
+    char *sk;   // xtcp only, no remote port then
+    struct mock_ctl *ctl;
+    struct mock_frps *frps;
+    struct evconnlistener *listener;
+    struct mock_proxy *next;
+};
+
+// xtcp rendezvous between a NatHoleVisitor and its NatHoleClient
+struct mock_hole {
+    char sid[32];
+    const char *proxy_name;
+    struct sockaddr_in visitor;
+    uint64_t created;   // usec
+    struct mock_hole *next;
+};
+
+struct mock_frps {
+    struct event_base *base;
+    struct in_addr addr;   // all listeners bind it
+    struct evconnlistener *listener;
+    struct mock_ctl *ctls;
+    int next_ctl;
+    struct mock_proxy *proxies;
+    mock_frps_proxy_cb proxy_cb;
+    void *proxy_cb_arg;
+    struct mock_frps_stats stats;
+
+    uint32_t pong_delay_usec;
+    uint32_t proxy_delay_usec;
+
+    int udp_fd;   // -1 without xtcp
+    int udp_port;
+    struct event *ev_udp;
+    struct mock_hole *holes;
+    int next_sid;
+    int nat_block;
+    struct ev_token_bucket_cfg *relay_rate;
+    struct splice *splices;   // live tunnels, freed with the mock
+};
+
+// one spliced pair, each side's ctx points to it
+struct splice {
+    struct bufferevent *a;
+    struct bufferevent *b;
+    struct mock_frps *frps;
+    struct splice *next;
+    struct splice **pprev;
+};
+
+static uint64_t bench_mock_now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void queue_push(struct conn_queue *q, struct conn_node *n)
+{
+    n->next = NULL;
+    if (q->tail)
+        q->tail->next = n;
+    else
+        q->head = n;
+    q->tail = n;
+}
+
+// first node still connected, closed ones are dropped on the way
+static struct conn_node *queue_pop(struct conn_queue *q)
+{
+    while (q->head) {
+        struct conn_node *n = q->head;
+        q->head             = n->next;
+        if (!q->head)
+            q->tail = NULL;
+        if (n->bev || n->sid)
+            return n;
+        free(n);
+    }
+    return NULL;
+}
+
+static void send_msg(struct bufferevent *bev, char type, const char *json)
+{
+    uint32_t len = htonl(strlen(json));
+    bufferevent_write(bev, &type, 1);
+    bufferevent_write(bev, &len, sizeof(len));
+    bufferevent_write(bev, json, strlen(json));
+}
+
+// return 1 and a malloced json body when a whole message is buffered
+static int read_msg(struct evbuffer *in, char *type, char **json)
+{
+    unsigned char head[MSG_HEAD_LEN];
+    if (evbuffer_copyout(in, head, MSG_HEAD_LEN) < MSG_HEAD_LEN)
+        return 0;
+
+    uint32_t len;
+    memcpy(&len, head + 1, sizeof(len));
+    len = ntohl(len);
+    if (evbuffer_get_length(in) < MSG_HEAD_LEN + len)
+        return 0;
+
+    *type = head[0];
+    *json = calloc(1, len + 1);
+    assert(*json);
+    evbuffer_drain(in, MSG_HEAD_LEN);
+    evbuffer_remove(in, *json, len);
+    return 1;
+}
+
+static void splice_read_cb(struct bufferevent *bev, void *ctx);
+static void splice_event_cb(struct bufferevent *bev, short what, void *ctx);
+
+static void splice_drained_cb(struct bufferevent *bev, void *ctx)
+{
+    struct splice *sp           = ctx;
+    struct bufferevent *partner = bev == sp->a ? sp->b : sp->a;
+    bufferevent_setcb(bev, splice_read_cb, NULL, splice_event_cb, sp);
+    bufferevent_setwatermark(bev, EV_WRITE, 0, 0);
+    if (partner)
+        bufferevent_enable(partner, EV_READ);
+}
+
+static void splice_read_cb(struct bufferevent *bev, void *ctx)
+{
+    struct splice *sp           = ctx;
+    struct bufferevent *partner = bev == sp->a ? sp->b : sp->a;
+    if (!partner) {
+        struct evbuffer *in = bufferevent_get_input(bev);
+        evbuffer_drain(in, evbuffer_get_length(in));
+        return;
+    }
+
+    struct evbuffer *dst = bufferevent_get_output(partner);
+    evbuffer_add_buffer(dst, bufferevent_get_input(bev));
+    if (evbuffer_get_length(dst) >= SPLICE_HIGH) {
+        bufferevent_setcb(partner, splice_read_cb, splice_drained_cb, splice_event_cb, sp);
+        bufferevent_setwatermark(partner, EV_WRITE, SPLICE_HIGH / 2, SPLICE_HIGH);
+        bufferevent_disable(bev, EV_READ);
+    }
+}
+
+static void splice_done(struct splice *sp)
+{
+    if (sp->next)
+        sp->next->pprev = sp->pprev;
+    *sp->pprev = sp->next;
+    sp->frps->stats.closed++;
+    free(sp);
+}
+
+static void splice_close_on_drain_cb(struct bufferevent *bev, void *ctx)
+{
+    struct splice *sp = ctx;
+    if (evbuffer_get_length(bufferevent_get_output(bev)))
+        return;
+
+    bufferevent_free(bev);
+    splice_done(sp);
+}
+
+static void splice_event_cb(struct bufferevent *bev, short what, void *ctx)
+{
+    struct splice *sp = ctx;
+    if (!(what & (BEV_EVENT_EOF | BEV_EVENT_ERROR)))
+        return;
+
+    struct bufferevent *partner = bev == sp->a ? sp->b : sp->a;
+    splice_read_cb(bev, sp);
+    bufferevent_free(bev);
+
+    if (partner && evbuffer_get_length(bufferevent_get_output(partner))) {
+        sp->a = partner;
+        sp->b = NULL;
+        bufferevent_setcb(partner, NULL, splice_close_on_drain_cb, splice_event_cb, sp);
+        bufferevent_disable(partner, EV_READ);
+        return;
+    }
+
+    if (partner)
+        bufferevent_free(partner);
+    splice_done(sp);
+}
+
+static void start_tunnel(struct mock_frps *frps, struct conn_node *user, struct conn_node *work)
+{
+    char json[256];
+    snprintf(json, sizeof(json), "{\"proxy_name\": \"%s\"}", user->proxy_name);
+    send_msg(work->bev, 's', json);
+    frps->stats.tunnels++;
+
+    struct splice *sp = calloc(1, sizeof(struct splice));
+    assert(sp);
+    sp->a    = user->bev;
+    sp->b    = work->bev;
+    sp->frps = frps;
+    sp->next = frps->splices;
+    if (sp->next)
+        sp->next->pprev = &sp->next;
+    sp->pprev     = &frps->splices;
+    frps->splices = sp;
+    if (frps->relay_rate)
+        bufferevent_set_rate_limit(sp->a, frps->relay_rate);
+    bufferevent_setcb(sp->a, splice_read_cb, NULL, splice_event_cb, sp);
+    bufferevent_setcb(sp->b, splice_read_cb, NULL, splice_event_cb, sp);
+    bufferevent_enable(sp->a, EV_READ | EV_WRITE);
+    bufferevent_enable(sp->b, EV_READ | EV_WRITE);
+    free(user);
+    free(work);
+
+    // bytes sent right after NewWorkConn or before pairing
+    splice_read_cb(sp->a, sp);
+    splice_read_cb(sp->b, sp);
+}
+
+static void close_flushed_cb(struct bufferevent *bev, void *ctx)
+{
+    if (!evbuffer_get_length(bufferevent_get_output(bev)))
+        bufferevent_free(bev);
+}
+
+static void close_event_cb(struct bufferevent *bev, short what, void *ctx)
+{
+    if (what & (BEV_EVENT_EOF | BEV_EVENT_ERROR))
+        bufferevent_free(bev);
+}
+
+// like frps, a work connection only carries the sid of an xtcp visitor and is closed
+static void send_sid(struct conn_node *req, struct conn_node *work)
+{
+    char json[256];
+    snprintf(json, sizeof(json), "{\"proxy_name\": \"%s\"}", req->proxy_name);
+    send_msg(work->bev, 's', json);
+    snprintf(json, sizeof(json), "{\"sid\": \"%s\"}", req->sid);
+    send_msg(work->bev, '5', json);
+    bufferevent_setcb(work->bev, NULL, close_flushed_cb, close_event_cb, NULL);
+    bufferevent_enable(work->bev, EV_WRITE);
+    free(req->sid);
+    free(req);
+    free(work);
+}
+
+static void pair_work(struct mock_frps *frps, struct conn_node *req, struct conn_node *work)
+{
+    if (req->sid)
+        send_sid(req, work);
+    else
+        start_tunnel(frps, req, work);
+}
+
+static void req_work_conn(struct mock_ctl *ctl)
+{
+    if (ctl->bev)
+        send_msg(ctl->bev, 'r', "{}");
+}
+
+// a queued connection closed before it was paired
+static void queued_event_cb(struct bufferevent *bev, short what, void *ctx)
+{
+    struct conn_node *n = ctx;
+    if (what & (BEV_EVENT_EOF | BEV_EVENT_ERROR)) {
+        bufferevent_free(bev);
+        n->bev = NULL;
+    }
+}
+
+// user connection or xtcp sid for a proxy of ctl
+static void need_work_conn(struct mock_ctl *ctl, struct conn_node *req)
+{
+    // like frps, take a pooled work connection and ask for a new one
+    struct conn_node *work = queue_pop(&ctl->work_pool);
+    req_work_conn(ctl);
+    if (work) {
+        pair_work(ctl->frps, req, work);
+        return;
+    }
+
+    // without read cb, early bytes wait in the input buffer for the tunnel
+    if (req->bev) {
+        bufferevent_setcb(req->bev, NULL, NULL, queued_event_cb, req);
+        bufferevent_enable(req->bev, EV_READ);
+    }
+    queue_push(&ctl->users, req);
+}
+
+static void user_accept_cb(struct evconnlistener *listener, evutil_socket_t fd,
+                           struct sockaddr *addr, int socklen, void *ctx)
+{
+    struct mock_proxy *mp  = ctx;
+    struct mock_frps *frps = mp->frps;
+    frps->stats.user_conns++;
+
+    struct conn_node *user = calloc(1, sizeof(struct conn_node));
+    assert(user);
+    user->bev = bufferevent_socket_new(frps->base, fd, BEV_OPT_CLOSE_ON_FREE);
+    assert(user->bev);
+    user->proxy_name = mp->name;
+    need_work_conn(mp->ctl, user);
+}
+
+static struct mock_proxy *find_proxy(struct mock_frps *frps, const char *name)
+{
+    struct mock_proxy *mp;
+    for (mp = frps->proxies; mp; mp = mp->next)
+        if (strcmp(mp->name, name) == 0)
+            return mp;
+    return NULL;
+}
+
+static struct mock_proxy *add_proxy(struct mock_ctl *ctl, const char *name, int remote_port,
+                                    const char *sk)
+{
+    struct mock_frps *frps = ctl->frps;
+    struct mock_proxy *mp  = find_proxy(frps, name);
+    if (mp) {
+        mp->ctl = ctl;
+        return mp;
+    }
+
+    mp = calloc(1, sizeof(struct mock_proxy));
+    assert(mp);
+    mp->name        = strdup(name);
+    mp->remote_port = remote_port;
+    mp->ctl         = ctl;
+    mp->frps        = frps;
+    mp->next        = frps->proxies;
+    frps->proxies   = mp;
+    if (sk) {
+        mp->sk = strdup(sk);
+        return mp;
+    }
+
+    struct sockaddr_in sin;
+    memset(&sin, 0, sizeof(sin));
+    sin.sin_family      = AF_INET;
+    sin.sin_port        = htons(remote_port);
+    sin.sin_addr        = frps->addr;
+    mp->listener        = evconnlistener_new_bind(frps->base, user_accept_cb, mp,
+                                                  LEV_OPT_CLOSE_ON_FREE | LEV_OPT_REUSEABLE, 1024,
+                                                  (struct sockaddr *) &sin, sizeof(sin));
+    if (!mp->listener) {
+        fprintf(stderr, "mock frps: listen on remote port %d failed\n", remote_port);
+        exit(1);
+    }
+    return mp;
+}
+
+static const char *json_str(struct json_object *j, const char *key)
+{
+    struct json_object *v = NULL;
+    return json_object_object_get_ex(j, key, &v) ? json_object_get_string(v) : NULL;
+}
+
+static void handle_new_proxy(struct mock_ctl *ctl, const char *json)
+{
+    struct json_object *j      = json_tokener_parse(json);
+    struct json_object *j_port = NULL;
+    const char *name           = j ? json_str(j, "proxy_name") : NULL;
+    if (!name) {
+        fprintf(stderr, "mock frps: bad NewProxy %s\n", json);
+        exit(1);
+    }
+    int remote_port = 0;
+    if (json_object_object_get_ex(j, "remote_port", &j_port))
+        remote_port = json_object_get_int(j_port);
+
+    const char *type = json_str(j, "proxy_type");
+    const char *sk   = json_str(j, "sk");
+    int xtcp         = type && strcmp(type, "xtcp") == 0;
+    struct mock_proxy *mp = add_proxy(ctl, name, remote_port, xtcp ? (sk ? sk : "") : NULL);
+
+    char resp[512];
+    snprintf(resp, sizeof(resp),
+             "{\"run_id\": \"%s\", \"remote_port\": %d, \"proxy_name\": \"%s\", "
+             "\"error\": \"\"}",
+             ctl->run_id, remote_port, name);
+    send_msg(ctl->bev, '2', resp);
+    json_object_put(j);
+
+    if (ctl->frps->proxy_cb && !xtcp)
+        ctl->frps->proxy_cb(mp->name, mp->remote_port, ctl->frps->proxy_cb_arg);
+}
+
+static void pong_cb(evutil_socket_t fd, short what, void *arg)
+{
+    struct mock_ctl *ctl = arg;
+    if (ctl->bev)
+        send_msg(ctl->bev, '4', "{}");
+}
+
+// a ping arriving while one pong is held back shares it
+static void delay_pong(struct mock_ctl *ctl)
+{
+    if (!ctl->ev_pong) {
+        ctl->ev_pong = evtimer_new(ctl->frps->base, pong_cb, ctl);
+        assert(ctl->ev_pong);
+    }
+    if (evtimer_pending(ctl->ev_pong, NULL))
+        return;
+
+    struct timeval tv = {ctl->frps->pong_delay_usec / 1000000,
+                         ctl->frps->pong_delay_usec % 1000000};
+    evtimer_add(ctl->ev_pong, &tv);
+}
+
+static void ctl_read_cb(struct bufferevent *bev, void *ctx);
+
+static void resume_cb(evutil_socket_t fd, short what, void *arg)
+{
+    struct mock_ctl *ctl = arg;
+    if (!ctl->bev)
+        return;
+    bufferevent_enable(ctl->bev, EV_READ);
+    ctl_read_cb(ctl->bev, ctl);
+}
+
+// frps serves the messages of one control in order, one at a time
+static void pause_ctl(struct mock_ctl *ctl)
+{
+    if (!ctl->ev_resume) {
+        ctl->ev_resume = evtimer_new(ctl->frps->base, resume_cb, ctl);
+        assert(ctl->ev_resume);
+    }
+    struct timeval tv = {ctl->frps->proxy_delay_usec / 1000000,
+                         ctl->frps->proxy_delay_usec % 1000000};
+    bufferevent_disable(ctl->bev, EV_READ);
+    evtimer_add(ctl->ev_resume, &tv);
+}
+
+static void ctl_read_cb(struct bufferevent *bev, void *ctx)
+{
+    struct mock_ctl *ctl = ctx;
+    struct evbuffer *in  = bufferevent_get_input(bev);
+    char type;
+    char *json = NULL;
+
+    while (read_msg(in, &type, &json)) {
+        switch (type) {
+            case 'p':
+                handle_new_proxy(ctl, json);
+                break;
+            case 'h':
+                if (ctl->frps->pong_delay_usec)
+                    delay_pong(ctl);
+                else
+                    send_msg(bev, '4', "{}");
+                break;
+            default:
+                break;
+        }
+        free(json);
+        if (type == 'p' && ctl->frps->proxy_delay_usec) {
+            pause_ctl(ctl);
+            return;
+        }
+    }
+}
+
+static void ctl_event_cb(struct bufferevent *bev, short what, void *ctx)
+{
+    struct mock_ctl *ctl = ctx;
+    if (what & (BEV_EVENT_EOF | BEV_EVENT_ERROR)) {
+        bufferevent_free(bev);
+        if (ctl->bev == bev)
+            ctl->bev = NULL;
+    }
+}
+
+static struct mock_ctl *find_ctl(struct mock_frps *frps, const char *run_id)
+{
+    struct mock_ctl *ctl;
+    for (ctl = frps->ctls; ctl && run_id; ctl = ctl->next)
+        if (strcmp(ctl->run_id, run_id) == 0)
+            return ctl;
+    return NULL;
+}
+
+// a known run_id is a reconnect, anything else a new client
+static void handle_login(struct mock_frps *frps, struct bufferevent *bev, const char *json)
+{
+    struct json_object *j = json_tokener_parse(json);
+    struct mock_ctl *ctl  = find_ctl(frps, j ? json_str(j, "run_id") : NULL);
+    if (j)
+        json_object_put(j);
+
+    if (!ctl) {
+        ctl = calloc(1, sizeof(struct mock_ctl));
+        assert(ctl);
+        ctl->frps = frps;
+        // the first client keeps the run_id earlier benchmarks saw
+        if (frps->next_ctl++)
+            snprintf(ctl->run_id, sizeof(ctl->run_id), "bench%d", frps->next_ctl);
+        else
+            snprintf(ctl->run_id, sizeof(ctl->run_id), "bench");
+        ctl->next  = frps->ctls;
+        frps->ctls = ctl;
+    }
+
+    frps->stats.logins++;
+    if (ctl->bev)
+        bufferevent_free(ctl->bev);
+    ctl->bev = bev;
+    bufferevent_setcb(bev, ctl_read_cb, NULL, ctl_event_cb, ctl);
+
+    char resp[256];
+    snprintf(resp, sizeof(resp),
+             "{\"version\": \"0.10.0\", \"run_id\": \"%s\", \"server_udp_port\": %d, "
+             "\"error\": \"\"}",
+             ctl->run_id, frps->udp_port);
+    send_msg(bev, '1', resp);
+
+    // one for the pool, one per user whose request was lost with the old control
+    struct conn_node *n;
+    req_work_conn(ctl);
+    for (n = ctl->users.head; n; n = n->next)
+        if (n->bev || n->sid)
+            req_work_conn(ctl);
+    ctl_read_cb(bev, ctl);
+}
+
+// the first message tells a control connection from a work connection
+static void first_msg_cb(struct bufferevent *bev, void *ctx)
+{
+    struct mock_frps *frps = ctx;
+    char type;
+    char *json = NULL;
+    if (!read_msg(bufferevent_get_input(bev), &type, &json))
+        return;
+
+    if (type == 'o') {
+        handle_login(frps, bev, json);
+        free(json);
+        return;
+    }
+
+    struct json_object *j = type == 'w' ? json_tokener_parse(json) : NULL;
+    struct mock_ctl *ctl  = find_ctl(frps, j ? json_str(j, "run_id") : NULL);
+    if (j)
+        json_object_put(j);
+    free(json);
+    if (!ctl) {
+        bufferevent_free(bev);
+        return;
+    }
+
+    frps->stats.work_conns++;
+    struct conn_node *work = calloc(1, sizeof(struct conn_node));
+    assert(work);
+    work->bev             = bev;
+    struct conn_node *req = queue_pop(&ctl->users);
+    if (req) {
+        pair_work(frps, req, work);
+        return;
+    }
+
+    bufferevent_setcb(bev, NULL, NULL, queued_event_cb, work);
+    queue_push(&ctl->work_pool, work);
+}
+
+static void first_event_cb(struct bufferevent *bev, short what, void *ctx)
+{
+    if (what & (BEV_EVENT_EOF | BEV_EVENT_ERROR))
+        bufferevent_free(bev);
+}
+
+static void frps_accept_cb(struct evconnlistener *listener, evutil_socket_t fd,
+                           struct sockaddr *addr, int socklen, void *ctx)
+{
+    struct mock_frps *frps  = ctx;
+    struct bufferevent *bev = bufferevent_socket_new(frps->base, fd, BEV_OPT_CLOSE_ON_FREE);
+    assert(bev);
+    bufferevent_setcb(bev, first_msg_cb, NULL, first_event_cb, frps);
+    bufferevent_enable(bev, EV_READ | EV_WRITE);
+}
+
+void mock_frps_use_mptcp(int on)
+{
+    use_mptcp = on;
+}
+
+int mock_frps_bind_addr(const char *ip)
+{
+    return inet_pton(AF_INET, ip, &bind_addr) == 1 ? 0 : -1;
+}
+
+static struct evconnlistener *mptcp_listen(struct event_base *base, struct mock_frps *frps,
+                                           const struct sockaddr_in *sin)
+{
+    int fd = socket(AF_INET, SOCK_STREAM, IPPROTO_MPTCP), on = 1;
+    if (fd < 0) {
+        perror("mock frps: multipath TCP socket");
+        return NULL;
+    }
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+    if (bind(fd, (const struct sockaddr *) sin, sizeof(*sin)) || listen(fd, 1024)) {
+        close(fd);
+        return NULL;
+    }
+    evutil_make_socket_nonblocking(fd);
+    return evconnlistener_new(base, frps_accept_cb, frps, LEV_OPT_CLOSE_ON_FREE, 0, fd);
+}
+
+struct mock_frps *mock_frps_new(struct event_base *base, int port, mock_frps_proxy_cb cb,
+                                void *arg)
+{
+    struct mock_frps *frps = calloc(1, sizeof(struct mock_frps));
+    assert(frps);
+    frps->base         = base;
+    frps->proxy_cb     = cb;
+    frps->proxy_cb_arg = arg;
+    frps->udp_fd       = -1;
+    frps->addr         = bind_addr;
+    if (!frps->addr.s_addr)
+        frps->addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    struct sockaddr_in sin;
+    memset(&sin, 0, sizeof(sin));
+    sin.sin_family      = AF_INET;
+    sin.sin_port        = htons(port);
+    sin.sin_addr        = frps->addr;
+    if (use_mptcp)
+        frps->listener = mptcp_listen(base, frps, &sin);
+    else
+        frps->listener = evconnlistener_new_bind(base, frps_accept_cb, frps,
+                                                 LEV_OPT_CLOSE_ON_FREE | LEV_OPT_REUSEABLE, 1024,
+                                                 (struct sockaddr *) &sin, sizeof(sin));
+    if (!frps->listener) {
+        free(frps);
+        return NULL;
+    }
+    return frps;
+}
+
+static void send_udp_msg(struct mock_frps *frps, const struct sockaddr_in *to, char type,
+                         const char *json)
+{
+    char buf[1024];
+    uint32_t len = strlen(json);
+    if (len + MSG_HEAD_LEN > sizeof(buf))
+        return;
+    buf[0]       = type;
+    uint32_t nlen = htonl(len);
+    memcpy(buf + 1, &nlen, sizeof(nlen));
+    memcpy(buf + MSG_HEAD_LEN, json, len);
+    sendto(frps->udp_fd, buf, MSG_HEAD_LEN + len, 0, (const struct sockaddr *) to, sizeof(*to));
+}
+
+static void addr_json(const struct mock_frps *frps, const struct sockaddr_in *sin, char *buf,
+                      size_t len)
+{
+    char ip[INET_ADDRSTRLEN];
+    inet_ntop(AF_INET, &sin->sin_addr, ip, sizeof(ip));
+    // a port nobody listens on, like the mapping of a symmetric NAT towards someone else
+    snprintf(buf, len, "%s:%d", ip, frps->nat_block ? 9 : ntohs(sin->sin_port));
+}
+
+static void hole_visitor(struct mock_frps *frps, const struct sockaddr_in *from, const char *json)
+{
+    struct json_object *j = json_tokener_parse(json);
+    const char *name      = j ? json_str(j, "proxy_name") : NULL;
+    struct mock_proxy *mp = name ? find_proxy(frps, name) : NULL;
+    // sign_key is md5(sk + timestamp), taken on trust here
+    if (!mp || !mp->sk || !mp->ctl) {
+        char resp[256];
+        snprintf(resp, sizeof(resp), "{\"sid\": \"\", \"error\": \"xtcp proxy [%s] not found\"}",
+                 name ? name : "");
+        send_udp_msg(frps, from, 'm', resp);
+        if (j)
+            json_object_put(j);
+        return;
+    }
+    json_object_put(j);
+
+    uint64_t now = bench_mock_now();
+    struct mock_hole **pp = &frps->holes;
+    while (*pp) {
+        struct mock_hole *h = *pp;
+        if (now - h->created > HOLE_TTL_USEC) {
+            *pp = h->next;
+            free(h);
+            continue;
+        }
+        pp = &h->next;
+    }
+
+    struct mock_hole *h = calloc(1, sizeof(struct mock_hole));
+    assert(h);
+    snprintf(h->sid, sizeof(h->sid), "%d%ld", ++frps->next_sid, (long) (now % 1000000));
+    h->proxy_name = mp->name;
+    h->visitor    = *from;
+    h->created    = now;
+    h->next       = frps->holes;
+    frps->holes   = h;
+    frps->stats.holes++;
+
+    struct conn_node *req = calloc(1, sizeof(struct conn_node));
+    assert(req);
+    req->proxy_name = mp->name;
+    req->sid        = strdup(h->sid);
+    need_work_conn(mp->ctl, req);
+}
+
+static void hole_client(struct mock_frps *frps, const struct sockaddr_in *from, const char *json)
+{
+    struct json_object *j = json_tokener_parse(json);
+    const char *sid       = j ? json_str(j, "sid") : NULL;
+    struct mock_hole *h;
+    for (h = frps->holes; h && sid; h = h->next)
+        if (strcmp(h->sid, sid) == 0)
+            break;
+    if (j)
+        json_object_put(j);
+    if (!h || !sid)
+        return;
+
+    char visitor[32], client[32], resp[256];
+    addr_json(frps, &h->visitor, visitor, sizeof(visitor));
+    addr_json(frps, from, client, sizeof(client));
+    snprintf(resp, sizeof(resp),
+             "{\"sid\": \"%s\", \"visitor_addr\": \"%s\", \"client_addr\": \"%s\", "
+             "\"error\": \"\"}",
+             h->sid, visitor, client);
+    send_udp_msg(frps, &h->visitor, 'm', resp);
+    send_udp_msg(frps, from, 'm', resp);
+}
+
+static void udp_read_cb(evutil_socket_t fd, short what, void *arg)
+{
+    struct mock_frps *frps = arg;
+    char buf[2048];
+    struct sockaddr_in from;
+    socklen_t alen = sizeof(from);
+    ssize_t n      = recvfrom(fd, buf, sizeof(buf) - 1, 0, (struct sockaddr *) &from, &alen);
+    if (n < MSG_HEAD_LEN)
+        return;
+
+    uint32_t len;
+    memcpy(&len, buf + 1, sizeof(len));
+    if (ntohl(len) != (uint32_t)(n - MSG_HEAD_LEN))
+        return;
+    buf[n] = 0;
+    if (buf[0] == 'i')
+        hole_visitor(frps, &from, buf + MSG_HEAD_LEN);
+    else if (buf[0] == 'n')
+        hole_client(frps, &from, buf + MSG_HEAD_LEN);
+}
+
+int mock_frps_listen_udp(struct mock_frps *frps, int port)
+{
+    struct sockaddr_in sin;
+    memset(&sin, 0, sizeof(sin));
+    sin.sin_family      = AF_INET;
+    sin.sin_port        = htons(port);
+    sin.sin_addr        = frps->addr;
+
+    int fd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (fd < 0 || bind(fd, (struct sockaddr *) &sin, sizeof(sin))) {
+        if (fd >= 0)
+            close(fd);
+        return -1;
+    }
+    evutil_make_socket_nonblocking(fd);
+    frps->udp_fd   = fd;
+    frps->udp_port = port;
+    frps->ev_udp   = event_new(frps->base, fd, EV_READ | EV_PERSIST, udp_read_cb, frps);
+    assert(frps->ev_udp);
+    event_add(frps->ev_udp, NULL);
+    return 0;
+}
+
+void mock_frps_set_nat_block(struct mock_frps *frps, int on)
+{
+    frps->nat_block = on;
+}
+
+void mock_frps_set_relay_rate(struct mock_frps *frps, size_t bytes_per_sec)
+{
+    if (frps->relay_rate)
+        ev_token_bucket_cfg_free(frps->relay_rate);
+    frps->relay_rate = NULL;
+    if (bytes_per_sec)
+        frps->relay_rate = ev_token_bucket_cfg_new(bytes_per_sec, bytes_per_sec, bytes_per_sec,
+                                                   bytes_per_sec, NULL);
+}
+
+static void free_queue(struct conn_queue *q)
+{
+    struct conn_node *n;
+    while ((n = queue_pop(q))) {
+        if (n->bev)
+            bufferevent_free(n->bev);
+        free(n->sid);
+        free(n);
+    }
+}
+
+void mock_frps_free(struct mock_frps *frps)
+{
+    if (!frps)
+        return;
+
+    struct mock_proxy *mp = frps->proxies;
+    while (mp) {
+        struct mock_proxy *next = mp->next;
+        if (mp->listener)
+            evconnlistener_free(mp->listener);
+        free(mp->name);
+        free(mp->sk);
+        free(mp);
+        mp = next;
+    }
+    while (frps->ctls) {
+        struct mock_ctl *ctl = frps->ctls;
+        frps->ctls           = ctl->next;
+        free_queue(&ctl->users);
+        free_queue(&ctl->work_pool);
+        if (ctl->bev)
+            bufferevent_free(ctl->bev);
+        if (ctl->ev_pong)
+            event_free(ctl->ev_pong);
+        if (ctl->ev_resume)
+            event_free(ctl->ev_resume);
+        free(ctl);
+    }
+    while (frps->splices) {
+        struct splice *sp = frps->splices;
+        bufferevent_free(sp->a);
+        if (sp->b)
+            bufferevent_free(sp->b);
+        splice_done(sp);
+    }
+    while (frps->holes) {
+        struct mock_hole *h = frps->holes;
+        frps->holes         = h->next;
+        free(h);
+    }
+    if (frps->ev_udp) {
+        event_free(frps->ev_udp);
+        close(frps->udp_fd);
+    }
+    mock_frps_set_relay_rate(frps, 0);
+    evconnlistener_free(frps->listener);
+    free(frps);
+}
+
+void mock_frps_set_pong_delay(struct mock_frps *frps, uint32_t usec)
+{
+    frps->pong_delay_usec = usec;
+}
+
+void mock_frps_set_proxy_delay(struct mock_frps *frps, uint32_t usec)
+{
+    frps->proxy_delay_usec = usec;
+}
+
+void mock_frps_drop_control(struct mock_frps *frps)
+{
+    struct mock_ctl *ctl;
+    for (ctl = frps->ctls; ctl; ctl = ctl->next) {
+        if (!ctl->bev)
+            continue;
+
+        // frps closes pooled work connections with their control
+        bufferevent_free(ctl->bev);
+        ctl->bev = NULL;
+        free_queue(&ctl->work_pool);
+    }
+}
+
+const struct mock_frps_stats *mock_frps_get_stats(const struct mock_frps *frps)
+{
+    return &frps->stats;
+}
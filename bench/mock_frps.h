@@ -0,0 +1,80 @@
+/* vim: set et ts=4 sts=4 sw=4 : */
+/********************************************************************\
+ * This program is free software; you can redistribute it and/or    *
+ * modify it under the terms of the GNU General Public License as   *
+ * published by the Free Software Foundation; either version 2 of   *
+ * the License, or (at your option) any later version.              *
+ *                                                                  *
+ * This program is distributed in the hope that it will be useful,  *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of   *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the    *
+ * GNU General Public License for more details.                     *
+ *                                                                  *
+ * You should have received a copy of the GNU General Public License*
+ * along with this program; if not, contact:                        *
+ *                                                                  *
+ * Free Software Foundation           Voice:  +1-617-542-5942       *
+ * 59 Temple Place - Suite 330        Fax:    +1-617-542-2652       *
+ * Boston, MA  02111-1307,  USA       gnu@gnu.org                   *
+ *                                                                  *
+\********************************************************************/
+
+/** @file mock_frps.h
+    @brief frps 0.10 stand-in for benchmarks
+
+    Speaks just enough of the protocol for a few xfrpc: Login, NewProxy,
+    Ping, ReqWorkConn and StartWorkConn. Users connecting to a proxy
+    remote_port are paired with a work connection of the xfrpc owning it
+    like frps does and bytes are spliced both ways. A login with a run_id
+    handed out before is a reconnect of that xfrpc.
+
+    With a udp port it is also the xtcp rendezvous of later frp versions:
+    NatHoleVisitor, NatHoleSid on a work connection, NatHoleClient and
+    NatHoleResp to both ends.
+*/
+
+#ifndef _MOCK_FRPS_H_
+#define _MOCK_FRPS_H_
+
+#include <stdint.h>
+#include <stddef.h>
+
+struct event_base;
+struct mock_frps;
+
+struct mock_frps_stats {
+    uint64_t logins;
+    uint64_t work_conns;   // NewWorkConn received
+    uint64_t user_conns;   // accepted on proxy remote ports
+    uint64_t tunnels;      // StartWorkConn sent
+    uint64_t closed;       // tunnels both sides gone
+    uint64_t holes;        // xtcp NatHoleVisitor accepted
+};
+
+// called once per NewProxy, the remote port is listening already
+typedef void (*mock_frps_proxy_cb)(const char *proxy_name, int remote_port, void *arg);
+
+// listen with multipath TCP in following mock_frps_new calls
+void mock_frps_use_mptcp(int on);
+// bind following mock_frps_new listeners, remote ports included, to another
+// loopback address so several mocks can serve the same ports; 0 or -1
+int mock_frps_bind_addr(const char *ip);
+struct mock_frps *mock_frps_new(struct event_base *base, int port, mock_frps_proxy_cb cb,
+                                void *arg);
+void mock_frps_free(struct mock_frps *frps);
+// xtcp rendezvous on port, told to clients in LoginResp; 0 or -1
+int mock_frps_listen_udp(struct mock_frps *frps, int port);
+// report unusable peer addresses in NatHoleResp, like symmetric NATs on both ends
+void mock_frps_set_nat_block(struct mock_frps *frps, int on);
+// cap each relayed user connection to bytes_per_sec both ways, 0 no cap
+void mock_frps_set_relay_rate(struct mock_frps *frps, size_t bytes_per_sec);
+// answer heartbeats usec late, like a frps further away
+void mock_frps_set_pong_delay(struct mock_frps *frps, uint32_t usec);
+// spend usec on each NewProxy, holding back later messages of the same
+// control connection like frps serving each control in order
+void mock_frps_set_proxy_delay(struct mock_frps *frps, uint32_t usec);
+// close the control connection like a frps restart, tunnels keep running
+void mock_frps_drop_control(struct mock_frps *frps);
+const struct mock_frps_stats *mock_frps_get_stats(const struct mock_frps *frps);
+
+#endif   //_MOCK_FRPS_H_
@@ -0,0 +1,460 @@
+/* vim: set et ts=4 sts=4 sw=4 : */
+/********************************************************************\
+ * This program is free software; you can redistribute it and/or    *
+ * modify it under the terms of the GNU General Public License as   *
+ * published by the Free Software Foundation; either version 2 of   *
+ * the License, or (at your option) any later version.              *
+ *                                                                  *
+ * This program is distributed in the hope that it will be useful,  *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of   *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the    *
+ * GNU General Public License for more details.                     *
+ *                                                                  *
+ * You should have received a copy of the GNU General Public License*
+ * along with this program; if not, contact:                        *
+ *                                                                  *
+ * Free Software Foundation           Voice:  +1-617-542-5942       *
+ * 59 Temple Place - Suite 330        Fax:    +1-617-542-2652       *
+ * Boston, MA  02111-1307,  USA       gnu@gnu.org                   *
+ *                                                                  *
+\********************************************************************/
+
+
+/** @file capture.c
+    @brief sampled pcapng capture of control and tunnel bytes
+
+    Bytes are framed as IPv4/TCP packets between 10.0.0.1 (xfrpc) and
+    10.0.0.2 (frps) so Wireshark can follow each connection: the control
+    connection uses the port of the frps it dialed, a tunnel uses the
+    remote_port of its proxy and a source port derived from the work
+    connection id. Payload is cut to capture_snaplen but sequence numbers
+    advance by the real length, so truncation shows up as missing segments.
+
+    Relay callbacks only copy into one of two buffers; once per second a
+    timer hands the filled one to a writer thread, which writes it to
+    capture_file while the loop goes on with the other, like the logger.
+    The writer never calls debug or libevent, the loop thread reports for it.
+*/
+
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <assert.h>
+#include <errno.h>
+#include <signal.h>
+#include <syslog.h>
+#include <sys/time.h>
+#include <arpa/inet.h>
+#include <pthread.h>
+
+#include <event2/event.h>
+#include <event2/buffer.h>
+
+#include "capture.h"
+#include "client.h"
+#include "config.h"
+#include "debug.h"
+#include "common.h"
+
+#define PCAPNG_SHB 0x0A0D0D0A
+#define PCAPNG_IDB 0x00000001
+#define PCAPNG_EPB 0x00000006
+#define PCAPNG_BYTE_ORDER_MAGIC 0x1A2B3C4D
+#define LINKTYPE_RAW 101   // packets begin with an IPv4 header
+
+#define PSEUDO_HDR_LEN 40   // ipv4 20 + tcp 20
+#define XFRPC_PSEUDO_ADDR 0x0A000001   // 10.0.0.1
+#define FRPS_PSEUDO_ADDR 0x0A000002    // 10.0.0.2
+
+// records are built in cap_buf[cap_fill] by the loop thread, cap_busy is
+// the buffer the writer thread has, -1 when it is idle
+static unsigned char *cap_buf[2];
+static size_t cap_used[2];
+static int cap_fill;
+static int cap_busy = -1;
+static uint64_t cap_queued;   // record bytes not written yet, atomic
+static int cap_open_errno;    // set by the writer, logged by the loop
+
+static pthread_t cap_writer;
+static pthread_mutex_t cap_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cap_cond   = PTHREAD_COND_INITIALIZER;
+static int cap_writer_state;   // 0 not started, 1 running, -1 failed to start
+static int cap_stop;
+
+static struct event *ev_cap_flush;
+static struct event *ev_cap_signal;
+static FILE *cap_fp;   // writer thread
+static int control_capture;
+static struct capture_stream control_stream;
+static uint16_t control_sport = 40000;
+static struct capture_stats cap_stats;
+
+static void put_u16(unsigned char *p, uint16_t v)
+{
+    v = htons(v);
+    memcpy(p, &v, sizeof(v));
+}
+
+static void put_u32(unsigned char *p, uint32_t v)
+{
+    v = htonl(v);
+    memcpy(p, &v, sizeof(v));
+}
+
+static uint16_t ip_checksum(const unsigned char *hdr, int len)
+{
+    uint32_t sum = 0;
+    int i;
+    for (i = 0; i < len; i += 2)
+        sum += (hdr[i] << 8) | hdr[i + 1];
+    while (sum >> 16)
+        sum = (sum & 0xffff) + (sum >> 16);
+    return (uint16_t) ~sum;
+}
+
+static void fill_pseudo_headers(unsigned char *pkt, const struct capture_stream *cs,
+                                enum capture_dir dir, size_t len)
+{
+    size_t ip_len = len + PSEUDO_HDR_LEN > 65535 ? 65535 : len + PSEUDO_HDR_LEN;
+    int tx        = dir == CAPTURE_TX;
+
+    memset(pkt, 0, PSEUDO_HDR_LEN);
+    pkt[0] = 0x45;   // ipv4, 20 bytes header
+    put_u16(pkt + 2, (uint16_t) ip_len);
+    put_u16(pkt + 6, 0x4000);   // don't fragment
+    pkt[8] = 64;
+    pkt[9] = IPPROTO_TCP;
+    put_u32(pkt + 12, tx ? XFRPC_PSEUDO_ADDR : FRPS_PSEUDO_ADDR);
+    put_u32(pkt + 16, tx ? FRPS_PSEUDO_ADDR : XFRPC_PSEUDO_ADDR);
+    put_u16(pkt + 10, ip_checksum(pkt, 20));
+
+    unsigned char *tcp = pkt + 20;
+    put_u16(tcp, tx ? cs->sport : cs->dport);
+    put_u16(tcp + 2, tx ? cs->dport : cs->sport);
+    put_u32(tcp + 4, cs->seq[dir]);
+    put_u32(tcp + 8, cs->seq[!dir]);
+    tcp[12] = 5 << 4;
+    tcp[13] = 0x18;   // PSH | ACK
+    put_u16(tcp + 14, 65535);
+}
+
+static int stream_enabled(const struct capture_stream *cs)
+{
+    return cs->ps ? cs->ps->capture : control_capture;
+}
+
+static size_t snap_len(size_t len)
+{
+    size_t snaplen = get_common_config()->capture_snaplen;
+    return len < snaplen ? len : snaplen;
+}
+
+// data holds the first snap bytes of len bytes relayed
+static void capture_record(struct capture_stream *cs, enum capture_dir dir, const void *data,
+                           size_t snap, size_t len)
+{
+    struct common_conf *c_conf = get_common_config();
+    size_t cap_len             = PSEUDO_HDR_LEN + snap;
+    size_t pad                 = (4 - cap_len % 4) % 4;
+    size_t rec_len             = 28 + cap_len + pad + 4;
+
+    uint64_t written = __atomic_load_n(&cap_stats.file_bytes, __ATOMIC_RELAXED);
+    uint64_t pending = __atomic_load_n(&cap_queued, __ATOMIC_RELAXED);
+    if (cap_used[cap_fill] + rec_len > CAPTURE_RING_SIZE ||
+        (c_conf->capture_max_size > 0 &&
+         written + pending + rec_len > (uint64_t) c_conf->capture_max_size * 1024)) {
+        cap_stats.dropped++;
+        cs->seq[dir] += len;
+        return;
+    }
+
+    if (!cap_buf[cap_fill]) {
+        cap_buf[cap_fill] = malloc(CAPTURE_RING_SIZE);
+        assert(cap_buf[cap_fill]);
+    }
+
+    // records are multiples of 4 bytes, so w stays aligned
+    unsigned char *rec = cap_buf[cap_fill] + cap_used[cap_fill];
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    uint64_t ts = (uint64_t) tv.tv_sec * 1000000 + tv.tv_usec;
+
+    uint32_t *w = (uint32_t *) rec;
+    w[0]        = PCAPNG_EPB;
+    w[1]        = rec_len;
+    w[2]        = 0;   // interface id
+    w[3]        = (uint32_t) (ts >> 32);
+    w[4]        = (uint32_t) ts;
+    w[5]        = cap_len;
+    w[6]        = PSEUDO_HDR_LEN + len;
+    fill_pseudo_headers(rec + 28, cs, dir, len);
+    memcpy(rec + 28 + PSEUDO_HDR_LEN, data, snap);
+    memset(rec + 28 + cap_len, 0, pad);
+    memcpy(rec + rec_len - 4, &w[1], 4);
+
+    cap_used[cap_fill] += rec_len;
+    __atomic_add_fetch(&cap_queued, rec_len, __ATOMIC_RELAXED);
+    cs->seq[dir] += len;
+    cap_stats.records++;
+    cap_stats.bytes += rec_len;
+}
+
+void capture_bytes(struct capture_stream *cs, enum capture_dir dir, const void *data, size_t len)
+{
+    if (!cs || !ev_cap_flush || !len || !stream_enabled(cs))
+        return;
+
+    capture_record(cs, dir, data, snap_len(len), len);
+}
+
+void capture_evbuffer(struct capture_stream *cs, enum capture_dir dir, struct evbuffer *buf)
+{
+    if (!cs || !ev_cap_flush || !stream_enabled(cs))
+        return;
+
+    unsigned char data[CAPTURE_SNAPLEN_MAX];
+    size_t len  = evbuffer_get_length(buf);
+    size_t snap = snap_len(len);
+    if (!len || evbuffer_copyout(buf, data, snap) < 0)
+        return;
+
+    capture_record(cs, dir, data, snap, len);
+}
+
+// writer thread
+static int open_capture_file()
+{
+    struct common_conf *c_conf = get_common_config();
+    cap_fp                     = fopen(c_conf->capture_file, "w");
+    if (!cap_fp) {
+        __atomic_store_n(&cap_open_errno, errno ? errno : EIO, __ATOMIC_RELAXED);
+        return -1;
+    }
+
+    uint32_t shb[7] = {PCAPNG_SHB, sizeof(shb), PCAPNG_BYTE_ORDER_MAGIC, 1 /* major 1 minor 0 */,
+                       0xffffffff, 0xffffffff /* section length unknown */, sizeof(shb)};
+    uint32_t idb[5] = {PCAPNG_IDB, sizeof(idb), LINKTYPE_RAW, (uint32_t) c_conf->capture_snaplen +
+                                                                  PSEUDO_HDR_LEN,
+                       sizeof(idb)};
+    fwrite(shb, sizeof(shb), 1, cap_fp);
+    fwrite(idb, sizeof(idb), 1, cap_fp);
+    __atomic_store_n(&cap_stats.file_bytes, sizeof(shb) + sizeof(idb), __ATOMIC_RELAXED);
+    return 0;
+}
+
+// writer thread, or the loop thread once the writer is gone
+static void write_capture(const unsigned char *buf, size_t len)
+{
+    if (cap_fp || !open_capture_file()) {
+        size_t n = fwrite(buf, 1, len, cap_fp);
+        fflush(cap_fp);
+        __atomic_add_fetch(&cap_stats.file_bytes, n, __ATOMIC_RELAXED);
+    }
+    __atomic_sub_fetch(&cap_queued, len, __ATOMIC_RELAXED);
+}
+
+static void *capture_writer_thread(void *arg)
+{
+    pthread_mutex_lock(&cap_mutex);
+    for (;;) {
+        while (cap_busy < 0 && !cap_stop)
+            pthread_cond_wait(&cap_cond, &cap_mutex);
+        if (cap_busy < 0)
+            break;
+
+        int b = cap_busy;
+        pthread_mutex_unlock(&cap_mutex);
+        write_capture(cap_buf[b], cap_used[b]);
+        pthread_mutex_lock(&cap_mutex);
+        cap_used[b] = 0;
+        cap_busy    = -1;
+    }
+    pthread_mutex_unlock(&cap_mutex);
+
+    return NULL;
+}
+
+static int start_capture_writer()
+{
+    cap_stop = 0;
+    if (pthread_create(&cap_writer, NULL, capture_writer_thread, NULL)) {
+        debug(LOG_ERR, "error: capture writer thread failed, write on the event loop");
+        cap_writer_state = -1;
+        return -1;
+    }
+
+    cap_writer_state = 1;
+    debug(LOG_INFO, "capture to [%s]", get_common_config()->capture_file);
+    return 0;
+}
+
+// a buffer still with the writer keeps the loop on the one it fills,
+// records past CAPTURE_RING_SIZE are dropped until the writer is back
+static void capture_flush_cb(evutil_socket_t fd, short event, void *arg)
+{
+    int err = __atomic_exchange_n(&cap_open_errno, 0, __ATOMIC_RELAXED);
+    if (err)
+        debug(LOG_ERR, "error: open capture file [%s] failed: %s",
+              get_common_config()->capture_file, strerror(err));
+
+    if (!cap_used[cap_fill])
+        return;
+
+    if (!cap_writer_state)
+        start_capture_writer();
+    if (cap_writer_state < 0) {
+        write_capture(cap_buf[cap_fill], cap_used[cap_fill]);
+        cap_used[cap_fill] = 0;
+        return;
+    }
+
+    pthread_mutex_lock(&cap_mutex);
+    if (cap_busy < 0) {
+        cap_busy = cap_fill;
+        cap_fill = !cap_fill;
+        pthread_cond_signal(&cap_cond);
+    }
+    pthread_mutex_unlock(&cap_mutex);
+}
+
+int capture_set_proxy(const char *name, int enable)
+{
+    int *flag = NULL;
+    if (strcmp(name, CAPTURE_CONTROL_NAME) == 0) {
+        flag = &control_capture;
+    } else {
+        struct proxy_service *ps = get_proxy_service(name);
+        if (!ps)
+            return -1;
+        flag = &ps->capture;
+    }
+
+    *flag = enable < 0 ? !*flag : !!enable;
+    debug(LOG_INFO, "capture of [%s] %s", name, *flag ? "on" : "off");
+    return *flag;
+}
+
+int capture_is_enabled(const char *name)
+{
+    if (strcmp(name, CAPTURE_CONTROL_NAME) == 0)
+        return control_capture;
+
+    struct proxy_service *ps = get_proxy_service(name);
+    return ps ? ps->capture : 0;
+}
+
+const struct capture_stats *get_capture_stats()
+{
+    return &cap_stats;
+}
+
+// toggle every proxy listed in capture_proxies
+static void capture_signal_cb(evutil_socket_t fd, short event, void *arg)
+{
+    const char *list = get_common_config()->capture_proxies;
+    if (!list) {
+        debug(LOG_WARNING, "SIGUSR1: capture_proxies is not set, nothing to capture");
+        return;
+    }
+
+    char *names = strdup(list);
+    assert(names);
+    char *save = NULL, *name;
+    for (name = strtok_r(names, ", ", &save); name; name = strtok_r(NULL, ", ", &save)) {
+        if (capture_set_proxy(name, -1) < 0)
+            debug(LOG_WARNING, "capture: proxy [%s] not found", name);
+    }
+    SAFE_FREE(names);
+}
+
+struct capture_stream *capture_tunnel_open(struct proxy_service *ps, int id)
+{
+    if (!ps->capture)
+        return NULL;
+
+    int sample = get_common_config()->capture_sample;
+    if (sample > 1 && ps->stats.total_tunnels % sample)
+        return NULL;
+
+    struct capture_stream *cs = calloc(1, sizeof(struct capture_stream));
+    assert(cs);
+    cs->ps    = ps;
+    cs->sport = 1024 + id % (65535 - 1024);
+    cs->dport = ps->remote_port;
+    return cs;
+}
+
+void capture_tunnel_close(struct capture_stream *cs)
+{
+    SAFE_FREE(cs);
+}
+
+struct capture_stream *capture_control_stream()
+{
+    return control_capture ? &control_stream : NULL;
+}
+
+// new control connection, new pseudo tcp connection
+void capture_control_reset(int dport)
+{
+    memset(&control_stream, 0, sizeof(control_stream));
+    control_stream.sport = ++control_sport;
+    control_stream.dport = dport;
+}
+
+void init_capture(struct event_base *base)
+{
+    struct common_conf *c_conf = get_common_config();
+    if (c_conf->capture_snaplen <= 0 || c_conf->capture_snaplen > CAPTURE_SNAPLEN_MAX)
+        c_conf->capture_snaplen = CAPTURE_SNAPLEN_MAX;
+
+    capture_control_reset(c_conf->server_port);
+
+    struct timeval tv = {CAPTURE_FLUSH_INTERVAL, 0};
+    ev_cap_flush      = event_new(base, -1, EV_PERSIST, capture_flush_cb, NULL);
+    assert(ev_cap_flush);
+    event_add(ev_cap_flush, &tv);
+
+    ev_cap_signal = evsignal_new(base, SIGUSR1, capture_signal_cb, NULL);
+    assert(ev_cap_signal);
+    event_add(ev_cap_signal, NULL);
+}
+
+void free_capture()
+{
+    if (ev_cap_flush)
+        capture_flush_cb(-1, 0, NULL);
+
+    if (cap_writer_state > 0) {
+        pthread_mutex_lock(&cap_mutex);
+        cap_stop = 1;
+        pthread_cond_signal(&cap_cond);
+        pthread_mutex_unlock(&cap_mutex);
+        pthread_join(cap_writer, NULL);
+    }
+    cap_writer_state = 0;
+
+    // the writer had the other buffer at the last flush
+    if (cap_used[cap_fill])
+        write_capture(cap_buf[cap_fill], cap_used[cap_fill]);
+
+    if (ev_cap_flush)
+        event_free(ev_cap_flush);
+    if (ev_cap_signal)
+        event_free(ev_cap_signal);
+    ev_cap_flush  = NULL;
+    ev_cap_signal = NULL;
+
+    int i;
+    for (i = 0; i < 2; i++) {
+        SAFE_FREE(cap_buf[i]);
+        cap_used[i] = 0;
+    }
+    cap_fill   = 0;
+    cap_busy   = -1;
+    cap_queued = 0;
+
+    if (cap_fp)
+        fclose(cap_fp);
+    cap_fp = NULL;
+}
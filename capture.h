@@ -0,0 +1,85 @@
+/* vim: set et ts=4 sts=4 sw=4 : */
+/********************************************************************\
+ * This program is free software; you can redistribute it and/or    *
+ * modify it under the terms of the GNU General Public License as   *
+ * published by the Free Software Foundation; either version 2 of   *
+ * the License, or (at your option) any later version.              *
+ *                                                                  *
+ * This program is distributed in the hope that it will be useful,  *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of   *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the    *
+ * GNU General Public License for more details.                     *
+ *                                                                  *
+ * You should have received a copy of the GNU General Public License*
+ * along with this program; if not, contact:                        *
+ *                                                                  *
+ * Free Software Foundation           Voice:  +1-617-542-5942       *
+ * 59 Temple Place - Suite 330        Fax:    +1-617-542-2652       *
+ * Boston, MA  02111-1307,  USA       gnu@gnu.org                   *
+ *                                                                  *
+\********************************************************************/
+
+
+/** @file capture.h
+    @brief sampled pcapng capture of control and tunnel bytes
+*/
+
+#ifndef _CAPTURE_H_
+#define _CAPTURE_H_
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define CAPTURE_CONTROL_NAME "control"   // proxy name that selects the control connection
+#define CAPTURE_RING_SIZE (256 * 1024)   // each of the two record buffers, dropped when full
+#define CAPTURE_SNAPLEN_MAX 4096
+#define CAPTURE_FLUSH_INTERVAL 1   // seconds
+
+enum capture_dir {
+    CAPTURE_TX = 0,   // xfrpc -> frps
+    CAPTURE_RX,       // frps -> xfrpc
+};
+
+struct event_base;
+struct evbuffer;
+struct proxy_service;
+
+// one pseudo tcp connection in the capture file
+struct capture_stream {
+    struct proxy_service *ps;   // NULL for control connection
+    uint16_t sport;
+    uint16_t dport;
+    uint32_t seq[2];   // next sequence number by capture_dir
+};
+
+struct capture_stats {
+    uint64_t records;
+    uint64_t bytes;     // record bytes queued
+    uint64_t dropped;   // records lost to a full ring or capture_max_size
+    uint64_t file_bytes;
+};
+
+// flush timer and SIGUSR1 toggle of capture_proxies
+void init_capture(struct event_base *base);
+void free_capture();
+
+// enable == -1 toggles, return new state or -1 when proxy not found
+int capture_set_proxy(const char *name, int enable);
+int capture_is_enabled(const char *name);
+const struct capture_stats *get_capture_stats();
+
+// NULL when the proxy is not captured or the tunnel is not sampled
+struct capture_stream *capture_tunnel_open(struct proxy_service *ps, int id);
+void capture_tunnel_close(struct capture_stream *cs);
+
+// control connection stream, NULL when not captured
+struct capture_stream *capture_control_stream();
+// new control connection to the frps port dport
+void capture_control_reset(int dport);
+
+void capture_bytes(struct capture_stream *cs, enum capture_dir dir, const void *data,
+                   size_t len);
+// copy up to snaplen bytes from buf without draining it
+void capture_evbuffer(struct capture_stream *cs, enum capture_dir dir, struct evbuffer *buf);
+
+#endif   //_CAPTURE_H_
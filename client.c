@@ -55,46 +55,54 @@
 #include "common.h"
 #include "proxy.h"
 #include "utils.h"
+#include "capture.h"
+#include "pool.h"
+#include "tls.h"
+#include "uplink.h"
+#include "server_list.h"
 
 #define MAX_OUTPUT (512 * 1024)
 
+static struct proxy_client *all_pc;   // work connections not closed yet
+static int pc_next_id;
+
 static void drained_writecb(struct bufferevent *bev, void *ctx);
-static void xfrp_event_cb(struct bufferevent *bev, short what, void *ctx);
 
-static void xfrp_read_cb(struct bufferevent *bev, void *ctx)
+// the relay callbacks moved bev input to partner p->bev, stop reading bev
+// while partner holds MAX_OUTPUT; the read callbacks stay, only the write
+// side of partner is hooked
+void tunnel_backpressure(struct bufferevent *bev, struct proxy *p)
 {
-    struct proxy *p             = (struct proxy *) ctx;
-    struct bufferevent *partner = p ? p->bev : NULL;
-    struct evbuffer *src, *dst;
-    size_t len;
-    src = bufferevent_get_input(bev);
-    len = evbuffer_get_length(src);
-    if (!partner) {
-        evbuffer_drain(src, len);
+    struct bufferevent *partner = p->bev;
+    if (!partner || evbuffer_get_length(bufferevent_get_output(partner)) < MAX_OUTPUT)
         return;
-    }
-    dst = bufferevent_get_output(partner);
-    evbuffer_add_buffer(dst, src);
-    struct proxy *p_l = new_proxy_buf(bev);
-
-    if (evbuffer_get_length(dst) >= MAX_OUTPUT) {
-        /* We're giving the other side data faster than it can
-         * pass it on.  Stop reading here until we have drained the
-         * other side to MAX_OUTPUT/2 bytes. */
-        bufferevent_setcb(partner, xfrp_read_cb, drained_writecb, xfrp_event_cb, p_l);
-        bufferevent_setwatermark(partner, EV_WRITE, MAX_OUTPUT / 2, MAX_OUTPUT);
-        bufferevent_disable(bev, EV_READ);
-    }
+
+    bufferevent_data_cb readcb;
+    bufferevent_event_cb eventcb;
+    void *cbarg;
+    bufferevent_getcb(partner, &readcb, NULL, &eventcb, &cbarg);
+
+    /* We're giving the other side data faster than it can
+     * pass it on.  Stop reading here until we have drained the
+     * other side to MAX_OUTPUT/2 bytes. */
+    bufferevent_setcb(partner, readcb, drained_writecb, eventcb, cbarg);
+    bufferevent_setwatermark(partner, EV_WRITE, MAX_OUTPUT / 2, MAX_OUTPUT);
+    bufferevent_disable(bev, EV_READ);
 }
 
+// ctx is the read ctx of bev, its proxy points at the side we choked
 static void drained_writecb(struct bufferevent *bev, void *ctx)
 {
     struct proxy *p             = (struct proxy *) ctx;
     struct bufferevent *partner = p ? p->bev : NULL;
 
+    bufferevent_data_cb readcb;
+    bufferevent_event_cb eventcb;
+    bufferevent_getcb(bev, &readcb, NULL, &eventcb, NULL);
+
     /* We were choking the other side until we drained our outbuf a bit.
      * Now it seems drained. */
-    bufferevent_setcb(bev, xfrp_read_cb, NULL, xfrp_event_cb, p);
+    bufferevent_setcb(bev, readcb, NULL, eventcb, p);
     bufferevent_setwatermark(bev, EV_WRITE, 0, 0);
     if (partner)
         bufferevent_enable(partner, EV_READ);
@@ -109,16 +117,57 @@ static void close_on_finished_writecb(struct bufferevent *bev, void *ctx)
     }
 }
 
+// first side of the tunnel closed, the other side is freed or flushing
+static void tunnel_closed(struct proxy_client *client, struct bufferevent *bev, short what)
+{
+    struct proxy_stats *stats = &client->ps->stats;
+    if (stats->active_tunnels)
+        stats->active_tunnels--;
+
+    if (what & BEV_EVENT_ERROR) {
+        // fast open reports connected before the handshake, a refused one
+        // fails before the local service answered anything
+        int local_up = client->trace[TS_LOCAL_CONNECTED] &&
+                       (!client->ps->tcp_fast_open || client->trace[TS_FIRST_C2S]);
+        stats->connect_failures++;
+        if (bev == client->local_proxy_bev && !local_up)
+            stats->local_connect_failures++;
+    }
+
+    client->ctl_bev         = NULL;
+    client->local_proxy_bev = NULL;
+    del_proxy_client(client);
+}
+
 static void xfrp_event_cb(struct bufferevent *bev, short what, void *ctx)
 {
     struct proxy *p             = (struct proxy *) ctx;
     struct bufferevent *partner = p ? p->bev : NULL;
+    struct proxy_client *client = p ? p->client : NULL;
+
+    if (what & BEV_EVENT_CONNECTED) {
+        if (client && bev == client->local_proxy_bev)
+            tunnel_stage(client, TS_LOCAL_CONNECTED);
+        // fast open holds the SYN back for the first bytes, with none at hand
+        // send it now, the service may be the one to speak first
+        if (client && client->ps->tcp_fast_open &&
+            !evbuffer_get_length(bufferevent_get_output(bev)))
+            send(bufferevent_getfd(bev), NULL, 0, MSG_NOSIGNAL);
+        return;
+    }
 
     if (what & (BEV_EVENT_EOF | BEV_EVENT_ERROR)) {
         debug(LOG_DEBUG, "working connection closed!");
+        // tcp_info of the work connection, ctl_bev may be the partner freed below
+        if (client && client->ctl_bev)
+            uplink_conn_closed(bufferevent_getfd(client->ctl_bev), client->uplink);
         if (partner) {
-            /* Flush all pending data */
-            xfrp_read_cb(bev, p);
+            /* Flush all pending data, through the relay callback so the
+             * bytes are counted and captured like the others */
+            bufferevent_data_cb readcb;
+            bufferevent_getcb(bev, &readcb, NULL, NULL, NULL);
+            if (readcb && evbuffer_get_length(bufferevent_get_input(bev)))
+                readcb(bev, p);
 
             if (evbuffer_get_length(bufferevent_get_output(partner))) {
                 /* We still have to flush data from the other
@@ -131,9 +180,10 @@ static void xfrp_event_cb(struct bufferevent *bev, short what, void *ctx)
                 /* We have nothing left to say to the other
                  * side; close it. */
                 bufferevent_free(partner);
-                free_proxy(p);
             }
         }
+        if (client)
+            tunnel_closed(client, bev, what);
         bufferevent_free(bev);
     }
 }
@@ -190,9 +240,8 @@ void start_xfrp_tunnel(struct proxy_client *client)
         return;
     }
 
-    struct event_base *base    = client->base;
-    struct common_conf *c_conf = get_common_config();
-    struct proxy_service *ps   = client->ps;
+    struct event_base *base  = client->base;
+    struct proxy_service *ps = client->ps;
 
     if (!base) {
         debug(LOG_ERR, "service event base get failed");
@@ -210,31 +259,53 @@ void start_xfrp_tunnel(struct proxy_client *client)
     }
 
 	//连接proxy service配置的对应的本地ip和本地的端口,比如ssh,本地ip:22端口
-    client->local_proxy_bev = connect_server(base, ps->local_ip, ps->local_port);
+    client->local_proxy_bev = connect_server(base, ps->local_ip, ps->local_port, ps);
 
 	//返回client对应的bufferevent
     if (!client->local_proxy_bev) {
         debug(LOG_ERR, "frpc tunnel connect local proxy port [%d] failed!", ps->local_port);
+        ps->stats.connect_failures++;
+        ps->stats.local_connect_failures++;
         bufferevent_free(client->ctl_bev);
+        client->ctl_bev = NULL;
         return;
     }
 
-    debug(LOG_DEBUG, "proxy server [%s:%d] <---> client [%s:%d]", c_conf->server_addr,
+    debug(LOG_DEBUG, "proxy server [%s:%d] <---> client [%s:%d]", get_server(client->server)->addr,
           ps->remote_port, ps->local_ip ? ps->local_ip : "::1", ps->local_port);
 
+    relay_xfrp_tunnel(client);
+}
+
+void relay_xfrp_tunnel(struct proxy_client *client)
+{
+    struct proxy_service *ps = client->ps;
+
+    // work connection carries tunnel bytes only from here on, hand TLS to the kernel
+    client->ctl_bev = tls_unwrap(client->ctl_bev);
+    // opened with [common] options before frps named the proxy
+    if (ps->tcp_tuned)
+        sock_tuning_apply(bufferevent_getfd(client->ctl_bev), &ps->tcp, ps->proxy_name);
+
 	//连接到服务器的bufferevent建立一个proxy结构
-    struct proxy *ctl_prox   = new_proxy_buf(client->ctl_bev);
+    struct proxy *ctl_prox = &client->ctl_prox;
+    ctl_prox->bev          = client->ctl_bev;
+    ctl_prox->client       = client;
 
 	//连接到本地的bufferevent新建一个proxy结构
-    struct proxy *local_prox = new_proxy_buf(client->local_proxy_bev);
+    struct proxy *local_prox = &client->local_prox;
+    local_prox->bev          = client->local_proxy_bev;
+    local_prox->client       = client;
     bufferevent_data_cb proxy_s2c_cb, proxy_c2s_cb;
 
+    ps->stats.total_tunnels++;
+    ps->stats.active_tunnels++;
+    client->cap = capture_tunnel_open(ps, client->id);
+
 	//ftp服务的特殊处理
     if (is_ftp_proxy(client->ps)) {
-        proxy_c2s_cb               = ftp_proxy_c2s_cb;
-        proxy_s2c_cb               = ftp_proxy_s2c_cb;
-        ctl_prox->remote_data_port = client->ps->remote_data_port;
-        ctl_prox->proxy_name       = strdup(ps->proxy_name);
+        proxy_c2s_cb = ftp_proxy_c2s_cb;
+        proxy_s2c_cb = ftp_proxy_s2c_cb;
     } else {
 		//设置proxy_c2s proxy_s2c的数据通道的回调函数
         proxy_c2s_cb = tcp_proxy_c2s_cb;
@@ -257,6 +328,9 @@ int send_client_data_tail(struct proxy_client *client)
     if (client->data_tail && client->data_tail_size && client->local_proxy_bev) {
         send_l =
             bufferevent_write(client->local_proxy_bev, client->data_tail, client->data_tail_size);
+        client->ps->stats.bytes_in += client->data_tail_size;
+        capture_bytes(client->cap, CAPTURE_RX, client->data_tail, client->data_tail_size);
+        tunnel_stage(client, TS_FIRST_S2C);
     }
 
     return send_l;
@@ -264,17 +338,14 @@ int send_client_data_tail(struct proxy_client *client)
 
 void free_proxy_client(struct proxy_client *client)
 {
-    if (client->local_ip)
-        free(client->local_ip);
-
-    free_base_config(client->bconf);
-
-    evtimer_del(client->ev_timeout);
+    capture_tunnel_close(client->cap);
+    client->cap = NULL;
+    uplink_release(client->uplink);
+    client->uplink = -1;
 }
 
 void del_proxy_client(struct proxy_client *client)
 {
-    struct proxy_client *all_pc = get_all_pc();
     if (!client || !all_pc) {
         debug(LOG_INFO, "Error: all_pc or client is NULL");
         return;
@@ -283,6 +354,76 @@ void del_proxy_client(struct proxy_client *client)
     HASH_DEL(all_pc, client);
 
     free_proxy_client(client);
+    pool_free(POOL_PROXY_CLIENT, client);
+}
+
+struct proxy_client *get_all_pc()
+{
+    return all_pc;
+}
+
+#define US_TO_MS(us) ((unsigned long long) (us) / 1000)
+
+static void log_slow_setup(const struct proxy_client *client)
+{
+    const uint64_t *at = client->trace;
+    debug(LOG_WARNING,
+          "slow tunnel setup [%s]: dial frps %llu ms, send NewWorkConn %llu ms, "
+          "pool wait %llu ms, connect local %llu ms",
+          client->ps->proxy_name, US_TO_MS(at[TS_FRPS_CONNECTED] - at[TS_REQ_WORK_CONN]),
+          US_TO_MS(at[TS_NEW_WORK_CONN] - at[TS_FRPS_CONNECTED]),
+          US_TO_MS(at[TS_START_WORK_CONN] - at[TS_NEW_WORK_CONN]),
+          US_TO_MS(at[TS_LOCAL_CONNECTED] - at[TS_START_WORK_CONN]));
+}
+
+void tunnel_stage(struct proxy_client *client, enum tunnel_stage stage)
+{
+    uint64_t *at = client->trace;
+    if (at[stage])
+        return;
+
+    at[stage] = get_monotonic_usec();
+
+    // stages before StartWorkConn are accounted when the proxy is known
+    if (!client->ps)
+        return;
+
+    struct latency_hist *lat = client->ps->stats.latency;
+    uint64_t dial            = at[TS_FRPS_CONNECTED] - at[TS_REQ_WORK_CONN];
+    switch (stage) {
+        case TS_START_WORK_CONN:
+            hist_add(&lat[LAT_DIAL], dial);
+            hist_add(&lat[LAT_POOL_WAIT], at[stage] - at[TS_NEW_WORK_CONN]);
+            break;
+
+        case TS_LOCAL_CONNECTED: {
+            uint64_t local = at[stage] - at[TS_START_WORK_CONN];
+            int slow_ms    = get_common_config()->slow_setup_ms;
+            hist_add(&lat[LAT_LOCAL], local);
+            hist_add(&lat[LAT_SETUP], dial + local);
+            if (slow_ms > 0 && dial + local >= (uint64_t) slow_ms * 1000)
+                log_slow_setup(client);
+            break;
+        }
+
+        case TS_FIRST_S2C:
+            hist_add(&lat[LAT_FIRST_S2C], at[stage] - at[TS_START_WORK_CONN]);
+            break;
+
+        case TS_FIRST_C2S:
+            hist_add(&lat[LAT_FIRST_C2S], at[stage] - at[TS_START_WORK_CONN]);
+            break;
+
+        default:
+            break;
+    }
+}
+
+const char *tunnel_latency_name(enum tunnel_latency lat)
+{
+    static const char *names[LAT_MAX] = {"dial", "pool_wait", "local", "first_s2c", "first_c2s",
+                                         "setup"};
+    return lat < LAT_MAX ? names[lat] : "unknown";
 }
 
 // Return NULL if proxy service not found with proxy_name
@@ -296,7 +437,10 @@ struct proxy_service *get_proxy_service(const char *proxy_name)
 
 struct proxy_client *new_proxy_client()
 {
-    struct proxy_client *client = calloc(1, sizeof(struct proxy_client));
-    assert(client);
+    struct proxy_client *client = pool_alloc(POOL_PROXY_CLIENT);
+    client->id      = ++pc_next_id;
+    client->uplink  = -1;
+    client->session = -1;
+    HASH_ADD_INT(all_pc, id, client);
     return client;
 }
\ No newline at end of file
@@ -31,30 +31,81 @@
 
 #include "uthash.h"
 #include "common.h"
+#include "histogram.h"
+#include "sockopt.h"
 
 struct event_base;
-struct base_conf;
 struct bufferevent;
-struct event;
+struct proxy_client;
 struct proxy_service;
+struct capture_stream;
 
+enum proxy_reg_state {
+    PS_REG_NONE = 0,   // not sent yet, or control connection lost
+    PS_REG_SENT,       // NewProxy sent, waiting for NewProxyResp
+    PS_REG_OK,
+    PS_REG_FAILED,
+};
+
+// setup stages of one tunnel, in the order they are reached
+enum tunnel_stage {
+    TS_REQ_WORK_CONN = 0,   // ReqWorkConn received, dialing frps
+    TS_FRPS_CONNECTED,
+    TS_NEW_WORK_CONN,     // NewWorkConn sent, idle in frps pool until used
+    TS_START_WORK_CONN,   // StartWorkConn received, dialing local service
+    TS_LOCAL_CONNECTED,
+    TS_FIRST_S2C,   // first byte frps -> local
+    TS_FIRST_C2S,   // first byte local -> frps
+    TS_MAX,
+};
+
+// per proxy latency histograms built from tunnel stages
+enum tunnel_latency {
+    LAT_DIAL = 0,    // ReqWorkConn -> frps connected
+    LAT_POOL_WAIT,   // NewWorkConn -> StartWorkConn
+    LAT_LOCAL,       // StartWorkConn -> local connected
+    LAT_FIRST_S2C,   // StartWorkConn -> first byte frps -> local
+    LAT_FIRST_C2S,   // StartWorkConn -> first byte local -> frps
+    LAT_SETUP,       // dial + local, time idle in frps pool is not setup work
+    LAT_MAX,
+};
+
+// counters of one proxy service, updated in relay callbacks
+struct proxy_stats {
+    uint64_t bytes_in;    // frps -> local service
+    uint64_t bytes_out;   // local service -> frps
+    uint32_t active_tunnels;
+    uint64_t total_tunnels;
+    uint64_t connect_failures;         // tunnels closed by socket error
+    uint64_t local_connect_failures;   // local service never connected
+    enum proxy_reg_state reg_state;
+    uint32_t reg_sessions;   // bit per control session that accepted NewProxy
+    struct latency_hist latency[LAT_MAX];
+};
+
+// callback ctx of one side of a tunnel, bev is the other side
+struct proxy {
+    struct bufferevent *bev;
+    struct proxy_client *client;   // tunnel this side belongs to
+};
+
+// one tunnel, proxy settings are read through ps and never copied
 struct proxy_client {
     struct event_base *base;
     struct bufferevent *ctl_bev;	//
     struct bufferevent *local_proxy_bev;	//
-    struct event *ev_timeout;
-
-    struct base_conf *bconf;
-    char *local_ip;
-    int local_port;
-    int remote_port;
-
-    char *host_header_rewrite;
 
     // provate arguments
-    UT_hash_handle hh;
-    int connected;
+    int id;   // key in all proxy clients
     int work_started;
+    int uplink;   // index of bound uplink, -1 default route
+    int session;  // control session that asked for it, -1 none
+    int server;   // frps it goes to, index in server list
+    UT_hash_handle hh;
+    uint64_t trace[TS_MAX];   // monotonic usec when each stage was reached, 0 not yet
+    struct capture_stream *cap;   // NULL when tunnel is not captured
+    struct proxy ctl_prox;        // callback ctx of local_proxy_bev
+    struct proxy local_prox;      // callback ctx of ctl_bev
     struct proxy_service *ps;
     unsigned char *data_tail;   // storage untrated data
     size_t data_tail_size;
@@ -71,6 +122,9 @@ struct proxy_service {
     int remote_port;
     int remote_data_port;
     int local_port;
+    int tcp_fast_open;   // local dial, the SYN waits for bytes from frps
+    struct sock_tuning tcp;   // [common] tcp_* options, overridden by the section
+    int tcp_tuned;            // section has tcp_* options of its own
 
     // http and https only
     char *custom_domains;
@@ -80,7 +134,18 @@ struct proxy_service {
     char *http_user;
     char *http_pwd;
 
+    // xtcp only
+    char *sk;                  // secret shared by the proxy and its visitors
+    int is_visitor;            // role = visitor, listens on bind_port instead of registering
+    char *server_name;         // visitor: xtcp proxy it reaches
+    char *bind_addr;           // visitor: default 127.0.0.1
+    int bind_port;             // visitor
+    int fallback_port;         // visitor: tcp proxy on frps used when punching fails, 0 none
+    int fallback_timeout_ms;   // visitor: default 3000, punching given up after it
+
     // provate arguments
+    struct proxy_stats stats;
+    int capture;   // tunnels started while set are captured
     UT_hash_handle hh;
 };
 
@@ -90,6 +155,10 @@ struct proxy_service {
 // frp tunnel
 // if client has data-tail(not NULL), client value will be changed
 void start_xfrp_tunnel(struct proxy_client *client);
+// relay between ctl_bev and local_proxy_bev, both set up already
+void relay_xfrp_tunnel(struct proxy_client *client);
+// relay callbacks call it after moving bev input to p->bev
+void tunnel_backpressure(struct bufferevent *bev, struct proxy *p);
 
 void del_proxy_client(struct proxy_client *client);
 
@@ -100,6 +169,13 @@ struct proxy_service *get_proxy_service(const char *proxy_name);
 int send_client_data_tail(struct proxy_client *client);
 
 int is_ftp_proxy(const struct proxy_service *ps);
+
+// new proxy client is kept in all proxy clients until del_proxy_client
 struct proxy_client *new_proxy_client();
+struct proxy_client *get_all_pc();
+
+// stamp first time the tunnel reached stage and feed proxy histograms
+void tunnel_stage(struct proxy_client *client, enum tunnel_stage stage);
+const char *tunnel_latency_name(enum tunnel_latency lat);
 
 #endif   //_CLIENT_H_
@@ -159,7 +159,8 @@ static void usage(const char *appname)
 void parse_commandline(int argc, char **argv)
 {
     int c;
-    int flag = 0;
+    int flag      = 0;
+    int level_set = 0;
 
     while (-1 != (c = getopt(argc, argv, "c:hfd:sw:vrx:i:a:"))) {
 
@@ -187,6 +188,7 @@ void parse_commandline(int argc, char **argv)
             case 'd':
                 if (optarg) {
                     debugconf.debuglevel = atoi(optarg);
+                    level_set            = 1;
                 }
                 break;
 
@@ -230,6 +232,13 @@ void parse_commandline(int argc, char **argv)
     //加载配置
     load_config(confile);
 
+    // -d wins over log_level
+    struct common_conf *c_conf = get_common_config();
+    if (!level_set)
+        debugconf.debuglevel = debug_level_of(c_conf->log_level);
+    if (c_conf->log_way && strcmp(c_conf->log_way, "syslog") == 0)
+        debugconf.log_syslog = 1;
+
     if (is_daemon) {
         //精灵进程惯用法
         makedaemon();
@@ -35,6 +35,7 @@
 #include "ini.h"
 #include "uthash.h"
 #include "config.h"
+#include "sockopt.h"
 #include "client.h"
 #include "debug.h"
 #include "msg.h"
@@ -42,7 +43,6 @@
 #include "version.h"
 
 static struct common_conf *c_conf;
-static struct proxy_client *p_clients;
 static struct proxy_service *p_services;
 
 static void new_ftp_data_proxy_service(struct proxy_service *ftp_ps);
@@ -72,12 +72,24 @@ void free_common_config()
     if (c_conf->privilege_token)
         free(c_conf->privilege_token);
     SAFE_FREE(c_conf->server_ip);
+    SAFE_FREE(c_conf->admin_addr);
+    SAFE_FREE(c_conf->capture_file);
+    SAFE_FREE(c_conf->capture_proxies);
+    SAFE_FREE(c_conf->tls_trusted_ca_file);
+    SAFE_FREE(c_conf->bind_addresses);
+    SAFE_FREE(c_conf->bind_interfaces);
+    SAFE_FREE(c_conf->bind_policy);
+    SAFE_FREE(c_conf->protocol);
+    SAFE_FREE(c_conf->servers);
+    SAFE_FREE(c_conf->server_policy);
+    sock_tuning_free(&c_conf->tcp);
 };
 
 //设置conf的server ip地址
 void set_common_server_ip(const char *ip)
 {
     struct common_conf *c_conf = get_common_config();
+    SAFE_FREE(c_conf->server_ip);
     c_conf->server_ip          = strdup(ip);
     assert(c_conf->server_ip);
 
@@ -98,11 +110,6 @@ void free_base_config(struct base_conf *bconf)
         free(bconf->subdomain);
 }
 
-struct proxy_client *get_all_pc()
-{
-    return p_clients;
-}
-
 struct proxy_service *get_all_proxy_services()
 {
     return p_services;
@@ -123,7 +130,7 @@ static const char *get_valid_type(const char *val)
 
 #define MATCH_VALUE(s) strcmp(val, s) == 0
     if (MATCH_VALUE("tcp") || MATCH_VALUE("http") || MATCH_VALUE("https") || MATCH_VALUE("udp") ||
-        MATCH_VALUE("ftp")) {
+        MATCH_VALUE("ftp") || MATCH_VALUE("xtcp")) {
 
         return val;
     }
@@ -151,6 +158,18 @@ static void dump_proxy_service(const int index, struct proxy_service *ps)
     if (!ps)
         return;
 
+    if (ps->is_visitor) {
+        if (!ps->proxy_type || strcmp(ps->proxy_type, "xtcp") || !ps->server_name ||
+            ps->bind_port <= 0) {
+            debug(LOG_ERR, "Visitor [%s] error: xtcp type, server_name and bind_port needed",
+                  ps->proxy_name);
+            exit(0);
+        }
+        debug(LOG_DEBUG, "Visitor %d: {name:%s, server_name:%s, bind_port:%d}", index,
+              ps->proxy_name, ps->server_name, ps->bind_port);
+        return;
+    }
+
     if (0 > ps->local_port) {
         debug(LOG_ERR, "Proxy [%s] error: local_port not found", ps->proxy_name);
         exit(0);
@@ -208,6 +227,10 @@ static struct proxy_service *new_proxy_service(const char *name)
     ps->http_user           = NULL;
     ps->http_pwd            = NULL;
 
+    ps->fallback_timeout_ms = 3000;
+    // [common] is parsed first, sections override single options
+    sock_tuning_copy(&ps->tcp, &c_conf->tcp);
+
     return ps;
 }
 
@@ -230,7 +253,8 @@ static void new_ftp_data_proxy_service(struct proxy_service *ftp_ps)
 
         ps->proxy_type  = strdup("tcp");
         ps->remote_port = ftp_ps->remote_data_port;
-        ps->local_ip    = ftp_ps->local_ip;
+        // set_ftp_data_proxy_tunnel replaces it, so it can not be shared with ftp_ps
+        ps->local_ip = ftp_ps->local_ip ? strdup(ftp_ps->local_ip) : NULL;
         ps->local_port = 0;   // will be init in working tunnel connectting
 
         HASH_ADD_KEYPTR(hh, p_services, ps->proxy_name, strlen(ps->proxy_name), ps);
@@ -311,6 +335,27 @@ static int proxy_service_handler(void *user, const char *sect, const char *nm, c
         ps->use_encryption = TO_BOOL(value);
     } else if (MATCH_NAME("use_compression")) {   //压缩
         ps->use_compression = TO_BOOL(value);
+    } else if (MATCH_NAME("tcp_fast_open")) {
+        ps->tcp_fast_open = TO_BOOL(value);
+    } else if (MATCH_NAME("sk")) {
+        ps->sk = strdup(value);
+        assert(ps->sk);
+    } else if (MATCH_NAME("role")) {
+        ps->is_visitor = strcmp(value, "visitor") == 0;
+    } else if (MATCH_NAME("server_name")) {
+        ps->server_name = strdup(value);
+        assert(ps->server_name);
+    } else if (MATCH_NAME("bind_addr")) {
+        ps->bind_addr = strdup(value);
+        assert(ps->bind_addr);
+    } else if (MATCH_NAME("bind_port")) {
+        ps->bind_port = atoi(value);
+    } else if (MATCH_NAME("fallback_port")) {
+        ps->fallback_port = atoi(value);
+    } else if (MATCH_NAME("fallback_timeout_ms")) {
+        ps->fallback_timeout_ms = atoi(value);
+    } else if (sock_tuning_parse(&ps->tcp, nm, value)) {
+        ps->tcp_tuned = 1;
     }
 
     SAFE_FREE(section);
@@ -339,6 +384,20 @@ static int common_handler(void *user, const char *section, const char *name, con
             set_common_server_ip(value);
     } else if (MATCH("common", "server_port")) { //server端口
         config->server_port = atoi(value);
+    } else if (MATCH("common", "servers")) {
+        SAFE_FREE(config->servers);
+        config->servers = strdup(value);
+        assert(config->servers);
+    } else if (MATCH("common", "server_policy")) {
+        SAFE_FREE(config->server_policy);
+        config->server_policy = strdup(value);
+        assert(config->server_policy);
+    } else if (MATCH("common", "active_servers")) {
+        config->active_servers = atoi(value);
+    } else if (MATCH("common", "server_probe_interval")) {
+        config->server_probe_interval = atoi(value);
+    } else if (MATCH("common", "control_sessions")) {
+        config->control_sessions = atoi(value);
     } else if (MATCH("common", "http_proxy")) { //http代理
         SAFE_FREE(config->http_proxy);
         config->http_proxy = strdup(value); //代理值
@@ -357,6 +416,8 @@ static int common_handler(void *user, const char *section, const char *name, con
         assert(config->log_level);
     } else if (MATCH("common", "log_max_days")) {
         config->log_max_days = atoi(value);
+    } else if (MATCH("common", "log_max_size")) {
+        config->log_max_size = atoi(value);
     } else if (MATCH("common", "privilege_token")) {
         SAFE_FREE(config->privilege_token);
         config->privilege_token = strdup(value);
@@ -373,8 +434,74 @@ static int common_handler(void *user, const char *section, const char *name, con
         SAFE_FREE(config->user);
         config->user = strdup(value);
         assert(config->user);
+    } else if (MATCH("common", "admin_addr")) {
+        SAFE_FREE(config->admin_addr);
+        config->admin_addr = strdup(value);
+        assert(config->admin_addr);
+    } else if (MATCH("common", "admin_port")) {
+        config->admin_port = atoi(value);
+    } else if (MATCH("common", "slow_setup_ms")) {
+        config->slow_setup_ms = atoi(value);
+    } else if (MATCH("common", "capture_file")) {
+        SAFE_FREE(config->capture_file);
+        config->capture_file = strdup(value);
+        assert(config->capture_file);
+    } else if (MATCH("common", "capture_proxies")) {
+        SAFE_FREE(config->capture_proxies);
+        config->capture_proxies = strdup(value);
+        assert(config->capture_proxies);
+    } else if (MATCH("common", "capture_snaplen")) {
+        config->capture_snaplen = atoi(value);
+    } else if (MATCH("common", "capture_sample")) {
+        config->capture_sample = atoi(value);
+    } else if (MATCH("common", "capture_max_size")) {
+        config->capture_max_size = atoi(value);
+    } else if (MATCH("common", "mem_class_max_size")) {
+        config->mem_class_max_size = atoi(value);
+    } else if (MATCH("common", "tls_enable")) {
+        config->tls_enable = TO_BOOL(value);
+    } else if (MATCH("common", "bind_addresses")) {
+        SAFE_FREE(config->bind_addresses);
+        config->bind_addresses = strdup(value);
+        assert(config->bind_addresses);
+    } else if (MATCH("common", "bind_interfaces")) {
+        SAFE_FREE(config->bind_interfaces);
+        config->bind_interfaces = strdup(value);
+        assert(config->bind_interfaces);
+    } else if (MATCH("common", "bind_policy")) {
+        SAFE_FREE(config->bind_policy);
+        config->bind_policy = strdup(value);
+        assert(config->bind_policy);
+    } else if (MATCH("common", "protocol")) {
+        SAFE_FREE(config->protocol);
+        config->protocol = strdup(value);
+        assert(config->protocol);
+    } else if (MATCH("common", "kcp_nodelay")) {
+        config->kcp_nodelay = TO_BOOL(value);
+    } else if (MATCH("common", "kcp_interval")) {
+        config->kcp_interval = atoi(value);
+    } else if (MATCH("common", "kcp_sndwnd")) {
+        config->kcp_sndwnd = atoi(value);
+    } else if (MATCH("common", "kcp_rcvwnd")) {
+        config->kcp_rcvwnd = atoi(value);
+    } else if (MATCH("common", "kcp_mtu")) {
+        config->kcp_mtu = atoi(value);
+    } else if (MATCH("common", "server_udp_port")) {
+        config->server_udp_port = atoi(value);
+    } else if (MATCH("common", "tcp_fast_open")) {
+        config->tcp_fast_open = TO_BOOL(value);
+    } else if (MATCH("common", "mptcp")) {
+        config->mptcp = TO_BOOL(value);
+    } else if (MATCH("common", "tls_ktls")) {
+        config->tls_ktls = TO_BOOL(value);
+    } else if (MATCH("common", "tls_trusted_ca_file")) {
+        SAFE_FREE(config->tls_trusted_ca_file);
+        config->tls_trusted_ca_file = strdup(value);
+        assert(config->tls_trusted_ca_file);
     } else if (MATCH("common", "tcp_mux")) {
         config->tcp_mux = 0;   // set tcp_mux to default: false
+    } else if (strcmp(section, "common") == 0) {
+        sock_tuning_parse(&config->tcp, name, value);
     }
     return 1;
 }
@@ -394,12 +521,46 @@ static void init_common_conf(struct common_conf *config)
     config->log_level = strdup("info");
     assert(config->log_level);
     config->log_max_days       = 3;
+    config->log_max_size       = 1024;
     config->heartbeat_interval = 30;
     config->heartbeat_timeout  = 60;
     config->tcp_mux            = 0;
     config->user               = NULL;
     config->server_ip          = NULL;
     config->is_router          = 0;
+    config->admin_addr         = strdup("127.0.0.1");
+    assert(config->admin_addr);
+    config->admin_port    = 0;
+    config->slow_setup_ms = 1000;
+    config->capture_file  = strdup("/tmp/xfrpc.pcapng");
+    assert(config->capture_file);
+    config->capture_proxies  = NULL;
+    config->capture_snaplen  = 256;
+    config->capture_sample   = 1;
+    config->capture_max_size   = 4096;
+    config->mem_class_max_size = 0;
+    config->tls_enable          = 0;
+    config->tls_trusted_ca_file = NULL;
+    config->tls_ktls            = 1;
+    config->mptcp               = 0;
+    config->bind_addresses      = NULL;
+    config->bind_interfaces     = NULL;
+    config->bind_policy         = NULL;
+    config->protocol            = strdup("tcp");
+    assert(config->protocol);
+    config->kcp_nodelay  = 1;
+    config->kcp_interval = 20;
+    config->kcp_sndwnd   = 128;
+    config->kcp_rcvwnd   = 512;
+    config->kcp_mtu      = 1350;
+    config->server_udp_port = 0;
+    config->tcp_fast_open   = 0;
+    sock_tuning_init(&config->tcp);
+    config->servers               = NULL;
+    config->server_policy         = NULL;
+    config->active_servers        = 1;
+    config->server_probe_interval = 30;
+    config->control_sessions      = 1;
 }
 
 // it should be free after using
@@ -53,12 +53,43 @@ struct common_conf {
     char *log_way;    /* default console */
     char *log_level;  /* default info */
     int log_max_days; /* default 3 */
+    int log_max_size; /* default 1024 KB, rotate log_file over it, 0 never */
     char *privilege_token;
     char *auth_token;
     int heartbeat_interval;        /* default 10 */
     int heartbeat_timeout;         /* default 30 */
     int tcp_mux; /* default 0 */   // TCP 多路复用,高级
     char *user;
+    char *admin_addr; /* default 127.0.0.1, "unix:/path" for unix socket */
+    int admin_port;   /* default 0, stats endpoint disabled */
+    int slow_setup_ms; /* default 1000, log tunnel setup slower than it, 0 never */
+    char *capture_file;    /* default /tmp/xfrpc.pcapng */
+    char *capture_proxies; /* proxies toggled by SIGUSR1, "control" for control connection */
+    int capture_snaplen;   /* default 256, payload bytes kept per packet */
+    int capture_sample;    /* default 1, capture one tunnel out of capture_sample */
+    int capture_max_size;  /* default 4096 KB, stop capture file growing over it, 0 never */
+    int mem_class_max_size; /* KB of libevent slabs per size class, default 0 plain malloc */
+    int tls_enable;            /* default 0, TLS to frps (terminated in front of frps) */
+    char *tls_trusted_ca_file; /* verify frps certificate against it, default no verification */
+    int tls_ktls;              /* default 1, relay tunnels on kernel TLS sockets when available */
+    int mptcp;                 /* default 0, multipath TCP to frps, falls back to TCP */
+    char *bind_addresses;      /* "addr[:weight], ..." work connections are bound to */
+    char *bind_interfaces;     /* "ifname[:weight], ..." for SO_BINDTODEVICE */
+    char *bind_policy;         /* roundrobin (default), weighted or least_loaded */
+    char *protocol;            /* tcp (default) or kcp, reliable UDP to a KCP relay of frps */
+    int kcp_nodelay;           /* default 1, fast resend and no congestion control */
+    int kcp_interval;          /* default 20 ms */
+    int kcp_sndwnd;            /* default 128 segments */
+    int kcp_rcvwnd;            /* default 512 segments */
+    int kcp_mtu;               /* default 1350 bytes */
+    int server_udp_port;       /* default 0, xtcp rendezvous of frps, 0 takes it from login */
+    int tcp_fast_open;         /* default 0, first message to frps rides in the SYN */
+    struct sock_tuning tcp;    /* tcp_nodelay, tcp_sndbuf... for all TCP sockets, see sockopt.h */
+    char *servers;             /* "host[:port], ..." frps in order of preference, over server_addr */
+    char *server_policy;       /* priority (default) or rtt */
+    int active_servers;        /* default 1, servers logged in to at once, proxies on each */
+    int server_probe_interval; /* default 30 s, TCP connect to idle servers, 0 never */
+    int control_sessions;      /* default 1, control connections per server, proxies sharded */
 
     /* private fields */
     int is_router;   // to sign router (Openwrt/LEDE) or not
@@ -71,8 +102,6 @@ void free_common_config();
 
 void free_base_config(struct base_conf *bconf);
 
-struct proxy_client *get_all_pc();
-
 void load_config(const char *confile);
 char *get_ftp_data_proxy_name(const char *ftp_proxy_name);
 void set_common_server_ip(const char *ip);
@@ -57,28 +57,30 @@
 #include "session.h"
 #include "common.h"
 #include "login.h"
+#include "addr_cache.h"
+#include "admin.h"
+#include "capture.h"
+#include "pool.h"
+#include "evmem.h"
+#include "tls.h"
+#include "uplink.h"
+#include "sockopt.h"
+#include "kcp_conn.h"
+#include "xtcp.h"
+#include "server_list.h"
 
 //全局主控
 static struct control *main_ctl;
-static int clients_conn_signel = 0;
+static int use_kcp;   // protocol = kcp
+static struct kcp_conn_conf kcp_conf;
 
-static void sync_new_work_connection(struct bufferevent *bev);
+static void sync_new_work_connection(struct bufferevent *bev, char *run_id);
 static void recv_cb(struct bufferevent *bev, void *ctx);
-
-static int is_client_connected()
-{
-    return clients_conn_signel;
-}
-
-static int client_connected(int is_connected)
-{
-    if (is_connected)
-        clients_conn_signel = 1;
-    else
-        clients_conn_signel = 0;
-
-    return clients_conn_signel;
-}
+static void ctl_recv_cb(struct bufferevent *bev, void *ctx);
+static void control_logged(struct ctl_session *sess);
+static void control_disconnected(struct ctl_session *sess);
+static void control_move(struct ctl_session *sess, int server);
+static void start_session_connect(struct ctl_session *sess);
 
 //更新client工作状态
 static int set_client_work_start(struct proxy_client *client, int is_start_work)
@@ -104,7 +106,7 @@ static void client_start_event_cb(struct bufferevent *bev, short what, void *ctx
 {
     struct proxy_client *client = ctx;
     assert(client);
-    struct common_conf *c_conf = get_common_config();
+    struct frps_server *srv = get_server(client->server);
 
 	//断开事件或者错误事件
     if (what & (BEV_EVENT_EOF | BEV_EVENT_ERROR)) {
@@ -113,12 +115,31 @@ static void client_start_event_cb(struct bufferevent *bev, short what, void *ctx
             bufferevent_free(client->ctl_bev);
             client->ctl_bev = NULL;
         }
-        debug(LOG_ERR, "Proxy connect server [%s:%d] error", c_conf->server_addr,
-              c_conf->server_port);
+        debug(LOG_ERR, "Proxy connect server [%s:%d] error", srv->addr, srv->port);
+        if (what & BEV_EVENT_ERROR)
+            main_ctl->work_conn_failures++;
+        // with fast open the handshake is still going on after CONNECTED,
+        // frps sends nothing on a work connection before StartWorkConn
+        if ((what & BEV_EVENT_ERROR) &&
+            (!client->trace[TS_FRPS_CONNECTED] ||
+             (uplink_fast_open_enabled() && !client->trace[TS_START_WORK_CONN])))
+            uplink_failed(client->uplink);
         bufferevent_free(bev);
-        free_proxy_client(client);
+        client->ctl_bev = NULL;
+        del_proxy_client(client);
     } else if (what & BEV_EVENT_CONNECTED) {
 		//状态:连接上了
+        // tcp connected, CONNECTED comes again when TLS handshake is done
+        if (tls_pending(bev)) {
+            client->ctl_bev = tls_wrap(bev, srv->addr);
+            if (!client->ctl_bev) {
+                main_ctl->work_conn_failures++;
+                del_proxy_client(client);
+            }
+            return;
+        }
+        tls_handshake_done(bev);
+        uplink_connected(bufferevent_getfd(bev));
 
 		//新增recv_cb事件处理, 传入client作为client_start_event_cb/recv_cb的参数
         bufferevent_setcb(bev, recv_cb, NULL, client_start_event_cb, client);
@@ -127,31 +148,36 @@ static void client_start_event_cb(struct bufferevent *bev, short what, void *ctx
         bufferevent_enable(bev, EV_READ | EV_WRITE);
 
 		//发送workconn消息和cmdSYN给对端
-        sync_new_work_connection(bev);
+        tunnel_stage(client, TS_FRPS_CONNECTED);
+        sync_new_work_connection(bev, main_ctl->sessions[client->session].run_id);
+        tunnel_stage(client, TS_NEW_WORK_CONN);
         debug(LOG_INFO, "proxy service start");
     }
 }
 
 
-//新的client连接
-static void new_client_connect()
+//新的client连接, on the server of the session asking for it
+static void new_client_connect(struct ctl_session *sess)
 {
 	//新建一个client信息结构
     struct proxy_client *client = new_proxy_client();
-    struct common_conf *c_conf  = get_common_config();
-    assert(c_conf);
-    client->base = main_ctl->connect_base;
+    struct frps_server *srv     = get_server(sess->server);
+    client->base    = main_ctl->connect_base;
+    client->session = sess->index;
+    client->server  = sess->server;
+    tunnel_stage(client, TS_REQ_WORK_CONN);
 
 	//连接服务器ip:port
-    struct bufferevent *bev =
-        connect_server(client->base, c_conf->server_addr, c_conf->server_port);
+    struct bufferevent *bev = connect_frps(client->base, srv, &client->uplink);
     if (!bev) {
-        debug(LOG_DEBUG, "Connect server [%s:%d] failed", c_conf->server_addr, c_conf->server_port);
+        debug(LOG_DEBUG, "Connect server [%s:%d] failed", srv->addr, srv->port);
+        main_ctl->work_conn_failures++;
+        uplink_failed(client->uplink);
+        del_proxy_client(client);
         return;
     }
 
-    debug(LOG_INFO, "work connection: connect server [%s:%d] ......", c_conf->server_addr,
-          c_conf->server_port);
+    debug(LOG_INFO, "work connection: connect server [%s:%d] ......", srv->addr, srv->port);
 
 	//设置这个client对应的bufferevent为新建立的连接的bufferevent
     client->ctl_bev = bev;
@@ -164,14 +190,32 @@ static void new_client_connect()
 }
 
 //开启proxy serivce()
-static void start_proxy_services()
+// proxies are spread over the shards by name, so a restart keeps each
+// one in the same shard
+static int proxy_shard(const struct proxy_service *ps)
+{
+    uint32_t h = 2166136261u;   // FNV-1a
+    const char *p;
+    for (p = ps->proxy_name; *p; p++)
+        h = (h ^ (uint8_t) *p) * 16777619u;
+    return h % main_ctl->shard_num;
+}
+
+// visitors are local listeners, frps does not know them
+static int session_owns(const struct ctl_session *sess, const struct proxy_service *ps)
+{
+    return !ps->is_visitor && proxy_shard(ps) == sess->shard;
+}
+
+static void start_proxy_services(struct ctl_session *sess)
 {
     struct proxy_service *all_ps = get_all_proxy_services();
     assert(all_ps);
 
     struct proxy_service *ps = NULL, *tmp = NULL;
 
-    debug(LOG_INFO, "Start xfrp proxy services ...");
+    debug(LOG_INFO, "session %d: start xfrp proxy services of shard %d ...", sess->index,
+          sess->shard);
 
 	//遍历所有的服务
     HASH_ITER(hh, all_ps, ps, tmp)
@@ -181,18 +225,21 @@ static void start_proxy_services()
             return;
         }
 
+        if (!session_owns(sess, ps))
+            continue;
+
 		//发送新的proxy服务
-        send_new_proxy(ps);
+        send_new_proxy(sess, ps);
     }
 }
 
 #ifdef USEENCRYPTION
-static void init_msg_writer()
+static void init_msg_writer(struct bufferevent *bev)
 {
     if (!is_encoder_inited()) {
         struct frp_coder *e = init_main_encoder();
         if (e)
-            sync_iv(e->iv);
+            sync_iv(bev, e->iv);
     }
 }
 
@@ -211,13 +258,7 @@ static void init_msg_reader(unsigned char *iv)
 static size_t request(struct bufferevent *bev, struct frame *f)
 {
     size_t write_len         = 0;
-    struct bufferevent *bout = NULL;
-
-    if (bev) {
-        bout = bev;
-    } else {
-        bout = main_ctl->connect_bev;
-    }
+    struct bufferevent *bout = bev;
 
     if (!bout)
         return 0;
@@ -230,6 +271,10 @@ static size_t request(struct bufferevent *bev, struct frame *f)
     if (0 == write_len)
         return 0;
 
+    // the pcapng has a single control stream, the first session's
+    if (bout == main_ctl->sessions[0].connect_bev)
+        capture_bytes(capture_control_stream(), CAPTURE_TX, f->data, write_len);
+
     //直接调用bufferevent往对应的ev发送数据
     bufferevent_write(bout, f->data, write_len);
     return write_len;
@@ -239,17 +284,7 @@ static size_t request(struct bufferevent *bev, struct frame *f)
 //
 static void base_control_ping(struct bufferevent *bev)
 {
-    if (!is_client_connected())
-        return;
-
-    struct bufferevent *bout = NULL;
-	//如果传入bufferevent，则用传入的bufferevent，否则直接往主控bufferevent发送
-    if (bev) {
-        bout = bev;
-    } else {
-        bout = main_ctl->connect_bev;
-    }
-
+    struct bufferevent *bout = bev;
     if (!bout) {
         debug(LOG_ERR, "bufferevent is not legal!");
         return;
@@ -263,16 +298,73 @@ static void base_control_ping(struct bufferevent *bev)
     free_frame(f);
 }
 
-//发送ping
-static void ping(struct bufferevent *bev)
+static void heartbeat_reset(struct heartbeat *hb)
 {
-    struct bufferevent *bout = NULL;
-    if (bev) {
-        bout = bev;
+    hb->pending_head = 0;
+    hb->pending_num  = 0;
+    hb->last_recv_at = get_monotonic_msec();
+}
+
+static void heartbeat_ping_sent(struct heartbeat *hb)
+{
+    // too many pings in flight, the oldest one is lost anyway
+    if (hb->pending_num == HB_PENDING_MAX) {
+        hb->pending_head = (hb->pending_head + 1) % HB_PENDING_MAX;
+        hb->pending_num--;
+    }
+
+    hb->pending[(hb->pending_head + hb->pending_num) % HB_PENDING_MAX] = get_monotonic_usec();
+    hb->pending_num++;
+    hb->pings++;
+}
+
+// rtt of the ping answered, 0 when none was in flight
+static uint32_t heartbeat_pong_recved(struct heartbeat *hb)
+{
+    uint64_t now     = get_monotonic_usec();
+    uint64_t timeout = (uint64_t) get_common_config()->heartbeat_timeout * 1000000;
+
+    // pings older than heartbeat_timeout will never be answered
+    while (hb->pending_num && now - hb->pending[hb->pending_head] > timeout) {
+        hb->pending_head = (hb->pending_head + 1) % HB_PENDING_MAX;
+        hb->pending_num--;
+    }
+
+    hb->pongs++;
+    if (!hb->pending_num) {
+        debug(LOG_DEBUG, "recv pong without ping in flight");
+        return 0;
+    }
+
+    uint64_t sent = hb->pending[hb->pending_head];
+    hb->pending_head = (hb->pending_head + 1) % HB_PENDING_MAX;
+    hb->pending_num--;
+
+    uint32_t rtt = (uint32_t) (now - sent);
+    if (!hb->srtt_us) {
+        hb->srtt_us   = rtt;
+        hb->rttvar_us = rtt / 2;
     } else {
-        bout = main_ctl->connect_bev;
+        uint32_t delta = rtt > hb->srtt_us ? rtt - hb->srtt_us : hb->srtt_us - rtt;
+        hb->rttvar_us  = (3 * hb->rttvar_us + delta) / 4;
+        hb->srtt_us    = (7 * hb->srtt_us + rtt) / 8;
     }
 
+    hb->last_rtt_us                  = rtt;
+    hb->history[hb->history_idx]     = rtt;
+    hb->history_idx                  = (hb->history_idx + 1) % HB_RTT_HISTORY;
+    if (hb->history_num < HB_RTT_HISTORY)
+        hb->history_num++;
+
+    debug(LOG_DEBUG, "heartbeat rtt %u us, srtt %u us, jitter %u us", rtt, hb->srtt_us,
+          hb->rttvar_us);
+    return rtt;
+}
+
+//发送ping
+static void ping(struct ctl_session *sess)
+{
+    struct bufferevent *bout = sess->connect_bev;
     if (!bout) {
         debug(LOG_ERR, "bufferevent is not legal!");
         return;
@@ -290,19 +382,14 @@ static void ping(struct bufferevent *bev)
     char *ping_msg = "{}";
 
 	//发送TypePing类型包
-    send_msg_frp_server(bev, TypePing, ping_msg, strlen(ping_msg), sid);
+    send_msg_frp_server(bout, TypePing, ping_msg, strlen(ping_msg), sid);
+    heartbeat_ping_sent(&sess->hb);
 }
 
 //回送PONG
 static void pong(struct bufferevent *bev, struct frame *f)
 {
-    struct bufferevent *bout = NULL;
-    if (bev) {
-        bout = bev;
-    } else {
-        bout = main_ctl->connect_bev;
-    }
-
+    struct bufferevent *bout = bev;
     if (!bout) {
         debug(LOG_ERR, "bufferevent is not legal!");
         return;
@@ -321,15 +408,9 @@ static void pong(struct bufferevent *bev, struct frame *f)
 
 
 //同步新的work connection
-static void sync_new_work_connection(struct bufferevent *bev)
+static void sync_new_work_connection(struct bufferevent *bev, char *run_id)
 {
-    struct bufferevent *bout = NULL;
-    if (bev) {
-        bout = bev;
-    } else {
-        bout = main_ctl->connect_bev;
-    }
-
+    struct bufferevent *bout = bev;
     if (!bout) {
         debug(LOG_ERR, "bufferevent is not legal!");
         return;
@@ -342,7 +423,7 @@ static void sync_new_work_connection(struct bufferevent *bev)
 
     struct work_conn *work_c = new_work_conn();
     assert(work_c);
-    work_c->run_id = get_run_id();
+    work_c->run_id = run_id;
     if (!work_c->run_id) {
         debug(LOG_ERR, "cannot found run ID, it should inited when login!");
         SAFE_FREE(work_c);
@@ -354,11 +435,14 @@ static void sync_new_work_connection(struct bufferevent *bev)
     int nret = new_work_conn_marshal(work_c, &new_work_conn_request_message);
     if (0 == nret) {
         debug(LOG_ERR, "new work connection request run_id marshal failed!");
+        free_frame(f);
+        SAFE_FREE(work_c);
         return;
     }
 
 	//发送NewWorkConn请求给frps服务器
     send_msg_frp_server(bev, TypeNewWorkConn, new_work_conn_request_message, nret, f->sid);
+    SAFE_FREE(new_work_conn_request_message);
 
 	//发送cmdSYN消息
     request(bout, f);
@@ -367,18 +451,80 @@ static void sync_new_work_connection(struct bufferevent *bev)
     SAFE_FREE(work_c);
 }
 
-//连接proxy server
-struct bufferevent *connect_server(struct event_base *base, const char *name, const int port)
+// dial that waits for the address cache, bev is held until the lookup ends
+struct pending_dial {
+    struct bufferevent *bev;
+    evutil_socket_t fd;   // socket given to dial, set on bev once there is an address
+    int port;
+};
+
+static void dial_resolved(const char *host, const struct sockaddr_in *sin, void *arg)
+{
+    struct pending_dial *pd = arg;
+    struct bufferevent *bev = pd->bev;
+    bufferevent_event_cb eventcb;
+    void *ctx;
+
+    // bufferevent_free clears the callbacks, every caller of dial sets one
+    bufferevent_getcb(bev, NULL, NULL, &eventcb, &ctx);
+    if (!eventcb) {
+        if (pd->fd >= 0)
+            evutil_closesocket(pd->fd);
+    } else if (sin) {
+        struct sockaddr_in to = *sin;
+        to.sin_port           = htons(pd->port);
+        if (pd->fd >= 0)
+            bufferevent_setfd(bev, pd->fd);
+        if (bufferevent_socket_connect(bev, (struct sockaddr *) &to, sizeof(to)) < 0)
+            eventcb(bev, BEV_EVENT_ERROR, ctx);
+    } else {
+        debug(LOG_ERR, "error: can not resolve [%s]", host);
+        if (pd->fd >= 0)
+            evutil_closesocket(pd->fd);
+        eventcb(bev, BEV_EVENT_ERROR, ctx);
+    }
+
+    bufferevent_decref(bev);
+    SAFE_FREE(pd);
+}
+
+// fd -1 lets libevent open a plain TCP socket
+static struct bufferevent *dial(struct event_base *base, evutil_socket_t fd, const char *name,
+                                const int port)
 {
     //生成bufferevent io base结构
-    struct bufferevent *bev = bufferevent_socket_new(base, -1, BEV_OPT_CLOSE_ON_FREE);
+    struct bufferevent *bev = bufferevent_socket_new(base, fd, BEV_OPT_CLOSE_ON_FREE);
     assert(bev);
 
-    //连接name:port
-    if (bufferevent_socket_connect_hostname(bev, main_ctl->dnsbase, AF_INET, name, port) < 0) {
+    // dial the cached address directly, no DNS on the hot path
+    struct sockaddr_in sin;
+    if (addr_cache_lookup(name, port, &sin)) {
+        if (bufferevent_socket_connect(bev, (struct sockaddr *) &sin, sizeof(sin)) < 0) {
+            bufferevent_free(bev);
+            return NULL;
+        }
 
-        bufferevent_free(bev);
+        return bev;
+    }
+
+    //连接name:port, cache is cold or expired, addr_cache_lookup has started refreshing it;
+    // wait for that lookup instead of sending one more. The socket stays off bev until
+    // then, reads enabled on an unconnected socket would see a hangup
+    struct pending_dial *pd = calloc(1, sizeof(struct pending_dial));
+    assert(pd);
+    pd->bev  = bev;
+    pd->fd   = bufferevent_getfd(bev);
+    pd->port = port;
+    if (pd->fd >= 0)
+        bufferevent_setfd(bev, -1);
+    bufferevent_incref(bev);
+    if (addr_cache_wait(name, dial_resolved, pd) < 0) {
+        if (pd->fd >= 0)
+            evutil_closesocket(pd->fd);
+        bufferevent_decref(bev);
+        SAFE_FREE(pd);
         //失败
+        bufferevent_free(bev);
         return NULL;
     }
 
@@ -386,6 +532,38 @@ struct bufferevent *connect_server(struct event_base *base, const char *name, co
     return bev;
 }
 
+//连接proxy server
+struct bufferevent *connect_server(struct event_base *base, const char *name, const int port,
+                                   const struct proxy_service *ps)
+{
+    evutil_socket_t fd = ps && ps->tcp_fast_open ? open_fast_open_socket() : -1;
+    fd = ps ? sock_tuning_socket(fd, &ps->tcp, ps->proxy_name)
+            : sock_tuning_socket(fd, &get_common_config()->tcp, name);
+    return dial(base, fd, name, port);
+}
+
+// no DNS on a datagram dial, a cold cache fails it and the caller retries
+// once addr_cache_lookup has refreshed the address
+static struct bufferevent *dial_kcp(struct event_base *base, const char *name, const int port)
+{
+    struct sockaddr_in sin;
+    if (!addr_cache_lookup(name, port, &sin))
+        return NULL;
+
+    return kcp_connect(base, &kcp_conf, &sin);
+}
+
+// control and work connections, the uplink decides the socket
+struct bufferevent *connect_frps(struct event_base *base, const struct frps_server *srv,
+                                 int *uplink)
+{
+    if (use_kcp)
+        return dial_kcp(base, srv->addr, srv->port);
+    evutil_socket_t fd =
+        sock_tuning_socket(uplink_socket(uplink), &get_common_config()->tcp, "frps");
+    return dial(base, fd, srv->addr, srv->port);
+}
+
 static void set_ticker_ping_timer(struct event *timeout)
 {
     struct timeval tv;
@@ -395,24 +573,85 @@ static void set_ticker_ping_timer(struct event *timeout)
     event_add(timeout, &tv);
 }
 
+// servers the other sessions of the shard are on or heading to
+static uint32_t busy_servers(const struct ctl_session *sess)
+{
+    uint32_t busy = 0;
+    int i;
+    for (i = 0; i < main_ctl->session_num; i++) {
+        const struct ctl_session *o = &main_ctl->sessions[i];
+        if (o != sess && o->shard == sess->shard && o->server >= 0)
+            busy |= 1u << o->server;
+    }
+    return busy;
+}
+
+static void session_heartbeat(struct ctl_session *sess)
+{
+    struct common_conf *c_conf = get_common_config();
+    if (sess->state == CTL_DISCONNECTED) {
+        // a probe found a server answering while this session backs off
+        int srv = server_pick(busy_servers(sess));
+        if (srv >= 0 && get_server(srv)->probe_ok && server_is_up(srv) &&
+            evtimer_pending(sess->ev_reconnect, NULL)) {
+            event_del(sess->ev_reconnect);
+            if (sess->server >= 0 && srv != sess->server)
+                sess->switches++;
+            sess->server = srv;
+            start_session_connect(sess);
+        }
+        return;
+    }
+
+    // half-open control connection, or a login that never finishes:
+    // nothing from frps for heartbeat_timeout
+    if (get_monotonic_msec() - sess->hb.last_recv_at >
+        (uint64_t) c_conf->heartbeat_timeout * 1000) {
+        debug(LOG_ERR, "error: no message from xfrp server in %d seconds, reconnect",
+              c_conf->heartbeat_timeout);
+        sess->hb.timeouts++;
+        control_disconnected(sess);
+        return;
+    }
+    if (sess->state != CTL_LOGGED)
+        return;
+
+    // a few rtt samples first, and no flapping right after a move
+    int better = -1;
+    if (sess->hb.pongs - sess->pongs_at_login >= SERVER_SETTLE_PONGS)
+        better = server_better(sess->server, busy_servers(sess));
+    if (better >= 0) {
+        control_move(sess, better);
+        return;
+    }
+
+	//主控keepalive ping-pong, 如果client连接，则ping
+    if (sess->proxies_started) {
+        base_control_ping(sess->connect_bev);
+        ping(sess);
+    }
+}
+
 static void hb_sender_cb(evutil_socket_t fd, short event, void *arg)
 {
-	//主控keepalive ping-pong
-    base_control_ping(NULL);
-	//如果client连接，则ping
-    if (is_client_connected())
-        ping(NULL);
+    int i;
+    for (i = 0; i < main_ctl->session_num; i++)
+        session_heartbeat(&main_ctl->sessions[i]);
 
 	//设置下一次timer事件
     set_ticker_ping_timer(main_ctl->ticker_ping);
 }
 
 // return: 0: raw succeed 1: raw failed
-static int proxy_service_resp_raw(struct new_proxy_response *npr)
+static int proxy_service_resp_raw(struct new_proxy_response *npr, struct ctl_session *sess)
 {
 	//检查error
     if (npr->error && strlen(npr->error) > 2) {
         debug(LOG_ERR, "error: new proxy response error_field:%s", npr->error);
+        struct proxy_service *failed_ps =
+            npr->proxy_name ? get_proxy_service(npr->proxy_name) : NULL;
+        if (failed_ps && !failed_ps->stats.reg_sessions)
+            failed_ps->stats.reg_state = PS_REG_FAILED;
         return 1;
     }
 
@@ -454,11 +693,15 @@ static int proxy_service_resp_raw(struct new_proxy_response *npr)
         main_ps->remote_data_port = npr->remote_port;
     }
 
+    ps->stats.reg_state = PS_REG_OK;
+    ps->stats.reg_sessions |= 1u << sess->index;
     return 0;
 }
 
 // msg为json消息字符串, 这里是原始的消息处理
-static void raw_message(struct message *msg, struct bufferevent *bev, struct proxy_client *client)
+// sess is the control session when msg came on its connection, NULL on a work connection
+static void raw_message(struct message *msg, struct bufferevent *bev, struct proxy_client *client,
+                        struct ctl_session *sess)
 {
     if (client) {// 来自client的消息
         if (client->work_started) {
@@ -471,6 +714,8 @@ static void raw_message(struct message *msg, struct bufferevent *bev, struct pro
 
         //如果收到的是登录Response
         case TypeLoginResp:
+            if (!sess)
+                break;
             if (msg->data_p == NULL) {
                 debug(LOG_ERR, "recved TypeLoginResp but no data, it should be never happend!");
                 break;
@@ -487,7 +732,7 @@ static void raw_message(struct message *msg, struct bufferevent *bev, struct pro
             int is_logged = login_resp_check(lr);
 #ifdef USEENCRYPTION
             if (is_logged) {
-                init_msg_writer();
+                init_msg_writer(bev);
             }
 #endif   // USEENCRYPTION
 
@@ -495,37 +740,44 @@ static void raw_message(struct message *msg, struct bufferevent *bev, struct pro
                 //登录失败,则重新调用login
                 debug(LOG_ERR, "xfrp login failed, try again!");
 				
-                login();
-                SAFE_FREE(lr);
+                login(sess);
                 return;
             }
 
-			//登录成功
-            SAFE_FREE(lr);
+			//登录成功, later logins ask frps for the same run_id
+            SAFE_FREE(sess->run_id);
+            sess->run_id = strdup(lr->run_id);
+            assert(sess->run_id);
+            get_server(sess->server)->udp_port = lr->server_udp_port;
+            control_logged(sess);
             break;
 
         // ReqWorkConn类型事件 
         case TypeReqWorkConn: //请求WorkConnection
+            if (!sess)
+                break;
 
 			//如果没有client连上来，表示本地的proxy服务没有开启，那么需要先开启下
-            if (!is_client_connected()) {
+            if (!sess->proxies_started) {
 
                 //开启proxy services
-                start_proxy_services();
+                start_proxy_services(sess);
 
                 //设置client已经连上
-                client_connected(1);
+                sess->proxies_started = 1;
 
                 //发送PING消息
-                ping(bev);
+                ping(sess);
             }
 
             //新的client连上来
-            new_client_connect();
+            new_client_connect(sess);
             break;
 
         // NewProxyResp类型事件, 上一个ReqWorkConn中初始会发送TypeNewProxy消息给frps服务器,这里收到返回
         case TypeNewProxyResp: {
+            if (!sess)
+                break;
             if (msg->data_p == NULL) {
                 debug(LOG_ERR, "recved TypeNewProxyResp but no data, it should be never happend!");
                 break;
@@ -539,9 +791,7 @@ static void raw_message(struct message *msg, struct bufferevent *bev, struct pro
             }
 
 			//proxy_service_resp消息检查
-            proxy_service_resp_raw(npr);
-
-            SAFE_FREE(npr);
+            proxy_service_resp_raw(npr, sess);
             break;
         }
 
@@ -572,6 +822,12 @@ static void raw_message(struct message *msg, struct bufferevent *bev, struct pro
 
 			// 如果有这个服务,则为相应client->ps赋值proxy service
             client->ps = ps;
+
+            // no tunnel on it, frps sends a NatHoleSid next
+            if (is_xtcp_proxy(ps))
+                break;
+
+            tunnel_stage(client, TS_START_WORK_CONN);
             debug(LOG_INFO, "proxy service [%s] [%s:%d] start work connection.", sr->proxy_name,
                   ps->local_ip, ps->local_port);
 
@@ -583,21 +839,42 @@ static void raw_message(struct message *msg, struct bufferevent *bev, struct pro
             set_client_work_start(client, 1);
             break;
 
+        // a visitor wants a direct path, punch towards it
+        case TypeNatHoleSid:
+            if (!client || !is_xtcp_proxy(client->ps) || !client->ctl_bev)
+                break;
+
+            xtcp_serve(client->base, client->ps, client->server,
+                       nat_hole_sid_unmarshal(msg->data_p));
+
+            // frps is done with this work connection, recv_cb deletes the client
+            bufferevent_free(client->ctl_bev);
+            client->ctl_bev = NULL;
+            break;
+
         //相应PING-PONG
         case TypePong:
+            if (sess) {
+                uint32_t rtt = heartbeat_pong_recved(&sess->hb);
+                if (rtt)
+                    server_rtt_sample(sess->server, rtt);
+            }
+            break;
+
+        case TypePing:
             pong(bev, NULL);
             break;
 
         default:
             break;
     }
-    SAFE_FREE(sr);
 }
 
 //数据handler, 直接处理数据段
-static size_t data_handler(unsigned char *buf, ushort len, struct proxy_client *client)
+static size_t data_handler(unsigned char *buf, ushort len, struct proxy_client *client,
+                           struct ctl_session *sess)
 {
-    struct bufferevent *bev = NULL;
+    struct bufferevent *bev = sess ? sess->connect_bev : NULL;
     if (client) {
 		//如果client非空,则表示由client bufferevent接收处理
         debug(LOG_DEBUG, "client(%s): recved control data",
@@ -636,7 +913,7 @@ static size_t data_handler(unsigned char *buf, ushort len, struct proxy_client *
 
 	//检查frame是否空
     if (f == NULL) {
-        debug(LOG_ERR, "raw_frame faild!");
+        debug_ratelimit(LOG_ERR, "raw_frame faild!");
         goto DATA_H_END;
     }
 
@@ -731,17 +1008,16 @@ static size_t data_handler(unsigned char *buf, ushort len, struct proxy_client *
             //实际数据push过来了,先unpack
             msg = unpack(ret_buf, f->len);
             if (!(msg && msg->data_p)) { // msg有问题,忽略此消息
-                debug(LOG_ERR, "message received format invalid");
+                debug_ratelimit(LOG_ERR, "message received format invalid");
                 goto DATA_H_END;
             }
             debug(LOG_DEBUG, "recv <---- %c: %s", msg->type, msg->data_p);
 
-			//TODO: 这里有内存泄漏,需要safe_free(msg)
             if (msg->data_p == NULL)
                 goto DATA_H_END;
 
             //将raw消息解开,并进行相应处理
-            raw_message(msg, bev, client);
+            raw_message(msg, bev, client, sess);
             break;
         default:
             break;
@@ -750,8 +1026,8 @@ static size_t data_handler(unsigned char *buf, ushort len, struct proxy_client *
     
 
 DATA_H_END:
-	//TODO: 移到这里来好了
-	SAFE_FREE(msg);
+	// msg and everything decoded from it are gone after this
+	msg_decode_reset();
 	
     free_frame(f);
 
@@ -763,7 +1039,7 @@ DATA_H_END:
 // ctx: if recv_cb was called by common control, ctx is NULL
 //		when ctx is not NULL it was called by client struct
 static unsigned char *multy_recv_buffer_raw(unsigned char *buf, size_t buf_len, size_t *ret_len,
-                                            void *ctx)
+                                            void *ctx, struct ctl_session *sess)
 {
     unsigned char *unraw_buf_p = NULL;
     unsigned char *raw_buf     = NULL;
@@ -787,7 +1063,7 @@ static unsigned char *multy_recv_buffer_raw(unsigned char *buf, size_t buf_len,
 
     for (;;) {
         if (buf_len > split_lv) { //解析数据,判断长度是否有效
-            if (!is_logged()) {
+            if (sess && sess->state != CTL_LOGGED) {
 				//如果未登陆
                 if (buf[0] == TypeLoginResp) { //49是登录请求的回应
                     msg_size_t data_len_bigend;
@@ -829,7 +1105,7 @@ static unsigned char *multy_recv_buffer_raw(unsigned char *buf, size_t buf_len,
                     splited   = 1;
                 } else {
 					//类型检查错误
-                    debug(LOG_ERR, "buffer type [%c] raw failed!", msg_type);
+                    debug_ratelimit(LOG_ERR, "buffer type [%c] raw failed!", msg_type);
                 }
                 break;
             }
@@ -839,7 +1115,7 @@ static unsigned char *multy_recv_buffer_raw(unsigned char *buf, size_t buf_len,
 
     if (!splited) {
         //数据未分离,直接处理返回
-        data_handler(buf, buf_len, ctx);
+        data_handler(buf, buf_len, ctx, sess);
         *ret_len = 0;
         return NULL;
 
@@ -853,7 +1129,7 @@ static unsigned char *multy_recv_buffer_raw(unsigned char *buf, size_t buf_len,
     if (split_len != 0 && raw_buf != NULL) {
 
 		//处理分离出的数据段
-        data_handler(raw_buf, split_len, ctx);
+        data_handler(raw_buf, split_len, ctx, sess);
         free(raw_buf);
 
 		//剩余数据段
@@ -867,23 +1143,61 @@ static unsigned char *multy_recv_buffer_raw(unsigned char *buf, size_t buf_len,
     return unraw_buf_p;
 }
 
+#ifndef USEENCRYPTION
+// bytes of the whole messages at the head of input, a message the socket
+// cut in two stays in input until the rest of it comes; -1 on a header no
+// frps sends, waiting for its length would stall the session
+static ssize_t complete_msgs_len(struct evbuffer *input)
+{
+    size_t total = evbuffer_get_length(input), off = 0;
+    unsigned char head[1 + sizeof(msg_size_t)];
+    struct evbuffer_ptr pos;
+
+    while (total - off >= sizeof(head)) {
+        evbuffer_ptr_set(input, &pos, off, EVBUFFER_PTR_SET);
+        evbuffer_copyout_from(input, &pos, head, sizeof(head));
+        msg_size_t data_len_bigend;
+        memcpy(&data_len_bigend, head + MSG_LEN_I, sizeof(data_len_bigend));
+        msg_size_t data_len = msg_ntoh(data_len_bigend);
+        if (!msg_type_valid_check(head[MSG_TYPE_I]) || data_len > MSG_DATA_MAX)
+            return -1;
+        if (data_len > total - off - sizeof(head))
+            break;
+        off += sizeof(head) + data_len;
+    }
+    return off;
+}
+#endif   // USEENCRYPTION
+
 // 非常重要的recv_cb回调事件
-// 如果ctx为NULL,表示数据callback从common ctrl来
-// 如果ctx非空,表示数据callback从client回调来的
-// ctx: if recv_cb was called by common control, ctx == NULL
-//		else ctx == client struct
-static void recv_cb(struct bufferevent *bev, void *ctx)
+// 如果sess非空,表示数据callback从common ctrl来
+// 如果client非空,表示数据callback从client回调来的
+static void recv_data(struct bufferevent *bev, struct proxy_client *client,
+                      struct ctl_session *sess)
 {
     // 拿到evbuffer,获取buffer长度
     struct evbuffer *input = bufferevent_get_input(bev);
     int len                = evbuffer_get_length(input);
 
-    //长度< 0 则直接返回不响应
-    if (len < 0) {
-        return;
+    if (sess) {
+        sess->hb.last_recv_at = get_monotonic_msec();
+#ifndef USEENCRYPTION
+        // thousands of NewProxyResp at startup do not fit one read
+        ssize_t whole = complete_msgs_len(input);
+        if (whole < 0) {
+            debug(LOG_ERR, "error: session %d: bad message header from xfrp server, reconnect",
+                  sess->index);
+            control_disconnected(sess);
+            return;
+        }
+        len = (int) whole;
+#endif   // USEENCRYPTION
     }
 
-    //如果长度len==0呢, 这里感觉有个bug， 直接在上面的判断中加 <= 0
+    //长度<= 0 则直接返回不响应
+    if (len <= 0) {
+        return;
+    }
 
     //构造buffer缓冲
     unsigned char *buf = calloc(1, len);
@@ -895,8 +1209,8 @@ static void recv_cb(struct bufferevent *bev, void *ctx)
     //从evbuffer中读取len长度的数据到buf中
     read_n = evbuffer_remove(input, buf, len);
 
-    //
-    struct proxy_client *client = (struct proxy_client *) ctx;
+    if (sess && sess->index == 0)
+        capture_bytes(capture_control_stream(), CAPTURE_RX, buf, read_n);
 
     //如果拿到的size > 0
     if (read_n) {
@@ -918,14 +1232,14 @@ static void recv_cb(struct bufferevent *bev, void *ctx)
 #endif   // CONN_DEBUG
 
             //进行数据处理，返回剩余部分数据
-            raw_buf_p = multy_recv_buffer_raw(raw_buf_p, read_n, &ret_len, client);
+            raw_buf_p = multy_recv_buffer_raw(raw_buf_p, read_n, &ret_len, client, sess);
 
 			//剩余未处理部分
             read_n    = ret_len;
 
-            if (ctx && is_client_work_started(client) && raw_buf_p && ret_len) {
+            if (client && is_client_work_started(client) && raw_buf_p && ret_len) {
 
-                debug(LOG_WARNING, "warning: data recved from frps is not split clear");
+                debug_ratelimit(LOG_WARNING, "warning: data recved from frps is not split clear");
                 unsigned char *dtail = calloc(1, read_n);
                 assert(dtail);
 
@@ -948,10 +1262,26 @@ static void recv_cb(struct bufferevent *bev, void *ctx)
     }
     SAFE_FREE(buf);
 
+    // local service refused the tunnel, its work connection is already freed
+    if (client && !client->ctl_bev)
+        del_proxy_client(client);
+
     return;
 }
 
-//开始一个新的session
+// ctx: client struct of a work connection
+static void recv_cb(struct bufferevent *bev, void *ctx)
+{
+    recv_data(bev, ctx, NULL);
+}
+
+// ctx: control session
+static void ctl_recv_cb(struct bufferevent *bev, void *ctx)
+{
+    recv_data(bev, NULL, ctx);
+}
+
+//开始一个新的session (tcp_mux)
 static void open_connection_session(struct bufferevent *bev)
 {
     // SYN frame
@@ -965,37 +1295,136 @@ static void open_connection_session(struct bufferevent *bev)
     free_frame(f);
 }
 
-// connect callback回调
-static void connect_event_cb(struct bufferevent *bev, short what, void *ctx)
+static void reconnect_cb(evutil_socket_t fd, short event, void *arg)
 {
-    struct common_conf *c_conf = get_common_config();
-    static int retry_times     = 0;
+    start_session_connect(arg);
+}
 
-    //状态, EOF || ERROR
-    if (what & (BEV_EVENT_EOF | BEV_EVENT_ERROR)) {
+// another server that is up is dialed at once, otherwise
+// exponential backoff with equal jitter: [delay/2, delay]
+static void schedule_reconnect(struct ctl_session *sess)
+{
+    int prev     = sess->server;
+    sess->server = server_pick(busy_servers(sess));
+    if (prev >= 0 && sess->server >= 0 && sess->server != prev)
+        sess->switches++;
 
-        //重试10次,失败则退出
-        if (retry_times >= 10) {   // only try 10 times consecutively
-            debug(LOG_ERR, "have retry connect to xfrp server for %d times, exit!", retry_times);
+    long delay_ms = 0;
+    if (sess->server < 0 || !server_is_up(sess->server)) {
+        int shift = sess->retry_times < 6 ? sess->retry_times : 6;
+        delay_ms  = (long) RECONNECT_DELAY_MIN * 1000 << shift;
+        if (delay_ms > RECONNECT_DELAY_MAX * 1000)
+            delay_ms = RECONNECT_DELAY_MAX * 1000;
 
-            exit(0);
-        }
+        uint32_t rnd = 0;
+        evutil_secure_rng_get_bytes(&rnd, sizeof(rnd));
+        delay_ms = delay_ms / 2 + rnd % (delay_ms / 2 + 1);
+    }
 
-        retry_times++;
-        debug(LOG_ERR, "error: connect server [%s:%d] failed", c_conf->server_addr,
-              c_conf->server_port);
+    sess->retry_times++;
+    sess->state = CTL_DISCONNECTED;
 
-        //释放失败的control
-        free_control();
+    struct timeval tv;
+    tv.tv_sec  = delay_ms / 1000;
+    tv.tv_usec = (delay_ms % 1000) * 1000;
+    event_add(sess->ev_reconnect, &tv);
 
-        //继续初始化,开始重试
-        init_main_control();
-        start_base_connect();
-        close_main_control();
-    } else if (what & BEV_EVENT_CONNECTED) {
+    debug(LOG_INFO, "session %d: reconnect xfrp server in %ld ms (retry %d)", sess->index,
+          delay_ms, sess->retry_times);
+}
 
-        //状态是CONNECTED,重置retry
-        retry_times = 0;
+// drop control connection only, work connections keep running in the same base
+static void control_close(struct ctl_session *sess)
+{
+    if (sess->connect_bev) {
+        uplink_conn_closed(bufferevent_getfd(sess->connect_bev), -1);
+        bufferevent_free(sess->connect_bev);
+        sess->connect_bev = NULL;
+    }
+
+    if (sess->state == CTL_LOGGED) {
+        sess->disconnected_at = get_monotonic_msec();
+        server_left(sess->server);
+    }
+    sess->state = CTL_DISCONNECTED;
+
+    // proxies will be registered again after next login
+    uint32_t bit = 1u << sess->index;
+    struct proxy_service *ps = NULL, *tmp = NULL, *all_ps = get_all_proxy_services();
+    HASH_ITER(hh, all_ps, ps, tmp)
+    {
+        if (!session_owns(sess, ps))
+            continue;
+        ps->stats.reg_sessions &= ~bit;
+        if (!ps->stats.reg_sessions)
+            ps->stats.reg_state = PS_REG_NONE;
+    }
+    sess->proxies_started = 0;
+}
+
+// connect, login or heartbeat failed, the next pick skips the server for a while
+static void control_disconnected(struct ctl_session *sess)
+{
+    server_failed(sess->server);
+    control_close(sess);
+    schedule_reconnect(sess);
+}
+
+// server is healthy, but policy prefers another one now
+static void control_move(struct ctl_session *sess, int server)
+{
+    struct frps_server *from = get_server(sess->server), *to = get_server(server);
+    debug(LOG_INFO, "session %d: moving from xfrp server [%s:%d] to [%s:%d]", sess->index,
+          from->addr, from->port, to->addr, to->port);
+
+    control_close(sess);
+    sess->server      = server;
+    sess->retry_times = 0;
+    sess->switches++;
+    start_session_connect(sess);
+}
+
+// login response accepted
+static void control_logged(struct ctl_session *sess)
+{
+    sess->state       = CTL_LOGGED;
+    sess->retry_times = 0;
+    heartbeat_reset(&sess->hb);
+    sess->pongs_at_login = sess->hb.pongs;
+    server_logged(sess->server);
+
+    struct frps_server *srv = get_server(sess->server);
+    debug(LOG_INFO, "session %d: logged in to xfrp server [%s:%d], run_id [%s]", sess->index,
+          srv->addr, srv->port, sess->run_id);
+    if (sess->disconnected_at) {
+        sess->last_recovery_ms = get_monotonic_msec() - sess->disconnected_at;
+        sess->disconnected_at  = 0;
+        debug(LOG_INFO, "control connection recovered in %llu ms",
+              (unsigned long long) sess->last_recovery_ms);
+    }
+}
+
+// connect callback回调, ctx: control session
+static void connect_event_cb(struct bufferevent *bev, short what, void *ctx)
+{
+    struct ctl_session *sess = ctx;
+    struct frps_server *srv  = get_server(sess->server);
+
+    //状态, EOF || ERROR
+    if (what & (BEV_EVENT_EOF | BEV_EVENT_ERROR)) {
+        debug(LOG_ERR, "error: connect server [%s:%d] failed", srv->addr, srv->port);
+
+        //重连, on the same event base, tunnels already working are not touched
+        control_disconnected(sess);
+    } else if (what & BEV_EVENT_CONNECTED) {
+        if (tls_pending(bev)) {
+            sess->connect_bev = tls_wrap(bev, srv->addr);
+            if (!sess->connect_bev)
+                control_disconnected(sess);
+            return;
+        }
+        tls_handshake_done(bev);
+        uplink_connected(bufferevent_getfd(bev));
 
         // 设置新的bev, callback事件
         // void bufferevent_setcb(struct bufferevent *bufev,
@@ -1005,9 +1434,9 @@ static void connect_event_cb(struct bufferevent *bev, short what, void *ctx)
         // 设置read,write,event事件回调
         //
         // 最主要的事件在recv_cb回调中
-        // 增加recv_cb到connect bufferevent中
+        // 增加ctl_recv_cb到connect bufferevent中
         // recv login-response message before recving othfer fprs messages,
-        bufferevent_setcb(bev, recv_cb, NULL, connect_event_cb, NULL);
+        bufferevent_setcb(bev, ctl_recv_cb, NULL, connect_event_cb, sess);
 
         //开启读写,并持久Persist,不清除读写标志
         bufferevent_enable(bev, EV_READ | EV_WRITE | EV_PERSIST);
@@ -1017,7 +1446,7 @@ static void connect_event_cb(struct bufferevent *bev, short what, void *ctx)
             open_connection_session(bev);
 
         //登录
-        login();
+        login(sess);
     }
 }
 
@@ -1032,62 +1461,52 @@ static void keep_control_alive()
     set_ticker_ping_timer(main_ctl->ticker_ping);
 }
 
-// dns callback dns回调,对返回addr进行解析
-static void server_dns_cb(int event_code, struct evutil_addrinfo *addr, void *ctx)
+// dns callback dns回调, server_ip is used by ftp proxy
+static void server_dns_cb(const char *host, const struct sockaddr_in *sin, void *ctx)
 {
-    if (event_code) {
-        set_common_server_ip((const char *) evutil_gai_strerror(event_code));
-    } else {
-        struct evutil_addrinfo *ai;
-        if (addr->ai_canonname)
-            debug(LOG_DEBUG, "addr->ai_canonname [%s]", addr->ai_canonname);
-        for (ai = addr; ai; ai = ai->ai_next) {
-            char buf[128];
-            const char *s = NULL;
-            if (ai->ai_family == AF_INET) {
-                struct sockaddr_in *sin = (struct sockaddr_in *) ai->ai_addr;
-                s                       = evutil_inet_ntop(AF_INET, &sin->sin_addr, buf, 128);
-            } else if (ai->ai_family == AF_INET6) {
-                struct sockaddr_in6 *sin6 = (struct sockaddr_in6 *) ai->ai_addr;
-                s                         = evutil_inet_ntop(AF_INET6, &sin6->sin6_addr, buf, 128);
-            }
-
-            if (s)
-                set_common_server_ip(s);
-        }
-        if (addr)
-            evutil_freeaddrinfo(addr);
-    }
+    char buf[128];
+    const char *s = evutil_inet_ntop(AF_INET, &sin->sin_addr, buf, sizeof(buf));
+    if (s)
+        set_common_server_ip(s);
 }
 
 
 //连接到server的ip:port
-void start_base_connect()
+static void start_session_connect(struct ctl_session *sess)
 {
-    struct common_conf *c_conf = get_common_config();
+    if (sess->server < 0)
+        sess->server = server_pick(busy_servers(sess));
+    if (sess->server < 0) {
+        schedule_reconnect(sess);
+        return;
+    }
 
-    //连接server,connect_bev存入主控结构
-    main_ctl->connect_bev =
-        connect_server(main_ctl->connect_base, c_conf->server_addr, c_conf->server_port);
-    //连接失败,则退出
-    if (!main_ctl->connect_bev) {
-        debug(LOG_ERR, "error: connect server [%s:%d] failed", c_conf->server_addr,
-              c_conf->server_port);
-        exit(0);
+    struct frps_server *srv = get_server(sess->server);
+    sess->state             = CTL_CONNECTING;
+    sess->hb.last_recv_at   = get_monotonic_msec();
+    if (sess->index == 0)
+        capture_control_reset(srv->port);
+
+    //连接server,connect_bev存入session
+    sess->connect_bev = connect_frps(main_ctl->connect_base, srv, NULL);
+    //连接失败,则稍后重试
+    if (!sess->connect_bev) {
+        debug(LOG_ERR, "error: connect server [%s:%d] failed", srv->addr, srv->port);
+        control_disconnected(sess);
+        return;
     }
 
-    debug(LOG_INFO, "connect server [%s:%d]...", c_conf->server_addr, c_conf->server_port);
+    debug(LOG_INFO, "session %d: connect server [%s:%d]...", sess->index, srv->addr, srv->port);
 
     //连接成功后,开启bufferevent io的读写
-    bufferevent_enable(main_ctl->connect_bev, EV_WRITE | EV_READ);
+    bufferevent_enable(sess->connect_bev, EV_WRITE | EV_READ);
     //设置bufferevent io的callback回调, 实质内容都在connect_event_cb
     //设置read,write事件为NULL,设置event事件为connect_event_cb
-    bufferevent_setcb(main_ctl->connect_bev, NULL, NULL, connect_event_cb, NULL);
+    bufferevent_setcb(sess->connect_bev, NULL, NULL, connect_event_cb, sess);
 }
 
-
 //加密同步iv init-vector
-void sync_iv(unsigned char *iv)
+void sync_iv(struct bufferevent *bev, unsigned char *iv)
 {
     struct frame *f = new_frame(cmdPSH, main_ctl->session_id);
     assert(f);
@@ -1096,23 +1515,18 @@ void sync_iv(unsigned char *iv)
     f->data = calloc(f->len, 1);
     memcpy(f->data, iv, f->len);
 
-    struct bufferevent *bout = main_ctl->connect_bev;
-    if (!bout) {
-        return;
-    }
-
-    request(bout, f);
+    request(bev, f);
     SAFE_FREE(f->data);
     free_frame(f);
 }
 
 //发送登录请求
-void login()
+void login(struct ctl_session *sess)
 {
     char *lg_msg = NULL;
 
     //构造login请求的json串
-    int len = login_request_marshal(&lg_msg);   // marshal login request
+    int len = login_request_marshal(sess->run_id, &lg_msg);   // marshal login request
     if (!lg_msg || !len) {
         debug(LOG_ERR, "error: login_request_marshal failed, it should never be happenned");
         exit(0);
@@ -1120,21 +1534,21 @@ void login()
 
     // using sid = 3 is only for matching fprs, it will change after using tcp-mux
     if (get_common_config()->tcp_mux)
-        sync_session_id(3);
+        sync_session_id(sess->connect_bev, 3);
 
     //发送LoginType消息lg_msg到proxy-server
-    send_msg_frp_server(NULL, TypeLogin, lg_msg, len, main_ctl->session_id);
+    send_msg_frp_server(sess->connect_bev, TypeLogin, lg_msg, len, main_ctl->session_id);
     SAFE_FREE(lg_msg);
 }
 
-void sync_session_id(uint32_t sid)
+void sync_session_id(struct bufferevent *bev, uint32_t sid)
 {
     struct frame *f = new_frame(cmdNOP, sid);
     assert(f);
 
-    size_t send_len = request(NULL, f);
+    size_t send_len = request(bev, f);
     debug(LOG_DEBUG, "sync session id %d, len %ld", sid, send_len);
-    SAFE_FREE(f);
+    free_frame(f);
 }
 
 
@@ -1142,13 +1556,11 @@ void sync_session_id(uint32_t sid)
 void send_msg_frp_server(struct bufferevent *bev, const enum msg_type type, const char *msg,
                          const size_t msg_len, uint32_t sid)
 {
-    struct bufferevent *bout = NULL;
-    if (bev) {
-        bout = bev;
-    } else {
-        bout = main_ctl->connect_bev;
+    struct bufferevent *bout = bev;
+    if (!bout) {
+        debug(LOG_ERR, "send [%c] failed, control connection is not ready", type);
+        return;
     }
-    assert(bout);
 
     debug(LOG_DEBUG, "send ----> [%c: %s]", type, msg);
 
@@ -1218,28 +1630,21 @@ struct control *get_main_control()
     return main_ctl;
 }
 
-//登录frp server, 似乎跟start_base_connect重复了???(应该是重复了)
-void start_login_frp_server(struct event_base *base)
+// frps of a control session, of the first logged one when session is -1
+int session_server(int session)
 {
-    struct common_conf *c_conf = get_common_config();
+    if (session >= 0 && session < main_ctl->session_num && main_ctl->sessions[session].server >= 0)
+        return main_ctl->sessions[session].server;
 
-	//登录server ip:port
-    struct bufferevent *bev    = connect_server(base, c_conf->server_addr, c_conf->server_port);
-    if (!bev) {
-        debug(LOG_DEBUG, "Connect server [%s:%d] failed", c_conf->server_addr, c_conf->server_port);
-        return;
-    }
-
-    debug(LOG_INFO, "Xfrpc login: connect server [%s:%d] ...", c_conf->server_addr,
-          c_conf->server_port);
-
-    bufferevent_enable(bev, EV_WRITE | EV_READ);
-	//设置connect事件回调
-    bufferevent_setcb(bev, NULL, NULL, connect_event_cb, NULL);
+    int i;
+    for (i = 0; i < main_ctl->session_num; i++)
+        if (main_ctl->sessions[i].state == CTL_LOGGED)
+            return main_ctl->sessions[i].server;
+    return 0;
 }
 
 //向frps服务器发送NewProxy消息,请求开一个Proxy服务
-void send_new_proxy(struct proxy_service *ps)
+void send_new_proxy(struct ctl_session *sess, struct proxy_service *ps)
 {
     if (!ps) {
         debug(LOG_ERR, "proxy service is invalid!");
@@ -1257,10 +1662,53 @@ void send_new_proxy(struct proxy_service *ps)
     }
 
 	//向Server主控发送TypeNewProxy消息结构
-    send_msg_frp_server(NULL, TypeNewProxy, new_proxy_msg, len, main_ctl->session_id);
+    send_msg_frp_server(sess->connect_bev, TypeNewProxy, new_proxy_msg, len,
+                        main_ctl->session_id);
+    // registered on another session already, that one still counts
+    if (ps->stats.reg_state != PS_REG_OK)
+        ps->stats.reg_state = PS_REG_SENT;
     SAFE_FREE(new_proxy_msg);
 }
 
+// xtcp tunnels run KCP too, with the same settings
+static void init_kcp_conf(struct common_conf *c_conf)
+{
+    kcp_conf.nodelay  = c_conf->kcp_nodelay;
+    kcp_conf.interval = c_conf->kcp_interval > 0 ? c_conf->kcp_interval : 20;
+    kcp_conf.sndwnd   = c_conf->kcp_sndwnd > 0 ? c_conf->kcp_sndwnd : 128;
+    kcp_conf.rcvwnd   = c_conf->kcp_rcvwnd > 0 ? c_conf->kcp_rcvwnd : 512;
+    kcp_conf.mtu      = c_conf->kcp_mtu > 0 ? c_conf->kcp_mtu : 1350;
+
+    use_kcp = c_conf->protocol && !strcmp(c_conf->protocol, "kcp");
+    if (c_conf->protocol && !use_kcp && strcmp(c_conf->protocol, "tcp"))
+        debug(LOG_WARNING, "protocol [%s] unknown, using tcp", c_conf->protocol);
+    if (!use_kcp)
+        return;
+
+    // all of them are about the TCP socket to frps
+    if (c_conf->tls_enable)
+        debug(LOG_WARNING, "tls_enable is ignored with protocol kcp");
+    if (c_conf->mptcp || c_conf->bind_addresses || c_conf->bind_interfaces)
+        debug(LOG_WARNING, "mptcp and bind_* are ignored with protocol kcp");
+}
+
+// frps keeps one control per run_id and drops the older one, shards of one
+// xfrpc on the same frps need a run_id each
+static char *shard_run_id(int shard)
+{
+    if (shard == 0) {
+        char *run_id = strdup(get_run_id());
+        assert(run_id);
+        return run_id;
+    }
+
+    size_t len   = strlen(get_run_id()) + 12;
+    char *run_id = calloc(1, len);
+    assert(run_id);
+    snprintf(run_id, len, "%s-%d", get_run_id(), shard);
+    return run_id;
+}
+
 void init_main_control()
 {
     //主控
@@ -1276,6 +1724,10 @@ void init_main_control()
     // conf
     struct common_conf *c_conf = get_common_config();
 
+    // before event_base_new, everything libevent allocates goes to slabs
+    if (c_conf->mem_class_max_size > 0)
+        init_evmem((size_t) c_conf->mem_class_max_size * 1024);
+
     // tcp mux
     if (c_conf->tcp_mux) {
         //会话id
@@ -1304,6 +1756,21 @@ void init_main_control()
         exit(0);
     }
     main_ctl->dnsbase = dnsbase;
+    init_addr_cache(base, dnsbase);
+    init_uplinks(base);
+    init_kcp_conf(c_conf);
+
+    // sessions from the control connection are resumed by work connections
+    if (c_conf->tls_enable && !use_kcp &&
+        init_tls(c_conf->tls_trusted_ca_file, c_conf->tls_ktls)) {
+        debug(LOG_ERR, "error: TLS init failed!");
+        exit(0);
+    }
+
+    start_admin_server(base);
+    init_xtcp(base, &kcp_conf);
+    init_capture(base);
+    start_evmem_trim(base);
 
     //设置超时
     evdns_base_set_option(dnsbase, "timeout", "1.0");
@@ -1317,43 +1784,86 @@ void init_main_control()
     evdns_base_nameserver_ip_add(dnsbase, "223.6.6.6");         // AliDNS
     evdns_base_nameserver_ip_add(dnsbase, "114.114.114.114");   // 114DNS
 
+    // one session per active server, each on a different one
+    init_server_list(base);
+    const struct frps_server *servers = NULL;
+    int n_servers                     = get_servers(&servers);
+    int num = c_conf->active_servers > 0 ? c_conf->active_servers : 1;
+    if (num > n_servers || num > CTL_SESSIONS_MAX) {
+        num = n_servers < CTL_SESSIONS_MAX ? n_servers : CTL_SESSIONS_MAX;
+        debug(LOG_WARNING, "active_servers [%d] is more than the servers, use %d",
+              c_conf->active_servers, num);
+    }
+    int shards = c_conf->control_sessions > 0 ? c_conf->control_sessions : 1;
+    if (num * shards > CTL_SESSIONS_MAX) {
+        shards = CTL_SESSIONS_MAX / num;
+        debug(LOG_WARNING, "control_sessions [%d] on %d servers is more than %d, use %d",
+              c_conf->control_sessions, num, CTL_SESSIONS_MAX, shards);
+    }
+    main_ctl->shard_num   = shards;
+    main_ctl->session_num = num * shards;
+    main_ctl->sessions    = calloc(main_ctl->session_num, sizeof(struct ctl_session));
+    assert(main_ctl->sessions);
+
+    int i;
+    for (i = 0; i < main_ctl->session_num; i++) {
+        struct ctl_session *sess = &main_ctl->sessions[i];
+        sess->index              = i;
+        sess->shard              = i % shards;
+        sess->server             = -1;
+        sess->run_id             = shard_run_id(sess->shard);
+        sess->ev_reconnect = evtimer_new(base, reconnect_cb, sess);
+        assert(sess->ev_reconnect);
+    }
+
     //如果给定的是ip地址,直接返回,不需要进行dns解析
     // if server_addr is ip, done control init.
-    if (is_valid_ip_address((const char *) c_conf->server_addr))
+    if (is_valid_ip_address(servers[0].addr)) {
+        set_common_server_ip(servers[0].addr);
         return;
+    }
 
     // if server_addr is domain, analyze it to ip for server_ip
-    debug(LOG_DEBUG, "Get ip address of [%s] from DNServer", c_conf->server_addr);
-
-    struct evutil_addrinfo hints;
-    struct evdns_getaddrinfo_request *dns_req;
-    memset(&hints, 0, sizeof(hints));
-    hints.ai_family   = AF_UNSPEC;
-    hints.ai_flags    = EVUTIL_AI_CANONNAME;
-    hints.ai_socktype = SOCK_STREAM;
-    hints.ai_protocol = IPPROTO_TCP;
-
-    // dns查询动作,并设置callback动作->server_dns_cb;
-    dns_req = evdns_getaddrinfo(dnsbase, c_conf->server_addr, NULL /* no service name given */,
-                                &hints, server_dns_cb, NULL);
-    if (!dns_req) {
-        debug(LOG_ERR, "error: can not analyse the dns of [%s]", c_conf->server_addr);
-        exit(0);
-    }
+    debug(LOG_DEBUG, "Get ip address of [%s] from DNServer", servers[0].addr);
+
+    // dns查询动作,并设置callback动作->server_dns_cb, the answer is kept in addr cache
+    addr_cache_resolve(servers[0].addr, server_dns_cb, NULL);
 }
 
 void close_main_control()
 {
     assert(main_ctl);
     event_base_dispatch(main_ctl->connect_base);
-    event_base_free(main_ctl->connect_base);
+
+    int i;
+    for (i = 0; i < main_ctl->session_num; i++) {
+        event_free(main_ctl->sessions[i].ev_reconnect);
+        SAFE_FREE(main_ctl->sessions[i].run_id);
+    }
+    SAFE_FREE(main_ctl->sessions);
+    main_ctl->session_num = 0;
+    free_admin_server();
+    free_xtcp();
+    free_capture();
+    stop_evmem_trim();
+    if (main_ctl->ticker_ping)
+        event_free(main_ctl->ticker_ping);
     evdns_base_free(main_ctl->dnsbase, 0);
+    free_addr_cache();
+    free_tls();
+    free_uplinks();
+    free_server_list();
+    event_base_free(main_ctl->connect_base);
+    free_msg_decode();
+    pool_trim();
 }
 
 //主控循环
 void run_control()
 {
-    start_base_connect();
+    int i;
+    for (i = 0; i < main_ctl->session_num; i++)
+        start_session_connect(&main_ctl->sessions[i]);
     keep_control_alive();
 }
 
@@ -34,36 +34,99 @@
 struct proxy_client;
 struct bufferevent;
 struct event_base;
+struct frps_server;
 enum msg_type;
 
+#define RECONNECT_DELAY_MIN 1    // seconds, first retry
+#define RECONNECT_DELAY_MAX 60   // seconds, backoff cap
+
+#define HB_PENDING_MAX 8    // pings sent and waiting for pong
+#define HB_RTT_HISTORY 32   // latest rtt samples kept for metrics
+
+// frp Ping/Pong carry no id, a pong answers the oldest ping in flight
+struct heartbeat {
+    uint64_t pending[HB_PENDING_MAX];   // usec, send time of pings in flight
+    int pending_head;
+    int pending_num;
+
+    uint64_t last_recv_at;   // msec, any message from frps on control
+    uint32_t last_rtt_us;
+    uint32_t srtt_us;     // smoothed rtt, RFC 6298
+    uint32_t rttvar_us;   // rtt jitter, RFC 6298
+    uint32_t history[HB_RTT_HISTORY];   // usec, ring of latest samples
+    int history_idx;
+    int history_num;
+
+    uint64_t pings;
+    uint64_t pongs;
+    uint64_t timeouts;
+};
+
+enum control_state {
+    CTL_DISCONNECTED = 0,   // waiting for reconnect timer
+    CTL_CONNECTING,         // tcp connecting or login sent
+    CTL_LOGGED,             // login response accepted
+};
+
+#define CTL_SESSIONS_MAX 32   // bits of proxy_stats.reg_sessions
+
+// one control connection, logged in to one server of the server list
+struct ctl_session {
+    int index;    // in sessions of struct control
+    int shard;    // registers the proxies whose name hashes to it
+    int server;   // in server list, -1 before the first pick
+    struct bufferevent *connect_bev;
+
+    enum control_state state;
+    struct event *ev_reconnect;   // backoff timer, reconnect in the same event base
+    int retry_times;              // consecutive failures since last login
+    uint64_t disconnected_at;     // monotonic msec, 0 when never lost
+    uint64_t last_recovery_ms;    // disconnect to login of latest reconnect
+    uint64_t switches;            // logged in to another server than the one before
+    uint64_t pongs_at_login;      // hb.pongs when logged in
+
+    char *run_id;          // sent in Login, the one frps answered once logged
+    int proxies_started;   // NewProxy sent since login
+    struct heartbeat hb;
+};
+
 struct control {
     struct event_base *connect_base;   // 主event base
     struct evdns_base *dnsbase;	// dns base
-    struct bufferevent *connect_bev;   // 主控的bufferevent
     char session_id;	//会话id
     struct event *ticker_ping;   // heartbeat timer 心跳间隔时间
+    uint64_t work_conn_failures;  // work connections failed before StartWorkConn
+
+    struct ctl_session *sessions;   // control_sessions per active server
+    int session_num;
+    int shard_num;   // control_sessions
 };
 
 void connect_eventcb(struct bufferevent *bev, short events, void *ptr);
-void sync_iv(unsigned char *iv);
-void start_base_connect();
-void sync_session_id(uint32_t sid);
+void sync_iv(struct bufferevent *bev, unsigned char *iv);
+void sync_session_id(struct bufferevent *bev, uint32_t sid);
 void init_main_control();
 void run_control();
 struct control *get_main_control();
 void close_main_control();
-void start_login_frp_server(struct event_base *base);
 void send_login_frp_server(struct bufferevent *bev);
-void login();
+void login(struct ctl_session *sess);
 void free_control();
-void sync_session_id(uint32_t sid);
 
 void send_msg_frp_server(struct bufferevent *bev, const enum msg_type type, const char *msg,
                          const size_t msg_len, uint32_t sid);
 
 void control_process(struct proxy_client *client);
-void send_new_proxy(struct proxy_service *ps);
+void send_new_proxy(struct ctl_session *sess, struct proxy_service *ps);
+
+// server of a control session, of the first logged one when session is -1
+int session_server(int session);
 
-struct bufferevent *connect_server(struct event_base *base, const char *name, const int port);
+// tcp_fast_open and tcp_* options of ps apply, [common] ones when NULL
+struct bufferevent *connect_server(struct event_base *base, const char *name, const int port,
+                                   const struct proxy_service *ps);
+// uplink NULL for control connection, see uplink_socket
+struct bufferevent *connect_frps(struct event_base *base, const struct frps_server *srv,
+                                 int *uplink);
 
 #endif   //_CONTROL_H_
\ No newline at end of file
@@ -1,82 +1,416 @@
-/* vim: set et ts=4 sts=4 sw=4 : */
-/********************************************************************\
- * This program is free software; you can redistribute it and/or    *
- * modify it under the terms of the GNU General Public License as   *
- * published by the Free Software Foundation; either version 2 of   *
- * the License, or (at your option) any later version.              *
- *                                                                  *
- * This program is distributed in the hope that it will be useful,  *
- * but WITHOUT ANY WARRANTY; without even the implied warranty of   *
- * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the    *
- * GNU General Public License for more details.                     *
- *                                                                  *
- * You should have received a copy of the GNU General Public License*
- * along with this program; if not, contact:                        *
- *                                                                  *
- * Free Software Foundation           Voice:  +1-617-542-5942       *
- * 59 Temple Place - Suite 330        Fax:    +1-617-542-2652       *
- * Boston, MA  02111-1307,  USA       gnu@gnu.org                   *
- *                                                                  *
-\********************************************************************/
-
-/** @file debug.c
-    @brief Debug output routines
-    @author Copyright (C) 2004 Philippe April <papril777@yahoo.com>
-*/
-
-#include <stdio.h>
-#include <errno.h>
-#include <syslog.h>
-#include <stdarg.h>
-#include <time.h>
-#include <unistd.h>
-#include <signal.h>
-
-#include "debug.h"
-
-debugconf_t debugconf = {
-    .debuglevel = LOG_INFO, .log_stderr = 1, .log_syslog = 0, .syslog_facility = 0};
-
-/** @internal
-Do not use directly, use the debug macro */
-void _debug(const char *filename, int line, int level, const char *format, ...)
-{
-    char buf[28];
-    va_list vlist;
-    time_t ts;
-    sigset_t block_chld;
-
-    time(&ts);
-
-    if (debugconf.debuglevel >= level) {
-        sigemptyset(&block_chld);
-        sigaddset(&block_chld, SIGCHLD);
-        sigprocmask(SIG_BLOCK, &block_chld, NULL);
-
-        if (level <= LOG_WARNING) {
-            fprintf(stderr, "[%d][%.24s][%u](%s:%d) ", level, ctime_r(&ts, buf), getpid(), filename,
-                    line);
-            va_start(vlist, format);
-            vfprintf(stderr, format, vlist);
-            va_end(vlist);
-            fputc('\n', stderr);
-        } else if (debugconf.log_stderr) {
-            fprintf(stderr, "[%d][%.24s][%u](%s:%d) ", level, ctime_r(&ts, buf), getpid(), filename,
-                    line);
-            va_start(vlist, format);
-            vfprintf(stderr, format, vlist);
-            va_end(vlist);
-            fputc('\n', stderr);
-        }
-
-        if (debugconf.log_syslog) {
-            openlog("wifidog", LOG_PID, debugconf.syslog_facility);
-            va_start(vlist, format);
-            vsyslog(level, format, vlist);
-            va_end(vlist);
-            closelog();
-        }
-
-        sigprocmask(SIG_UNBLOCK, &block_chld, NULL);
-    }
-}
+/* vim: set et ts=4 sts=4 sw=4 : */
+/********************************************************************\
+ * This program is free software; you can redistribute it and/or    *
+ * modify it under the terms of the GNU General Public License as   *
+ * published by the Free Software Foundation; either version 2 of   *
+ * the License, or (at your option) any later version.              *
+ *                                                                  *
+ * This program is distributed in the hope that it will be useful,  *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of   *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the    *
+ * GNU General Public License for more details.                     *
+ *                                                                  *
+ * You should have received a copy of the GNU General Public License*
+ * along with this program; if not, contact:                        *
+ *                                                                  *
+ * Free Software Foundation           Voice:  +1-617-542-5942       *
+ * 59 Temple Place - Suite 330        Fax:    +1-617-542-2652       *
+ * Boston, MA  02111-1307,  USA       gnu@gnu.org                   *
+ *                                                                  *
+\********************************************************************/
+
+/** @file debug.c
+    @brief Debug output routines
+    @author Copyright (C) 2004 Philippe April <papril777@yahoo.com>
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <syslog.h>
+#include <stdarg.h>
+#include <time.h>
+#include <unistd.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sys/time.h>
+#include <sys/stat.h>
+
+#include <event2/event.h>
+
+#include "debug.h"
+
+debugconf_t debugconf = {
+    .debuglevel = LOG_INFO, .log_stderr = 1, .log_syslog = 0, .syslog_facility = 0};
+
+// The event loop thread is the only producer, the writer thread the only
+// consumer, so head and tail need ordering but no lock. A full ring drops
+// lines instead of blocking the loop.
+struct log_slot {
+    int level;
+    int len;
+    int msg_at;   // message after the "[level][time][pid](file:line) " prefix
+    char line[LOG_LINE_MAX];
+};
+
+static struct log_slot *log_ring;
+static uint32_t ring_head;   // next slot to fill, written by producer
+static uint32_t ring_tail;   // next slot to write, written by writer
+static uint32_t ring_dropped;
+
+static pthread_t log_writer;
+static pthread_mutex_t log_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t log_cond   = PTHREAD_COND_INITIALIZER;
+static int writer_stop;
+
+static struct event_base *log_base;
+static unsigned int log_pid;
+
+// writer thread state
+static FILE *log_fp;
+static char *log_path;   // NULL when writing to stderr
+static long log_size;
+static long log_max_size;
+static int log_max_days;
+static int log_day;   // local year * 1000 + yday of current file
+
+static int local_day(time_t ts)
+{
+    struct tm tm;
+    localtime_r(&ts, &tm);
+    return tm.tm_year * 1000 + tm.tm_yday;
+}
+
+static void open_log_file()
+{
+    struct stat st;
+
+    log_fp = fopen(log_path, "a");
+    if (!log_fp) {
+        fprintf(stderr, "open log file [%s] failed: %s\n", log_path, strerror(errno));
+        return;
+    }
+
+    if (fstat(fileno(log_fp), &st) == 0) {
+        log_size = st.st_size;
+        log_day  = local_day(st.st_size ? st.st_mtime : time(NULL));
+    } else {
+        log_size = 0;
+        log_day  = local_day(time(NULL));
+    }
+}
+
+// log_file -> log_file.1 -> ... -> log_file.LOG_KEEP_FILES, then expire by mtime
+static void rotate_log_file()
+{
+    char from[PATH_MAX], to[PATH_MAX];
+    time_t now = time(NULL);
+    int i;
+
+    if (log_fp)
+        fclose(log_fp);
+    log_fp = NULL;
+
+    snprintf(to, sizeof(to), "%s.%d", log_path, LOG_KEEP_FILES);
+    unlink(to);
+    for (i = LOG_KEEP_FILES - 1; i >= 1; i--) {
+        snprintf(from, sizeof(from), "%s.%d", log_path, i);
+        snprintf(to, sizeof(to), "%s.%d", log_path, i + 1);
+        rename(from, to);
+    }
+    snprintf(to, sizeof(to), "%s.1", log_path);
+    rename(log_path, to);
+
+    if (log_max_days > 0) {
+        for (i = 1; i <= LOG_KEEP_FILES; i++) {
+            struct stat st;
+            snprintf(from, sizeof(from), "%s.%d", log_path, i);
+            if (stat(from, &st) == 0 && now - st.st_mtime > (time_t) log_max_days * 86400)
+                unlink(from);
+        }
+    }
+
+    open_log_file();
+}
+
+static void write_log_line(int level, const char *line, int len, int msg_at)
+{
+    if (debugconf.log_syslog) {
+        syslog(level, "%.*s", len - msg_at - 1, line + msg_at);   // without '\n'
+        // warnings and errors show on stderr too, as they always did
+        if (level <= LOG_WARNING || debugconf.log_stderr)
+            fwrite(line, 1, len, stderr);
+        return;
+    }
+
+    if (!log_path) {
+        if (level <= LOG_WARNING || debugconf.log_stderr)
+            fwrite(line, 1, len, stderr);
+        return;
+    }
+
+    if (log_max_size > 0 && log_size + len > log_max_size)
+        rotate_log_file();
+
+    if (log_fp && fwrite(line, 1, len, log_fp) == (size_t) len)
+        log_size += len;
+}
+
+// write all lines the producer published, return number written
+static int drain_log_ring()
+{
+    uint32_t tail = ring_tail;
+    uint32_t head = __atomic_load_n(&ring_head, __ATOMIC_ACQUIRE);
+    int n         = 0;
+
+    if (log_path && head != tail && local_day(time(NULL)) != log_day)
+        rotate_log_file();
+
+    while (tail != head) {
+        struct log_slot *slot = &log_ring[tail & (LOG_RING_SLOTS - 1)];
+        write_log_line(slot->level, slot->line, slot->len, slot->msg_at);
+        tail++;
+        n++;
+        __atomic_store_n(&ring_tail, tail, __ATOMIC_RELEASE);
+    }
+
+    uint32_t dropped = __atomic_exchange_n(&ring_dropped, 0, __ATOMIC_RELAXED);
+    if (dropped) {
+        char note[64];
+        int len = snprintf(note, sizeof(note), "[%d] %u log lines dropped, ring full\n",
+                           LOG_WARNING, dropped);
+        write_log_line(LOG_WARNING, note, len, 0);
+    }
+
+    if (n || dropped)
+        fflush(log_path ? log_fp : stderr);
+
+    return n;
+}
+
+static void *log_writer_thread(void *arg)
+{
+    for (;;) {
+        drain_log_ring();
+        if (__atomic_load_n(&writer_stop, __ATOMIC_ACQUIRE)) {
+            drain_log_ring();
+            break;
+        }
+
+        // producer signals when ring is half full or on errors, the
+        // timeout covers the wakeups it does not send
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_nsec += 100 * 1000 * 1000;
+        if (ts.tv_nsec >= 1000000000) {
+            ts.tv_sec++;
+            ts.tv_nsec -= 1000000000;
+        }
+        pthread_mutex_lock(&log_mutex);
+        if (!__atomic_load_n(&writer_stop, __ATOMIC_ACQUIRE))
+            pthread_cond_timedwait(&log_cond, &log_mutex, &ts);
+        pthread_mutex_unlock(&log_mutex);
+    }
+
+    return NULL;
+}
+
+int start_async_logger(const char *log_file, long max_size, int max_days, struct event_base *base)
+{
+    if (log_ring)
+        return 0;
+
+    log_base     = base;
+    log_pid      = getpid();
+    log_max_size = max_size;
+    log_max_days = max_days;
+    writer_stop  = 0;
+
+    if (!debugconf.log_syslog && log_file && strcmp(log_file, "console") != 0) {
+        log_path = strdup(log_file);
+        if (!log_path)
+            return -1;
+        open_log_file();
+    }
+
+    if (debugconf.log_syslog)
+        openlog("xfrpc", LOG_PID, debugconf.syslog_facility);
+
+    log_ring = calloc(LOG_RING_SLOTS, sizeof(struct log_slot));
+    if (!log_ring)
+        return -1;
+
+    if (pthread_create(&log_writer, NULL, log_writer_thread, NULL)) {
+        free(log_ring);
+        log_ring = NULL;
+        return -1;
+    }
+
+    // lines logged right before exit() are still in the ring
+    static int atexit_set;
+    if (!atexit_set) {
+        atexit(stop_async_logger);
+        atexit_set = 1;
+    }
+
+    return 0;
+}
+
+void stop_async_logger()
+{
+    if (!log_ring)
+        return;
+
+    pthread_mutex_lock(&log_mutex);
+    __atomic_store_n(&writer_stop, 1, __ATOMIC_RELEASE);
+    pthread_cond_signal(&log_cond);
+    pthread_mutex_unlock(&log_mutex);
+    pthread_join(log_writer, NULL);
+
+    free(log_ring);
+    log_ring   = NULL;
+    ring_head  = 0;
+    ring_tail  = 0;
+    log_base   = NULL;
+    if (log_fp)
+        fclose(log_fp);
+    log_fp = NULL;
+    free(log_path);
+    log_path = NULL;
+    if (debugconf.log_syslog)
+        closelog();
+}
+
+int debug_level_of(const char *name)
+{
+    if (!name)
+        return LOG_INFO;
+
+    if (strcmp(name, "error") == 0)
+        return LOG_ERR;
+    if (strcmp(name, "warn") == 0 || strcmp(name, "warning") == 0)
+        return LOG_WARNING;
+    if (strcmp(name, "debug") == 0 || strcmp(name, "trace") == 0)
+        return LOG_DEBUG;
+
+    return LOG_INFO;
+}
+
+// "Mon Oct 19 02:25:04 2026" formatted once per second
+static const char *log_time_str()
+{
+    static time_t cached_sec = -1;
+    static char cached_str[32];
+    struct timeval tv;
+
+    if (!log_base || event_base_gettimeofday_cached(log_base, &tv) != 0)
+        gettimeofday(&tv, NULL);
+
+    if (tv.tv_sec != cached_sec) {
+        struct tm tm;
+        time_t sec = tv.tv_sec;
+        localtime_r(&sec, &tm);
+        strftime(cached_str, sizeof(cached_str), "%a %b %e %H:%M:%S %Y", &tm);
+        cached_sec = tv.tv_sec;
+    }
+
+    return cached_str;
+}
+
+// logger not started yet, or stopped: write in place as before
+static void debug_sync(const char *filename, int line, int level, const char *format,
+                       va_list vlist)
+{
+    va_list vsys;
+    va_copy(vsys, vlist);
+
+    if (level <= LOG_WARNING || debugconf.log_stderr) {
+        fprintf(stderr, "[%d][%s][%u](%s:%d) ", level, log_time_str(), getpid(), filename, line);
+        vfprintf(stderr, format, vlist);
+        fputc('\n', stderr);
+    }
+
+    if (debugconf.log_syslog) {
+        openlog("xfrpc", LOG_PID, debugconf.syslog_facility);
+        vsyslog(level, format, vsys);
+        closelog();
+    }
+    va_end(vsys);
+}
+
+/** @internal
+Do not use directly, use the debug_ratelimit macro */
+int _debug_ratelimit_pass(struct debug_ratelimit *rl, const char *filename, int line, int level)
+{
+    struct timespec ts;
+#ifdef CLOCK_MONOTONIC_COARSE
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+#else
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+#endif
+    unsigned long long now = (unsigned long long) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+
+    if (!rl->begin || now - rl->begin >= DEBUG_RATELIMIT_INTERVAL) {
+        if (rl->suppressed)
+            _debug(filename, line, level, "%u similar messages suppressed", rl->suppressed);
+        rl->begin      = now;
+        rl->printed    = 0;
+        rl->suppressed = 0;
+    }
+
+    if (rl->printed < DEBUG_RATELIMIT_BURST) {
+        rl->printed++;
+        return 1;
+    }
+
+    rl->suppressed++;
+    return 0;
+}
+
+/** @internal
+Do not use directly, use the debug macro */
+void _debug(const char *filename, int line, int level, const char *format, ...)
+{
+    va_list vlist;
+
+    if (debugconf.debuglevel < level)
+        return;
+
+    va_start(vlist, format);
+    if (!log_ring) {
+        debug_sync(filename, line, level, format, vlist);
+        va_end(vlist);
+        return;
+    }
+
+    uint32_t head = ring_head;
+    uint32_t used = head - __atomic_load_n(&ring_tail, __ATOMIC_ACQUIRE);
+    if (used >= LOG_RING_SLOTS) {
+        __atomic_add_fetch(&ring_dropped, 1, __ATOMIC_RELAXED);
+        va_end(vlist);
+        return;
+    }
+
+    struct log_slot *slot = &log_ring[head & (LOG_RING_SLOTS - 1)];
+    int max               = LOG_LINE_MAX - 1;   // room for '\n'
+    int n = snprintf(slot->line, max, "[%d][%s][%u](%s:%d) ", level, log_time_str(), log_pid,
+                     filename, line);
+    if (n < 0 || n >= max)
+        n = max - 1;
+    slot->msg_at = n;
+    int m = vsnprintf(slot->line + n, max - n, format, vlist);
+    va_end(vlist);
+    if (m < 0)
+        m = 0;
+    n += m < max - n ? m : max - n - 1;
+    slot->line[n++] = '\n';
+    slot->len       = n;
+    slot->level     = level;
+
+    __atomic_store_n(&ring_head, head + 1, __ATOMIC_RELEASE);
+
+    if (used + 1 == LOG_RING_SLOTS / 2 || level <= LOG_ERR)
+        pthread_cond_signal(&log_cond);
+}
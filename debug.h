@@ -1,54 +1,111 @@
-/* vim: set et ts=4 sts=4 sw=4 : */
-/********************************************************************\
- * This program is free software; you can redistribute it and/or    *
- * modify it under the terms of the GNU General Public License as   *
- * published by the Free Software Foundation; either version 2 of   *
- * the License, or (at your option) any later version.              *
- *                                                                  *
- * This program is distributed in the hope that it will be useful,  *
- * but WITHOUT ANY WARRANTY; without even the implied warranty of   *
- * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the    *
- * GNU General Public License for more details.                     *
- *                                                                  *
- * You should have received a copy of the GNU General Public License*
- * along with this program; if not, contact:                        *
- *                                                                  *
- * Free Software Foundation           Voice:  +1-617-542-5942       *
- * 59 Temple Place - Suite 330        Fax:    +1-617-542-2652       *
- * Boston, MA  02111-1307,  USA       gnu@gnu.org                   *
- *                                                                  *
-\********************************************************************/
-
-/** @file debug.h
-    @brief Debug output routines
-    @author Copyright (C) 2004 Philippe April <papril777@yahoo.com>
-*/
-
-#ifndef _WIFIDOG_DEBUG_H_
-#define _WIFIDOG_DEBUG_H_
-
-#include <string.h>
-
-#define __FILENAME__ (strrchr(__FILE__, '/') ? strrchr(__FILE__, '/') + 1 : __FILE__)
-
-typedef struct _debug_conf {
-    int debuglevel;      /**< @brief Debug information verbosity */
-    int log_stderr;      /**< @brief Output log to stdout */
-    int log_syslog;      /**< @brief Output log to syslog */
-    int syslog_facility; /**< @brief facility to use when using syslog for logging */
-} debugconf_t;
-
-extern debugconf_t debugconf;
-
-/** Used to output messages.
- * The messages will include the filename and line number, and will be sent to syslog if so
- * configured in the config file
- * @param level Debug level
- * @param format... sprintf like format string
- */
-#define debug(level, format...) _debug(__FILENAME__, __LINE__, level, format)
-
-/** @internal */
-void _debug(const char *, int, int, const char *, ...);
-
-#endif /* _DEBUG_H_ */
+/* vim: set et ts=4 sts=4 sw=4 : */
+/********************************************************************\
+ * This program is free software; you can redistribute it and/or    *
+ * modify it under the terms of the GNU General Public License as   *
+ * published by the Free Software Foundation; either version 2 of   *
+ * the License, or (at your option) any later version.              *
+ *                                                                  *
+ * This program is distributed in the hope that it will be useful,  *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of   *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the    *
+ * GNU General Public License for more details.                     *
+ *                                                                  *
+ * You should have received a copy of the GNU General Public License*
+ * along with this program; if not, contact:                        *
+ *                                                                  *
+ * Free Software Foundation           Voice:  +1-617-542-5942       *
+ * 59 Temple Place - Suite 330        Fax:    +1-617-542-2652       *
+ * Boston, MA  02111-1307,  USA       gnu@gnu.org                   *
+ *                                                                  *
+\********************************************************************/
+
+/** @file debug.h
+    @brief Debug output routines
+    @author Copyright (C) 2004 Philippe April <papril777@yahoo.com>
+*/
+
+#ifndef _WIFIDOG_DEBUG_H_
+#define _WIFIDOG_DEBUG_H_
+
+#include <string.h>
+#include <syslog.h>
+
+/** Most verbose level compiled in, set by cmake -DXFRPC_MAX_LOG_LEVEL=<0-7>.
+ * Calls above it compile to nothing, arguments are not evaluated.
+ */
+#ifndef XFRPC_MAX_LOG_LEVEL
+#define XFRPC_MAX_LOG_LEVEL LOG_DEBUG
+#endif
+
+#define DEBUG_RATELIMIT_INTERVAL 5000   // msec
+#define DEBUG_RATELIMIT_BURST 10        // lines per call site in one interval
+
+#define __FILENAME__ (strrchr(__FILE__, '/') ? strrchr(__FILE__, '/') + 1 : __FILE__)
+
+#define LOG_RING_SLOTS 256   // must be power of 2
+#define LOG_LINE_MAX 512     // longer lines are truncated
+#define LOG_KEEP_FILES 5     // rotated files kept as log_file.1 .. log_file.N
+
+typedef struct _debug_conf {
+    int debuglevel;      /**< @brief Debug information verbosity */
+    int log_stderr;      /**< @brief Output log to stdout */
+    int log_syslog;      /**< @brief Output log to syslog */
+    int syslog_facility; /**< @brief facility to use when using syslog for logging */
+} debugconf_t;
+
+extern debugconf_t debugconf;
+
+struct event_base;
+
+/** Start the background log writer, lines are formatted into a ring buffer by the
+ * event loop thread and written by the writer thread. Call it after daemonizing.
+ * @param log_file path of log file, NULL or "console" for stderr
+ * @param max_size rotate when the file grows over max_size bytes, 0 never
+ * @param max_days remove rotated files older than max_days, 0 never
+ * @param base loop whose cached time is used for timestamps, can be NULL
+ */
+int start_async_logger(const char *log_file, long max_size, int max_days, struct event_base *base);
+
+/** Flush pending lines and stop the writer, later lines are written synchronously */
+void stop_async_logger();
+
+/** Map log_level config (error, warn, info, debug, trace) to syslog level */
+int debug_level_of(const char *name);
+
+/** Used to output messages.
+ * The messages will include the filename and line number, and will be sent to syslog if so
+ * configured in the config file
+ * @param level Debug level
+ * @param format... sprintf like format string
+ */
+#define debug(level, format...)                                                \
+    do {                                                                       \
+        if ((level) <= XFRPC_MAX_LOG_LEVEL && (level) <= debugconf.debuglevel) \
+            _debug(__FILENAME__, __LINE__, level, format);                     \
+    } while (0)
+
+/** Same as debug, but each call site prints at most DEBUG_RATELIMIT_BURST lines
+ * every DEBUG_RATELIMIT_INTERVAL, then reports how many were suppressed.
+ * For error paths that can repeat per message, like a garbled frps stream.
+ */
+#define debug_ratelimit(level, format...)                                      \
+    do {                                                                       \
+        static struct debug_ratelimit _drl;                                    \
+        if ((level) <= XFRPC_MAX_LOG_LEVEL && (level) <= debugconf.debuglevel && \
+            _debug_ratelimit_pass(&_drl, __FILENAME__, __LINE__, level))       \
+            _debug(__FILENAME__, __LINE__, level, format);                     \
+    } while (0)
+
+struct debug_ratelimit {
+    unsigned long long begin;   // monotonic msec of current interval
+    unsigned int printed;
+    unsigned int suppressed;
+};
+
+/** @internal */
+void _debug(const char *, int, int, const char *, ...);
+
+/** @internal */
+int _debug_ratelimit_pass(struct debug_ratelimit *rl, const char *filename, int line, int level);
+
+#endif /* _DEBUG_H_ */
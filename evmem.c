@@ -0,0 +1,351 @@
+/* vim: set et ts=4 sts=4 sw=4 : */
+/********************************************************************\
+ * This program is free software; you can redistribute it and/or    *
+ * modify it under the terms of the GNU General Public License as   *
+ * published by the Free Software Foundation; either version 2 of   *
+ * the License, or (at your option) any later version.              *
+ *                                                                  *
+ * This program is distributed in the hope that it will be useful,  *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of   *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the    *
+ * GNU General Public License for more details.                     *
+ *                                                                  *
+ * You should have received a copy of the GNU General Public License*
+ * along with this program; if not, contact:                        *
+ *                                                                  *
+ * Free Software Foundation           Voice:  +1-617-542-5942       *
+ * 59 Temple Place - Suite 330        Fax:    +1-617-542-2652       *
+ * Boston, MA  02111-1307,  USA       gnu@gnu.org                   *
+ *                                                                  *
+\********************************************************************/
+
+/** @file evmem.c
+    @brief size class slab allocator behind libevent buffers
+
+    evbuffer chains and bufferevents come and go with every tunnel in
+    sizes from a few dozen bytes to 16 KB. Served by malloc they leave
+    holes all over the heap and RSS never comes down on a router with
+    hundreds of tunnels. Here every size class is carved from its own
+    mmapped slabs, so freed chains are reused by the same class, and a
+    slab left empty for an idle period is unmapped.
+
+    Only the event loop thread allocates through libevent.
+*/
+
+#include <string.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <syslog.h>
+#include <malloc.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include <event2/event.h>
+
+#include "evmem.h"
+#include "debug.h"
+#include "common.h"
+
+#define EVMEM_ALIGN 16
+#define EVMEM_MIN_SIZE 16
+#define EVMEM_MAX_SIZE 16384
+
+// in front of every object, padded to EVMEM_ALIGN so objects behind it
+// stay aligned on 32 bit targets too
+struct evmem_hdr {
+    struct evmem_slab *slab;   // NULL for malloc fallback
+    size_t size;               // requested size
+} __attribute__((aligned(EVMEM_ALIGN)));
+
+struct evmem_slab {
+    struct evmem_slab *next;
+    struct evmem_slab *avail_next;   // in avail of the class while used < per_slab
+    struct evmem_hdr *free_list;   // freed objects, hdr->slab reused as link
+    uint32_t carved;               // objects cut from data so far
+    uint32_t used;
+    int cls;
+    char data[] __attribute__((aligned(EVMEM_ALIGN)));
+};
+
+struct evmem_class {
+    struct evmem_slab *slabs;   // oldest first
+    struct evmem_slab *last;
+    struct evmem_slab *avail;   // slabs with a free object, malloc takes the head
+    size_t obj_size;     // header included
+    uint32_t per_slab;
+    uint32_t max_slabs;
+    uint64_t allocs;     // since last trim, tells idle classes apart
+    struct evmem_class_stats stats;
+};
+
+static struct evmem_class classes[EVMEM_CLASSES];
+static struct evmem_stats evmem_stats;
+static struct event *ev_trim;
+static int evmem_on;
+
+// evbuffer chains are powers of two but libevent structs fall anywhere,
+// so every power of two is split in 8 classes (16 bytes apart at least)
+// and no object wastes more than 1/8 of its size
+static void init_class_sizes()
+{
+    size_t size = EVMEM_MIN_SIZE;
+    int cls;
+    for (cls = 0; cls < EVMEM_CLASSES; cls++) {
+        classes[cls].stats.size = size;
+
+        size_t pow2 = 1;
+        while (pow2 * 2 <= size)
+            pow2 *= 2;
+        size += pow2 / 8 > EVMEM_ALIGN ? pow2 / 8 : EVMEM_ALIGN;
+    }
+    assert(classes[EVMEM_CLASSES - 1].stats.size == EVMEM_MAX_SIZE);
+}
+
+static int size_class(size_t size)
+{
+    if (size > EVMEM_MAX_SIZE)
+        return -1;
+
+    int lo = 0, hi = EVMEM_CLASSES - 1;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (classes[mid].stats.size < size)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+static struct evmem_slab *new_slab(int cls)
+{
+    struct evmem_class *c = &classes[cls];
+    if (c->stats.slabs >= c->max_slabs)
+        return NULL;
+
+    void *mem = mmap(NULL, c->stats.slab_size, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mem == MAP_FAILED)
+        return NULL;
+
+    struct evmem_slab *s = mem;
+    s->next              = NULL;
+    s->free_list         = NULL;
+    s->carved            = 0;
+    s->used              = 0;
+    s->cls               = cls;
+
+    // only mapped with no slab available, so it is all of avail
+    s->avail_next = NULL;
+    c->avail      = s;
+    if (c->last)
+        c->last->next = s;
+    else
+        c->slabs = s;
+    c->last = s;
+
+    c->stats.slabs++;
+    c->stats.capacity += c->per_slab;
+    evmem_stats.slab_bytes += c->stats.slab_size;
+    return s;
+}
+
+static struct evmem_hdr *slab_take(struct evmem_slab *s)
+{
+    struct evmem_class *c = &classes[s->cls];
+    struct evmem_hdr *h   = s->free_list;
+
+    if (h) {
+        s->free_list = (struct evmem_hdr *) h->slab;
+    } else if (s->carved < c->per_slab) {
+        h = (struct evmem_hdr *) (s->data + (size_t) s->carved * c->obj_size);
+        s->carved++;
+    } else {
+        return NULL;
+    }
+
+    s->used++;
+    c->stats.used++;
+    h->slab = s;
+    return h;
+}
+
+static void *evmem_malloc(size_t size)
+{
+    struct evmem_hdr *h = NULL;
+    int cls             = size_class(size);
+
+    if (cls >= 0) {
+        struct evmem_class *c = &classes[cls];
+        struct evmem_slab *s  = c->avail ? c->avail : new_slab(cls);
+        c->allocs++;
+        if (s) {
+            h = slab_take(s);
+            if (s->used == c->per_slab)
+                c->avail = s->avail_next;
+        }
+        if (!h)
+            c->stats.fallbacks++;
+    }
+
+    if (!h) {
+        h = malloc(sizeof(struct evmem_hdr) + size);
+        if (!h)
+            return NULL;
+        h->slab = NULL;
+        evmem_stats.large_bytes += size;
+    }
+
+    h->size = size;
+    return h + 1;
+}
+
+static void evmem_free(void *ptr)
+{
+    if (!ptr)
+        return;
+
+    struct evmem_hdr *h  = (struct evmem_hdr *) ptr - 1;
+    struct evmem_slab *s = h->slab;
+    if (!s) {
+        evmem_stats.large_bytes -= h->size;
+        free(h);
+        return;
+    }
+
+    struct evmem_class *c = &classes[s->cls];
+    if (s->used == c->per_slab) {
+        s->avail_next = c->avail;
+        c->avail      = s;
+    }
+
+    h->slab      = (struct evmem_slab *) s->free_list;
+    s->free_list = h;
+    s->used--;
+    c->stats.used--;
+}
+
+static void *evmem_realloc(void *ptr, size_t size)
+{
+    if (!ptr)
+        return evmem_malloc(size);
+
+    struct evmem_hdr *h = (struct evmem_hdr *) ptr - 1;
+    if (h->slab && size <= classes[h->slab->cls].stats.size) {
+        h->size = size;
+        return ptr;
+    }
+
+    void *n = evmem_malloc(size);
+    if (!n)
+        return NULL;
+    memcpy(n, ptr, h->size < size ? h->size : size);
+    evmem_free(ptr);
+    return n;
+}
+
+// unmap empty slabs of classes idle since last trim, busy classes keep
+// one empty slab for the next burst; avail is rebuilt oldest first, so
+// older slabs are filled first and the newer ones can empty out
+static void evmem_trim_cb(evutil_socket_t fd, short event, void *arg)
+{
+    int cls, idle = 1;
+    for (cls = 0; cls < EVMEM_CLASSES; cls++) {
+        struct evmem_class *c     = &classes[cls];
+        struct evmem_slab **link  = &c->slabs;
+        struct evmem_slab **avail = &c->avail;
+        int keep                  = c->allocs ? 1 : 0;
+
+        if (c->allocs)
+            idle = 0;
+        c->allocs = 0;
+        c->last   = NULL;
+
+        while (*link) {
+            struct evmem_slab *s = *link;
+            if (s->used || keep-- > 0) {
+                if (s->used < c->per_slab) {
+                    *avail = s;
+                    avail  = &s->avail_next;
+                }
+                c->last = s;
+                link    = &s->next;
+                continue;
+            }
+            *link = s->next;
+            munmap(s, c->stats.slab_size);
+            c->stats.slabs--;
+            c->stats.capacity -= c->per_slab;
+            evmem_stats.slab_bytes -= c->stats.slab_size;
+            evmem_stats.unmapped++;
+        }
+        *avail = NULL;
+    }
+
+#if defined(__GLIBC__) && !defined(__UCLIBC__)
+    // what is left in malloc is what we could not hold in slabs
+    if (idle)
+        malloc_trim(0);
+#endif
+}
+
+void init_evmem(size_t class_max)
+{
+    if (evmem_on || !class_max)
+        return;
+
+    size_t page = sysconf(_SC_PAGESIZE);
+    int cls;
+    init_class_sizes();
+    for (cls = 0; cls < EVMEM_CLASSES; cls++) {
+        struct evmem_class *c = &classes[cls];
+        c->obj_size           = sizeof(struct evmem_hdr) + c->stats.size;
+
+        // small classes get one page, so a few live objects pin little
+        size_t slab_size = offsetof(struct evmem_slab, data) + EVMEM_SLAB_OBJS * c->obj_size;
+        c->stats.slab_size = (slab_size + page - 1) / page * page;
+        c->per_slab  = (c->stats.slab_size - offsetof(struct evmem_slab, data)) / c->obj_size;
+        c->max_slabs = class_max / c->stats.slab_size;
+        if (!c->max_slabs)
+            c->max_slabs = 1;
+    }
+
+    event_set_mem_functions(evmem_malloc, evmem_realloc, evmem_free);
+    evmem_on = 1;
+    debug(LOG_DEBUG, "libevent memory served by slabs, %u KB per size class",
+          (unsigned) (class_max / 1024));
+}
+
+void start_evmem_trim(struct event_base *base)
+{
+    if (!evmem_on || ev_trim)
+        return;
+
+    struct timeval tv = {EVMEM_TRIM_INTERVAL, 0};
+    ev_trim           = event_new(base, -1, EV_PERSIST, evmem_trim_cb, NULL);
+    assert(ev_trim);
+    event_add(ev_trim, &tv);
+}
+
+void stop_evmem_trim()
+{
+    if (ev_trim) {
+        event_free(ev_trim);
+        ev_trim = NULL;
+    }
+}
+
+int evmem_enabled()
+{
+    return evmem_on;
+}
+
+const struct evmem_stats *get_evmem_stats()
+{
+    return &evmem_stats;
+}
+
+const struct evmem_class_stats *get_evmem_class_stats(int cls)
+{
+    return &classes[cls].stats;
+}
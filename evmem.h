@@ -0,0 +1,64 @@
+/* vim: set et ts=4 sts=4 sw=4 : */
+/********************************************************************\
+ * This program is free software; you can redistribute it and/or    *
+ * modify it under the terms of the GNU General Public License as   *
+ * published by the Free Software Foundation; either version 2 of   *
+ * the License, or (at your option) any later version.              *
+ *                                                                  *
+ * This program is distributed in the hope that it will be useful,  *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of   *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the    *
+ * GNU General Public License for more details.                     *
+ *                                                                  *
+ * You should have received a copy of the GNU General Public License*
+ * along with this program; if not, contact:                        *
+ *                                                                  *
+ * Free Software Foundation           Voice:  +1-617-542-5942       *
+ * 59 Temple Place - Suite 330        Fax:    +1-617-542-2652       *
+ * Boston, MA  02111-1307,  USA       gnu@gnu.org                   *
+ *                                                                  *
+\********************************************************************/
+
+/** @file evmem.h
+    @brief size class slab allocator behind libevent buffers
+*/
+
+#ifndef _EVMEM_H_
+#define _EVMEM_H_
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define EVMEM_CLASSES 64             // 16 ... 16384 bytes, eight per power of two
+#define EVMEM_SLAB_OBJS 8            // a slab holds at least that many objects
+#define EVMEM_TRIM_INTERVAL 30       // seconds
+
+struct event_base;
+
+struct evmem_class_stats {
+    size_t size;          // usable bytes of one object
+    size_t slab_size;     // bytes mapped at once
+    uint32_t slabs;       // slabs mapped now
+    uint32_t used;        // objects handed out
+    uint32_t capacity;    // objects the mapped slabs hold
+    uint64_t fallbacks;   // allocations over the class cap, served by malloc
+};
+
+struct evmem_stats {
+    uint64_t slab_bytes;    // mapped for slabs
+    uint64_t large_bytes;   // requested over the largest class or cap, in malloc
+    uint64_t unmapped;      // empty slabs given back to the OS
+};
+
+// install the allocator, must run before libevent allocates anything;
+// class_max is bytes of slabs one class may map, 0 keeps plain malloc
+void init_evmem(size_t class_max);
+// give idle empty slabs back to the OS every EVMEM_TRIM_INTERVAL
+void start_evmem_trim(struct event_base *base);
+void stop_evmem_trim();
+
+int evmem_enabled();
+const struct evmem_stats *get_evmem_stats();
+const struct evmem_class_stats *get_evmem_class_stats(int cls);
+
+#endif   //_EVMEM_H_
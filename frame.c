@@ -2,6 +2,7 @@
 #include "session.h"
 #include "version.h"
 #include "common.h"
+#include "pool.h"
 
 const static int size_of_ver    = 1;
 const static int size_of_cmd    = 1;
@@ -16,7 +17,7 @@ int get_header_size()
 
 struct frame *new_frame(char cmd, uint32_t sid)
 {
-    struct frame *f = calloc(sizeof(struct frame), 1);
+    struct frame *f = pool_alloc(POOL_FRAME);
     if (f != NULL) {
         f->ver  = version;
         f->cmd  = cmd;
@@ -69,7 +70,8 @@ void set_frame_len(struct frame *f, ushort data_len)
     f->len = data_len;
 }
 
+// f->data is not owned by frame
 void free_frame(struct frame *f)
 {
-    SAFE_FREE(f);
+    pool_free(POOL_FRAME, f);
 }
\ No newline at end of file
@@ -0,0 +1,78 @@
+/* vim: set et ts=4 sts=4 sw=4 : */
+/********************************************************************\
+ * This program is free software; you can redistribute it and/or    *
+ * modify it under the terms of the GNU General Public License as   *
+ * published by the Free Software Foundation; either version 2 of   *
+ * the License, or (at your option) any later version.              *
+ *                                                                  *
+ * This program is distributed in the hope that it will be useful,  *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of   *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the    *
+ * GNU General Public License for more details.                     *
+ *                                                                  *
+ * You should have received a copy of the GNU General Public License*
+ * along with this program; if not, contact:                        *
+ *                                                                  *
+ * Free Software Foundation           Voice:  +1-617-542-5942       *
+ * 59 Temple Place - Suite 330        Fax:    +1-617-542-2652       *
+ * Boston, MA  02111-1307,  USA       gnu@gnu.org                   *
+ *                                                                  *
+\********************************************************************/
+
+
+/** @file histogram.c
+    @brief log2 bucketed latency histogram
+
+    Fixed size, no allocation, O(1) insert; good enough to tell a 2ms
+    local connect from a 200ms one, which is all the percentiles are for.
+*/
+
+#include "histogram.h"
+
+static int hist_bucket(uint64_t us)
+{
+    if (us < 2)
+        return 0;
+
+    int idx = 63 - __builtin_clzll(us);
+    return idx < HIST_BUCKETS ? idx : HIST_BUCKETS - 1;
+}
+
+void hist_add(struct latency_hist *h, uint64_t us)
+{
+    h->buckets[hist_bucket(us)]++;
+    h->count++;
+    h->sum_us += us;
+    if (us > h->max_us)
+        h->max_us = us;
+}
+
+uint64_t hist_percentile(const struct latency_hist *h, int pct)
+{
+    if (!h->count)
+        return 0;
+
+    uint64_t rank = (h->count * pct + 99) / 100;
+    if (!rank)
+        rank = 1;
+
+    uint64_t seen = 0;
+    int i;
+    for (i = 0; i < HIST_BUCKETS; i++) {
+        if (!h->buckets[i] || seen + h->buckets[i] < rank) {
+            seen += h->buckets[i];
+            continue;
+        }
+
+        uint64_t low  = i ? (1ULL << i) : 0;
+        uint64_t high = (1ULL << (i + 1));
+        if (i == HIST_BUCKETS - 1 || high > h->max_us)
+            high = h->max_us;
+        if (high < low)
+            return low;
+
+        return low + (high - low) * (rank - seen) / h->buckets[i];
+    }
+
+    return h->max_us;
+}
@@ -0,0 +1,824 @@
+/* vim: set et ts=4 sts=4 sw=4 : */
+/********************************************************************\
+ * This program is free software; you can redistribute it and/or    *
+ * modify it under the terms of the GNU General Public License as   *
+ * published by the Free Software Foundation; either version 2 of   *
+ * the License, or (at your option) any later version.              *
+ *                                                                  *
+ * This program is distributed in the hope that it will be useful,  *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of   *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the    *
+ * GNU General Public License for more details.                     *
+ *                                                                  *
+ * You should have received a copy of the GNU General Public License*
+ * along with this program; if not, contact:                        *
+ *                                                                  *
+ * Free Software Foundation           Voice:  +1-617-542-5942       *
+ * 59 Temple Place - Suite 330        Fax:    +1-617-542-2652       *
+ * Boston, MA  02111-1307,  USA       gnu@gnu.org                   *
+ *                                                                  *
+\********************************************************************/
+
+
+/** @file kcp.c
+    @brief KCP reliable stream over datagrams
+
+    ARQ of the KCP protocol, segment for segment compatible with ikcp in
+    stream mode. Every datagram carries one or more segments:
+
+        conv:32 cmd:8 frg:8 wnd:16 ts:32 sn:32 una:32 len:32 data[len]
+
+    all little endian. KCP trades bandwidth for latency: a lost segment is
+    resent after a few acks skipped it instead of waiting for the
+    retransmission timeout, the timeout backs off by 1.5 instead of 2 and
+    congestion control may be turned off, so lossy cellular links do not
+    stall the way TCP does. A zero length PUSH segment is the end of
+    stream, KCP itself has no close.
+*/
+
+#include <string.h>
+#include <stdlib.h>
+#include <assert.h>
+
+#include "kcp.h"
+
+#define KCP_CMD_PUSH 81   // data
+#define KCP_CMD_ACK 82
+#define KCP_CMD_WASK 83   // ask the peer for its window
+#define KCP_CMD_WINS 84   // tell the peer our window
+
+#define KCP_ASK_SEND 1
+#define KCP_ASK_TELL 2
+
+#define KCP_RTO_NDL 30   // rto floor with nodelay
+#define KCP_RTO_MIN 100
+#define KCP_RTO_DEF 200
+#define KCP_RTO_MAX 60000
+#define KCP_WND_SND 32
+#define KCP_WND_RCV 128
+#define KCP_INTERVAL 100
+#define KCP_THRESH_INIT 2
+#define KCP_THRESH_MIN 2
+#define KCP_PROBE_INIT 7000
+#define KCP_PROBE_LIMIT 120000
+#define KCP_DEADLINK 20
+#define KCP_FASTACK_LIMIT 5
+
+struct kcp_node {
+    struct kcp_node *prev;
+    struct kcp_node *next;
+};
+
+struct kcp_seg {
+    struct kcp_node node;   // first, a node pointer is a segment pointer
+    uint32_t sn;
+    uint32_t ts;
+    uint32_t resendts;
+    uint32_t rto;
+    uint32_t fastack;
+    uint32_t xmit;
+    uint32_t len;
+    char data[];
+};
+
+struct kcp_ack {
+    uint32_t sn;
+    uint32_t ts;
+};
+
+struct kcp {
+    uint32_t conv, mtu, mss;
+    uint32_t snd_una, snd_nxt, rcv_nxt;
+    uint32_t ssthresh;
+    int32_t rx_rttval, rx_srtt;
+    int32_t rx_rto, rx_minrto;
+    uint32_t snd_wnd, rcv_wnd, rmt_wnd, cwnd, probe;
+    uint32_t current, interval, ts_flush;
+    uint32_t nodelay, updated;
+    uint32_t ts_probe, probe_wait;
+    uint32_t incr;
+    int fastresend;
+    int nocwnd;
+    int dead;
+    int snd_eof;   // end of stream queued
+    int rcv_eof;   // end of stream read
+
+    struct kcp_node snd_queue, snd_buf, rcv_queue, rcv_buf;
+    uint32_t nsnd_que, nsnd_buf, nrcv_que, nrcv_buf;
+    uint32_t rcv_off;   // bytes of rcv_queue head already read
+
+    struct kcp_ack *acklist;
+    uint32_t ackcount, ackblock;
+
+    char *buffer;   // datagram being built
+    kcp_output_cb output;
+    void *arg;
+    struct kcp_stats stats;
+};
+
+static inline int32_t timediff(uint32_t later, uint32_t earlier)
+{
+    return (int32_t)(later - earlier);
+}
+
+static inline void list_init(struct kcp_node *head)
+{
+    head->prev = head->next = head;
+}
+
+static inline int list_empty(const struct kcp_node *head)
+{
+    return head->next == head;
+}
+
+static inline void list_add_before(struct kcp_node *node, struct kcp_node *pos)
+{
+    node->prev       = pos->prev;
+    node->next       = pos;
+    pos->prev->next  = node;
+    pos->prev        = node;
+}
+
+static inline void list_del(struct kcp_node *node)
+{
+    node->prev->next = node->next;
+    node->next->prev = node->prev;
+    node->prev = node->next = NULL;
+}
+
+#define SEG(n) ((struct kcp_seg *) (n))
+
+static struct kcp_seg *seg_new(int size)
+{
+    struct kcp_seg *seg = calloc(1, sizeof(struct kcp_seg) + size);
+    assert(seg);
+    return seg;
+}
+
+static void free_list(struct kcp_node *head)
+{
+    while (!list_empty(head)) {
+        struct kcp_node *n = head->next;
+        list_del(n);
+        free(n);
+    }
+}
+
+static char *encode8(char *p, uint8_t v)
+{
+    *(uint8_t *) p = v;
+    return p + 1;
+}
+
+static char *encode16(char *p, uint16_t v)
+{
+    p[0] = v & 0xff;
+    p[1] = v >> 8;
+    return p + 2;
+}
+
+static char *encode32(char *p, uint32_t v)
+{
+    p[0] = v & 0xff;
+    p[1] = (v >> 8) & 0xff;
+    p[2] = (v >> 16) & 0xff;
+    p[3] = v >> 24;
+    return p + 4;
+}
+
+static const char *decode8(const char *p, uint8_t *v)
+{
+    *v = *(const uint8_t *) p;
+    return p + 1;
+}
+
+static const char *decode16(const char *p, uint16_t *v)
+{
+    const uint8_t *u = (const uint8_t *) p;
+    *v               = u[0] | (u[1] << 8);
+    return p + 2;
+}
+
+static const char *decode32(const char *p, uint32_t *v)
+{
+    const uint8_t *u = (const uint8_t *) p;
+    *v               = u[0] | (u[1] << 8) | (u[2] << 16) | ((uint32_t) u[3] << 24);
+    return p + 4;
+}
+
+struct kcp *kcp_new(uint32_t conv, kcp_output_cb output, void *arg)
+{
+    struct kcp *kcp = calloc(1, sizeof(struct kcp));
+    assert(kcp);
+
+    kcp->conv      = conv;
+    kcp->output    = output;
+    kcp->arg       = arg;
+    kcp->snd_wnd   = KCP_WND_SND;
+    kcp->rcv_wnd   = KCP_WND_RCV;
+    kcp->rmt_wnd   = KCP_WND_RCV;
+    kcp->mtu       = KCP_MTU_DEF;
+    kcp->mss       = kcp->mtu - KCP_OVERHEAD;
+    kcp->rx_rto    = KCP_RTO_DEF;
+    kcp->rx_minrto = KCP_RTO_MIN;
+    kcp->interval  = KCP_INTERVAL;
+    kcp->ts_flush  = KCP_INTERVAL;
+    kcp->ssthresh  = KCP_THRESH_INIT;
+    kcp->buffer    = malloc((kcp->mtu + KCP_OVERHEAD) * 3);
+    assert(kcp->buffer);
+
+    list_init(&kcp->snd_queue);
+    list_init(&kcp->snd_buf);
+    list_init(&kcp->rcv_queue);
+    list_init(&kcp->rcv_buf);
+    return kcp;
+}
+
+void kcp_free(struct kcp *kcp)
+{
+    if (!kcp)
+        return;
+
+    free_list(&kcp->snd_queue);
+    free_list(&kcp->snd_buf);
+    free_list(&kcp->rcv_queue);
+    free_list(&kcp->rcv_buf);
+    free(kcp->acklist);
+    free(kcp->buffer);
+    free(kcp);
+}
+
+void kcp_set_nodelay(struct kcp *kcp, int nodelay, int interval, int resend, int nc)
+{
+    if (nodelay >= 0) {
+        kcp->nodelay   = nodelay;
+        kcp->rx_minrto = nodelay ? KCP_RTO_NDL : KCP_RTO_MIN;
+    }
+    if (interval >= 0) {
+        if (interval > 5000)
+            interval = 5000;
+        else if (interval < 10)
+            interval = 10;
+        kcp->interval = interval;
+    }
+    if (resend >= 0)
+        kcp->fastresend = resend;
+    if (nc >= 0)
+        kcp->nocwnd = nc;
+}
+
+void kcp_set_wndsize(struct kcp *kcp, int sndwnd, int rcvwnd)
+{
+    if (sndwnd > 0)
+        kcp->snd_wnd = sndwnd;
+    // a message may have up to 128 fragments in ikcp, keep the window over it
+    if (rcvwnd > 0)
+        kcp->rcv_wnd = rcvwnd < KCP_WND_RCV ? KCP_WND_RCV : rcvwnd;
+}
+
+int kcp_set_mtu(struct kcp *kcp, int mtu)
+{
+    if (mtu < 50 || mtu < KCP_OVERHEAD)
+        return -1;
+
+    char *buffer = malloc((mtu + KCP_OVERHEAD) * 3);
+    if (!buffer)
+        return -1;
+    free(kcp->buffer);
+    kcp->buffer = buffer;
+    kcp->mtu    = mtu;
+    kcp->mss    = mtu - KCP_OVERHEAD;
+    return 0;
+}
+
+int kcp_send(struct kcp *kcp, const char *buf, int len)
+{
+    if (kcp->snd_eof || len < 0)
+        return -1;
+
+    if (len == 0) {
+        struct kcp_seg *seg = seg_new(0);
+        list_add_before(&seg->node, &kcp->snd_queue);
+        kcp->nsnd_que++;
+        kcp->snd_eof = 1;
+        return 0;
+    }
+
+    int sent = 0;
+    // stream mode, fill up the last queued segment first
+    if (!list_empty(&kcp->snd_queue)) {
+        struct kcp_seg *old = SEG(kcp->snd_queue.prev);
+        if (old->len && old->len < kcp->mss) {
+            int extend          = kcp->mss - old->len;
+            if (extend > len)
+                extend = len;
+            struct kcp_seg *seg = seg_new(old->len + extend);
+            memcpy(seg->data, old->data, old->len);
+            memcpy(seg->data + old->len, buf, extend);
+            seg->len = old->len + extend;
+            list_add_before(&seg->node, &old->node);
+            list_del(&old->node);
+            free(old);
+            sent += extend;
+        }
+    }
+
+    while (sent < len) {
+        int size            = len - sent > (int) kcp->mss ? (int) kcp->mss : len - sent;
+        struct kcp_seg *seg = seg_new(size);
+        memcpy(seg->data, buf + sent, size);
+        seg->len = size;
+        list_add_before(&seg->node, &kcp->snd_queue);
+        kcp->nsnd_que++;
+        sent += size;
+    }
+    return sent;
+}
+
+static void move_rcv_buf(struct kcp *kcp)
+{
+    while (!list_empty(&kcp->rcv_buf)) {
+        struct kcp_seg *seg = SEG(kcp->rcv_buf.next);
+        if (seg->sn != kcp->rcv_nxt || kcp->nrcv_que >= kcp->rcv_wnd)
+            break;
+        list_del(&seg->node);
+        kcp->nrcv_buf--;
+        list_add_before(&seg->node, &kcp->rcv_queue);
+        kcp->nrcv_que++;
+        kcp->rcv_nxt++;
+    }
+}
+
+int kcp_recv(struct kcp *kcp, char *buf, int len)
+{
+    int recover = kcp->nrcv_que >= kcp->rcv_wnd;
+    int n       = 0;
+
+    while (n < len && !list_empty(&kcp->rcv_queue)) {
+        struct kcp_seg *seg = SEG(kcp->rcv_queue.next);
+        int copy            = seg->len - kcp->rcv_off;
+        if (copy > len - n)
+            copy = len - n;
+        memcpy(buf + n, seg->data + kcp->rcv_off, copy);
+        n += copy;
+        kcp->rcv_off += copy;
+        if (kcp->rcv_off < seg->len)
+            break;
+
+        if (!seg->len)
+            kcp->rcv_eof = 1;
+        list_del(&seg->node);
+        free(seg);
+        kcp->nrcv_que--;
+        kcp->rcv_off = 0;
+        if (kcp->rcv_eof)
+            break;
+    }
+
+    move_rcv_buf(kcp);
+
+    // window was full, tell the peer it opened without waiting for its probe
+    if (recover && kcp->nrcv_que < kcp->rcv_wnd)
+        kcp->probe |= KCP_ASK_TELL;
+    return n;
+}
+
+static void update_ack(struct kcp *kcp, int32_t rtt)
+{
+    if (kcp->rx_srtt == 0) {
+        kcp->rx_srtt   = rtt;
+        kcp->rx_rttval = rtt / 2;
+    } else {
+        int32_t delta  = rtt > kcp->rx_srtt ? rtt - kcp->rx_srtt : kcp->rx_srtt - rtt;
+        kcp->rx_rttval = (3 * kcp->rx_rttval + delta) / 4;
+        kcp->rx_srtt   = (7 * kcp->rx_srtt + rtt) / 8;
+        if (kcp->rx_srtt < 1)
+            kcp->rx_srtt = 1;
+    }
+
+    int32_t var = 4 * kcp->rx_rttval;
+    int32_t rto = kcp->rx_srtt + ((int32_t) kcp->interval > var ? (int32_t) kcp->interval : var);
+    if (rto < kcp->rx_minrto)
+        rto = kcp->rx_minrto;
+    if (rto > KCP_RTO_MAX)
+        rto = KCP_RTO_MAX;
+    kcp->rx_rto = rto;
+}
+
+static void shrink_buf(struct kcp *kcp)
+{
+    kcp->snd_una = list_empty(&kcp->snd_buf) ? kcp->snd_nxt : SEG(kcp->snd_buf.next)->sn;
+}
+
+static void parse_ack(struct kcp *kcp, uint32_t sn)
+{
+    if (timediff(sn, kcp->snd_una) < 0 || timediff(sn, kcp->snd_nxt) >= 0)
+        return;
+
+    struct kcp_node *n;
+    for (n = kcp->snd_buf.next; n != &kcp->snd_buf; n = n->next) {
+        struct kcp_seg *seg = SEG(n);
+        if (seg->sn == sn) {
+            list_del(n);
+            free(seg);
+            kcp->nsnd_buf--;
+            break;
+        }
+        if (timediff(sn, seg->sn) < 0)
+            break;
+    }
+}
+
+static void parse_una(struct kcp *kcp, uint32_t una)
+{
+    while (!list_empty(&kcp->snd_buf)) {
+        struct kcp_seg *seg = SEG(kcp->snd_buf.next);
+        if (timediff(una, seg->sn) <= 0)
+            break;
+        list_del(&seg->node);
+        free(seg);
+        kcp->nsnd_buf--;
+    }
+}
+
+static void parse_fastack(struct kcp *kcp, uint32_t sn)
+{
+    if (timediff(sn, kcp->snd_una) < 0 || timediff(sn, kcp->snd_nxt) >= 0)
+        return;
+
+    struct kcp_node *n;
+    for (n = kcp->snd_buf.next; n != &kcp->snd_buf; n = n->next) {
+        struct kcp_seg *seg = SEG(n);
+        if (timediff(sn, seg->sn) < 0)
+            break;
+        if (sn != seg->sn)
+            seg->fastack++;
+    }
+}
+
+static void ack_push(struct kcp *kcp, uint32_t sn, uint32_t ts)
+{
+    if (kcp->ackcount == kcp->ackblock) {
+        kcp->ackblock = kcp->ackblock ? kcp->ackblock * 2 : 8;
+        kcp->acklist  = realloc(kcp->acklist, kcp->ackblock * sizeof(struct kcp_ack));
+        assert(kcp->acklist);
+    }
+    kcp->acklist[kcp->ackcount].sn = sn;
+    kcp->acklist[kcp->ackcount].ts = ts;
+    kcp->ackcount++;
+}
+
+static void parse_data(struct kcp *kcp, struct kcp_seg *newseg)
+{
+    uint32_t sn = newseg->sn;
+    if (timediff(sn, kcp->rcv_nxt + kcp->rcv_wnd) >= 0 || timediff(sn, kcp->rcv_nxt) < 0) {
+        kcp->stats.dup_recv++;
+        free(newseg);
+        return;
+    }
+
+    // rcv_buf is ordered by sn, new segments usually belong at its end
+    struct kcp_node *n;
+    for (n = kcp->rcv_buf.prev; n != &kcp->rcv_buf; n = n->prev) {
+        struct kcp_seg *seg = SEG(n);
+        if (seg->sn == sn) {
+            kcp->stats.dup_recv++;
+            free(newseg);
+            return;
+        }
+        if (timediff(sn, seg->sn) > 0)
+            break;
+    }
+    list_add_before(&newseg->node, n->next);
+    kcp->nrcv_buf++;
+    kcp->stats.segs_recv++;
+
+    move_rcv_buf(kcp);
+}
+
+uint32_t kcp_getconv(const char *data, int size)
+{
+    uint32_t conv = 0;
+    if (size >= 4)
+        decode32(data, &conv);
+    return conv;
+}
+
+int kcp_input(struct kcp *kcp, const char *data, int size)
+{
+    uint32_t prev_una = kcp->snd_una;
+    uint32_t maxack = 0;
+    int flag         = 0;
+
+    if (size < KCP_OVERHEAD)
+        return -1;
+
+    while (size >= KCP_OVERHEAD) {
+        uint32_t conv, ts, sn, una, len;
+        uint16_t wnd;
+        uint8_t cmd, frg;
+
+        data = decode32(data, &conv);
+        if (conv != kcp->conv)
+            return -1;
+        data = decode8(data, &cmd);
+        data = decode8(data, &frg);
+        data = decode16(data, &wnd);
+        data = decode32(data, &ts);
+        data = decode32(data, &sn);
+        data = decode32(data, &una);
+        data = decode32(data, &len);
+        size -= KCP_OVERHEAD;
+
+        if ((uint32_t) size < len)
+            return -2;
+        if (cmd != KCP_CMD_PUSH && cmd != KCP_CMD_ACK && cmd != KCP_CMD_WASK &&
+            cmd != KCP_CMD_WINS)
+            return -3;
+
+        kcp->rmt_wnd = wnd;
+        parse_una(kcp, una);
+        shrink_buf(kcp);
+
+        if (cmd == KCP_CMD_ACK) {
+            if (timediff(kcp->current, ts) >= 0)
+                update_ack(kcp, timediff(kcp->current, ts));
+            parse_ack(kcp, sn);
+            shrink_buf(kcp);
+            if (!flag || timediff(sn, maxack) > 0)
+                maxack = sn;
+            flag = 1;
+        } else if (cmd == KCP_CMD_PUSH) {
+            if (timediff(sn, kcp->rcv_nxt + kcp->rcv_wnd) < 0) {
+                ack_push(kcp, sn, ts);
+                if (timediff(sn, kcp->rcv_nxt) >= 0) {
+                    struct kcp_seg *seg = seg_new(len);
+                    seg->sn             = sn;
+                    seg->ts             = ts;
+                    seg->len            = len;
+                    memcpy(seg->data, data, len);
+                    parse_data(kcp, seg);
+                } else {
+                    kcp->stats.dup_recv++;
+                }
+            }
+        } else if (cmd == KCP_CMD_WASK) {
+            kcp->probe |= KCP_ASK_TELL;
+        }
+
+        data += len;
+        size -= len;
+    }
+
+    if (flag)
+        parse_fastack(kcp, maxack);
+
+    // congestion window grows with acked data, slow start then avoidance
+    if (timediff(kcp->snd_una, prev_una) > 0 && kcp->cwnd < kcp->rmt_wnd) {
+        uint32_t mss = kcp->mss;
+        if (kcp->cwnd < kcp->ssthresh) {
+            kcp->cwnd++;
+            kcp->incr += mss;
+        } else {
+            if (kcp->incr < mss)
+                kcp->incr = mss;
+            kcp->incr += (mss * mss) / kcp->incr + (mss / 16);
+            if ((kcp->cwnd + 1) * mss <= kcp->incr)
+                kcp->cwnd = (kcp->incr + mss - 1) / (mss > 0 ? mss : 1);
+        }
+        if (kcp->cwnd > kcp->rmt_wnd) {
+            kcp->cwnd = kcp->rmt_wnd;
+            kcp->incr = kcp->rmt_wnd * mss;
+        }
+    }
+    return 0;
+}
+
+static char *encode_seg(char *p, const struct kcp *kcp, uint8_t cmd, uint16_t wnd, uint32_t ts,
+                        uint32_t sn, uint32_t len)
+{
+    p = encode32(p, kcp->conv);
+    p = encode8(p, cmd);
+    p = encode8(p, 0);   // frg, always 0 in stream mode
+    p = encode16(p, wnd);
+    p = encode32(p, ts);
+    p = encode32(p, sn);
+    p = encode32(p, kcp->rcv_nxt);
+    p = encode32(p, len);
+    return p;
+}
+
+// make room for need bytes in the datagram being built
+static char *reserve(struct kcp *kcp, char *p, int need)
+{
+    if ((int) (p - kcp->buffer) + need > (int) kcp->mtu) {
+        kcp->output(kcp->buffer, p - kcp->buffer, kcp->arg);
+        p = kcp->buffer;
+    }
+    return p;
+}
+
+void kcp_flush(struct kcp *kcp, uint32_t current)
+{
+    if (!kcp->updated)
+        return;
+
+    kcp->current = current;
+    char *p          = kcp->buffer;
+    uint16_t wnd     = kcp->nrcv_que < kcp->rcv_wnd ? kcp->rcv_wnd - kcp->nrcv_que : 0;
+    uint32_t i;
+
+    for (i = 0; i < kcp->ackcount; i++) {
+        p = reserve(kcp, p, KCP_OVERHEAD);
+        p = encode_seg(p, kcp, KCP_CMD_ACK, wnd, kcp->acklist[i].ts, kcp->acklist[i].sn, 0);
+    }
+    kcp->ackcount = 0;
+
+    // peer window is zero, probe it now and then
+    if (kcp->rmt_wnd == 0) {
+        if (kcp->probe_wait == 0) {
+            kcp->probe_wait = KCP_PROBE_INIT;
+            kcp->ts_probe   = current + kcp->probe_wait;
+        } else if (timediff(current, kcp->ts_probe) >= 0) {
+            if (kcp->probe_wait < KCP_PROBE_INIT)
+                kcp->probe_wait = KCP_PROBE_INIT;
+            kcp->probe_wait += kcp->probe_wait / 2;
+            if (kcp->probe_wait > KCP_PROBE_LIMIT)
+                kcp->probe_wait = KCP_PROBE_LIMIT;
+            kcp->ts_probe = current + kcp->probe_wait;
+            kcp->probe |= KCP_ASK_SEND;
+        }
+    } else {
+        kcp->ts_probe   = 0;
+        kcp->probe_wait = 0;
+    }
+
+    if (kcp->probe & KCP_ASK_SEND) {
+        p = reserve(kcp, p, KCP_OVERHEAD);
+        p = encode_seg(p, kcp, KCP_CMD_WASK, wnd, 0, 0, 0);
+    }
+    if (kcp->probe & KCP_ASK_TELL) {
+        p = reserve(kcp, p, KCP_OVERHEAD);
+        p = encode_seg(p, kcp, KCP_CMD_WINS, wnd, 0, 0, 0);
+    }
+    kcp->probe = 0;
+
+    uint32_t cwnd = kcp->snd_wnd < kcp->rmt_wnd ? kcp->snd_wnd : kcp->rmt_wnd;
+    if (!kcp->nocwnd && kcp->cwnd < cwnd)
+        cwnd = kcp->cwnd;
+
+    while (timediff(kcp->snd_nxt, kcp->snd_una + cwnd) < 0 && !list_empty(&kcp->snd_queue)) {
+        struct kcp_seg *seg = SEG(kcp->snd_queue.next);
+        list_del(&seg->node);
+        list_add_before(&seg->node, &kcp->snd_buf);
+        kcp->nsnd_que--;
+        kcp->nsnd_buf++;
+        seg->ts       = current;
+        seg->sn       = kcp->snd_nxt++;
+        seg->resendts = current;
+        seg->rto      = kcp->rx_rto;
+        seg->fastack  = 0;
+        seg->xmit     = 0;
+    }
+
+    uint32_t resent = kcp->fastresend > 0 ? (uint32_t) kcp->fastresend : 0xffffffff;
+    uint32_t rtomin = kcp->nodelay == 0 ? (kcp->rx_rto >> 3) : 0;
+    int change = 0, lost = 0;
+
+    struct kcp_node *n;
+    for (n = kcp->snd_buf.next; n != &kcp->snd_buf; n = n->next) {
+        struct kcp_seg *seg = SEG(n);
+        int needsend        = 0;
+
+        if (seg->xmit == 0) {
+            needsend      = 1;
+            seg->xmit++;
+            seg->rto      = kcp->rx_rto;
+            seg->resendts = current + seg->rto + rtomin;
+            kcp->stats.segs_sent++;
+        } else if (timediff(current, seg->resendts) >= 0) {
+            needsend = 1;
+            seg->xmit++;
+            if (kcp->nodelay == 0)
+                seg->rto += seg->rto > (uint32_t) kcp->rx_rto ? seg->rto : (uint32_t) kcp->rx_rto;
+            else
+                seg->rto += (kcp->nodelay < 2 ? seg->rto : (uint32_t) kcp->rx_rto) / 2;
+            seg->resendts = current + seg->rto;
+            lost          = 1;
+            kcp->stats.retrans++;
+        } else if (seg->fastack >= resent && seg->xmit <= KCP_FASTACK_LIMIT) {
+            needsend      = 1;
+            seg->xmit++;
+            seg->fastack  = 0;
+            seg->resendts = current + seg->rto;
+            change++;
+            kcp->stats.fast_retrans++;
+        }
+
+        if (!needsend)
+            continue;
+
+        p = reserve(kcp, p, KCP_OVERHEAD + seg->len);
+        p = encode_seg(p, kcp, KCP_CMD_PUSH, wnd, current, seg->sn, seg->len);
+        if (seg->len) {
+            memcpy(p, seg->data, seg->len);
+            p += seg->len;
+        }
+        seg->ts = current;
+        if (seg->xmit >= KCP_DEADLINK)
+            kcp->dead = 1;
+    }
+
+    if (p > kcp->buffer)
+        kcp->output(kcp->buffer, p - kcp->buffer, kcp->arg);
+
+    if (change) {
+        uint32_t inflight = kcp->snd_nxt - kcp->snd_una;
+        kcp->ssthresh     = inflight / 2;
+        if (kcp->ssthresh < KCP_THRESH_MIN)
+            kcp->ssthresh = KCP_THRESH_MIN;
+        kcp->cwnd = kcp->ssthresh + resent;
+        kcp->incr = kcp->cwnd * kcp->mss;
+    }
+    if (lost) {
+        kcp->ssthresh = cwnd / 2;
+        if (kcp->ssthresh < KCP_THRESH_MIN)
+            kcp->ssthresh = KCP_THRESH_MIN;
+        kcp->cwnd = 1;
+        kcp->incr = kcp->mss;
+    }
+    if (kcp->cwnd < 1) {
+        kcp->cwnd = 1;
+        kcp->incr = kcp->mss;
+    }
+}
+
+void kcp_update(struct kcp *kcp, uint32_t current)
+{
+    kcp->current = current;
+    if (!kcp->updated) {
+        kcp->updated  = 1;
+        kcp->ts_flush = current;
+    }
+
+    int32_t slap = timediff(current, kcp->ts_flush);
+    if (slap >= 10000 || slap < -10000) {
+        kcp->ts_flush = current;
+        slap          = 0;
+    }
+
+    if (slap >= 0) {
+        kcp->ts_flush += kcp->interval;
+        if (timediff(current, kcp->ts_flush) >= 0)
+            kcp->ts_flush = current + kcp->interval;
+        kcp_flush(kcp, current);
+    }
+}
+
+uint32_t kcp_check(const struct kcp *kcp, uint32_t current)
+{
+    if (!kcp->updated)
+        return current;
+
+    uint32_t ts_flush = kcp->ts_flush;
+    if (timediff(current, ts_flush) >= 10000 || timediff(current, ts_flush) < -10000)
+        ts_flush = current;
+    if (timediff(current, ts_flush) >= 0)
+        return current;
+
+    int32_t tm_flush  = timediff(ts_flush, current);
+    int32_t tm_packet = 0x7fffffff;
+    const struct kcp_node *n;
+    for (n = kcp->snd_buf.next; n != &kcp->snd_buf; n = n->next) {
+        int32_t diff = timediff(SEG(n)->resendts, current);
+        if (diff <= 0)
+            return current;
+        if (diff < tm_packet)
+            tm_packet = diff;
+    }
+
+    uint32_t minimal = tm_packet < tm_flush ? tm_packet : tm_flush;
+    if (minimal >= kcp->interval)
+        minimal = kcp->interval;
+    return current + minimal;
+}
+
+int kcp_waitsnd(const struct kcp *kcp)
+{
+    return kcp->nsnd_buf + kcp->nsnd_que;
+}
+
+int kcp_peek_eof(const struct kcp *kcp)
+{
+    return kcp->rcv_eof;
+}
+
+int kcp_dead(const struct kcp *kcp)
+{
+    return kcp->dead;
+}
+
+const struct kcp_stats *kcp_get_stats(const struct kcp *kcp)
+{
+    return &kcp->stats;
+}
@@ -0,0 +1,81 @@
+/* vim: set et ts=4 sts=4 sw=4 : */
+/********************************************************************\
+ * This program is free software; you can redistribute it and/or    *
+ * modify it under the terms of the GNU General Public License as   *
+ * published by the Free Software Foundation; either version 2 of   *
+ * the License, or (at your option) any later version.              *
+ *                                                                  *
+ * This program is distributed in the hope that it will be useful,  *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of   *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the    *
+ * GNU General Public License for more details.                     *
+ *                                                                  *
+ * You should have received a copy of the GNU General Public License*
+ * along with this program; if not, contact:                        *
+ *                                                                  *
+ * Free Software Foundation           Voice:  +1-617-542-5942       *
+ * 59 Temple Place - Suite 330        Fax:    +1-617-542-2652       *
+ * Boston, MA  02111-1307,  USA       gnu@gnu.org                   *
+ *                                                                  *
+\********************************************************************/
+
+
+/** @file kcp.h
+    @brief KCP reliable stream over datagrams
+*/
+
+#ifndef _KCP_H_
+#define _KCP_H_
+
+#include <stdint.h>
+
+#define KCP_OVERHEAD 24   // segment header, see kcp.c
+#define KCP_MTU_DEF 1400
+
+struct kcp;
+
+// send one datagram of the conversation
+typedef int (*kcp_output_cb)(const char *buf, int len, void *arg);
+
+struct kcp_stats {
+    uint64_t segs_sent;   // data segments, first transmission
+    uint64_t retrans;     // timeout retransmissions
+    uint64_t fast_retrans;
+    uint64_t segs_recv;   // data segments accepted
+    uint64_t dup_recv;    // already received or out of window
+};
+
+struct kcp *kcp_new(uint32_t conv, kcp_output_cb output, void *arg);
+void kcp_free(struct kcp *kcp);
+
+// nodelay 1 halves the rto backoff and lowers its floor to 30 ms, resend is
+// the number of acks skipping a segment before it is fast retransmitted (0 off),
+// nc 1 turns congestion control off, interval is the flush period in ms
+void kcp_set_nodelay(struct kcp *kcp, int nodelay, int interval, int resend, int nc);
+// segments in flight and segments the peer may buffer for us
+void kcp_set_wndsize(struct kcp *kcp, int sndwnd, int rcvwnd);
+int kcp_set_mtu(struct kcp *kcp, int mtu);
+
+// append stream bytes, len 0 marks end of stream; -1 after end of stream
+int kcp_send(struct kcp *kcp, const char *buf, int len);
+// copy up to len ordered bytes, return count
+int kcp_recv(struct kcp *kcp, char *buf, int len);
+// one datagram from the peer, <0 when it is not a valid segment of this conversation
+int kcp_input(struct kcp *kcp, const char *data, int size);
+
+// call every interval ms, or at kcp_check time
+void kcp_update(struct kcp *kcp, uint32_t current);
+// when kcp_update has to run next, a time in the same clock as current
+uint32_t kcp_check(const struct kcp *kcp, uint32_t current);
+// send pending acks and segments now, without waiting for the next update
+void kcp_flush(struct kcp *kcp, uint32_t current);
+
+int kcp_waitsnd(const struct kcp *kcp);   // segments not acked yet, queued ones included
+int kcp_peek_eof(const struct kcp *kcp);  // peer end of stream was read by kcp_recv
+int kcp_dead(const struct kcp *kcp);      // a segment was retransmitted too often
+const struct kcp_stats *kcp_get_stats(const struct kcp *kcp);
+
+// conversation id of a datagram, 0 when too short
+uint32_t kcp_getconv(const char *data, int size);
+
+#endif   //_KCP_H_
@@ -0,0 +1,565 @@
+/* vim: set et ts=4 sts=4 sw=4 : */
+/********************************************************************\
+ * This program is free software; you can redistribute it and/or    *
+ * modify it under the terms of the GNU General Public License as   *
+ * published by the Free Software Foundation; either version 2 of   *
+ * the License, or (at your option) any later version.              *
+ *                                                                  *
+ * This program is distributed in the hope that it will be useful,  *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of   *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the    *
+ * GNU General Public License for more details.                     *
+ *                                                                  *
+ * You should have received a copy of the GNU General Public License*
+ * along with this program; if not, contact:                        *
+ *                                                                  *
+ * Free Software Foundation           Voice:  +1-617-542-5942       *
+ * 59 Temple Place - Suite 330        Fax:    +1-617-542-2652       *
+ * Boston, MA  02111-1307,  USA       gnu@gnu.org                   *
+ *                                                                  *
+\********************************************************************/
+
+
+/** @file kcp_conn.c
+    @brief KCP connections to frps as bufferevents
+
+    A KCP conversation is a UDP socket, the kcp state and a bufferevent
+    pair: the caller gets one end and uses it like the socket bufferevent
+    of a TCP connection, so control and work connections run the same
+    message handling over both. Bytes written to it are cut into KCP
+    segments, bytes received are appended in order to its input. The
+    pair is created with deferred callbacks, the caller never reenters
+    here from its own callbacks.
+
+    KCP has no close. Freeing the caller end queues a zero length
+    segment, the end of stream, and keeps the conversation until it is
+    acked or KCP_CONN_LINGER passed; the end of stream from the peer
+    comes out as BEV_EVENT_EOF. A peer silent for KCP_CONN_TIMEOUT while
+    data waits for its ack is BEV_EVENT_ERROR.
+
+    kcp_listen is the peer side, it is only used by the benchmark relay
+    in front of the mock frps (frps 0.10 has no KCP). Conversations are
+    told apart by conv, a peer whose address changed (NAT rebinding on
+    cellular links) keeps its conversation.
+*/
+
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <assert.h>
+#include <syslog.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+#include <event2/util.h>
+#include <event2/event.h>
+#include <event2/buffer.h>
+#include <event2/bufferevent.h>
+
+#include "kcp_conn.h"
+#include "debug.h"
+#include "common.h"
+#include "utils.h"
+
+#define KCP_SOCK_BUF (512 * 1024)
+#define KCP_READ_BURST 64   // datagrams read per wakeup
+#define KCP_IDLE_TICK 1000  // ms between updates with nothing in flight
+
+enum kcp_conn_state {
+    KC_OPEN,
+    KC_LINGER,   // caller freed its end, sending what is left and the end of stream
+    KC_FAILED,   // error delivered, waiting for the caller to free its end
+};
+
+struct kcp_listener {
+    evutil_socket_t fd;
+    struct event *ev_read;
+    struct kcp_conn_conf conf;
+    kcp_accept_cb cb;
+    void *arg;
+    struct kcp_conn *conns;   // by conv
+};
+
+struct kcp_conn {
+    uint32_t conv;
+    struct kcp *kcp;
+    evutil_socket_t fd;   // own connected socket, or the listener one
+    struct sockaddr_in peer;
+    struct kcp_listener *listener;
+    struct bufferevent *pair[2];   // pair[0] is the caller end
+    struct event *ev_read;         // own socket only
+    struct event *ev_connected;    // own socket only
+    struct event *timer;
+    int interval;
+    int idle;   // timer runs at KCP_IDLE_TICK
+    enum kcp_conn_state state;
+    int sndwnd;
+    int send_blocked;
+    int eof_queued;
+    int eof_delivered;
+    int input_pending;   // acks to send once the datagrams at hand are read
+    uint64_t last_alive;   // datagram from the peer, or nothing waiting for its ack
+    uint64_t linger_until;
+
+    struct kcp_conn *prev, *next;   // all conversations
+    UT_hash_handle hh;
+};
+
+static struct kcp_conn *all_conns;
+static struct kcp_conn_stats conn_stats;   // seg counters are of closed conversations only
+
+static uint32_t kcp_clock()
+{
+    return (uint32_t) get_monotonic_msec();
+}
+
+static int conn_output(const char *buf, int len, void *arg)
+{
+    struct kcp_conn *c = arg;
+    ssize_t n          = c->listener
+                             ? sendto(c->fd, buf, len, 0, (struct sockaddr *) &c->peer, sizeof(c->peer))
+                             : send(c->fd, buf, len, 0);
+    // a datagram dropped here is a lost one, kcp resends it
+    if (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != ENOBUFS)
+        debug_ratelimit(LOG_DEBUG, "kcp conv %u send failed: %s", c->conv, strerror(errno));
+    return 0;
+}
+
+static void conn_free(struct kcp_conn *c)
+{
+    const struct kcp_stats *ks = kcp_get_stats(c->kcp);
+    conn_stats.seg.segs_sent += ks->segs_sent;
+    conn_stats.seg.retrans += ks->retrans;
+    conn_stats.seg.fast_retrans += ks->fast_retrans;
+    conn_stats.seg.segs_recv += ks->segs_recv;
+    conn_stats.seg.dup_recv += ks->dup_recv;
+    conn_stats.live_conns--;
+
+    if (c->prev)
+        c->prev->next = c->next;
+    else
+        all_conns = c->next;
+    if (c->next)
+        c->next->prev = c->prev;
+
+    if (c->listener)
+        HASH_DEL(c->listener->conns, c);
+    else
+        evutil_closesocket(c->fd);
+    if (c->ev_read)
+        event_free(c->ev_read);
+    if (c->ev_connected)
+        event_free(c->ev_connected);
+    event_free(c->timer);
+    // the caller end is gone already, or freed with its partner
+    bufferevent_free(c->pair[1]);
+    kcp_free(c->kcp);
+    SAFE_FREE(c);
+}
+
+static int caller_alive(struct kcp_conn *c)
+{
+    return bufferevent_pair_get_partner(c->pair[1]) != NULL;
+}
+
+static void conn_schedule(struct kcp_conn *c, int idle)
+{
+    int ms            = idle ? KCP_IDLE_TICK : c->interval;
+    struct timeval tv = {ms / 1000, (ms % 1000) * 1000};
+    c->idle           = idle;
+    event_add(c->timer, &tv);
+}
+
+// back to the flush interval as soon as there is something to send or ack
+static void conn_wake(struct kcp_conn *c)
+{
+    if (c->idle)
+        conn_schedule(c, 0);
+}
+
+static void conn_fail(struct kcp_conn *c)
+{
+    conn_stats.timeouts++;
+    debug(LOG_WARNING, "kcp conv %u: peer gone, closing", c->conv);
+
+    struct bufferevent *caller = bufferevent_pair_get_partner(c->pair[1]);
+    if (!caller) {
+        conn_free(c);
+        return;
+    }
+    c->state = KC_FAILED;
+    conn_schedule(c, 1);
+    bufferevent_disable(c->pair[1], EV_READ | EV_WRITE);
+    bufferevent_trigger_event(caller, BEV_EVENT_ERROR | BEV_EVENT_READING, 0);
+}
+
+// caller bytes to kcp, as far as the send window allows
+static void conn_send(struct kcp_conn *c)
+{
+    struct evbuffer *in = bufferevent_get_input(c->pair[1]);
+    int sent            = 0;
+
+    while (kcp_waitsnd(c->kcp) < c->sndwnd * 2 && evbuffer_get_length(in)) {
+        struct evbuffer_iovec v;
+        if (evbuffer_peek(in, -1, NULL, &v, 1) < 1)
+            break;
+        kcp_send(c->kcp, v.iov_base, v.iov_len);
+        evbuffer_drain(in, v.iov_len);
+        sent = 1;
+    }
+
+    if (c->state == KC_LINGER && !c->eof_queued && !evbuffer_get_length(in)) {
+        kcp_send(c->kcp, NULL, 0);
+        c->eof_queued = 1;
+        sent          = 1;
+    }
+
+    // keep the rest in the caller output, its high watermark pushes back
+    c->send_blocked = evbuffer_get_length(in) > 0 || kcp_waitsnd(c->kcp) >= c->sndwnd * 2;
+    if (c->state == KC_OPEN) {
+        if (c->send_blocked)
+            bufferevent_disable(c->pair[1], EV_READ);
+        else
+            bufferevent_enable(c->pair[1], EV_READ);
+    }
+
+    if (sent) {
+        kcp_flush(c->kcp, kcp_clock());
+        conn_wake(c);
+    }
+}
+
+// kcp bytes to the caller, as far as the caller reads them
+static void conn_deliver(struct kcp_conn *c)
+{
+    if (c->state != KC_OPEN || c->eof_delivered || !caller_alive(c))
+        return;
+
+    struct evbuffer *out = bufferevent_get_output(c->pair[1]);
+    while (evbuffer_get_length(out) < KCP_CONN_MAX_OUTPUT) {
+        struct evbuffer_iovec v;
+        if (evbuffer_reserve_space(out, 16384, &v, 1) < 1)
+            break;
+        int n = kcp_recv(c->kcp, v.iov_base, v.iov_len);
+        if (n <= 0)
+            break;
+        v.iov_len = n;
+        evbuffer_commit_space(out, &v, 1);
+    }
+
+    if (kcp_peek_eof(c->kcp)) {
+        c->eof_delivered = 1;
+        bufferevent_flush(c->pair[1], EV_WRITE, BEV_FINISHED);
+    }
+}
+
+static void conn_input(struct kcp_conn *c, const char *buf, int len)
+{
+    if (kcp_input(c->kcp, buf, len) < 0)
+        return;
+    c->last_alive    = get_monotonic_msec();
+    c->input_pending = 1;
+    conn_wake(c);
+    conn_deliver(c);
+    // acked segments opened the window
+    if (c->send_blocked)
+        conn_send(c);
+}
+
+static void timer_cb(evutil_socket_t fd, short event, void *arg)
+{
+    struct kcp_conn *c = arg;
+    uint64_t now       = get_monotonic_msec();
+
+    if (c->state == KC_OPEN && !caller_alive(c)) {
+        c->state        = KC_LINGER;
+        c->linger_until = now + KCP_CONN_LINGER;
+        conn_send(c);
+    } else if (c->state == KC_FAILED) {
+        if (!caller_alive(c))
+            conn_free(c);
+        else
+            conn_schedule(c, 1);
+        return;
+    }
+
+    kcp_update(c->kcp, kcp_clock());
+    if (c->send_blocked || (c->state == KC_LINGER && !c->eof_queued))
+        conn_send(c);
+    conn_deliver(c);
+
+    if (c->state == KC_LINGER) {
+        if ((c->eof_queued && !kcp_waitsnd(c->kcp)) || now >= c->linger_until || kcp_dead(c->kcp))
+            conn_free(c);
+        else
+            conn_schedule(c, 0);
+        return;
+    }
+
+    // an idle conversation has no peer to wait for, and no need to tick often
+    if (!kcp_waitsnd(c->kcp) && !c->send_blocked) {
+        c->last_alive = now;
+        conn_schedule(c, 1);
+    } else if (kcp_dead(c->kcp) || now - c->last_alive > KCP_CONN_TIMEOUT) {
+        conn_fail(c);
+    } else {
+        conn_schedule(c, 0);
+    }
+}
+
+static void pair_read_cb(struct bufferevent *bev, void *ctx)
+{
+    conn_send(ctx);
+}
+
+static void pair_write_cb(struct bufferevent *bev, void *ctx)
+{
+    conn_deliver(ctx);
+}
+
+static struct kcp_conn *conn_new(struct event_base *base, const struct kcp_conn_conf *kc,
+                                 evutil_socket_t fd, uint32_t conv)
+{
+    struct kcp_conn *c = calloc(1, sizeof(struct kcp_conn));
+    assert(c);
+    c->conv       = conv;
+    c->fd         = fd;
+    c->sndwnd     = kc->sndwnd;
+    c->interval   = kc->interval;
+    c->last_alive = get_monotonic_msec();
+
+    c->kcp = kcp_new(conv, conn_output, c);
+    if (kc->nodelay)
+        kcp_set_nodelay(c->kcp, 1, kc->interval, 2, 1);
+    else
+        kcp_set_nodelay(c->kcp, 0, kc->interval, 0, 0);
+    kcp_set_wndsize(c->kcp, kc->sndwnd, kc->rcvwnd);
+    if (kcp_set_mtu(c->kcp, kc->mtu))
+        debug(LOG_WARNING, "kcp mtu %d ignored", kc->mtu);
+    kcp_update(c->kcp, kcp_clock());
+
+    if (bufferevent_pair_new(base, BEV_OPT_DEFER_CALLBACKS, c->pair)) {
+        kcp_free(c->kcp);
+        SAFE_FREE(c);
+        return NULL;
+    }
+    bufferevent_setcb(c->pair[1], pair_read_cb, pair_write_cb, NULL, c);
+    bufferevent_setwatermark(c->pair[1], EV_WRITE, KCP_CONN_MAX_OUTPUT / 2, 0);
+    bufferevent_enable(c->pair[1], EV_READ | EV_WRITE);
+
+    c->timer = evtimer_new(base, timer_cb, c);
+    assert(c->timer);
+    conn_schedule(c, 0);
+
+    c->next = all_conns;
+    if (all_conns)
+        all_conns->prev = c;
+    all_conns = c;
+    conn_stats.live_conns++;
+    conn_stats.total_conns++;
+    return c;
+}
+
+static void socket_buffers(evutil_socket_t fd)
+{
+    int size = KCP_SOCK_BUF;
+    setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+    setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
+}
+
+// from the loop, the caller sets its callbacks after kcp_connect returned
+static void connected_cb(evutil_socket_t fd, short event, void *arg)
+{
+    struct kcp_conn *c         = arg;
+    struct bufferevent *caller = bufferevent_pair_get_partner(c->pair[1]);
+    if (caller && c->state == KC_OPEN)
+        bufferevent_trigger_event(caller, BEV_EVENT_CONNECTED, 0);
+}
+
+// ack what was read and send what the acks let out, not on the next tick
+static void conn_input_done(struct kcp_conn *c)
+{
+    if (!c->input_pending)
+        return;
+    c->input_pending = 0;
+    kcp_flush(c->kcp, kcp_clock());
+}
+
+static void client_read_cb(evutil_socket_t fd, short event, void *arg)
+{
+    struct kcp_conn *c = arg;
+    char buf[65536];
+    int i;
+
+    for (i = 0; i < KCP_READ_BURST; i++) {
+        ssize_t n = recv(fd, buf, sizeof(buf), 0);
+        if (n < 0) {
+            // port unreachable from the peer host, nobody listens there
+            if (errno == ECONNREFUSED && c->state == KC_OPEN) {
+                conn_fail(c);
+                return;
+            }
+            break;
+        }
+        conn_input(c, buf, n);
+    }
+    conn_input_done(c);
+}
+
+struct bufferevent *kcp_connect_fd(struct event_base *base, const struct kcp_conn_conf *kc,
+                                   evutil_socket_t fd, uint32_t conv)
+{
+    struct sockaddr_in peer;
+    socklen_t len = sizeof(peer);
+    if (getpeername(fd, (struct sockaddr *) &peer, &len))
+        return NULL;
+
+    evutil_make_socket_nonblocking(fd);
+    socket_buffers(fd);
+    struct kcp_conn *c = conn_new(base, kc, fd, conv);
+    if (!c)
+        return NULL;
+    c->peer    = peer;
+    c->ev_read = event_new(base, fd, EV_READ | EV_PERSIST, client_read_cb, c);
+    assert(c->ev_read);
+    event_add(c->ev_read, NULL);
+
+    // nothing to wait for on a datagram socket, the peer shows up with its first ack
+    c->ev_connected = event_new(base, -1, 0, connected_cb, c);
+    assert(c->ev_connected);
+    event_active(c->ev_connected, EV_TIMEOUT, 1);
+    return c->pair[0];
+}
+
+struct bufferevent *kcp_connect(struct event_base *base, const struct kcp_conn_conf *kc,
+                                const struct sockaddr_in *sin)
+{
+    evutil_socket_t fd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (fd < 0)
+        return NULL;
+    evutil_make_socket_closeonexec(fd);
+    if (connect(fd, (const struct sockaddr *) sin, sizeof(*sin))) {
+        evutil_closesocket(fd);
+        return NULL;
+    }
+
+    uint32_t conv = 0;
+    while (!conv)
+        evutil_secure_rng_get_bytes(&conv, sizeof(conv));
+
+    struct bufferevent *bev = kcp_connect_fd(base, kc, fd, conv);
+    if (!bev)
+        evutil_closesocket(fd);
+    return bev;
+}
+
+// first segment of a conversation, anything else for an unknown conv is
+// left over from one already closed
+static int is_first_segment(const char *buf, ssize_t len)
+{
+    uint32_t sn, una;
+    if (len < KCP_OVERHEAD || (uint8_t) buf[4] != 81)
+        return 0;
+    memcpy(&sn, buf + 12, 4);
+    memcpy(&una, buf + 16, 4);
+    return sn == 0 && una == 0;
+}
+
+static void listener_read_cb(evutil_socket_t fd, short event, void *arg)
+{
+    struct kcp_listener *l = arg;
+    char buf[65536];
+    int i;
+
+    for (i = 0; i < KCP_READ_BURST; i++) {
+        struct sockaddr_in peer;
+        socklen_t plen = sizeof(peer);
+        ssize_t n      = recvfrom(fd, buf, sizeof(buf), 0, (struct sockaddr *) &peer, &plen);
+        if (n < 0)
+            break;
+
+        uint32_t conv      = kcp_getconv(buf, n);
+        struct kcp_conn *c = NULL;
+        HASH_FIND_INT(l->conns, &conv, c);
+        if (!c) {
+            if (!conv || !is_first_segment(buf, n))
+                continue;
+            c = conn_new(event_get_base(l->ev_read), &l->conf, fd, conv);
+            if (!c)
+                continue;
+            c->listener = l;
+            c->peer     = peer;
+            HASH_ADD_INT(l->conns, conv, c);
+            l->cb(c->pair[0], &peer, l->arg);
+        }
+        c->peer = peer;
+        conn_input(c, buf, n);
+    }
+
+    struct kcp_conn *c = NULL, *tmp = NULL;
+    HASH_ITER(hh, l->conns, c, tmp)
+    {
+        conn_input_done(c);
+    }
+}
+
+struct kcp_listener *kcp_listen(struct event_base *base, const struct kcp_conn_conf *kc,
+                                const struct sockaddr_in *sin, kcp_accept_cb cb, void *arg)
+{
+    evutil_socket_t fd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (fd < 0)
+        return NULL;
+    evutil_make_socket_nonblocking(fd);
+    evutil_make_socket_closeonexec(fd);
+    evutil_make_listen_socket_reuseable(fd);
+    socket_buffers(fd);
+    if (bind(fd, (const struct sockaddr *) sin, sizeof(*sin))) {
+        evutil_closesocket(fd);
+        return NULL;
+    }
+
+    struct kcp_listener *l = calloc(1, sizeof(struct kcp_listener));
+    assert(l);
+    l->fd      = fd;
+    l->conf    = *kc;
+    l->cb      = cb;
+    l->arg     = arg;
+    l->ev_read = event_new(base, fd, EV_READ | EV_PERSIST, listener_read_cb, l);
+    assert(l->ev_read);
+    event_add(l->ev_read, NULL);
+    return l;
+}
+
+void kcp_listener_free(struct kcp_listener *l)
+{
+    if (!l)
+        return;
+
+    struct kcp_conn *c = NULL, *tmp = NULL;
+    HASH_ITER(hh, l->conns, c, tmp)
+    {
+        struct bufferevent *caller = bufferevent_pair_get_partner(c->pair[1]);
+        conn_free(c);
+        if (caller)
+            bufferevent_free(caller);
+    }
+    event_free(l->ev_read);
+    evutil_closesocket(l->fd);
+    SAFE_FREE(l);
+}
+
+void get_kcp_conn_stats(struct kcp_conn_stats *st)
+{
+    memcpy(st, &conn_stats, sizeof(*st));
+
+    struct kcp_conn *c;
+    for (c = all_conns; c; c = c->next) {
+        const struct kcp_stats *ks = kcp_get_stats(c->kcp);
+        st->seg.segs_sent += ks->segs_sent;
+        st->seg.retrans += ks->retrans;
+        st->seg.fast_retrans += ks->fast_retrans;
+        st->seg.segs_recv += ks->segs_recv;
+        st->seg.dup_recv += ks->dup_recv;
+    }
+}
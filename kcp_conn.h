@@ -0,0 +1,79 @@
+/* vim: set et ts=4 sts=4 sw=4 : */
+/********************************************************************\
+ * This program is free software; you can redistribute it and/or    *
+ * modify it under the terms of the GNU General Public License as   *
+ * published by the Free Software Foundation; either version 2 of   *
+ * the License, or (at your option) any later version.              *
+ *                                                                  *
+ * This program is distributed in the hope that it will be useful,  *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of   *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the    *
+ * GNU General Public License for more details.                     *
+ *                                                                  *
+ * You should have received a copy of the GNU General Public License*
+ * along with this program; if not, contact:                        *
+ *                                                                  *
+ * Free Software Foundation           Voice:  +1-617-542-5942       *
+ * 59 Temple Place - Suite 330        Fax:    +1-617-542-2652       *
+ * Boston, MA  02111-1307,  USA       gnu@gnu.org                   *
+ *                                                                  *
+\********************************************************************/
+
+
+/** @file kcp_conn.h
+    @brief KCP connections to frps as bufferevents
+*/
+
+#ifndef _KCP_CONN_H_
+#define _KCP_CONN_H_
+
+#include <stdint.h>
+#include <netinet/in.h>
+
+#include <event2/util.h>
+
+#include "kcp.h"
+
+#define KCP_CONN_TIMEOUT 15000   // ms without a datagram from the peer while data is pending
+#define KCP_CONN_LINGER 10000    // ms to get the end of stream acked after local close
+#define KCP_CONN_MAX_OUTPUT (256 * 1024)   // bytes queued on either side before pushing back
+
+struct event_base;
+struct bufferevent;
+struct kcp_listener;
+
+struct kcp_conn_conf {
+    int nodelay;   // also turns on fast resend after 2 skips and drops congestion control
+    int interval;  // ms
+    int sndwnd;    // segments
+    int rcvwnd;
+    int mtu;       // bytes of a datagram
+};
+
+struct kcp_conn_stats {
+    uint32_t live_conns;
+    uint64_t total_conns;
+    uint64_t timeouts;   // conversations given up, peer silent or segment resent too often
+    struct kcp_stats seg;
+};
+
+typedef void (*kcp_accept_cb)(struct bufferevent *bev, const struct sockaddr_in *peer, void *arg);
+
+// connected datagram socket to sin; the bev gets BEV_EVENT_CONNECTED from the
+// loop, an EOF when the peer ends the stream and an ERROR when it goes silent.
+// Freeing the bev ends the stream, queued data is still delivered
+struct bufferevent *kcp_connect(struct event_base *base, const struct kcp_conn_conf *kc,
+                                const struct sockaddr_in *sin);
+// same over a datagram socket already connected to the peer, which both
+// ends agreed on conv with; the conversation owns fd from here on
+struct bufferevent *kcp_connect_fd(struct event_base *base, const struct kcp_conn_conf *kc,
+                                   evutil_socket_t fd, uint32_t conv);
+
+// a new conversation from a peer is handed to cb as a connected bev
+struct kcp_listener *kcp_listen(struct event_base *base, const struct kcp_conn_conf *kc,
+                                const struct sockaddr_in *sin, kcp_accept_cb cb, void *arg);
+void kcp_listener_free(struct kcp_listener *l);
+
+void get_kcp_conn_stats(struct kcp_conn_stats *st);
+
+#endif   //_KCP_CONN_H_
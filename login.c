@@ -29,11 +29,6 @@ struct login *get_common_login_config()
     return c_login;
 }
 
-int is_logged()
-{
-    return c_login->logged;
-}
-
 void init_login()
 {
     //创建login结构
@@ -70,8 +65,6 @@ void init_login()
     c_login->privilege_key = NULL;
     c_login->user          = c_conf->user;
 
-    c_login->logged = 0;
-
     /* start to init login->run_id */
     //初始化run_id
     char ifname[16] = {0};
@@ -104,18 +97,10 @@ int login_resp_check(struct login_resp *lr)
             debug(LOG_ERR, "login response error: %s", lr->error);
         }
         debug(LOG_ERR, "login falied!");
-        c_login->logged = 0;
-    } else {
-		//设置login标志
-        c_login->logged = 1;
-        debug(LOG_DEBUG, "xfrp login response: run_id: [%s], version: [%s]", lr->run_id,
-              lr->version);
-        SAFE_FREE(c_login->run_id);
-
-        //登录run_id从服务器获取的run_id
-        c_login->run_id = strdup(lr->run_id);
-        assert(c_login->run_id);
+        return 0;
     }
 
-    return c_login->logged;
+    debug(LOG_DEBUG, "xfrp login response: run_id: [%s], version: [%s]", lr->run_id,
+          lr->version);
+    return 1;
 }
\ No newline at end of file
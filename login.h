@@ -18,21 +18,20 @@ struct login {
     long int timestamp;
     char *run_id;
     int pool_count;
-
-    /* fields not need json marshal */
-    int logged;   // 0 not login 1:logged
 };
 
 struct login_resp {
     char *version;
     char *run_id;
     char *error;
+    int server_udp_port;
 };
 
 void init_login();
+// run_id of the first login, the MAC address
 char *get_run_id();
 struct login *get_common_login_config();
-int is_logged();
+// 1 when frps accepted the login, each control session keeps lr->run_id itself
 int login_resp_check(struct login_resp *lr);
 
 #endif   //_LOGIN_H_
\ No newline at end of file
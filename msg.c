@@ -43,6 +43,7 @@
 #include "login.h"
 #include "client.h"
 #include "utils.h"
+#include "arena.h"
 
 #define JSON_MARSHAL_TYPE(jobj, key, jtype, item) \
     json_object_object_add(jobj, key, json_object_new_##jtype((item)));
@@ -51,7 +52,10 @@
 
 const char msg_typs[] = {TypeLogin,       TypeLoginResp,   TypeNewProxy,      TypeNewProxyResp,
                          TypeNewWorkConn, TypeReqWorkConn, TypeStartWorkConn, TypePing,
-                         TypePong,        TypeUdpPacket};
+                         TypePong,        TypeUdpPacket,   TypeNatHoleResp,   TypeNatHoleSid};
+
+// everything unpack and *_resp_unmarshal return lives here
+static struct arena decode_arena;
 
 char *calc_md5(const char *data, int datalen)
 {
@@ -96,16 +100,14 @@ static void fill_custom_domains(struct json_object *j_ctl_req, const char *custo
     json_object_object_add(j_ctl_req, "custom_domains", jarray_cdomains);
 }
 
-// NEED FREE
-struct message *new_message()
+void msg_decode_reset()
 {
-    struct message *msg = calloc(1, sizeof(struct message));   // TODO: FREE
-    if (msg) {
-        msg->data_p   = NULL;
-        msg->data_len = 0;
-    }
+    arena_reset(&decode_arena);
+}
 
-    return msg;
+void free_msg_decode()
+{
+    arena_free(&decode_arena);
 }
 
 struct work_conn *new_work_conn()
@@ -129,7 +131,7 @@ char *get_auth_key(const char *token, long int *timestamp)
     return calc_md5(seed, strlen(seed));
 }
 
-size_t login_request_marshal(char **msg)
+size_t login_request_marshal(const char *run_id, char **msg)
 {
     size_t nret = 0;
 
@@ -159,7 +161,7 @@ size_t login_request_marshal(char **msg)
 
     JSON_MARSHAL_TYPE(j_login_req, "privilege_key", string, SAFE_JSON_STRING(lg->privilege_key));
     JSON_MARSHAL_TYPE(j_login_req, "timestamp", int64, lg->timestamp);
-    JSON_MARSHAL_TYPE(j_login_req, "run_id", string, SAFE_JSON_STRING(lg->run_id));
+    JSON_MARSHAL_TYPE(j_login_req, "run_id", string, SAFE_JSON_STRING(run_id));
     JSON_MARSHAL_TYPE(j_login_req, "pool_count", int, lg->pool_count);
 
     const char *tmp = NULL;
@@ -199,6 +201,9 @@ int new_proxy_service_marshal(const struct proxy_service *np_req, char **msg)
 	//是否压缩
     JSON_MARSHAL_TYPE(j_np_req, "use_compression", boolean, np_req->use_compression);
 
+    if (np_req->sk)
+        JSON_MARSHAL_TYPE(j_np_req, "sk", string, np_req->sk);
+
 	//是否属于ftp代理, 需要加上remote_data_port结构
     if (is_ftp_proxy(np_req)) {
         JSON_MARSHAL_TYPE(j_np_req, "remote_data_port", int, np_req->remote_data_port);
@@ -221,9 +226,8 @@ int new_proxy_service_marshal(const struct proxy_service *np_req, char **msg)
     JSON_MARSHAL_TYPE(j_np_req, "subdomain", string, SAFE_JSON_STRING(np_req->subdomain));
 
 	//array
-    json_object *j_location_array = json_object_new_array();
     if (np_req->locations) {
-        json_object_object_add(j_np_req, "locations", j_location_array);
+        json_object_object_add(j_np_req, "locations", json_object_new_array());
     } else {
         json_object_object_add(j_np_req, "locations", NULL);
     }
@@ -272,23 +276,21 @@ int new_work_conn_marshal(const struct work_conn *work_c, char **msg)
 
 
 // new_proxy_resp 消息解析
-// result returned of this func need be free
+// result is valid until msg_decode_reset
 struct new_proxy_response *new_proxy_resp_unmarshal(const char *jres)
 {
     struct json_object *j_np_res = json_tokener_parse(jres);
     if (is_error(j_np_res))
         return NULL;
 
-    struct new_proxy_response *npr = calloc(1, sizeof(struct new_proxy_response));
-    assert(npr);
+    struct new_proxy_response *npr = arena_alloc(&decode_arena, sizeof(struct new_proxy_response));
 
 	//frps服务器会回run_id/remote_port/proxy_name/error_info
 	// 将这些消息填入new_proxy_response结构体
     struct json_object *npr_run_id = NULL;
     if (!json_object_object_get_ex(j_np_res, "run_id", &npr_run_id))
         goto END_ERROR;
-    npr->run_id = strdup(json_object_get_string(npr_run_id));
-    assert(npr->run_id);
+    npr->run_id = arena_strdup(&decode_arena, json_object_get_string(npr_run_id));
 
     struct json_object *npr_proxy_remote_port = NULL;
     if (!json_object_object_get_ex(j_np_res, "remote_port", &npr_proxy_remote_port))
@@ -298,14 +300,12 @@ struct new_proxy_response *new_proxy_resp_unmarshal(const char *jres)
     struct json_object *npr_proxy_name = NULL;
     if (!json_object_object_get_ex(j_np_res, "proxy_name", &npr_proxy_name))
         goto END_ERROR;
-    npr->proxy_name = strdup(json_object_get_string(npr_proxy_name));
-    assert(npr->proxy_name);
+    npr->proxy_name = arena_strdup(&decode_arena, json_object_get_string(npr_proxy_name));
 
     struct json_object *npr_error = NULL;
     if (!json_object_object_get_ex(j_np_res, "error", &npr_error))
         goto END_ERROR;
-    npr->error = strdup(json_object_get_string(npr_error));
-    assert(npr->error);
+    npr->error = arena_strdup(&decode_arena, json_object_get_string(npr_error));
 
 END_ERROR:
     json_object_put(j_np_res);
@@ -314,36 +314,37 @@ END_ERROR:
 
 
 // 从login_resp的字符串中解析出login_resp结构体
-// login_resp_unmarshal NEED FREE
+// result is valid until msg_decode_reset
 struct login_resp *login_resp_unmarshal(const char *jres)
 {
     struct json_object *j_lg_res = json_tokener_parse(jres);
     if (is_error(j_lg_res))
         return NULL;
 
-    struct login_resp *lr = calloc(1, sizeof(struct login_resp));
-    assert(lr);
+    struct login_resp *lr = arena_alloc(&decode_arena, sizeof(struct login_resp));
 
 	//拿到version
     struct json_object *l_version = NULL;
     if (!json_object_object_get_ex(j_lg_res, "version", &l_version))
         goto END_ERROR;
-    lr->version = strdup(json_object_get_string(l_version));
-    assert(lr->version);
+    lr->version = arena_strdup(&decode_arena, json_object_get_string(l_version));
 
 	//拿到run_id
     struct json_object *l_run_id = NULL;
     if (!json_object_object_get_ex(j_lg_res, "run_id", &l_run_id))
         goto END_ERROR;
-    lr->run_id = strdup(json_object_get_string(l_run_id));
-    assert(lr->run_id);
+    lr->run_id = arena_strdup(&decode_arena, json_object_get_string(l_run_id));
 
 	//拿到error info
     struct json_object *l_error = NULL;
     if (!json_object_object_get_ex(j_lg_res, "error", &l_error))
         goto END_ERROR;
-    lr->error = strdup(json_object_get_string(l_error));
-    assert(lr->error);
+    lr->error = arena_strdup(&decode_arena, json_object_get_string(l_error));
+
+    // frps without xtcp leaves it out
+    struct json_object *l_udp_port = NULL;
+    if (json_object_object_get_ex(j_lg_res, "server_udp_port", &l_udp_port))
+        lr->server_udp_port = json_object_get_int(l_udp_port);
 
 END_ERROR:
     json_object_put(j_lg_res);
@@ -357,22 +358,88 @@ struct start_work_conn_resp *start_work_conn_resp_unmarshal(const char *resp_msg
     if (is_error(j_start_w_res))
         return NULL;
 
-    struct start_work_conn_resp *sr = calloc(1, sizeof(struct start_work_conn_resp));
-    assert(sr);
+    struct start_work_conn_resp *sr =
+        arena_alloc(&decode_arena, sizeof(struct start_work_conn_resp));
 
     struct json_object *pn = NULL;
     if (!json_object_object_get_ex(j_start_w_res, "proxy_name", &pn))
         goto START_W_C_R_END;
 
 	//设置proxy-name
-    sr->proxy_name = strdup(json_object_get_string(pn));
-    assert(sr->proxy_name);
+    sr->proxy_name = arena_strdup(&decode_arena, json_object_get_string(pn));
 
 START_W_C_R_END:
     json_object_put(j_start_w_res);
     return sr;
 }
 
+static char *arena_json_string(struct json_object *j, const char *key)
+{
+    struct json_object *v = NULL;
+    if (!json_object_object_get_ex(j, key, &v))
+        return NULL;
+    return arena_strdup(&decode_arena, json_object_get_string(v));
+}
+
+// result is valid until msg_decode_reset
+struct nat_hole_resp *nat_hole_resp_unmarshal(const char *jres)
+{
+    struct json_object *j_nh_res = json_tokener_parse(jres);
+    if (is_error(j_nh_res))
+        return NULL;
+
+    struct nat_hole_resp *nhr = arena_alloc(&decode_arena, sizeof(struct nat_hole_resp));
+    nhr->sid          = arena_json_string(j_nh_res, "sid");
+    nhr->visitor_addr = arena_json_string(j_nh_res, "visitor_addr");
+    nhr->client_addr  = arena_json_string(j_nh_res, "client_addr");
+    nhr->error        = arena_json_string(j_nh_res, "error");
+
+    json_object_put(j_nh_res);
+    return nhr;
+}
+
+// result is valid until msg_decode_reset
+char *nat_hole_sid_unmarshal(const char *jres)
+{
+    struct json_object *j_sid = json_tokener_parse(jres);
+    if (is_error(j_sid))
+        return NULL;
+
+    char *sid = arena_json_string(j_sid, "sid");
+    json_object_put(j_sid);
+    return sid;
+}
+
+int nat_hole_marshal(const char *proxy_name, const char *sk, const char *sid, char **msg)
+{
+    const char *tmp         = NULL;
+    int nret                = 0;
+    struct json_object *j_nh = json_object_new_object();
+    if (!j_nh)
+        return 0;
+
+    JSON_MARSHAL_TYPE(j_nh, "proxy_name", string, proxy_name);
+    if (sk) {
+        long int timestamp = 0;
+        char *sign_key     = get_auth_key(sk, &timestamp);
+        JSON_MARSHAL_TYPE(j_nh, "sign_key", string, sign_key);
+        JSON_MARSHAL_TYPE(j_nh, "timestamp", int64, timestamp);
+        SAFE_FREE(sign_key);
+    } else {
+        JSON_MARSHAL_TYPE(j_nh, "sid", string, SAFE_JSON_STRING(sid));
+    }
+
+    tmp = json_object_to_json_string(j_nh);
+    if (tmp && strlen(tmp) > 0) {
+        nret = strlen(tmp);
+        *msg = strdup(tmp);
+        assert(*msg);
+    }
+    json_object_put(j_nh);
+
+    return nret;
+}
+
 struct control_response *control_response_unmarshal(const char *jres)
 {
     struct json_object *j_ctl_res = json_tokener_parse(jres);
@@ -424,26 +491,25 @@ int msg_type_valid_check(char msg_type)
 
 // 仅仅处理类型正确的消息,从frame->data中构造出message消息体
 // only handle recved message with right message type
+// result is valid until msg_decode_reset
 struct message *unpack(unsigned char *recv_msg, const ushort len)
 {
-    struct message *msg = new_message();
-    msg->type           = *(recv_msg + MSG_TYPE_I);
-
 	//检查type是否正确
-    if (!msg_type_valid_check(msg->type)) {
+    if (!msg_type_valid_check(*(recv_msg + MSG_TYPE_I))) {
         debug(LOG_ERR, "message recved type is invalid!");
         return NULL;
     }
 
+    struct message *msg = arena_alloc(&decode_arena, sizeof(struct message));
+    msg->type           = *(recv_msg + MSG_TYPE_I);
+
     msg_size_t data_len_bigend;
     data_len_bigend = *(msg_size_t *) (recv_msg + MSG_LEN_I);
     msg->data_len   = msg_ntoh(data_len_bigend);
 
 	//构造msg
     if (msg->data_len > 0) {
-        msg->data_p = calloc(msg->data_len + 1, 1);
-        assert(msg->data_p);
-
+        msg->data_p = arena_alloc(&decode_arena, msg->data_len + 1);
         memcpy(msg->data_p, recv_msg + MSG_DATA_I, msg->data_len);
     }
 
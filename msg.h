@@ -41,6 +41,7 @@
 #define MSG_TYPE_I 0
 #define MSG_LEN_I 1
 #define MSG_DATA_I 5
+#define MSG_DATA_MAX (64 * 1024)   // no control message from frps comes near it
 
 // msg_type match frp v0.10.0
 enum msg_type {
@@ -54,6 +55,12 @@ enum msg_type {
     TypePing          = 'h',	//PING
     TypePong          = '4',	//PONG
     TypeUdpPacket     = 'u',
+
+    // xtcp, from later frp versions
+    TypeNatHoleVisitor = 'i',   // visitor -> frps udp
+    TypeNatHoleClient  = 'n',   // proxy -> frps udp
+    TypeNatHoleResp    = 'm',   // frps udp -> both
+    TypeNatHoleSid     = '5',   // frps -> proxy on a work connection, also the punch probe
 };
 
 struct general_response {
@@ -88,19 +95,34 @@ struct start_work_conn_resp {
     char *proxy_name;
 };
 
+struct nat_hole_resp {
+    char *sid;
+    char *visitor_addr;   // "ip:port" as frps saw each end
+    char *client_addr;
+    char *error;
+};
+
 int new_proxy_service_marshal(const struct proxy_service *np_req, char **msg);
 int msg_type_valid_check(char msg_type);
-struct message *new_message();
 char *calc_md5(const char *data, int datalen);
 char *get_auth_key(const char *token, long int *timestamp);
-size_t login_request_marshal(char **msg);
+size_t login_request_marshal(const char *run_id, char **msg);
 size_t pack(struct message *req_msg, unsigned char **ret_buf);
 struct message *unpack(unsigned char *recv_msg, const ushort len);
+// release what unpack and *_resp_unmarshal returned, call it once the
+// message is dispatched
+void msg_decode_reset();
+void free_msg_decode();
 
 // tranlate control request to json string
 struct new_proxy_response *new_proxy_resp_unmarshal(const char *jres);
 struct login_resp *login_resp_unmarshal(const char *jres);
 struct start_work_conn_resp *start_work_conn_resp_unmarshal(const char *resp_msg);
+struct nat_hole_resp *nat_hole_resp_unmarshal(const char *jres);
+// sid of a NatHoleSid, NULL when missing
+char *nat_hole_sid_unmarshal(const char *jres);
+// NatHoleVisitor when sk is set, NatHoleClient otherwise
+int nat_hole_marshal(const char *proxy_name, const char *sk, const char *sid, char **msg);
 
 // parse json string to control response
 struct control_response *control_response_unmarshal(const char *jres);
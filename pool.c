@@ -0,0 +1,118 @@
+/* vim: set et ts=4 sts=4 sw=4 : */
+/********************************************************************\
+ * This program is free software; you can redistribute it and/or    *
+ * modify it under the terms of the GNU General Public License as   *
+ * published by the Free Software Foundation; either version 2 of   *
+ * the License, or (at your option) any later version.              *
+ *                                                                  *
+ * This program is distributed in the hope that it will be useful,  *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of   *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the    *
+ * GNU General Public License for more details.                     *
+ *                                                                  *
+ * You should have received a copy of the GNU General Public License*
+ * along with this program; if not, contact:                        *
+ *                                                                  *
+ * Free Software Foundation           Voice:  +1-617-542-5942       *
+ * 59 Temple Place - Suite 330        Fax:    +1-617-542-2652       *
+ * Boston, MA  02111-1307,  USA       gnu@gnu.org                   *
+ *                                                                  *
+\********************************************************************/
+
+
+/** @file pool.c
+    @brief typed free-list pools for per-connection and per-message structs
+
+    Frames are allocated for every message, proxy clients for every
+    tunnel. Reusing them from a per-type free list keeps those small
+    sizes out of the libc heap, which fragments badly over weeks of
+    uptime on uClibc/musl. Only the event loop thread uses pools.
+*/
+
+#include <string.h>
+#include <stdlib.h>
+#include <assert.h>
+
+#include "pool.h"
+#include "frame.h"
+#include "proxy.h"
+#include "client.h"
+
+struct pool_obj {
+    struct pool_obj *next;
+};
+
+struct obj_pool {
+    size_t size;
+    uint32_t max_pooled;   // bound of memory kept after a burst
+    struct pool_obj *free_list;
+    struct pool_stats stats;
+};
+
+#define POOL_DEF(type, name, max) {sizeof(type), max, NULL, {name, 0, 0, 0, 0}}
+
+static struct obj_pool pools[POOL_MAX] = {
+    [POOL_FRAME]        = POOL_DEF(struct frame, "frame", 16),
+    [POOL_PROXY_CLIENT] = POOL_DEF(struct proxy_client, "proxy_client", 64),
+    [POOL_FTP_PASV]     = POOL_DEF(struct ftp_pasv, "ftp_pasv", 4),
+};
+
+void *pool_alloc(enum pool_type type)
+{
+    struct obj_pool *pool = &pools[type];
+    struct pool_obj *obj  = pool->free_list;
+
+    if (obj) {
+        pool->free_list = obj->next;
+        pool->stats.pooled--;
+        pool->stats.reuses++;
+        memset(obj, 0, pool->size);
+    } else {
+        obj = calloc(1, pool->size < sizeof(*obj) ? sizeof(*obj) : pool->size);
+        assert(obj);
+        pool->stats.allocs++;
+    }
+
+    pool->stats.live++;
+    return obj;
+}
+
+void pool_free(enum pool_type type, void *ptr)
+{
+    struct obj_pool *pool = &pools[type];
+    struct pool_obj *obj  = ptr;
+
+    if (!obj)
+        return;
+
+    assert(pool->stats.live);
+    pool->stats.live--;
+
+    if (pool->stats.pooled >= pool->max_pooled) {
+        free(obj);
+        return;
+    }
+
+    obj->next       = pool->free_list;
+    pool->free_list = obj;
+    pool->stats.pooled++;
+}
+
+const struct pool_stats *get_pool_stats(enum pool_type type)
+{
+    return &pools[type].stats;
+}
+
+void pool_trim()
+{
+    int i;
+    for (i = 0; i < POOL_MAX; i++) {
+        struct obj_pool *pool = &pools[i];
+        while (pool->free_list) {
+            struct pool_obj *obj = pool->free_list;
+            pool->free_list      = obj->next;
+            free(obj);
+        }
+        pool->stats.pooled = 0;
+    }
+}
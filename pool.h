@@ -0,0 +1,57 @@
+/* vim: set et ts=4 sts=4 sw=4 : */
+/********************************************************************\
+ * This program is free software; you can redistribute it and/or    *
+ * modify it under the terms of the GNU General Public License as   *
+ * published by the Free Software Foundation; either version 2 of   *
+ * the License, or (at your option) any later version.              *
+ *                                                                  *
+ * This program is distributed in the hope that it will be useful,  *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of   *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the    *
+ * GNU General Public License for more details.                     *
+ *                                                                  *
+ * You should have received a copy of the GNU General Public License*
+ * along with this program; if not, contact:                        *
+ *                                                                  *
+ * Free Software Foundation           Voice:  +1-617-542-5942       *
+ * 59 Temple Place - Suite 330        Fax:    +1-617-542-2652       *
+ * Boston, MA  02111-1307,  USA       gnu@gnu.org                   *
+ *                                                                  *
+\********************************************************************/
+
+
+/** @file pool.h
+    @brief typed free-list pools for per-connection and per-message structs
+*/
+
+#ifndef _POOL_H_
+#define _POOL_H_
+
+#include <stdint.h>
+#include <stddef.h>
+
+enum pool_type {
+    POOL_FRAME = 0,
+    POOL_PROXY_CLIENT,
+    POOL_FTP_PASV,
+    POOL_MAX,
+};
+
+struct pool_stats {
+    const char *name;
+    uint32_t live;         // handed out, not returned yet
+    uint32_t pooled;       // returned, kept for reuse
+    uint64_t allocs;       // taken from malloc
+    uint64_t reuses;       // taken from pool
+};
+
+// zeroed object like calloc, never NULL
+void *pool_alloc(enum pool_type type);
+// NULL is ignored; objects over the pool limit go back to libc
+void pool_free(enum pool_type type, void *obj);
+
+const struct pool_stats *get_pool_stats(enum pool_type type);
+// give pooled objects back to libc
+void pool_trim();
+
+#endif   //_POOL_H_
@@ -19,18 +19,15 @@ struct ftp_pasv {
     int ftp_server_port;
 };
 
-struct proxy {
-    struct bufferevent *bev;
-    char *proxy_name;
-    int remote_data_port;   // used in ftp proxy
-};
-
 void tcp_proxy_c2s_cb(struct bufferevent *bev, void *ctx);
 void tcp_proxy_s2c_cb(struct bufferevent *bev, void *ctx);
 void ftp_proxy_c2s_cb(struct bufferevent *bev, void *ctx);
 void ftp_proxy_s2c_cb(struct bufferevent *bev, void *ctx);
-struct proxy *new_proxy_buf(struct bufferevent *bev);
-void free_proxy(struct proxy *p);
 void set_ftp_data_proxy_tunnel(const char *ftp_proxy_name, struct ftp_pasv *local_fp,
                                struct ftp_pasv *remote_fp);
+// parse a 227 passive mode reply, NULL for other replies, free it with free_ftp_pasv
+struct ftp_pasv *pasv_unpack(char *data);
+// format fp as a 227 reply into *pack_p, which must be freed, return its length
+size_t pasv_pack(struct ftp_pasv *fp, char **pack_p);
+void free_ftp_pasv(struct ftp_pasv *fp);
 #endif   //_PROXY_H_
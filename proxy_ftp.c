@@ -12,6 +12,7 @@
 #include <event2/buffer.h>
 #include <event2/listener.h>
 #include <event2/event.h>
+#include <event2/util.h>
 
 #include "debug.h"
 #include "uthash.h"
@@ -19,14 +20,15 @@
 #include "proxy.h"
 #include "config.h"
 #include "client.h"
+#include "capture.h"
+#include "pool.h"
+#include "server_list.h"
+#include "addr_cache.h"
 
 #define FTP_PRO_BUF 256
 #define FTP_PASV_PORT_BLOCK 256
 
 static struct ftp_pasv *new_ftp_pasv();
-static void free_ftp_pasv(struct ftp_pasv *fp);
-static struct ftp_pasv *pasv_unpack(char *data);
-static size_t pasv_pack(struct ftp_pasv *fp, char **pack_p);
 
 void set_ftp_data_proxy_tunnel(const char *ftp_proxy_name, struct ftp_pasv *local_fp,
                                struct ftp_pasv *remote_fp)
@@ -43,7 +45,8 @@ void set_ftp_data_proxy_tunnel(const char *ftp_proxy_name, struct ftp_pasv *loca
     }
 
     ps->local_port = local_fp->ftp_server_port;
-    ps->local_ip   = strdup(local_fp->ftp_server_ip);
+    SAFE_FREE(ps->local_ip);
+    ps->local_ip = strdup(local_fp->ftp_server_ip);
     assert(ps->local_ip);
 
     ps->remote_port = remote_fp->ftp_server_port;
@@ -55,6 +58,24 @@ FTP_DATA_PROXY_TUNNEL_END:
     free(ftp_data_proxy_name);
 }
 
+// address of the frps the work connection is on, server_ip while the
+// address cache has none for it
+static int ftp_server_ip(const struct proxy_client *client, char *ip, size_t len)
+{
+    struct common_conf *c_conf = get_common_config();
+    struct frps_server *srv    = get_server(client->server);
+    struct sockaddr_in sin;
+
+    if (srv && addr_cache_lookup(srv->addr, srv->port, &sin) &&
+        evutil_inet_ntop(AF_INET, &sin.sin_addr, ip, len))
+        return 0;
+    if (!c_conf->server_ip)
+        return -1;
+
+    snprintf(ip, len, "%s", c_conf->server_ip);
+    return 0;
+}
+
 // read from client-working host port
 void ftp_proxy_c2s_cb(struct bufferevent *bev, void *ctx)
 {
@@ -72,10 +93,16 @@ void ftp_proxy_c2s_cb(struct bufferevent *bev, void *ctx)
     dst = bufferevent_get_output(partner);
     assert(dst);
 
-    unsigned char *buf = calloc(1, len);
+    // pasv_unpack parses it as a string
+    unsigned char *buf = calloc(1, len + 1);
     assert(buf);
     size_t read_n = 0;
     read_n        = evbuffer_remove(src, buf, len);
+    if (p->client) {
+        p->client->ps->stats.bytes_out += read_n;
+        tunnel_stage(p->client, TS_FIRST_C2S);
+        capture_bytes(p->client->cap, CAPTURE_TX, buf, read_n);
+    }
 
 // #define FTP_P_DEBUG 1
 #ifdef FTP_P_DEBUG
@@ -91,19 +118,18 @@ void ftp_proxy_c2s_cb(struct bufferevent *bev, void *ctx)
 #endif   // FTP_P_DEBUG
 
     struct ftp_pasv *local_fp = pasv_unpack((char *) buf);
+    struct ftp_pasv *r_fp     = NULL;
 
     if (local_fp) {
-        struct common_conf *c_conf = get_common_config();
-        struct ftp_pasv *r_fp      = new_ftp_pasv();
-        r_fp->code                 = local_fp->code;
+        r_fp       = new_ftp_pasv();
+        r_fp->code = local_fp->code;
 
-        if (!c_conf->server_ip) {
+        // users reach the data port on the frps this tunnel came from
+        if (ftp_server_ip(p->client, r_fp->ftp_server_ip, sizeof(r_fp->ftp_server_ip))) {
             debug(LOG_ERR, "error: FTP proxy without server ip!");
-            exit(0);
+            goto FTP_C2S_CB_END;
         }
-
-        strncpy(r_fp->ftp_server_ip, c_conf->server_ip, IP_LEN);
-        r_fp->ftp_server_port = p->remote_data_port;
+        r_fp->ftp_server_port = p->client->ps->remote_data_port;
 
         if (r_fp->ftp_server_port <= 0) {
             debug(LOG_ERR, "error: remote ftp data port is not init!");
@@ -122,7 +148,7 @@ void ftp_proxy_c2s_cb(struct bufferevent *bev, void *ctx)
         debug(LOG_DEBUG, "ftp pack result:%s", pasv_msg);
 #endif   // FTP_P_DEBUG
 
-        set_ftp_data_proxy_tunnel(p->proxy_name, local_fp, r_fp);
+        set_ftp_data_proxy_tunnel(p->client->ps->proxy_name, local_fp, r_fp);
         evbuffer_add(dst, pasv_msg, pack_len);
         SAFE_FREE(pasv_msg);
     } else {
@@ -130,8 +156,10 @@ void ftp_proxy_c2s_cb(struct bufferevent *bev, void *ctx)
     }
 
 FTP_C2S_CB_END:
+    tunnel_backpressure(bev, p);
     SAFE_FREE(buf);
     free_ftp_pasv(local_fp);
+    free_ftp_pasv(r_fp);
     return;
 }
 
@@ -140,7 +168,7 @@ void ftp_proxy_s2c_cb(struct bufferevent *bev, void *ctx)
     tcp_proxy_s2c_cb(bev, ctx);
 }
 
-static struct ftp_pasv *pasv_unpack(char *data)
+struct ftp_pasv *pasv_unpack(char *data)
 {
     char cd_buf[4] = {0};
     snprintf(cd_buf, 4, "%s", data);
@@ -192,6 +220,7 @@ static struct ftp_pasv *pasv_unpack(char *data)
         }
         default:
             free_ftp_pasv(fp);
+            fp = NULL;
             break;
     }
 
@@ -199,7 +228,7 @@ static struct ftp_pasv *pasv_unpack(char *data)
 }
 
 // the value returned need FREE after using
-static size_t pasv_pack(struct ftp_pasv *fp, char **pack_p)
+size_t pasv_pack(struct ftp_pasv *fp, char **pack_p)
 {
     *pack_p = (char *) calloc(1, FTP_PRO_BUF);
     assert(*pack_p);
@@ -236,11 +265,7 @@ static size_t pasv_pack(struct ftp_pasv *fp, char **pack_p)
 // need be free after using
 static struct ftp_pasv *new_ftp_pasv()
 {
-    struct ftp_pasv *fp = (struct ftp_pasv *) calloc(1, sizeof(struct ftp_pasv));
-    if (!fp)
-        return NULL;
-
-    memset(fp->ftp_server_ip, 0, IP_LEN);
+    struct ftp_pasv *fp = pool_alloc(POOL_FTP_PASV);
     fp->ftp_server_port = -1;
     fp->code            = -1;
 
@@ -248,11 +273,7 @@ static struct ftp_pasv *new_ftp_pasv()
 }
 
 // can be used to free NULL pointer also
-static void free_ftp_pasv(struct ftp_pasv *fp)
+void free_ftp_pasv(struct ftp_pasv *fp)
 {
-    if (!fp)
-        return;
-
-    SAFE_FREE(fp);
-    fp = NULL;
+    pool_free(POOL_FTP_PASV, fp);
 }
\ No newline at end of file
@@ -17,6 +17,7 @@
 #include "uthash.h"
 #include "common.h"
 #include "proxy.h"
+#include "capture.h"
 
 //TCP client->server callback, 都是读callback
 //
@@ -32,8 +33,16 @@ void tcp_proxy_c2s_cb(struct bufferevent *bev, void *ctx)
 
 	//读到>0的数据,直接将数据放到proxy对应的另一端的buffevent中
     if (len > 0) {
+        if (p->client) {
+            p->client->ps->stats.bytes_out += len;
+            if (!p->client->trace[TS_FIRST_C2S])
+                tunnel_stage(p->client, TS_FIRST_C2S);
+            if (p->client->cap)
+                capture_evbuffer(p->client->cap, CAPTURE_TX, src);
+        }
         dst = bufferevent_get_output(partner);
         evbuffer_add_buffer(dst, src);
+        tunnel_backpressure(bev, p);
     }
 }
 
@@ -48,6 +57,15 @@ void tcp_proxy_s2c_cb(struct bufferevent *bev, void *ctx)
     src = bufferevent_get_input(bev);
     dst = bufferevent_get_output(partner);
 
+    if (p->client) {
+        p->client->ps->stats.bytes_in += evbuffer_get_length(src);
+        if (!p->client->trace[TS_FIRST_S2C])
+            tunnel_stage(p->client, TS_FIRST_S2C);
+        if (p->client->cap)
+            capture_evbuffer(p->client->cap, CAPTURE_RX, src);
+    }
+
 	//直接把读到的src 加到 dst的后面
     evbuffer_add_buffer(dst, src);
+    tunnel_backpressure(bev, p);
 }
\ No newline at end of file
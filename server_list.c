@@ -0,0 +1,327 @@
+/* vim: set et ts=4 sts=4 sw=4 : */
+/********************************************************************\
+ * This program is free software; you can redistribute it and/or    *
+ * modify it under the terms of the GNU General Public License as   *
+ * published by the Free Software Foundation; either version 2 of   *
+ * the License, or (at your option) any later version.              *
+ *                                                                  *
+ * This program is distributed in the hope that it will be useful,  *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of   *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the    *
+ * GNU General Public License for more details.                     *
+ *                                                                  *
+ * You should have received a copy of the GNU General Public License*
+ * along with this program; if not, contact:                        *
+ *                                                                  *
+ * Free Software Foundation           Voice:  +1-617-542-5942       *
+ * 59 Temple Place - Suite 330        Fax:    +1-617-542-2652       *
+ * Boston, MA  02111-1307,  USA       gnu@gnu.org                   *
+ *                                                                  *
+\********************************************************************/
+
+
+/** @file server_list.c
+    @brief frps servers to log in to, their health and the selection policy
+
+    servers lists frps hosts in order of preference. Each control session
+    logs in to one of them; a server whose connect, login or heartbeat
+    failed is left alone for SERVER_DOWN_SEC and the session moves on to
+    the next one at once instead of backing off. Servers no session is on
+    are probed with a TCP connect every server_probe_interval, and a probe
+    that connects marks the server up again so sessions can move back to it.
+
+    The rtt policy probes servers in use too and ranks every server by its
+    connect time, plus the time its frps took to answer heartbeats beyond
+    that when a session was on it. Heartbeat and connect times are never
+    compared with each other: a heartbeat also waits for frps, so an idle
+    server would always look faster than the one in use.
+*/
+
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <assert.h>
+#include <syslog.h>
+#include <netinet/in.h>
+
+#include <event2/util.h>
+#include <event2/event.h>
+#include <event2/bufferevent.h>
+
+#include "server_list.h"
+#include "addr_cache.h"
+#include "config.h"
+#include "debug.h"
+#include "common.h"
+#include "utils.h"
+
+static struct frps_server servers[SERVER_LIST_MAX];
+static int n_servers;
+static enum server_policy policy;
+static struct event_base *probe_base;
+static struct event *ev_probe;
+
+int get_servers(const struct frps_server **list)
+{
+    *list = servers;
+    return n_servers;
+}
+
+struct frps_server *get_server(int idx)
+{
+    return idx >= 0 && idx < n_servers ? &servers[idx] : NULL;
+}
+
+const char *server_policy_str()
+{
+    return policy == SERVER_RTT ? "rtt" : "priority";
+}
+
+int server_is_up(int idx)
+{
+    return get_monotonic_msec() >= servers[idx].down_until;
+}
+
+// connect time plus the slowness of frps seen last, 0 when not probed yet
+static uint32_t server_cost(const struct frps_server *s)
+{
+    return s->probe_srtt_us ? s->probe_srtt_us + s->slow_us : 0;
+}
+
+// 1 when a is the better pick of the two
+static int pick_before(int a, int b)
+{
+    int a_up = server_is_up(a), b_up = server_is_up(b);
+    if (a_up != b_up)
+        return a_up;
+    if (!a_up)
+        return servers[a].down_until < servers[b].down_until;
+
+    uint32_t a_cost = server_cost(&servers[a]), b_cost = server_cost(&servers[b]);
+    if (policy == SERVER_RTT && a_cost != b_cost) {
+        if (!a_cost || !b_cost)
+            return a_cost != 0;
+        return a_cost < b_cost;
+    }
+    return a < b;
+}
+
+int server_pick(uint32_t busy)
+{
+    int i, best = -1;
+    for (i = 0; i < n_servers; i++) {
+        if (busy & (1u << i))
+            continue;
+        if (best < 0 || pick_before(i, best))
+            best = i;
+    }
+    return best;
+}
+
+int server_better(int cur, uint32_t busy)
+{
+    uint32_t c_cost = server_cost(&servers[cur]);
+    uint32_t margin = c_cost / 4 > SERVER_RTT_MARGIN_US ? c_cost / 4 : SERVER_RTT_MARGIN_US;
+    int i, best = -1;
+    for (i = 0; i < n_servers; i++) {
+        const struct frps_server *s = &servers[i];
+        if (i == cur || (busy & (1u << i)) || !s->probe_ok || !server_is_up(i))
+            continue;
+
+        if (policy == SERVER_PRIORITY) {
+            if (i < cur)
+                return i;
+            continue;
+        }
+
+        uint32_t s_cost = server_cost(s);
+        if (!s_cost || !c_cost || s_cost + margin >= c_cost)
+            continue;
+        if (best < 0 || s_cost < server_cost(&servers[best]))
+            best = i;
+    }
+    return best;
+}
+
+void server_failed(int idx)
+{
+    struct frps_server *s = get_server(idx);
+    if (!s)
+        return;
+
+    s->failures++;
+    s->probe_ok   = 0;
+    s->down_until = get_monotonic_msec() + SERVER_DOWN_SEC * 1000;
+}
+
+void server_logged(int idx)
+{
+    struct frps_server *s = get_server(idx);
+    if (!s)
+        return;
+
+    // heartbeats of sessions that left are not smoothed into new ones
+    if (!s->sessions++)
+        s->srtt_us = 0;
+    s->logins++;
+    s->down_until = 0;
+}
+
+void server_left(int idx)
+{
+    struct frps_server *s = get_server(idx);
+    if (s && s->sessions && !--s->sessions)
+        s->srtt_us = 0;
+}
+
+static void update_slow(struct frps_server *s)
+{
+    if (s->srtt_us && s->probe_srtt_us)
+        s->slow_us = s->srtt_us > s->probe_srtt_us ? s->srtt_us - s->probe_srtt_us : 0;
+}
+
+void server_rtt_sample(int idx, uint32_t rtt_us)
+{
+    struct frps_server *s = get_server(idx);
+    if (!s)
+        return;
+
+    s->srtt_us = s->srtt_us ? (7 * s->srtt_us + rtt_us) / 8 : rtt_us;
+    update_slow(s);
+}
+
+static void probe_event_cb(struct bufferevent *bev, short what, void *ctx)
+{
+    struct frps_server *s = ctx;
+    if (what & BEV_EVENT_CONNECTED) {
+        s->probe_ok   = 1;
+        s->down_until = 0;
+        uint32_t rtt_us  = (uint32_t) (get_monotonic_usec() - s->probe_at);
+        s->probe_srtt_us = s->probe_srtt_us ? (7 * s->probe_srtt_us + rtt_us) / 8 : rtt_us;
+        update_slow(s);
+    } else {
+        s->probe_ok   = 0;
+        s->down_until = get_monotonic_msec() + SERVER_DOWN_SEC * 1000;
+        debug(LOG_DEBUG, "probe of xfrp server [%s:%d] failed", s->addr, s->port);
+    }
+
+    bufferevent_free(bev);
+    s->probe = NULL;
+}
+
+static void probe(struct frps_server *s)
+{
+    struct sockaddr_in sin;
+    if (!addr_cache_lookup(s->addr, s->port, &sin))
+        return;   // resolving, next round
+
+    s->probe = bufferevent_socket_new(probe_base, -1, BEV_OPT_CLOSE_ON_FREE);
+    assert(s->probe);
+    struct timeval tv = {SERVER_DOWN_SEC, 0};
+    bufferevent_set_timeouts(s->probe, NULL, &tv);
+    bufferevent_setcb(s->probe, NULL, NULL, probe_event_cb, s);
+    s->probe_at = get_monotonic_usec();
+    if (bufferevent_socket_connect(s->probe, (struct sockaddr *) &sin, sizeof(sin)) < 0) {
+        bufferevent_free(s->probe);
+        s->probe    = NULL;
+        s->probe_ok = 0;
+    }
+}
+
+// the priority policy needs no word on servers carrying a session, the rtt
+// policy compares their connect time with the idle ones
+static void probe_cb(evutil_socket_t fd, short event, void *arg)
+{
+    int i;
+    for (i = 0; i < n_servers; i++)
+        if ((!servers[i].sessions || policy == SERVER_RTT) && !servers[i].probe)
+            probe(&servers[i]);
+}
+
+static void add_server(const char *addr, int port)
+{
+    if (n_servers == SERVER_LIST_MAX) {
+        debug(LOG_ERR, "error: more than %d servers, [%s] skipped", SERVER_LIST_MAX, addr);
+        return;
+    }
+    if (port <= 0 || port > 65535) {
+        debug(LOG_ERR, "error: server [%s] port [%d] is invalid, skipped", addr, port);
+        return;
+    }
+
+    struct frps_server *s = &servers[n_servers++];
+    memset(s, 0, sizeof(*s));
+    s->addr = strdup(addr);
+    assert(s->addr);
+    s->port = port;
+
+    if (!is_valid_ip_address(s->addr))
+        addr_cache_resolve(s->addr, NULL, NULL);
+}
+
+// "host[:port], ..." port defaults to server_port
+static void add_servers(const char *list, int default_port)
+{
+    char *names = strdup(list);
+    assert(names);
+    char *name, *save = NULL;
+    for (name = strtok_r(names, ", ", &save); name; name = strtok_r(NULL, ", ", &save)) {
+        int port     = default_port;
+        char *port_p = strchr(name, ':');
+        if (port_p) {
+            *port_p++ = '\0';
+            port      = atoi(port_p);
+        }
+        add_server(name, port);
+    }
+    free(names);
+}
+
+void init_server_list(struct event_base *base)
+{
+    struct common_conf *c_conf = get_common_config();
+
+    if (c_conf->servers)
+        add_servers(c_conf->servers, c_conf->server_port);
+    if (!n_servers)
+        add_server(c_conf->server_addr, c_conf->server_port);
+    assert(n_servers);
+
+    const char *p = c_conf->server_policy;
+    if (!p || !strcmp(p, "priority"))
+        policy = SERVER_PRIORITY;
+    else if (!strcmp(p, "rtt"))
+        policy = SERVER_RTT;
+    else
+        debug(LOG_ERR, "error: server_policy [%s] is unknown, use priority", p);
+
+    if (n_servers == 1)
+        return;
+    debug(LOG_INFO, "%d xfrp servers, %s", n_servers, server_policy_str());
+
+    // a TCP connect tells nothing about a KCP relay
+    if (c_conf->server_probe_interval <= 0 ||
+        (c_conf->protocol && !strcmp(c_conf->protocol, "kcp")))
+        return;
+    probe_base        = base;
+    struct timeval tv = {c_conf->server_probe_interval, 0};
+    ev_probe          = event_new(base, -1, EV_PERSIST, probe_cb, NULL);
+    assert(ev_probe);
+    event_add(ev_probe, &tv);
+    probe_cb(-1, 0, NULL);
+}
+
+void free_server_list()
+{
+    if (ev_probe)
+        event_free(ev_probe);
+    ev_probe = NULL;
+
+    int i;
+    for (i = 0; i < n_servers; i++) {
+        if (servers[i].probe)
+            bufferevent_free(servers[i].probe);
+        SAFE_FREE(servers[i].addr);
+    }
+    n_servers = 0;
+}
@@ -0,0 +1,83 @@
+/* vim: set et ts=4 sts=4 sw=4 : */
+/********************************************************************\
+ * This program is free software; you can redistribute it and/or    *
+ * modify it under the terms of the GNU General Public License as   *
+ * published by the Free Software Foundation; either version 2 of   *
+ * the License, or (at your option) any later version.              *
+ *                                                                  *
+ * This program is distributed in the hope that it will be useful,  *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of   *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the    *
+ * GNU General Public License for more details.                     *
+ *                                                                  *
+ * You should have received a copy of the GNU General Public License*
+ * along with this program; if not, contact:                        *
+ *                                                                  *
+ * Free Software Foundation           Voice:  +1-617-542-5942       *
+ * 59 Temple Place - Suite 330        Fax:    +1-617-542-2652       *
+ * Boston, MA  02111-1307,  USA       gnu@gnu.org                   *
+ *                                                                  *
+\********************************************************************/
+
+
+/** @file server_list.h
+    @brief frps servers to log in to, their health and the selection policy
+*/
+
+#ifndef _SERVER_LIST_H_
+#define _SERVER_LIST_H_
+
+#include <stdint.h>
+
+#define SERVER_LIST_MAX 16
+#define SERVER_DOWN_SEC 10            // a failed server is left alone for so long
+#define SERVER_RTT_MARGIN_US 2000     // rtt policy moves for a gain of 1/4 and at least this
+#define SERVER_SETTLE_PONGS 3         // heartbeats answered after login before moving again
+
+struct event_base;
+struct bufferevent;
+
+enum server_policy {
+    SERVER_PRIORITY = 0,   // first of servers that is up
+    SERVER_RTT,            // lowest smoothed rtt
+};
+
+struct frps_server {
+    char *addr;
+    int port;
+    int udp_port;   // xtcp rendezvous from LoginResp, 0 unknown
+
+    uint32_t srtt_us;         // heartbeats of the sessions on it; 0 unknown or idle
+    uint32_t probe_srtt_us;   // connect time of probes; 0 unknown
+    uint32_t slow_us;         // srtt_us over probe_srtt_us, kept while idle
+    uint64_t down_until;   // monotonic msec
+    int probe_ok;          // latest probe connected
+    struct bufferevent *probe;   // connect in flight
+    uint64_t probe_at;           // usec
+
+    uint32_t sessions;   // control sessions logged on it
+    uint64_t logins;
+    uint64_t failures;   // connect, login or heartbeat failed
+};
+
+// servers of common config, server_addr:server_port without it
+void init_server_list(struct event_base *base);
+void free_server_list();
+
+int get_servers(const struct frps_server **list);
+struct frps_server *get_server(int idx);
+const char *server_policy_str();
+
+// server for a control session, never one in busy (bit per server), which
+// holds the servers a session of the same shard is on; -1 when all are busy
+int server_pick(uint32_t busy);
+int server_is_up(int idx);
+// an up server worth leaving cur for, -1 to stay
+int server_better(int cur, uint32_t busy);
+
+void server_failed(int idx);
+void server_logged(int idx);
+void server_left(int idx);
+void server_rtt_sample(int idx, uint32_t rtt_us);
+
+#endif   //_SERVER_LIST_H_
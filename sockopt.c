@@ -0,0 +1,154 @@
+/* vim: set et ts=4 sts=4 sw=4 : */
+/********************************************************************\
+ * This program is free software; you can redistribute it and/or    *
+ * modify it under the terms of the GNU General Public License as   *
+ * published by the Free Software Foundation; either version 2 of   *
+ * the License, or (at your option) any later version.              *
+ *                                                                  *
+ * This program is distributed in the hope that it will be useful,  *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of   *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the    *
+ * GNU General Public License for more details.                     *
+ *                                                                  *
+ * You should have received a copy of the GNU General Public License*
+ * along with this program; if not, contact:                        *
+ *                                                                  *
+ * Free Software Foundation           Voice:  +1-617-542-5942       *
+ * 59 Temple Place - Suite 330        Fax:    +1-617-542-2652       *
+ * Boston, MA  02111-1307,  USA       gnu@gnu.org                   *
+ *                                                                  *
+\********************************************************************/
+
+
+/** @file sockopt.c
+    @brief TCP socket options of frps connections and local dials
+
+    [common] tcp_* options apply to the control connection, work
+    connections and local dials, a proxy section overrides them for its
+    own tunnels. A work connection is opened before frps tells which
+    proxy it serves, so the proxy options reach it with StartWorkConn,
+    after the handshake. Buffers set then only grow within the window
+    scale picked from tcp_rmem.
+*/
+
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <assert.h>
+#include <syslog.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include "sockopt.h"
+#include "debug.h"
+#include "common.h"
+
+void sock_tuning_init(struct sock_tuning *t)
+{
+    t->nodelay         = -1;
+    t->sndbuf          = -1;
+    t->rcvbuf          = -1;
+    t->keepalive_idle  = -1;
+    t->keepalive_intvl = -1;
+    t->keepalive_cnt   = -1;
+    t->user_timeout    = -1;
+    t->congestion      = NULL;
+}
+
+void sock_tuning_copy(struct sock_tuning *dst, const struct sock_tuning *src)
+{
+    *dst = *src;
+    if (src->congestion) {
+        dst->congestion = strdup(src->congestion);
+        assert(dst->congestion);
+    }
+}
+
+void sock_tuning_free(struct sock_tuning *t)
+{
+    SAFE_FREE(t->congestion);
+    t->congestion = NULL;
+}
+
+int sock_tuning_parse(struct sock_tuning *t, const char *name, const char *value)
+{
+    if (strcmp(name, "tcp_nodelay") == 0) {
+        t->nodelay = strcmp(value, "true") == 0;
+    } else if (strcmp(name, "tcp_sndbuf") == 0) {
+        t->sndbuf = atoi(value);
+    } else if (strcmp(name, "tcp_rcvbuf") == 0) {
+        t->rcvbuf = atoi(value);
+    } else if (strcmp(name, "tcp_keepalive_idle") == 0) {
+        t->keepalive_idle = atoi(value);
+    } else if (strcmp(name, "tcp_keepalive_interval") == 0) {
+        t->keepalive_intvl = atoi(value);
+    } else if (strcmp(name, "tcp_keepalive_count") == 0) {
+        t->keepalive_cnt = atoi(value);
+    } else if (strcmp(name, "tcp_user_timeout") == 0) {
+        t->user_timeout = atoi(value);
+    } else if (strcmp(name, "tcp_congestion") == 0) {
+        SAFE_FREE(t->congestion);
+        t->congestion = strdup(value);
+        assert(t->congestion);
+    } else {
+        return 0;
+    }
+    return 1;
+}
+
+int sock_tuning_empty(const struct sock_tuning *t)
+{
+    return t->nodelay < 0 && t->sndbuf < 0 && t->rcvbuf < 0 && t->keepalive_idle < 0 &&
+           t->keepalive_intvl < 0 && t->keepalive_cnt < 0 && t->user_timeout < 0 &&
+           !t->congestion;
+}
+
+static void set_int(evutil_socket_t fd, int level, int opt, int value, const char *name,
+                    const char *who)
+{
+    if (value < 0)
+        return;
+    if (setsockopt(fd, level, opt, &value, sizeof(value)))
+        debug_ratelimit(LOG_WARNING, "%s: set %s %d failed: %s", who, name, value,
+                        strerror(errno));
+}
+
+void sock_tuning_apply(evutil_socket_t fd, const struct sock_tuning *t, const char *who)
+{
+    if (fd < 0)
+        return;
+
+    set_int(fd, IPPROTO_TCP, TCP_NODELAY, t->nodelay, "tcp_nodelay", who);
+    set_int(fd, SOL_SOCKET, SO_SNDBUF, t->sndbuf, "tcp_sndbuf", who);
+    set_int(fd, SOL_SOCKET, SO_RCVBUF, t->rcvbuf, "tcp_rcvbuf", who);
+    if (t->keepalive_idle >= 0)
+        set_int(fd, SOL_SOCKET, SO_KEEPALIVE, t->keepalive_idle > 0, "keepalive", who);
+    if (t->keepalive_idle > 0) {
+        set_int(fd, IPPROTO_TCP, TCP_KEEPIDLE, t->keepalive_idle, "tcp_keepalive_idle", who);
+        set_int(fd, IPPROTO_TCP, TCP_KEEPINTVL, t->keepalive_intvl, "tcp_keepalive_interval",
+                who);
+        set_int(fd, IPPROTO_TCP, TCP_KEEPCNT, t->keepalive_cnt, "tcp_keepalive_count", who);
+    }
+    set_int(fd, IPPROTO_TCP, TCP_USER_TIMEOUT, t->user_timeout, "tcp_user_timeout", who);
+
+    // unknown or not allowed algorithms (net.ipv4.tcp_allowed_congestion_control) keep the default
+    if (t->congestion &&
+        setsockopt(fd, IPPROTO_TCP, TCP_CONGESTION, t->congestion, strlen(t->congestion)))
+        debug_ratelimit(LOG_WARNING, "%s: set tcp_congestion %s failed: %s", who, t->congestion,
+                        strerror(errno));
+}
+
+evutil_socket_t sock_tuning_socket(evutil_socket_t fd, const struct sock_tuning *t,
+                                   const char *who)
+{
+    if (fd < 0 && !sock_tuning_empty(t)) {
+        fd = socket(AF_INET, SOCK_STREAM, 0);
+        if (fd < 0)
+            return -1;
+        evutil_make_socket_nonblocking(fd);
+        evutil_make_socket_closeonexec(fd);
+    }
+    sock_tuning_apply(fd, t, who);
+    return fd;
+}
@@ -0,0 +1,60 @@
+/* vim: set et ts=4 sts=4 sw=4 : */
+/********************************************************************\
+ * This program is free software; you can redistribute it and/or    *
+ * modify it under the terms of the GNU General Public License as   *
+ * published by the Free Software Foundation; either version 2 of   *
+ * the License, or (at your option) any later version.              *
+ *                                                                  *
+ * This program is distributed in the hope that it will be useful,  *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of   *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the    *
+ * GNU General Public License for more details.                     *
+ *                                                                  *
+ * You should have received a copy of the GNU General Public License*
+ * along with this program; if not, contact:                        *
+ *                                                                  *
+ * Free Software Foundation           Voice:  +1-617-542-5942       *
+ * 59 Temple Place - Suite 330        Fax:    +1-617-542-2652       *
+ * Boston, MA  02111-1307,  USA       gnu@gnu.org                   *
+ *                                                                  *
+\********************************************************************/
+
+
+/** @file sockopt.h
+    @brief TCP socket options of frps connections and local dials
+*/
+
+#ifndef _SOCKOPT_H_
+#define _SOCKOPT_H_
+
+#include <event2/util.h>
+
+// -1 (NULL) leaves the kernel default
+struct sock_tuning {
+    int nodelay;           // tcp_nodelay
+    int sndbuf;            // tcp_sndbuf, bytes
+    int rcvbuf;            // tcp_rcvbuf, bytes
+    int keepalive_idle;    // tcp_keepalive_idle, seconds, SO_KEEPALIVE on, 0 off
+    int keepalive_intvl;   // tcp_keepalive_interval, seconds
+    int keepalive_cnt;     // tcp_keepalive_count, probes
+    int user_timeout;      // tcp_user_timeout, ms unacked data may wait, 0 kernel default
+    char *congestion;      // tcp_congestion, bbr, cubic...
+};
+
+void sock_tuning_init(struct sock_tuning *t);
+void sock_tuning_copy(struct sock_tuning *dst, const struct sock_tuning *src);
+void sock_tuning_free(struct sock_tuning *t);
+// 1 when name is one of the tcp_* options above and value was taken
+int sock_tuning_parse(struct sock_tuning *t, const char *name, const char *value);
+// nothing to set, sockets stay as libevent opens them
+int sock_tuning_empty(const struct sock_tuning *t);
+
+// set what t asks for on a TCP socket, buffers before connect to count in
+// the window scale; who names it in warnings
+void sock_tuning_apply(evutil_socket_t fd, const struct sock_tuning *t, const char *who);
+// fd when given, else a nonblocking TCP socket when t is not empty, -1 lets
+// libevent open one; t applied either way
+evutil_socket_t sock_tuning_socket(evutil_socket_t fd, const struct sock_tuning *t,
+                                   const char *who);
+
+#endif   //_SOCKOPT_H_
@@ -0,0 +1,313 @@
+/* vim: set et ts=4 sts=4 sw=4 : */
+/********************************************************************\
+ * This program is free software; you can redistribute it and/or    *
+ * modify it under the terms of the GNU General Public License as   *
+ * published by the Free Software Foundation; either version 2 of   *
+ * the License, or (at your option) any later version.              *
+ *                                                                  *
+ * This program is distributed in the hope that it will be useful,  *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of   *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the    *
+ * GNU General Public License for more details.                     *
+ *                                                                  *
+ * You should have received a copy of the GNU General Public License*
+ * along with this program; if not, contact:                        *
+ *                                                                  *
+ * Free Software Foundation           Voice:  +1-617-542-5942       *
+ * 59 Temple Place - Suite 330        Fax:    +1-617-542-2652       *
+ * Boston, MA  02111-1307,  USA       gnu@gnu.org                   *
+ *                                                                  *
+\********************************************************************/
+
+
+/** @file tls.c
+    @brief TLS to frps with session resumption
+
+    Every work connection is a new connection to frps, a full handshake
+    for each would cost router CPUs more than the tunnel itself. Sessions
+    and tickets frps hands out are cached here, the newest one is offered
+    by every later connection so frps can resume it with a cheap
+    abbreviated handshake. With several frps servers each one has its own
+    session, keyed by the server name the connection was made to.
+
+    With kernel TLS, openssl installs the negotiated keys on the socket
+    after the handshake. A tunnel whose socket got both directions is
+    relayed by a plain socket bufferevent from then on, so tunnel bytes
+    skip openssl entirely.
+*/
+
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <assert.h>
+#include <syslog.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+#include <openssl/x509v3.h>
+
+#include <event2/event.h>
+#include <event2/buffer.h>
+#include <event2/bufferevent.h>
+#include <event2/bufferevent_ssl.h>
+
+#include "tls.h"
+#include "debug.h"
+#include "common.h"
+#include "uthash.h"
+
+struct tls_cached {
+    char *name;              // frps address the session came from
+    SSL_SESSION *session;    // newest session from it
+    UT_hash_handle hh;
+};
+
+static SSL_CTX *tls_ctx;
+static struct tls_cached *tls_sessions;
+static int tls_verify;   // check frps certificate against its name
+static struct tls_stats tls_stats;
+
+// openssl marks the session of a connection freed without close_notify as
+// not resumable, bufferevent_openssl frees them that way, so neither the
+// cache nor any connection ever holds the session of another
+static SSL_SESSION *session_copy(SSL_SESSION *sess)
+{
+    int len = i2d_SSL_SESSION(sess, NULL);
+    if (len <= 0)
+        return NULL;
+
+    unsigned char *der = malloc(len);
+    assert(der);
+    unsigned char *p = der;
+    i2d_SSL_SESSION(sess, &p);
+    const unsigned char *q = der;
+    SSL_SESSION *copy      = d2i_SSL_SESSION(NULL, &q, len);
+    free(der);
+    return copy;
+}
+
+static struct tls_cached *get_cached(const char *name, int create)
+{
+    struct tls_cached *c = NULL;
+    HASH_FIND_STR(tls_sessions, name, c);
+    if (c || !create)
+        return c;
+
+    c = calloc(1, sizeof(struct tls_cached));
+    assert(c);
+    c->name = strdup(name);
+    assert(c->name);
+    HASH_ADD_KEYPTR(hh, tls_sessions, c->name, strlen(c->name), c);
+    return c;
+}
+
+static int new_session_cb(SSL *ssl, SSL_SESSION *sess)
+{
+    const char *name = SSL_get_app_data(ssl);
+    if (!name)
+        return 0;
+
+    SSL_SESSION *copy = session_copy(sess);
+    if (!copy)
+        return 0;
+
+    struct tls_cached *c = get_cached(name, 1);
+    if (c->session)
+        SSL_SESSION_free(c->session);
+    c->session = copy;
+    return 0;   // reference of sess is not kept
+}
+
+static int is_ip_address(const char *name)
+{
+    struct in_addr addr;
+    return inet_pton(AF_INET, name, &addr) == 1;
+}
+
+int init_tls(const char *ca_file, int ktls)
+{
+#if OPENSSL_VERSION_NUMBER < 0x10100000L
+    SSL_library_init();
+    SSL_load_error_strings();
+#endif
+
+    tls_ctx = SSL_CTX_new(SSLv23_client_method());
+    if (!tls_ctx) {
+        debug(LOG_ERR, "error: create TLS context failed");
+        return -1;
+    }
+    SSL_CTX_set_options(tls_ctx, SSL_OP_NO_SSLv2 | SSL_OP_NO_SSLv3 | SSL_OP_NO_TLSv1 |
+                                     SSL_OP_NO_TLSv1_1 | SSL_OP_NO_COMPRESSION);
+    SSL_CTX_set_mode(tls_ctx, SSL_MODE_RELEASE_BUFFERS);
+#ifdef SSL_OP_ENABLE_KTLS
+    // openssl silently stays in user space when the kernel or the cipher can not do it
+    if (ktls)
+        SSL_CTX_set_options(tls_ctx, SSL_OP_ENABLE_KTLS);
+#endif
+
+    // sessions are kept by new_session_cb only, openssl's own client cache is never looked up
+    SSL_CTX_set_session_cache_mode(tls_ctx,
+                                   SSL_SESS_CACHE_CLIENT | SSL_SESS_CACHE_NO_INTERNAL_STORE);
+    SSL_CTX_sess_set_new_cb(tls_ctx, new_session_cb);
+
+    if (ca_file) {
+        if (!SSL_CTX_load_verify_locations(tls_ctx, ca_file, NULL)) {
+            debug(LOG_ERR, "error: load TLS trusted CA [%s] failed", ca_file);
+            free_tls();
+            return -1;
+        }
+        SSL_CTX_set_verify(tls_ctx, SSL_VERIFY_PEER, NULL);
+        tls_verify = 1;
+    }
+
+    return 0;
+}
+
+void free_tls()
+{
+    tls_forget_session();
+    if (tls_ctx)
+        SSL_CTX_free(tls_ctx);
+    tls_ctx    = NULL;
+    tls_verify = 0;
+}
+
+int tls_enabled()
+{
+    return tls_ctx != NULL;
+}
+
+int tls_pending(struct bufferevent *bev)
+{
+    return tls_ctx && !bufferevent_openssl_get_ssl(bev);
+}
+
+struct bufferevent *tls_wrap(struct bufferevent *bev, const char *server_name)
+{
+    struct event_base *base = bufferevent_get_base(bev);
+    evutil_socket_t fd      = bufferevent_getfd(bev);
+    bufferevent_data_cb readcb, writecb;
+    bufferevent_event_cb eventcb;
+    void *ctx;
+    bufferevent_getcb(bev, &readcb, &writecb, &eventcb, &ctx);
+
+    SSL *ssl = SSL_new(tls_ctx);
+    if (!ssl) {
+        tls_stats.failed++;
+        bufferevent_free(bev);
+        return NULL;
+    }
+    // the name lives in the server list as long as the ssl does
+    SSL_set_app_data(ssl, (void *) server_name);
+    int ip = is_ip_address(server_name);
+    if (!ip)
+        SSL_set_tlsext_host_name(ssl, server_name);
+    if (tls_verify) {
+        if (ip)
+            X509_VERIFY_PARAM_set1_ip_asc(SSL_get0_param(ssl), server_name);
+        else
+            SSL_set1_host(ssl, server_name);
+    }
+
+    struct tls_cached *c = get_cached(server_name, 0);
+    SSL_SESSION *sess    = c && c->session ? session_copy(c->session) : NULL;
+    if (sess) {
+        SSL_set_session(ssl, sess);
+        SSL_SESSION_free(sess);
+    }
+
+    // hand the socket over, the new bev closes it
+    bufferevent_setfd(bev, -1);
+    bufferevent_free(bev);
+
+    struct bufferevent *tls_bev = bufferevent_openssl_socket_new(
+        base, fd, ssl, BUFFEREVENT_SSL_CONNECTING, BEV_OPT_CLOSE_ON_FREE);
+    if (!tls_bev) {
+        tls_stats.failed++;
+        SSL_free(ssl);
+        evutil_closesocket(fd);
+        return NULL;
+    }
+
+    // frps side may close without close_notify, take it as a plain EOF
+    bufferevent_openssl_set_allow_dirty_shutdown(tls_bev, 1);
+    bufferevent_setcb(tls_bev, readcb, writecb, eventcb, ctx);
+    bufferevent_enable(tls_bev, EV_READ | EV_WRITE);
+    return tls_bev;
+}
+
+void tls_handshake_done(struct bufferevent *bev)
+{
+    SSL *ssl = bufferevent_openssl_get_ssl(bev);
+    if (!ssl)
+        return;
+
+    if (SSL_session_reused(ssl)) {
+        tls_stats.resumed++;
+        return;
+    }
+    tls_stats.full++;
+    debug(LOG_DEBUG, "TLS full handshake with frps, %s %s", SSL_get_version(ssl),
+          SSL_get_cipher_name(ssl));
+}
+
+struct bufferevent *tls_unwrap(struct bufferevent *bev)
+{
+#if defined(SSL_OP_ENABLE_KTLS) && !defined(OPENSSL_NO_KTLS)
+    SSL *ssl = bufferevent_openssl_get_ssl(bev);
+    if (!ssl || !BIO_get_ktls_send(SSL_get_wbio(ssl)) || !BIO_get_ktls_recv(SSL_get_rbio(ssl)))
+        return bev;
+
+    // anything still held in openssl or queued for it would be lost
+    if (SSL_has_pending(ssl) || BIO_wpending(SSL_get_wbio(ssl)) ||
+        evbuffer_get_length(bufferevent_get_output(bev)))
+        return bev;
+
+    // the ssl bev closes its own descriptor when freed, keys stay on the socket
+    evutil_socket_t fd = dup(bufferevent_getfd(bev));
+    if (fd < 0)
+        return bev;
+    evutil_make_socket_nonblocking(fd);
+
+    struct bufferevent *plain =
+        bufferevent_socket_new(bufferevent_get_base(bev), fd, BEV_OPT_CLOSE_ON_FREE);
+    if (!plain) {
+        evutil_closesocket(fd);
+        return bev;
+    }
+
+    bufferevent_data_cb readcb, writecb;
+    bufferevent_event_cb eventcb;
+    void *ctx;
+    bufferevent_getcb(bev, &readcb, &writecb, &eventcb, &ctx);
+    bufferevent_setcb(plain, readcb, writecb, eventcb, ctx);
+    evbuffer_add_buffer(bufferevent_get_input(plain), bufferevent_get_input(bev));
+    bufferevent_free(bev);
+    bufferevent_enable(plain, EV_READ | EV_WRITE);
+
+    tls_stats.ktls++;
+    return plain;
+#else
+    return bev;
+#endif
+}
+
+void tls_forget_session()
+{
+    struct tls_cached *c = NULL, *tmp = NULL;
+    HASH_ITER(hh, tls_sessions, c, tmp)
+    {
+        HASH_DEL(tls_sessions, c);
+        if (c->session)
+            SSL_SESSION_free(c->session);
+        SAFE_FREE(c->name);
+        SAFE_FREE(c);
+    }
+}
+
+const struct tls_stats *get_tls_stats()
+{
+    return &tls_stats;
+}
@@ -0,0 +1,69 @@
+/* vim: set et ts=4 sts=4 sw=4 : */
+/********************************************************************\
+ * This program is free software; you can redistribute it and/or    *
+ * modify it under the terms of the GNU General Public License as   *
+ * published by the Free Software Foundation; either version 2 of   *
+ * the License, or (at your option) any later version.              *
+ *                                                                  *
+ * This program is distributed in the hope that it will be useful,  *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of   *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the    *
+ * GNU General Public License for more details.                     *
+ *                                                                  *
+ * You should have received a copy of the GNU General Public License*
+ * along with this program; if not, contact:                        *
+ *                                                                  *
+ * Free Software Foundation           Voice:  +1-617-542-5942       *
+ * 59 Temple Place - Suite 330        Fax:    +1-617-542-2652       *
+ * Boston, MA  02111-1307,  USA       gnu@gnu.org                   *
+ *                                                                  *
+\********************************************************************/
+
+
+/** @file tls.h
+    @brief TLS to frps with session resumption
+*/
+
+#ifndef _TLS_H_
+#define _TLS_H_
+
+#include <stdint.h>
+
+struct bufferevent;
+
+struct tls_stats {
+    uint64_t full;        // handshakes with a new session
+    uint64_t resumed;     // handshakes that resumed the cached session
+    uint64_t failed;      // connections that could not be wrapped
+    uint64_t ktls;        // tunnels relayed on a kernel TLS socket
+};
+
+// ca_file NULL skips verification of frps certificate; ktls asks openssl to
+// move record processing to the kernel when it can
+int init_tls(const char *ca_file, int ktls);
+void free_tls();
+int tls_enabled();
+
+// connected tcp bev that still has to be wrapped
+int tls_pending(struct bufferevent *bev);
+
+// start the handshake on the socket of bev, bev is freed and the returned
+// one keeps its callbacks, BEV_EVENT_CONNECTED comes again once the
+// handshake is done; NULL on failure, bev is freed as well.
+// server_name is the frps address dialed: sent as SNI, verified against the
+// certificate and keys the resumable session; it must outlive the connection
+struct bufferevent *tls_wrap(struct bufferevent *bev, const char *server_name);
+
+// call on BEV_EVENT_CONNECTED of a wrapped bev, counts the handshake
+void tls_handshake_done(struct bufferevent *bev);
+
+// when the kernel took over both directions of a wrapped bev, return a
+// plain socket bev on the same connection with its callbacks and input,
+// bev is freed; otherwise bev itself is returned and keeps running in openssl
+struct bufferevent *tls_unwrap(struct bufferevent *bev);
+
+// drop the cached sessions, next handshakes are full ones
+void tls_forget_session();
+const struct tls_stats *get_tls_stats();
+
+#endif   //_TLS_H_
@@ -0,0 +1,533 @@
+/* vim: set et ts=4 sts=4 sw=4 : */
+/********************************************************************\
+ * This program is free software; you can redistribute it and/or    *
+ * modify it under the terms of the GNU General Public License as   *
+ * published by the Free Software Foundation; either version 2 of   *
+ * the License, or (at your option) any later version.              *
+ *                                                                  *
+ * This program is distributed in the hope that it will be useful,  *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of   *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the    *
+ * GNU General Public License for more details.                     *
+ *                                                                  *
+ * You should have received a copy of the GNU General Public License*
+ * along with this program; if not, contact:                        *
+ *                                                                  *
+ * Free Software Foundation           Voice:  +1-617-542-5942       *
+ * 59 Temple Place - Suite 330        Fax:    +1-617-542-2652       *
+ * Boston, MA  02111-1307,  USA       gnu@gnu.org                   *
+ *                                                                  *
+\********************************************************************/
+
+
+/** @file uplink.c
+    @brief sockets of the connections to frps, multipath TCP and uplink binding
+
+    Control and work connections to frps can be opened as multipath TCP,
+    so a router with a wired WAN and an LTE uplink spreads them over both
+    and keeps them alive when one link drops. The kernel path manager
+    decides the subflows (ip mptcp endpoint ... subflow), xfrpc only opens
+    the socket and reports per path byte counters. Kernels without
+    multipath TCP and frps hosts that answer plain TCP fall back to TCP.
+
+    Without multipath TCP, work connections can still be spread over
+    several uplinks: each new one is bound to the next of bind_addresses
+    (explicit bind) or bind_interfaces (SO_BINDTODEVICE), round robin,
+    weighted round robin or to the uplink carrying the least bytes per
+    second. An uplink that fails to bind or connect is skipped for
+    UPLINK_DOWN_SEC. The control connection keeps the default route.
+*/
+
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+#include <assert.h>
+#include <syslog.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <linux/tcp.h>
+
+#if defined(__has_include)
+#if __has_include(<linux/mptcp.h>)
+#include <linux/mptcp.h>
+#endif
+#endif
+
+#include <event2/util.h>
+#include <event2/event.h>
+#include <event2/bufferevent.h>
+
+#include "uplink.h"
+#include "config.h"
+#include "debug.h"
+#include "client.h"
+#include "common.h"
+#include "utils.h"
+
+#ifndef IPPROTO_MPTCP
+#define IPPROTO_MPTCP 262
+#endif
+#ifndef SOL_MPTCP
+#define SOL_MPTCP 284
+#endif
+
+static int mptcp_unsupported;
+static struct uplink_stats closed_stats;
+
+static struct uplink *uplinks;
+static int n_uplinks;
+static enum uplink_policy policy;
+static struct event *ev_rate;
+
+int uplink_mptcp_enabled()
+{
+    return get_common_config()->mptcp;
+}
+
+// multipath TCP counts fallbacks once the handshake is done, fast open hides it
+int uplink_fast_open_enabled()
+{
+    return get_common_config()->tcp_fast_open && !uplink_mptcp_enabled();
+}
+
+static evutil_socket_t open_socket(int mptcp)
+{
+    evutil_socket_t fd = -1;
+    if (mptcp && !mptcp_unsupported) {
+        fd = socket(AF_INET, SOCK_STREAM, IPPROTO_MPTCP);
+        // no multipath TCP in kernel, or net.mptcp.enabled = 0
+        if (fd < 0 && (errno == EPROTONOSUPPORT || errno == EINVAL || errno == ENOPROTOOPT)) {
+            debug(LOG_WARNING, "multipath TCP unavailable: %s, connect frps with TCP",
+                  strerror(errno));
+            mptcp_unsupported = 1;
+        }
+    }
+    if (mptcp && fd < 0)
+        closed_stats.fallback_conns++;
+    if (fd < 0)
+        fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0)
+        return -1;
+
+    evutil_make_socket_nonblocking(fd);
+    evutil_make_socket_closeonexec(fd);
+    return fd;
+}
+
+static int pick_uplink()
+{
+    uint64_t now = get_monotonic_msec();
+    int i, best = -1, total = 0;
+
+    for (i = 0; i < n_uplinks; i++) {
+        struct uplink *u = &uplinks[i];
+        if (u->down_until > now)
+            continue;
+
+        if (policy == UPLINK_LEAST_LOADED) {
+            // compare rate / weight, then conns / weight, without division
+            struct uplink *b = best < 0 ? NULL : &uplinks[best];
+            if (!b || u->rate * b->weight < b->rate * u->weight ||
+                (u->rate * b->weight == b->rate * u->weight &&
+                 (uint64_t) u->conns * b->weight < (uint64_t) b->conns * u->weight))
+                best = i;
+            continue;
+        }
+
+        // smooth weighted round robin, weights are 1 for plain round robin
+        int w = policy == UPLINK_WEIGHTED ? u->weight : 1;
+        u->current += w;
+        total += w;
+        if (best < 0 || u->current > uplinks[best].current)
+            best = i;
+    }
+
+    if (best >= 0) {
+        uplinks[best].current -= total;
+        return best;
+    }
+
+    // all down, try the one that failed first
+    best = 0;
+    for (i = 1; i < n_uplinks; i++)
+        if (uplinks[i].down_until < uplinks[best].down_until)
+            best = i;
+    return best;
+}
+
+static int bind_uplink(evutil_socket_t fd, const struct uplink *u)
+{
+    if (u->is_dev)
+        return setsockopt(fd, SOL_SOCKET, SO_BINDTODEVICE, u->name, strlen(u->name) + 1);
+
+#ifdef IP_BIND_ADDRESS_NO_PORT
+    // leave the port to connect, so the 4-tuple decides and ports are not used up
+    int on = 1;
+    setsockopt(fd, IPPROTO_IP, IP_BIND_ADDRESS_NO_PORT, &on, sizeof(on));
+#endif
+    return bind(fd, (const struct sockaddr *) &u->sin, sizeof(u->sin));
+}
+
+evutil_socket_t uplink_socket(int *uplink)
+{
+    int mptcp     = uplink_mptcp_enabled();
+    int bound     = uplink && n_uplinks > 0;
+    int fast_open = uplink_fast_open_enabled();
+
+    if (uplink)
+        *uplink = -1;
+    if (!mptcp && !bound && !fast_open)
+        return -1;
+
+    evutil_socket_t fd = open_socket(mptcp);
+    if (fd >= 0 && fast_open && set_tcp_fast_open(fd))
+        debug_ratelimit(LOG_WARNING, "tcp fast open unavailable: %s", strerror(errno));
+    if (fd < 0 || !bound)
+        return fd;
+
+    int tries;
+    for (tries = 0; tries < n_uplinks; tries++) {
+        int i = pick_uplink();
+        if (bind_uplink(fd, &uplinks[i])) {
+            debug_ratelimit(LOG_WARNING, "bind work connection to uplink [%s] failed: %s",
+                            uplinks[i].name, strerror(errno));
+            uplink_failed(i);
+            continue;
+        }
+        uplinks[i].conns++;
+        uplinks[i].total_conns++;
+        *uplink = i;
+        return fd;
+    }
+
+    debug_ratelimit(LOG_WARNING, "no uplink could be bound, work connection takes default route");
+    return fd;
+}
+
+void uplink_failed(int uplink)
+{
+    if (uplink < 0 || uplink >= n_uplinks)
+        return;
+
+    uplinks[uplink].failures++;
+    uplinks[uplink].down_until = get_monotonic_msec() + UPLINK_DOWN_SEC * 1000;
+}
+
+void uplink_release(int uplink)
+{
+    if (uplink >= 0 && uplink < n_uplinks && uplinks[uplink].conns)
+        uplinks[uplink].conns--;
+}
+
+static int is_fallback(evutil_socket_t fd)
+{
+#ifdef MPTCP_INFO
+    struct mptcp_info info;
+    socklen_t len = sizeof(info);
+    if (getsockopt(fd, SOL_MPTCP, MPTCP_INFO, &info, &len))
+        return 1;
+    return (info.mptcpi_flags & MPTCP_INFO_FLAG_FALLBACK) != 0;
+#else
+    return 0;
+#endif
+}
+
+void uplink_connected(evutil_socket_t fd)
+{
+    int proto     = 0;
+    socklen_t len = sizeof(proto);
+    if (fd < 0 || getsockopt(fd, SOL_SOCKET, SO_PROTOCOL, &proto, &len) || proto != IPPROTO_MPTCP)
+        return;
+
+    // frps host without multipath TCP, or a middlebox stripped the option
+    if (is_fallback(fd))
+        closed_stats.fallback_conns++;
+    else
+        closed_stats.mptcp_conns++;
+}
+
+static void addr_str(const struct sockaddr_storage *ss, char *buf, size_t len)
+{
+    const void *addr = NULL;
+    if (ss->ss_family == AF_INET)
+        addr = &((const struct sockaddr_in *) ss)->sin_addr;
+    else if (ss->ss_family == AF_INET6)
+        addr = &((const struct sockaddr_in6 *) ss)->sin6_addr;
+
+    if (!addr || !evutil_inet_ntop(ss->ss_family, addr, buf, len))
+        snprintf(buf, len, "?");
+}
+
+static void add_path(struct uplink_stats *st, const struct sockaddr_storage *local,
+                     const struct sockaddr_storage *remote, const struct tcp_info *ti, int live)
+{
+    char l[sizeof(st->paths[0].local)], r[sizeof(st->paths[0].remote)];
+    addr_str(local, l, sizeof(l));
+    addr_str(remote, r, sizeof(r));
+
+    int i;
+    for (i = 0; i < st->npaths; i++)
+        if (!strcmp(st->paths[i].local, l) && !strcmp(st->paths[i].remote, r))
+            break;
+
+    if (i == st->npaths) {
+        if (st->npaths == UPLINK_MAX_PATHS)
+            return;
+        st->npaths++;
+        memset(&st->paths[i], 0, sizeof(st->paths[i]));
+        snprintf(st->paths[i].local, sizeof(st->paths[i].local), "%s", l);
+        snprintf(st->paths[i].remote, sizeof(st->paths[i].remote), "%s", r);
+    }
+
+    struct uplink_path *p = &st->paths[i];
+    p->subflows += live;
+    p->bytes_sent += ti->tcpi_bytes_acked;
+    p->bytes_received += ti->tcpi_bytes_received;
+}
+
+static int read_tcp_info(evutil_socket_t fd, struct tcp_info *ti)
+{
+    socklen_t len = sizeof(*ti);
+    memset(ti, 0, sizeof(*ti));
+    return getsockopt(fd, IPPROTO_TCP, TCP_INFO, ti, &len);
+}
+
+// single path of a plain TCP connection, or of a multipath one that fell back
+static void read_tcp_path(evutil_socket_t fd, struct uplink_stats *st, int live)
+{
+    struct sockaddr_storage local, remote;
+    socklen_t llen = sizeof(local), rlen = sizeof(remote);
+    struct tcp_info ti;
+
+    if (getsockname(fd, (struct sockaddr *) &local, &llen) ||
+        getpeername(fd, (struct sockaddr *) &remote, &rlen) || read_tcp_info(fd, &ti))
+        return;
+
+    add_path(st, &local, &remote, &ti, live);
+}
+
+#ifdef MPTCP_SUBFLOW_ADDRS
+// return 0 when fd is not running multipath, its paths are then read as TCP
+static int read_subflows(evutil_socket_t fd, struct uplink_stats *st, int live)
+{
+    if (is_fallback(fd))
+        return 0;
+
+    socklen_t len;
+    struct {
+        struct mptcp_subflow_data d;
+        struct mptcp_subflow_addrs a[UPLINK_MAX_PATHS];
+    } addrs;
+    struct {
+        struct mptcp_subflow_data d;
+        struct tcp_info t[UPLINK_MAX_PATHS];
+    } infos;
+
+    memset(&addrs, 0, sizeof(addrs));
+    addrs.d.size_subflow_data = sizeof(addrs.d);
+    addrs.d.size_user         = sizeof(addrs.a[0]);
+    len                       = sizeof(addrs);
+    if (getsockopt(fd, SOL_MPTCP, MPTCP_SUBFLOW_ADDRS, &addrs, &len))
+        return 0;
+
+    memset(&infos, 0, sizeof(infos));
+    infos.d.size_subflow_data = sizeof(infos.d);
+    infos.d.size_user         = sizeof(infos.t[0]);
+    len                       = sizeof(infos);
+    if (getsockopt(fd, SOL_MPTCP, MPTCP_TCPINFO, &infos, &len))
+        return 0;
+
+    // both lists walk the subflows in the same order
+    uint32_t n = addrs.d.num_subflows;
+    if (n > infos.d.num_subflows)
+        n = infos.d.num_subflows;
+    if (n > UPLINK_MAX_PATHS)
+        n = UPLINK_MAX_PATHS;
+
+    uint32_t i;
+    for (i = 0; i < n; i++)
+        add_path(st, (struct sockaddr_storage *) &addrs.a[i].ss_local,
+                 (struct sockaddr_storage *) &addrs.a[i].ss_remote, &infos.t[i], live);
+    return 1;
+}
+#else
+static int read_subflows(evutil_socket_t fd, struct uplink_stats *st, int live)
+{
+    return 0;
+}
+#endif
+
+static void read_paths(evutil_socket_t fd, struct uplink_stats *st, int live)
+{
+    if (fd < 0)
+        return;
+    if (!read_subflows(fd, st, live))
+        read_tcp_path(fd, st, live);
+}
+
+void uplink_conn_closed(evutil_socket_t fd, int uplink)
+{
+    if (uplink_mptcp_enabled())
+        read_paths(fd, &closed_stats, 0);
+
+    struct tcp_info ti;
+    if (fd < 0 || read_tcp_info(fd, &ti))
+        return;
+    if (uplink_fast_open_enabled()) {
+        closed_stats.fast_open_conns++;
+        if (ti.tcpi_options & TCPI_OPT_SYN_DATA)
+            closed_stats.fast_open_syn_data++;
+    }
+
+    if (uplink < 0 || uplink >= n_uplinks)
+        return;
+    uplinks[uplink].closed_sent += ti.tcpi_bytes_acked;
+    uplinks[uplink].closed_received += ti.tcpi_bytes_received;
+}
+
+void uplink_sample(evutil_socket_t fd, struct uplink_stats *st)
+{
+    read_paths(fd, st, 1);
+}
+
+void get_uplink_stats(struct uplink_stats *st)
+{
+    memcpy(st, &closed_stats, sizeof(*st));
+}
+
+static void uplinks_refresh()
+{
+    int i;
+    for (i = 0; i < n_uplinks; i++) {
+        uplinks[i].bytes_sent     = uplinks[i].closed_sent;
+        uplinks[i].bytes_received = uplinks[i].closed_received;
+    }
+
+    struct proxy_client *client = NULL;
+    for (client = get_all_pc(); client; client = client->hh.next) {
+        struct tcp_info ti;
+        if (client->uplink < 0 || client->uplink >= n_uplinks || !client->ctl_bev ||
+            read_tcp_info(bufferevent_getfd(client->ctl_bev), &ti))
+            continue;
+        uplinks[client->uplink].bytes_sent += ti.tcpi_bytes_acked;
+        uplinks[client->uplink].bytes_received += ti.tcpi_bytes_received;
+    }
+}
+
+int get_uplinks(const struct uplink **list)
+{
+    uplinks_refresh();
+    *list = uplinks;
+    return n_uplinks;
+}
+
+static void rate_cb(evutil_socket_t fd, short event, void *arg)
+{
+    uplinks_refresh();
+
+    int i;
+    for (i = 0; i < n_uplinks; i++) {
+        struct uplink *u = &uplinks[i];
+        uint64_t total   = u->bytes_sent + u->bytes_received;
+        // a closing connection may fold in a little less than was sampled live
+        u->rate       = total > u->rate_total ? (total - u->rate_total) / UPLINK_RATE_SEC : 0;
+        u->rate_total = total;
+    }
+}
+
+const char *uplink_policy_str()
+{
+    switch (policy) {
+    case UPLINK_WEIGHTED:
+        return "weighted";
+    case UPLINK_LEAST_LOADED:
+        return "least_loaded";
+    default:
+        return "roundrobin";
+    }
+}
+
+// "addr[:weight], ..." or "ifname[:weight], ..."
+static void add_uplinks(const char *list, int is_dev)
+{
+    if (!list)
+        return;
+
+    char *names = strdup(list);
+    assert(names);
+    char *name, *save = NULL;
+    for (name = strtok_r(names, ", ", &save); name; name = strtok_r(NULL, ", ", &save)) {
+        int weight   = 1;
+        char *weight_p = strchr(name, ':');
+        if (weight_p) {
+            *weight_p++ = '\0';
+            weight      = atoi(weight_p);
+            if (weight <= 0) {
+                debug(LOG_ERR, "error: uplink [%s] weight [%s] is invalid, use 1", name,
+                      weight_p);
+                weight = 1;
+            }
+        }
+
+        struct uplink u;
+        memset(&u, 0, sizeof(u));
+        u.is_dev     = is_dev;
+        u.weight     = weight;
+        u.sin.sin_family = AF_INET;
+        if (!is_dev && evutil_inet_pton(AF_INET, name, &u.sin.sin_addr) != 1) {
+            debug(LOG_ERR, "error: bind address [%s] is not an ipv4 address, skipped", name);
+            continue;
+        }
+        u.name = strdup(name);
+        assert(u.name);
+
+        uplinks = realloc(uplinks, sizeof(struct uplink) * (n_uplinks + 1));
+        assert(uplinks);
+        uplinks[n_uplinks++] = u;
+    }
+    free(names);
+}
+
+void init_uplinks(struct event_base *base)
+{
+    struct common_conf *c_conf = get_common_config();
+
+    add_uplinks(c_conf->bind_addresses, 0);
+    add_uplinks(c_conf->bind_interfaces, 1);
+    if (!n_uplinks)
+        return;
+
+    const char *p = c_conf->bind_policy;
+    if (!p || !strcmp(p, "roundrobin"))
+        policy = UPLINK_ROUNDROBIN;
+    else if (!strcmp(p, "weighted"))
+        policy = UPLINK_WEIGHTED;
+    else if (!strcmp(p, "least_loaded"))
+        policy = UPLINK_LEAST_LOADED;
+    else
+        debug(LOG_ERR, "error: bind_policy [%s] is unknown, use roundrobin", p);
+
+    debug(LOG_INFO, "work connections spread over %d uplinks, %s", n_uplinks,
+          uplink_policy_str());
+
+    if (policy != UPLINK_LEAST_LOADED)
+        return;
+    struct timeval tv = {UPLINK_RATE_SEC, 0};
+    ev_rate           = event_new(base, -1, EV_PERSIST, rate_cb, NULL);
+    assert(ev_rate);
+    event_add(ev_rate, &tv);
+}
+
+void free_uplinks()
+{
+    if (ev_rate)
+        event_free(ev_rate);
+    ev_rate = NULL;
+
+    int i;
+    for (i = 0; i < n_uplinks; i++)
+        SAFE_FREE(uplinks[i].name);
+    SAFE_FREE(uplinks);
+    n_uplinks = 0;
+}
@@ -0,0 +1,114 @@
+/* vim: set et ts=4 sts=4 sw=4 : */
+/********************************************************************\
+ * This program is free software; you can redistribute it and/or    *
+ * modify it under the terms of the GNU General Public License as   *
+ * published by the Free Software Foundation; either version 2 of   *
+ * the License, or (at your option) any later version.              *
+ *                                                                  *
+ * This program is distributed in the hope that it will be useful,  *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of   *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the    *
+ * GNU General Public License for more details.                     *
+ *                                                                  *
+ * You should have received a copy of the GNU General Public License*
+ * along with this program; if not, contact:                        *
+ *                                                                  *
+ * Free Software Foundation           Voice:  +1-617-542-5942       *
+ * 59 Temple Place - Suite 330        Fax:    +1-617-542-2652       *
+ * Boston, MA  02111-1307,  USA       gnu@gnu.org                   *
+ *                                                                  *
+\********************************************************************/
+
+
+/** @file uplink.h
+    @brief sockets of the connections to frps, multipath TCP and uplink binding
+*/
+
+#ifndef _UPLINK_H_
+#define _UPLINK_H_
+
+#include <stdint.h>
+#include <netinet/in.h>
+#include <event2/util.h>
+
+#define UPLINK_MAX_PATHS 8
+#define UPLINK_DOWN_SEC 10   // a failed uplink gets no work connection for so long
+#define UPLINK_RATE_SEC 2    // throughput sampling of least_loaded policy
+
+struct event_base;
+
+enum uplink_policy {
+    UPLINK_ROUNDROBIN = 0,
+    UPLINK_WEIGHTED,
+    UPLINK_LEAST_LOADED,
+};
+
+// a source address or interface work connections are bound to
+struct uplink {
+    char *name;   // as configured, without weight
+    int is_dev;   // SO_BINDTODEVICE, else bind to sin
+    struct sockaddr_in sin;
+    int weight;
+    int current;   // smooth weighted round robin
+
+    uint32_t conns;   // live work connections
+    uint64_t total_conns;
+    uint64_t failures;     // bind or connect failed
+    uint64_t down_until;   // monotonic msec
+
+    uint64_t closed_sent;   // bytes of closed work connections
+    uint64_t closed_received;
+    uint64_t bytes_sent;   // closed plus live, see uplinks_refresh
+    uint64_t bytes_received;
+    uint64_t rate;         // bytes per second both ways, last sample
+    uint64_t rate_total;   // bytes_sent + bytes_received at last sample
+};
+
+// one local address -> frps address pair, a subflow of multipath TCP
+struct uplink_path {
+    char local[48];
+    char remote[48];
+    uint32_t subflows;         // live subflows on this path, 0 in closed totals
+    uint64_t bytes_sent;       // acked by frps
+    uint64_t bytes_received;
+};
+
+struct uplink_stats {
+    uint64_t mptcp_conns;      // connected with multipath TCP
+    uint64_t fallback_conns;   // multipath asked, kernel or frps side spoke plain TCP
+    uint64_t fast_open_conns;      // closed frps connections opened with tcp_fast_open
+    uint64_t fast_open_syn_data;   // of those, frps acked the first message in the SYN
+    int npaths;
+    struct uplink_path paths[UPLINK_MAX_PATHS];
+};
+
+// bind_addresses / bind_interfaces of common config, timer of least_loaded
+void init_uplinks(struct event_base *base);
+void free_uplinks();
+
+// socket for a new connection to frps, -1 lets libevent open a plain TCP one;
+// uplink NULL for control connection, otherwise a work connection is bound
+// to the chosen uplink and its index stored there, -1 when unbound
+evutil_socket_t uplink_socket(int *uplink);
+int uplink_mptcp_enabled();
+// tcp_fast_open and no multipath TCP
+int uplink_fast_open_enabled();
+// count how a new connection to frps came up
+void uplink_connected(evutil_socket_t fd);
+// connecting through uplink failed, leave it alone for a while
+void uplink_failed(int uplink);
+// work connection of uplink is gone
+void uplink_release(int uplink);
+
+// fold counters of a frps connection about to be closed into the totals
+void uplink_conn_closed(evutil_socket_t fd, int uplink);
+// add path counters of a live frps connection to st
+void uplink_sample(evutil_socket_t fd, struct uplink_stats *st);
+// totals of closed connections, live ones are added by uplink_sample
+void get_uplink_stats(struct uplink_stats *st);
+
+// bound uplinks with byte counters of live work connections added
+int get_uplinks(const struct uplink **list);
+const char *uplink_policy_str();
+
+#endif   //_UPLINK_H_
@@ -5,6 +5,7 @@
 #include <fcntl.h>
 #include <arpa/inet.h>
 #include <sys/time.h>
+#include <time.h>
 #include <sys/stat.h>
 #include <errno.h>
 #include <ctype.h>
@@ -13,12 +14,17 @@
 #include <sys/ioctl.h>
 #include <arpa/inet.h>
 #include <sys/socket.h>
+#include <netinet/tcp.h>
 #include <netdb.h>
 #include <ifaddrs.h>
 #include <linux/if_link.h>
 
 #include "utils.h"
 
+#ifndef TCP_FASTOPEN_CONNECT
+#define TCP_FASTOPEN_CONNECT 30
+#endif
+
 // s_sleep using select instead of sleep
 // s: second, u: usec 10^6usec = 1s
 
@@ -217,4 +223,34 @@ int dns_unified(const char *dname, char *udname_buf, int udname_buf_len)
         return 1;
 
     return 0;
-}
\ No newline at end of file
+}
+
+uint64_t get_monotonic_msec()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+uint64_t get_monotonic_usec()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+int set_tcp_fast_open(int fd)
+{
+    int on = 1;
+    return setsockopt(fd, IPPROTO_TCP, TCP_FASTOPEN_CONNECT, &on, sizeof(on));
+}
+
+int open_fast_open_socket()
+{
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd >= 0 && set_tcp_fast_open(fd)) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
@@ -1,6 +1,8 @@
 #ifndef _UTILS_H_
 #define _UTILS_H_
 
+#include <stdint.h>
+
 struct mycurl_string {
     char *ptr;
     size_t len;
@@ -16,4 +18,14 @@ int get_net_ifname(char *if_buf, int blen);
 int get_net_mac(char *net_if_name, char *mac, int mac_len);
 int dns_unified(const char *dname, char *udname_buf, int udname_buf_len);
 
+// milliseconds from CLOCK_MONOTONIC, never jump with system time
+uint64_t get_monotonic_msec();
+uint64_t get_monotonic_usec();
+
+// TCP_FASTOPEN_CONNECT: connect returns at once and the SYN waits for the first
+// write to carry it, a plain handshake until the peer gave us a cookie; 0 on success
+int set_tcp_fast_open(int fd);
+// nonblocking TCP socket with it set, -1 when the kernel has no fast open
+int open_fast_open_socket();
+
 #endif   //_UTILS_H_
@@ -48,9 +48,16 @@
 
 void xfrpc_loop()
 {
+    struct common_conf *c_conf = get_common_config();
+
     //初始化主控
     init_main_control();
 
+    // after daemonizing, the writer thread would not survive fork
+    if (start_async_logger(c_conf->log_file, (long) c_conf->log_max_size * 1024,
+                           c_conf->log_max_days, get_main_control()->connect_base))
+        debug(LOG_ERR, "error: start async logger failed, log synchronously");
+
     //启动主控,主循环
     run_control();
 
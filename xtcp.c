@@ -0,0 +1,599 @@
+/* vim: set et ts=4 sts=4 sw=4 : */
+/********************************************************************\
+ * This program is free software; you can redistribute it and/or    *
+ * modify it under the terms of the GNU General Public License as   *
+ * published by the Free Software Foundation; either version 2 of   *
+ * the License, or (at your option) any later version.              *
+ *                                                                  *
+ * This program is distributed in the hope that it will be useful,  *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of   *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the    *
+ * GNU General Public License for more details.                     *
+ *                                                                  *
+ * You should have received a copy of the GNU General Public License*
+ * along with this program; if not, contact:                        *
+ *                                                                  *
+ * Free Software Foundation           Voice:  +1-617-542-5942       *
+ * 59 Temple Place - Suite 330        Fax:    +1-617-542-2652       *
+ * Boston, MA  02111-1307,  USA       gnu@gnu.org                   *
+ *                                                                  *
+\********************************************************************/
+
+/** @file xtcp.c
+    @brief xtcp proxies and visitors, tunnels over a UDP hole punched between two xfrpc
+
+    Rendezvous follows later frp versions. A visitor sends NatHoleVisitor
+    with the signed sk of the proxy to the udp port of frps, frps hands a
+    sid to the proxy side in a NatHoleSid on one of its work connections,
+    the proxy side answers with NatHoleClient on udp and frps sends both
+    ends a NatHoleResp with the address it saw the other end from.
+
+    Each end then sends NatHoleSid probes to that address from the same
+    socket, which opens its own NAT mapping towards the peer. The first
+    probe, or KCP segment, from the peer proves the path: the socket is
+    connected to where it came from and carries one KCP conversation,
+    whose conv both ends derive from the sid.
+
+    A visitor whose punch does not finish in fallback_timeout_ms relays
+    the tunnel through frps on fallback_port, a plain tcp proxy of the
+    same service, and keeps doing so for XTCP_FALLBACK_HOLD seconds.
+*/
+
+#include <string.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <errno.h>
+#include <syslog.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include <event2/event.h>
+#include <event2/buffer.h>
+#include <event2/bufferevent.h>
+#include <event2/listener.h>
+#include <event2/util.h>
+
+#include "xtcp.h"
+#include "kcp_conn.h"
+#include "client.h"
+#include "config.h"
+#include "control.h"
+#include "proxy.h"
+#include "msg.h"
+#include "addr_cache.h"
+#include "server_list.h"
+#include "debug.h"
+#include "common.h"
+#include "utils.h"
+
+#define PUNCH_READ_BURST 16
+#define PUNCH_ANSWERS 3   // probes sent back to the peer, the last one it may miss
+
+struct xtcp_visitor {
+    struct proxy_service *ps;
+    struct evconnlistener *listener;
+    uint64_t punch_after;   // monotonic msec, relay through frps until then
+    struct xtcp_visitor *next;
+};
+
+enum punch_state {
+    PUNCH_RENDEZVOUS = 0,   // waiting for NatHoleResp
+    PUNCH_PROBING,          // probing the peer address
+};
+
+struct punch {
+    struct proxy_client *client;    // tunnel waiting for the path
+    struct xtcp_visitor *visitor;   // NULL on the proxy side
+    const char *proxy_name;         // points into the proxy service
+    enum punch_state state;
+    evutil_socket_t fd;
+    struct event *ev_read;
+    struct event *timer;
+
+    char *sid;   // the visitor learns it from NatHoleResp
+    unsigned char *hello;   // packed NatHoleVisitor or NatHoleClient
+    size_t hello_len;
+    unsigned char *probe;   // packed NatHoleSid
+    size_t probe_len;
+    uint64_t next_hello;    // monotonic msec, 0 not resent
+    uint64_t deadline;
+    struct sockaddr_in frps;
+    struct sockaddr_in peer;
+
+    struct punch *prev;
+    struct punch *next;
+};
+
+static struct event_base *xtcp_base;
+static struct kcp_conn_conf xtcp_kcp;
+static struct xtcp_visitor *visitors;
+static struct punch *punches;
+static struct xtcp_stats stats;
+
+int is_xtcp_proxy(const struct proxy_service *ps)
+{
+    return ps && ps->proxy_type && strcmp(ps->proxy_type, "xtcp") == 0;
+}
+
+const struct xtcp_stats *get_xtcp_stats()
+{
+    return &stats;
+}
+
+// both ends agree on it without another round trip
+static uint32_t sid_conv(const char *sid)
+{
+    uint32_t h = 2166136261u;   // FNV-1a
+    for (; *sid; sid++)
+        h = (h ^ (uint8_t) *sid) * 16777619u;
+    return h ? h : 1;
+}
+
+static unsigned char *pack_msg(char type, char *json, size_t len, size_t *out_len)
+{
+    struct message m;
+    unsigned char *buf = NULL;
+    m.type             = type;
+    m.data_p           = json;
+    m.data_len         = len;
+    *out_len           = pack(&m, &buf);
+    return buf;
+}
+
+// message in one datagram, NULL unless its length field matches; valid until msg_decode_reset
+static struct message *unpack_datagram(unsigned char *buf, ssize_t n)
+{
+    msg_size_t len;
+    if (n < MSG_DATA_I)
+        return NULL;
+    memcpy(&len, buf + MSG_LEN_I, sizeof(len));
+    if (msg_ntoh(len) != (msg_size_t)(n - MSG_DATA_I))
+        return NULL;
+    return unpack(buf, n);
+}
+
+static int same_addr(const struct sockaddr_in *a, const struct sockaddr_in *b)
+{
+    return a->sin_addr.s_addr == b->sin_addr.s_addr && a->sin_port == b->sin_port;
+}
+
+static const char *addr_str(const struct sockaddr_in *sin, char *buf, size_t len)
+{
+    char ip[INET_ADDRSTRLEN] = {0};
+    evutil_inet_ntop(AF_INET, &sin->sin_addr, ip, sizeof(ip));
+    snprintf(buf, len, "%s:%d", ip, ntohs(sin->sin_port));
+    return buf;
+}
+
+static void punch_send(struct punch *p, const struct sockaddr_in *to, const unsigned char *buf,
+                       size_t len)
+{
+    if (sendto(p->fd, buf, len, 0, (const struct sockaddr *) to, sizeof(*to)) < 0)
+        debug_ratelimit(LOG_DEBUG, "xtcp [%s]: sendto failed: %s", p->proxy_name,
+                        strerror(errno));
+}
+
+static void punch_free(struct punch *p)
+{
+    if (p->prev)
+        p->prev->next = p->next;
+    else
+        punches = p->next;
+    if (p->next)
+        p->next->prev = p->prev;
+
+    event_free(p->ev_read);
+    event_free(p->timer);
+    if (p->fd >= 0)
+        evutil_closesocket(p->fd);
+    SAFE_FREE(p->sid);
+    SAFE_FREE(p->hello);
+    SAFE_FREE(p->probe);
+    free(p);
+}
+
+static struct punch *find_punch(const struct proxy_client *client)
+{
+    struct punch *p;
+    for (p = punches; p; p = p->next)
+        if (p->client == client)
+            return p;
+    return NULL;
+}
+
+static void visitor_tunnel(struct proxy_client *client)
+{
+    tunnel_stage(client, TS_FRPS_CONNECTED);
+    tunnel_stage(client, TS_NEW_WORK_CONN);
+    tunnel_stage(client, TS_START_WORK_CONN);
+    tunnel_stage(client, TS_LOCAL_CONNECTED);
+    relay_xfrp_tunnel(client);
+
+    // what the user sent while the path was set up
+    struct bufferevent *user = client->local_proxy_bev;
+    if (evbuffer_get_length(bufferevent_get_input(user)))
+        tcp_proxy_c2s_cb(user, &client->ctl_prox);
+}
+
+static void visitor_close(struct proxy_client *client)
+{
+    bufferevent_free(client->local_proxy_bev);
+    client->local_proxy_bev = NULL;
+    del_proxy_client(client);
+}
+
+static void visitor_fallback(struct proxy_client *client)
+{
+    struct proxy_service *ps = client->ps;
+    if (ps->fallback_port > 0)
+        client->ctl_bev =
+            connect_server(client->base, get_server(client->server)->addr, ps->fallback_port, ps);
+
+    if (!client->ctl_bev) {
+        debug(LOG_WARNING, "xtcp visitor [%s]: no direct path and no relay through frps",
+              ps->proxy_name);
+        ps->stats.connect_failures++;
+        visitor_close(client);
+        return;
+    }
+
+    stats.fallbacks++;
+    visitor_tunnel(client);
+}
+
+static void serve_tunnel(struct proxy_client *client)
+{
+    tunnel_stage(client, TS_FRPS_CONNECTED);
+    tunnel_stage(client, TS_NEW_WORK_CONN);
+    tunnel_stage(client, TS_START_WORK_CONN);
+    start_xfrp_tunnel(client);
+
+    // local service refused, the conversation is freed already
+    if (!client->ctl_bev)
+        del_proxy_client(client);
+}
+
+static void punch_fail(struct punch *p, const char *why)
+{
+    struct proxy_client *client = p->client;
+    struct xtcp_visitor *v      = p->visitor;
+
+    stats.failures++;
+    debug(LOG_WARNING, "xtcp [%s]: %s", p->proxy_name, why);
+    punch_free(p);
+
+    if (!v) {
+        del_proxy_client(client);
+        return;
+    }
+    v->punch_after = get_monotonic_msec() + XTCP_FALLBACK_HOLD * 1000;
+    visitor_fallback(client);
+}
+
+static void punch_done(struct punch *p, const struct sockaddr_in *from)
+{
+    char buf[32];
+    event_del(p->ev_read);
+    if (connect(p->fd, (const struct sockaddr *) from, sizeof(*from))) {
+        punch_fail(p, "connect to peer failed");
+        return;
+    }
+
+    struct bufferevent *bev = kcp_connect_fd(xtcp_base, &xtcp_kcp, p->fd, sid_conv(p->sid));
+    if (!bev) {
+        punch_fail(p, "KCP conversation failed");
+        return;
+    }
+
+    struct proxy_client *client = p->client;
+    struct xtcp_visitor *v      = p->visitor;
+    stats.punched++;
+    debug(LOG_INFO, "xtcp [%s]: direct path to %s", p->proxy_name,
+          addr_str(from, buf, sizeof(buf)));
+    p->fd = -1;   // the conversation owns it
+    punch_free(p);
+
+    client->ctl_bev = bev;
+    if (v)
+        visitor_tunnel(client);
+    else
+        serve_tunnel(client);
+}
+
+static void set_probe(struct punch *p)
+{
+    char *msg = NULL;
+    int len   = nat_hole_marshal(p->proxy_name, NULL, p->sid, &msg);
+    p->probe  = pack_msg(TypeNatHoleSid, msg, len, &p->probe_len);
+    SAFE_FREE(msg);
+}
+
+static int is_probe(const struct punch *p, unsigned char *buf, ssize_t n)
+{
+    struct message *msg = p->sid ? unpack_datagram(buf, n) : NULL;
+    const char *sid     = NULL;
+    if (msg && msg->type == TypeNatHoleSid && msg->data_p)
+        sid = nat_hole_sid_unmarshal(msg->data_p);
+
+    int ret = sid && strcmp(sid, p->sid) == 0;
+    msg_decode_reset();
+    return ret;
+}
+
+// NatHoleResp from frps, return 1 when p is gone
+static int punch_rendezvous(struct punch *p, unsigned char *buf, ssize_t n)
+{
+    struct message *msg = unpack_datagram(buf, n);
+    if (p->state != PUNCH_RENDEZVOUS || !msg || msg->type != TypeNatHoleResp || !msg->data_p) {
+        msg_decode_reset();
+        return 0;
+    }
+
+    char why[256]            = {0};
+    struct nat_hole_resp *nr = nat_hole_resp_unmarshal(msg->data_p);
+    const char *peer         = nr ? (p->visitor ? nr->client_addr : nr->visitor_addr) : NULL;
+    int peer_len             = sizeof(p->peer);
+    if (!nr || !nr->sid || (p->sid && strcmp(nr->sid, p->sid))) {
+        msg_decode_reset();
+        return 0;
+    } else if (nr->error && *nr->error) {
+        snprintf(why, sizeof(why), "refused by frps: %s", nr->error);
+    } else if (!peer ||
+               evutil_parse_sockaddr_port(peer, (struct sockaddr *) &p->peer, &peer_len) ||
+               p->peer.sin_family != AF_INET) {
+        snprintf(why, sizeof(why), "bad peer address [%s] from frps", peer ? peer : "");
+    } else if (!p->sid) {
+        p->sid = strdup(nr->sid);
+        assert(p->sid);
+    }
+    msg_decode_reset();
+
+    if (why[0]) {
+        punch_fail(p, why);
+        return 1;
+    }
+
+    debug(LOG_DEBUG, "xtcp [%s]: sid %s, probing %s", p->proxy_name, p->sid, peer);
+    p->state = PUNCH_PROBING;
+    if (!p->probe)
+        set_probe(p);
+    punch_send(p, &p->peer, p->probe, p->probe_len);
+    return 0;
+}
+
+static void punch_read_cb(evutil_socket_t fd, short what, void *arg)
+{
+    struct punch *p = arg;
+    unsigned char buf[2048];
+    int i;
+
+    for (i = 0; i < PUNCH_READ_BURST; i++) {
+        struct sockaddr_in from;
+        socklen_t len = sizeof(from);
+        ssize_t n     = recvfrom(fd, buf, sizeof(buf), 0, (struct sockaddr *) &from, &len);
+        if (n < 0)
+            return;
+
+        if (same_addr(&from, &p->frps)) {
+            if (punch_rendezvous(p, buf, n))
+                return;
+            continue;
+        }
+
+        // the peer may be quicker with its NatHoleResp, its probes count once the sid is known
+        int probe = is_probe(p, buf, n);
+        if (!probe && (p->state != PUNCH_PROBING || from.sin_addr.s_addr != p->peer.sin_addr.s_addr))
+            continue;
+
+        if (probe) {
+            int k;
+            for (k = 0; k < PUNCH_ANSWERS; k++)
+                punch_send(p, &from, p->probe, p->probe_len);
+        }
+        punch_done(p, &from);
+        return;
+    }
+}
+
+static void punch_timer_cb(evutil_socket_t fd, short what, void *arg)
+{
+    struct punch *p = arg;
+    uint64_t now    = get_monotonic_msec();
+
+    if (now >= p->deadline) {
+        punch_fail(p, p->state == PUNCH_RENDEZVOUS ? "no NatHoleResp from frps"
+                                                   : "peer did not answer, falling back");
+        return;
+    }
+
+    if (p->state == PUNCH_PROBING) {
+        punch_send(p, &p->peer, p->probe, p->probe_len);
+    } else if (p->next_hello && now >= p->next_hello) {
+        punch_send(p, &p->frps, p->hello, p->hello_len);
+        p->next_hello = now + XTCP_RESEND_MS;
+    }
+}
+
+// 0 when punching started, the client is then owned by it
+static int punch_start(struct proxy_client *client, struct xtcp_visitor *v, const char *sid,
+                       int timeout_ms)
+{
+    struct frps_server *srv  = get_server(client->server);
+    struct proxy_service *ps = client->ps;
+    const char *name         = v ? ps->server_name : ps->proxy_name;
+    int port                 = get_common_config()->server_udp_port;
+    if (!port)
+        port = srv->udp_port;
+
+    struct sockaddr_in frps;
+    if (port <= 0) {
+        debug_ratelimit(LOG_WARNING, "xtcp [%s]: frps has no udp port for rendezvous", name);
+        return -1;
+    }
+    if (!addr_cache_lookup(srv->addr, port, &frps))
+        return -1;
+
+    evutil_socket_t fd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (fd < 0)
+        return -1;
+    evutil_make_socket_nonblocking(fd);
+    evutil_make_socket_closeonexec(fd);
+
+    struct punch *p = calloc(1, sizeof(struct punch));
+    assert(p);
+    p->client     = client;
+    p->visitor    = v;
+    p->proxy_name = name;
+    p->fd         = fd;
+    p->frps       = frps;
+    if (sid) {
+        p->sid = strdup(sid);
+        assert(p->sid);
+    }
+
+    char *msg    = NULL;
+    int len      = nat_hole_marshal(name, v ? (ps->sk ? ps->sk : "") : NULL, sid, &msg);
+    p->hello     = pack_msg(v ? TypeNatHoleVisitor : TypeNatHoleClient, msg, len, &p->hello_len);
+    SAFE_FREE(msg);
+
+    uint64_t now = get_monotonic_msec();
+    p->deadline  = now + timeout_ms;
+    // frps opens a session per NatHoleVisitor, only NatHoleClient is safe to repeat
+    p->next_hello = v ? 0 : now + XTCP_RESEND_MS;
+
+    p->ev_read = event_new(xtcp_base, fd, EV_READ | EV_PERSIST, punch_read_cb, p);
+    p->timer   = event_new(xtcp_base, -1, EV_PERSIST, punch_timer_cb, p);
+    assert(p->ev_read && p->timer);
+    struct timeval tick = {0, XTCP_PROBE_MS * 1000};
+    event_add(p->ev_read, NULL);
+    event_add(p->timer, &tick);
+
+    p->next = punches;
+    if (punches)
+        punches->prev = p;
+    punches = p;
+
+    stats.punches++;
+    punch_send(p, &frps, p->hello, p->hello_len);
+    return 0;
+}
+
+void xtcp_serve(struct event_base *base, struct proxy_service *ps, int server, const char *sid)
+{
+    if (!sid || !*sid) {
+        debug(LOG_ERR, "xtcp [%s]: NatHoleSid without sid", ps->proxy_name);
+        return;
+    }
+
+    struct proxy_client *client = new_proxy_client();
+    client->base                = base;
+    client->ps                  = ps;
+    client->server              = server;
+    tunnel_stage(client, TS_REQ_WORK_CONN);
+    if (punch_start(client, NULL, sid, XTCP_SERVE_TIMEOUT)) {
+        stats.failures++;
+        del_proxy_client(client);
+    }
+}
+
+// user left before the path was ready
+static void waiting_event_cb(struct bufferevent *bev, short what, void *ctx)
+{
+    struct proxy_client *client = ctx;
+    if (!(what & (BEV_EVENT_EOF | BEV_EVENT_ERROR)))
+        return;
+
+    struct punch *p = find_punch(client);
+    if (p)
+        punch_free(p);
+    visitor_close(client);
+}
+
+static void visitor_accept_cb(struct evconnlistener *listener, evutil_socket_t fd,
+                              struct sockaddr *addr, int socklen, void *ctx)
+{
+    struct xtcp_visitor *v      = ctx;
+    struct proxy_client *client = new_proxy_client();
+    client->base                = xtcp_base;
+    client->ps                  = v->ps;
+    client->server              = session_server(-1);
+    sock_tuning_apply(fd, &v->ps->tcp, v->ps->proxy_name);
+    client->local_proxy_bev = bufferevent_socket_new(xtcp_base, fd, BEV_OPT_CLOSE_ON_FREE);
+    assert(client->local_proxy_bev);
+    tunnel_stage(client, TS_REQ_WORK_CONN);
+
+    if (get_monotonic_msec() >= v->punch_after &&
+        !punch_start(client, v, NULL, v->ps->fallback_timeout_ms)) {
+        // early bytes wait in the input buffer for the tunnel
+        bufferevent_setcb(client->local_proxy_bev, NULL, NULL, waiting_event_cb, client);
+        bufferevent_enable(client->local_proxy_bev, EV_READ);
+        return;
+    }
+    visitor_fallback(client);
+}
+
+static void start_visitor(struct proxy_service *ps)
+{
+    struct sockaddr_in sin;
+    memset(&sin, 0, sizeof(sin));
+    sin.sin_family = AF_INET;
+    sin.sin_port   = htons(ps->bind_port);
+    if (evutil_inet_pton(AF_INET, ps->bind_addr ? ps->bind_addr : "127.0.0.1", &sin.sin_addr) !=
+        1) {
+        debug(LOG_ERR, "xtcp visitor [%s]: bad bind_addr [%s]", ps->proxy_name, ps->bind_addr);
+        return;
+    }
+
+    struct xtcp_visitor *v = calloc(1, sizeof(struct xtcp_visitor));
+    assert(v);
+    v->ps       = ps;
+    v->listener = evconnlistener_new_bind(xtcp_base, visitor_accept_cb, v,
+                                          LEV_OPT_CLOSE_ON_FREE | LEV_OPT_REUSEABLE, 128,
+                                          (struct sockaddr *) &sin, sizeof(sin));
+    if (!v->listener) {
+        debug(LOG_ERR, "xtcp visitor [%s]: listen on port %d failed", ps->proxy_name,
+              ps->bind_port);
+        free(v);
+        return;
+    }
+
+    debug(LOG_INFO, "xtcp visitor [%s] of [%s] listening on port %d", ps->proxy_name,
+          ps->server_name, ps->bind_port);
+    v->next  = visitors;
+    visitors = v;
+}
+
+void init_xtcp(struct event_base *base, const struct kcp_conn_conf *kc)
+{
+    xtcp_base = base;
+    xtcp_kcp  = *kc;
+
+    struct proxy_service *ps = NULL, *tmp = NULL;
+    struct proxy_service *all_ps = get_all_proxy_services();
+    HASH_ITER(hh, all_ps, ps, tmp)
+    {
+        if (ps->is_visitor)
+            start_visitor(ps);
+    }
+}
+
+void free_xtcp()
+{
+    while (punches) {
+        struct proxy_client *client = punches->client;
+        punch_free(punches);
+        if (client->local_proxy_bev)
+            visitor_close(client);
+        else
+            del_proxy_client(client);
+    }
+
+    while (visitors) {
+        struct xtcp_visitor *v = visitors;
+        visitors               = v->next;
+        evconnlistener_free(v->listener);
+        free(v);
+    }
+    xtcp_base = NULL;
+}
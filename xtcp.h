@@ -0,0 +1,59 @@
+/* vim: set et ts=4 sts=4 sw=4 : */
+/********************************************************************\
+ * This program is free software; you can redistribute it and/or    *
+ * modify it under the terms of the GNU General Public License as   *
+ * published by the Free Software Foundation; either version 2 of   *
+ * the License, or (at your option) any later version.              *
+ *                                                                  *
+ * This program is distributed in the hope that it will be useful,  *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of   *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the    *
+ * GNU General Public License for more details.                     *
+ *                                                                  *
+ * You should have received a copy of the GNU General Public License*
+ * along with this program; if not, contact:                        *
+ *                                                                  *
+ * Free Software Foundation           Voice:  +1-617-542-5942       *
+ * 59 Temple Place - Suite 330        Fax:    +1-617-542-2652       *
+ * Boston, MA  02111-1307,  USA       gnu@gnu.org                   *
+ *                                                                  *
+\********************************************************************/
+
+/** @file xtcp.h
+    @brief xtcp proxies and visitors, tunnels over a UDP hole punched between two xfrpc
+*/
+
+#ifndef _XTCP_H_
+#define _XTCP_H_
+
+#include <stdint.h>
+
+#define XTCP_RESEND_MS 500        // proxy side NatHoleClient resent until answered
+#define XTCP_PROBE_MS 100         // punch probes to the peer address
+#define XTCP_SERVE_TIMEOUT 10000  // ms, proxy side gives up punching after it
+#define XTCP_FALLBACK_HOLD 60     // seconds a visitor relays through frps after a failed punch
+
+struct event_base;
+struct proxy_service;
+struct kcp_conn_conf;
+
+struct xtcp_stats {
+    uint64_t punches;     // hole punching started, both roles
+    uint64_t punched;     // peer reached, tunnel runs over KCP
+    uint64_t failures;    // no answer from frps or the peer in time
+    uint64_t fallbacks;   // visitor tunnels relayed through frps instead
+};
+
+int is_xtcp_proxy(const struct proxy_service *ps);
+
+// listen on the bind_port of each visitor, punched tunnels use kc
+void init_xtcp(struct event_base *base, const struct kcp_conn_conf *kc);
+void free_xtcp();
+
+// NatHoleSid from frps on a work connection of ps to server (index in server
+// list), punch towards the visitor through the same frps
+void xtcp_serve(struct event_base *base, struct proxy_service *ps, int server, const char *sid);
+
+const struct xtcp_stats *get_xtcp_stats();
+
+#endif   //_XTCP_H_